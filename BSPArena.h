@@ -0,0 +1,138 @@
+#pragma once
+#include "stdafx.h"
+#include <memory>
+
+// Bump allocator for BSP build temporaries (triangle lists, SoA copies, candidate lists).
+// Memory is handed out LIFO: BuildTree takes a mark on entry and rewinds to it on exit,
+// so the arena never holds more than the lists along the current recursion path.
+// Blocks are kept across rewinds and Reset(), a second build reuses them without
+// touching the heap. Not thread safe, every build thread works in its own arena.
+class CBSPArena
+{
+public:
+    struct Mark
+    {
+        size_t block;
+        size_t offset;
+        size_t base;    // Bytes in the blocks before 'block'
+    };
+
+    explicit CBSPArena(size_t blockSize = 4 << 20) : m_blockSize(blockSize) {}
+    CBSPArena(const CBSPArena&) = delete;
+    CBSPArena& operator=(const CBSPArena&) = delete;
+
+    void* Allocate(size_t size, size_t align)
+    {
+        for (;;)
+        {
+            if (m_current < m_blocks.size())
+            {
+                Block& b = m_blocks[m_current];
+                size_t offset = (m_offset + align - 1) & ~(align - 1);
+                if (offset + size <= b.size)
+                {
+                    m_offset = offset + size;
+                    m_peak = std::max(m_peak, m_base + m_offset);
+                    return b.data.get() + offset;
+                }
+                if (m_offset != 0)
+                {
+                    // Doesn't fit in what's left, move on to the next block
+                    m_base += b.size;
+                    m_current++;
+                    m_offset = 0;
+                    continue;
+                }
+            }
+            // Out of blocks, or the next one is too small for this request.
+            // Everything past m_current is free after a rewind, so it can be replaced.
+            Block b;
+            b.size = std::max(m_blockSize, size + align);
+            b.data.reset(new BYTE[b.size]);
+            m_heapAllocs++;
+            if (m_current < m_blocks.size())
+                m_blocks[m_current] = std::move(b);
+            else
+                m_blocks.push_back(std::move(b));
+            m_offset = 0;
+        }
+    }
+
+    template <typename T>
+    T* AllocArray(size_t count) { return (T*)Allocate(sizeof(T) * std::max<size_t>(count, 1), alignof(T)); }
+
+    Mark GetMark() const { Mark m = { m_current, m_offset, m_base }; return m; }
+    void Rewind(const Mark& m)
+    {
+        m_current = m.block;
+        m_offset = m.offset;
+        m_base = m.base;
+    }
+
+    // Start of a build: drop everything, keep the blocks
+    void Reset()
+    {
+        m_current = 0;
+        m_offset = 0;
+        m_base = 0;
+        m_peak = 0;
+        m_heapAllocs = 0;
+    }
+
+    int    GetHeapAllocs() const { return m_heapAllocs; }  // Blocks allocated since Reset()
+    size_t GetPeakBytes() const { return m_peak; }          // Includes the unused tails of skipped blocks
+
+private:
+    struct Block
+    {
+        std::unique_ptr<BYTE[]> data;
+        size_t size = 0;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_blockSize;
+    size_t m_current = 0;
+    size_t m_offset = 0;
+    size_t m_base = 0;
+    size_t m_peak = 0;
+    int    m_heapAllocs = 0;
+};
+
+// Rewinds the arena to where it was when the scope was entered
+class CBSPArenaScope
+{
+public:
+    explicit CBSPArenaScope(CBSPArena& arena) : m_arena(arena), m_mark(arena.GetMark()) {}
+    ~CBSPArenaScope() { m_arena.Rewind(m_mark); }
+    CBSPArenaScope(const CBSPArenaScope&) = delete;
+    CBSPArenaScope& operator=(const CBSPArenaScope&) = delete;
+
+private:
+    CBSPArena& m_arena;
+    CBSPArena::Mark m_mark;
+};
+
+// std allocator on top of CBSPArena. deallocate() is a no-op, the memory comes back
+// when the owning scope rewinds, so containers should be reserved to their final size.
+template <typename T>
+struct BSPArenaAllocator
+{
+    typedef T value_type;
+
+    CBSPArena* arena;
+
+    explicit BSPArenaAllocator(CBSPArena& a) : arena(&a) {}
+    template <typename U>
+    BSPArenaAllocator(const BSPArenaAllocator<U>& o) : arena(o.arena) {}
+
+    T* allocate(size_t n) { return arena->AllocArray<T>(n); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const BSPArenaAllocator<U>& o) const { return arena == o.arena; }
+    template <typename U>
+    bool operator!=(const BSPArenaAllocator<U>& o) const { return arena != o.arena; }
+};
+
+template <typename T>
+using BSPArenaVector = std::vector<T, BSPArenaAllocator<T>>;
@@ -0,0 +1,58 @@
+#pragma once
+#include "stdafx.h"
+
+// Compiled level cache (.bspc) written next to the source OBJ once a build finishes.
+// Layout: BSPCacheHeader, BSPCacheSection table, then the raw section data.
+// Anything that changes a section's element layout must bump BSPCACHE_VERSION.
+static const char BSPCACHE_MAGIC[4] = { 'B', 'S', 'P', 'C' };
+static const UINT BSPCACHE_VERSION = 3;
+
+enum eBSPCacheSection
+{
+    BSPC_MATERIALS,     // BSPMaterial
+    BSPC_FLAT_NODES,    // BSPFlatNode
+    BSPC_FLAT_VERTS,    // OBJVertex, 3 per triangle, baked radiosity colors
+    BSPC_FLAT_MATINDEX, // int, 1 per triangle
+    BSPC_FLAT_OBJECTID, // int, 1 per triangle
+    BSPC_SOURCE_TRIS,   // BSPTriangle, the unsubdivided mesh (physics and rebuilds)
+    BSPC_LIGHTMAP_SIZE, // UINT, width and height, empty without a lightmap
+    BSPC_LIGHTMAP,      // DWORD, width * height texels
+    BSPC_SECTION_COUNT
+};
+
+struct BSPCacheHeader
+{
+    char     magic[4];
+    UINT     version;
+    uint64_t key;           // Source files + build parameters, see CBSPlevel::GetCacheKey
+    UINT     sectionCount;
+    UINT     reserved;
+};
+
+struct BSPCacheSection
+{
+    UINT     id;
+    UINT     elemSize;      // sizeof the element when written, checked on load
+    uint64_t offset;        // From the start of the file
+    uint64_t count;
+};
+
+// 64 bit FNV-1a, used to key the cache
+struct FNV1aHash
+{
+    uint64_t value = 14695981039346656037ull;
+
+    void Add(const void* data, size_t size)
+    {
+        const BYTE* p = (const BYTE*)data;
+        uint64_t h = value;
+        for (size_t i = 0; i < size; i++)
+        {
+            h ^= p[i];
+            h *= 1099511628211ull;
+        }
+        value = h;
+    }
+    template <typename T>
+    void AddValue(const T& v) { Add(&v, sizeof(T)); }
+};
@@ -0,0 +1,183 @@
+#include "stdafx.h"
+#include <intrin.h>
+#include <immintrin.h>
+#include "CBSPlevel.h"
+#include "BSPClassifier.h"
+
+// Must match ClassifyTriangle
+static const float ON_PLANE_EPSILON = 0.001f;
+
+// Lane result bits: 1 = some corner in front, 2 = some corner behind
+static const BYTE s_maskToSide[4] = { S_COPLANAR, S_FRONT, S_BACK, S_SPLIT };
+
+void BSPTriSoA::Build(const BSPTriangle* tris, UINT numTris)
+{
+    m_data.resize((size_t)numTris * 9);
+    Build(tris, numTris, m_data.data());
+}
+
+void BSPTriSoA::Build(const BSPTriangle* tris, UINT numTris, float* storage)
+{
+    count = numTris;
+    for (int k = 0; k < 9; k++)
+        pos[k] = storage + (size_t)k * numTris;
+
+    float* dst = storage;
+    for (UINT i = 0; i < numTris; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            dst[(size_t)(c * 3 + 0) * numTris + i] = tris[i].v[c].x;
+            dst[(size_t)(c * 3 + 1) * numTris + i] = tris[i].v[c].y;
+            dst[(size_t)(c * 3 + 2) * numTris + i] = tris[i].v[c].z;
+        }
+    }
+}
+
+eClassifyPath GetBestClassifyPath()
+{
+    static eClassifyPath best = []()
+        {
+            int info[4];
+            __cpuid(info, 0);
+            int maxLeaf = info[0];
+
+            __cpuid(info, 1);
+            bool sse2 = (info[3] & (1 << 26)) != 0;
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            // The OS must also save the YMM registers on context switch.
+            // The kernels are float only, AVX (no AVX2) covers them.
+            bool ymmEnabled = maxLeaf >= 1 && osxsave && avx && ((_xgetbv(0) & 0x6) == 0x6);
+
+            if (ymmEnabled) return CLASSIFY_AVX;
+            if (sse2) return CLASSIFY_SSE;
+            return CLASSIFY_SCALAR;
+        }();
+    return best;
+}
+
+const char* GetClassifyPathName(eClassifyPath path)
+{
+    switch (path)
+    {
+    case CLASSIFY_AUTO:   return GetClassifyPathName(GetBestClassifyPath());
+    case CLASSIFY_SCALAR: return "scalar";
+    case CLASSIFY_SSE:    return "sse";
+    case CLASSIFY_AVX:    return "avx";
+    default:              return "unknown";
+    }
+}
+
+static inline UINT CountBits(UINT v)
+{
+    UINT n = 0;
+    for (; v; v &= v - 1) n++;
+    return n;
+}
+
+// Adds one lane group's front/back bit masks to the counters
+static inline void AccumulateMasks(UINT frontBits, UINT backBits, UINT laneMask, UINT first,
+    BSPClassifyCounts& counts, BYTE* outSides)
+{
+    UINT split = frontBits & backBits;
+    counts.split += CountBits(split);
+    counts.front += CountBits(frontBits & ~backBits);
+    counts.back += CountBits(backBits & ~frontBits);
+    counts.coplanar += CountBits(~(frontBits | backBits) & laneMask);
+
+    if (outSides)
+    {
+        for (UINT lane = 0; laneMask >> lane; lane++)
+            outSides[first + lane] = s_maskToSide[((frontBits >> lane) & 1) | (((backBits >> lane) & 1) << 1)];
+    }
+}
+
+static void ClassifyScalar(const BSPTriSoA& soa, const D3DXPLANE& plane, UINT start,
+    BSPClassifyCounts& counts, BYTE* outSides)
+{
+    for (UINT i = start; i < soa.count; i++)
+    {
+        UINT f = 0, b = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            float dist = (plane.a * soa.pos[c * 3 + 0][i]) + (plane.b * soa.pos[c * 3 + 1][i]) +
+                (plane.c * soa.pos[c * 3 + 2][i]) + plane.d;
+            if (dist > ON_PLANE_EPSILON)       f = 1;
+            else if (dist < -ON_PLANE_EPSILON) b = 1;
+        }
+        AccumulateMasks(f, b, 1, i, counts, outSides);
+    }
+}
+
+static void ClassifySSE(const BSPTriSoA& soa, const D3DXPLANE& plane, BSPClassifyCounts& counts, BYTE* outSides)
+{
+    const __m128 pa = _mm_set1_ps(plane.a);
+    const __m128 pb = _mm_set1_ps(plane.b);
+    const __m128 pc = _mm_set1_ps(plane.c);
+    const __m128 pd = _mm_set1_ps(plane.d);
+    const __m128 epsPos = _mm_set1_ps(ON_PLANE_EPSILON);
+    const __m128 epsNeg = _mm_set1_ps(-ON_PLANE_EPSILON);
+
+    UINT i = 0;
+    for (; i + 4 <= soa.count; i += 4)
+    {
+        __m128 front = _mm_setzero_ps();
+        __m128 back = _mm_setzero_ps();
+        for (int c = 0; c < 3; c++)
+        {
+            // ((a*x + b*y) + c*z) + d, same order as the scalar code
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(pa, _mm_loadu_ps(soa.pos[c * 3 + 0] + i)),
+                _mm_mul_ps(pb, _mm_loadu_ps(soa.pos[c * 3 + 1] + i))),
+                _mm_mul_ps(pc, _mm_loadu_ps(soa.pos[c * 3 + 2] + i))), pd);
+            front = _mm_or_ps(front, _mm_cmpgt_ps(dist, epsPos));
+            back = _mm_or_ps(back, _mm_cmplt_ps(dist, epsNeg));
+        }
+        AccumulateMasks((UINT)_mm_movemask_ps(front), (UINT)_mm_movemask_ps(back), 0xF, i, counts, outSides);
+    }
+    ClassifyScalar(soa, plane, i, counts, outSides);
+}
+
+static void ClassifyAVX(const BSPTriSoA& soa, const D3DXPLANE& plane, BSPClassifyCounts& counts, BYTE* outSides)
+{
+    const __m256 pa = _mm256_set1_ps(plane.a);
+    const __m256 pb = _mm256_set1_ps(plane.b);
+    const __m256 pc = _mm256_set1_ps(plane.c);
+    const __m256 pd = _mm256_set1_ps(plane.d);
+    const __m256 epsPos = _mm256_set1_ps(ON_PLANE_EPSILON);
+    const __m256 epsNeg = _mm256_set1_ps(-ON_PLANE_EPSILON);
+
+    UINT i = 0;
+    for (; i + 8 <= soa.count; i += 8)
+    {
+        __m256 front = _mm256_setzero_ps();
+        __m256 back = _mm256_setzero_ps();
+        for (int c = 0; c < 3; c++)
+        {
+            // No FMA here: it would round differently from the scalar path
+            __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                _mm256_mul_ps(pa, _mm256_loadu_ps(soa.pos[c * 3 + 0] + i)),
+                _mm256_mul_ps(pb, _mm256_loadu_ps(soa.pos[c * 3 + 1] + i))),
+                _mm256_mul_ps(pc, _mm256_loadu_ps(soa.pos[c * 3 + 2] + i))), pd);
+            front = _mm256_or_ps(front, _mm256_cmp_ps(dist, epsPos, _CMP_GT_OQ));
+            back = _mm256_or_ps(back, _mm256_cmp_ps(dist, epsNeg, _CMP_LT_OQ));
+        }
+        AccumulateMasks((UINT)_mm256_movemask_ps(front), (UINT)_mm256_movemask_ps(back), 0xFF, i, counts, outSides);
+    }
+    _mm256_zeroupper();
+    ClassifyScalar(soa, plane, i, counts, outSides);
+}
+
+void ClassifyTriangles(const BSPTriSoA& soa, const D3DXPLANE& plane, BSPClassifyCounts& counts,
+    BYTE* outSides, eClassifyPath path)
+{
+    if (path == CLASSIFY_AUTO) path = GetBestClassifyPath();
+
+    switch (path)
+    {
+    case CLASSIFY_AVX:  ClassifyAVX(soa, plane, counts, outSides); break;
+    case CLASSIFY_SSE:  ClassifySSE(soa, plane, counts, outSides); break;
+    default:            ClassifyScalar(soa, plane, 0, counts, outSides); break;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "stdafx.h"
+
+struct BSPTriangle;
+
+// Which kernel ClassifyTriangles runs. AUTO picks the best one the CPU supports.
+enum eClassifyPath
+{
+    CLASSIFY_AUTO,
+    CLASSIFY_SCALAR,
+    CLASSIFY_SSE,
+    CLASSIFY_AVX
+};
+
+struct BSPClassifyCounts
+{
+    UINT front = 0;
+    UINT back = 0;
+    UINT split = 0;
+    UINT coplanar = 0;
+};
+
+// Structure-of-arrays copy of the triangle corners, so a plane test
+// can load 8 triangles' worth of one coordinate at a time.
+struct BSPTriSoA
+{
+    // pos[corner * 3 + axis] -> 'count' floats
+    const float* pos[9] = {};
+    UINT count = 0;
+
+    BSPTriSoA() {}
+    BSPTriSoA(const BSPTriSoA&) = delete;
+    BSPTriSoA& operator=(const BSPTriSoA&) = delete;
+
+    void Build(const BSPTriangle* tris, UINT numTris);
+    // Same, but the copy goes to 'storage' (numTris * 9 floats) owned by the caller
+    void Build(const BSPTriangle* tris, UINT numTris, float* storage);
+
+private:
+    std::vector<float> m_data;
+};
+
+eClassifyPath GetBestClassifyPath();
+const char* GetClassifyPathName(eClassifyPath path);
+
+// Classifies every triangle in 'soa' against 'plane' in one pass.
+// Same thresholds and float evaluation order as CBSPlevel::ClassifyTriangle,
+// so every path gives identical results. 'outSides' (optional) gets one eSide per triangle.
+void ClassifyTriangles(const BSPTriSoA& soa, const D3DXPLANE& plane, BSPClassifyCounts& counts,
+    BYTE* outSides = nullptr, eClassifyPath path = CLASSIFY_AUTO);
@@ -0,0 +1,326 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "CBSPlevel.h"
+#include "BSPRayPacket.h"
+
+// Same as IntersectTriangleShadowEdges
+static const float RAY_EPSILON = 0.00001f;
+// Child segments overlap by this much around the split point, so a ray grazing a
+// splitting plane is looked up on both sides instead of falling between them
+static const float SPLIT_SLACK = 0.0001f;
+
+// Iterative walk starting at 'root' over the ray segment [tmin, tmax].
+// The near child (the origin's side) is visited first, the far part of the segment waits on the stack.
+static bool CastRayFrom(const BSPFlatNode* nodes, const BSPShadowTri* tris, const D3DXVECTOR3& start,
+    const D3DXVECTOR3& dir, float length, int root, float tmin, float tmax)
+{
+    struct Entry
+    {
+        int   node;
+        float tmin, tmax;
+    };
+    Entry stack[BSP_RAY_STACK_DEPTH];
+    int sp = 0;
+    int nodeIndex = root;
+
+    for (;;)
+    {
+        if (nodeIndex != -1)
+        {
+            const BSPFlatNode& node = nodes[nodeIndex];
+            const BSPShadowTri* tri = tris + node.firstTri;
+            for (UINT t = 0; t < node.triCount; t++, tri++)
+            {
+                if (IntersectTriangleShadowEdges(start, dir, length + RAY_EPSILON, tri->v0, tri->edge1, tri->edge2))
+                    return true;
+            }
+
+            if (!node.isLeaf)
+            {
+                const D3DXPLANE& p = node.plane;
+                float distStart = p.a * start.x + p.b * start.y + p.c * start.z + p.d;
+                float denom = p.a * dir.x + p.b * dir.y + p.c * dir.z;
+                bool nearFront = distStart >= 0.0f;
+                int nearChild = nearFront ? node.iFront : node.iBack;
+                int farChild = nearFront ? node.iBack : node.iFront;
+
+                // Only a ray heading towards the plane reaches the far side
+                bool toward = nearFront ? (denom < 0.0f) : (denom > 0.0f);
+                float nearMax = tmax, farMin = FLT_MAX;
+                if (toward)
+                {
+                    float tSplit = -distStart / denom;
+                    nearMax = std::min(tmax, tSplit + SPLIT_SLACK);
+                    farMin = std::max(tmin, tSplit - SPLIT_SLACK);
+                }
+                else if (fabsf(distStart) <= RAY_EPSILON)
+                    farMin = tmin; // Starts on the plane, could be either side
+
+                if (farChild != -1 && farMin <= tmax)
+                {
+                    if (sp < BSP_RAY_STACK_DEPTH)
+                    {
+                        stack[sp].node = farChild;
+                        stack[sp].tmin = farMin;
+                        stack[sp].tmax = tmax;
+                        sp++;
+                    }
+                    else if (CastRayFrom(nodes, tris, start, dir, length, farChild, farMin, tmax))
+                        return true;
+                }
+                if (nearChild != -1 && tmin <= nearMax)
+                {
+                    nodeIndex = nearChild;
+                    tmax = nearMax;
+                    continue;
+                }
+            }
+        }
+
+        if (sp == 0) return false;
+        sp--;
+        nodeIndex = stack[sp].node;
+        tmin = stack[sp].tmin;
+        tmax = stack[sp].tmax;
+    }
+}
+
+bool BSPRayCastAny(const BSPFlatNode* nodes, const BSPShadowTri* tris,
+    const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length)
+{
+    return CastRayFrom(nodes, tris, start, dir, length, 0, 0.0f, length);
+}
+
+// Lane wrappers so the packet walk is written once for both widths
+struct LanesSSE
+{
+    typedef __m128 V;
+    enum { W = 4 };
+    static V Set(float f) { return _mm_set1_ps(f); }
+    static V Load(const float* p) { return _mm_loadu_ps(p); }
+    static void Store(float* p, V v) { _mm_storeu_ps(p, v); }
+    static V Add(V a, V b) { return _mm_add_ps(a, b); }
+    static V Sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V Mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V Div(V a, V b) { return _mm_div_ps(a, b); }
+    static V Min(V a, V b) { return _mm_min_ps(a, b); }
+    static V Max(V a, V b) { return _mm_max_ps(a, b); }
+    static V Lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+    static V Gt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+    static V Le(V a, V b) { return _mm_cmple_ps(a, b); }
+    static V Ge(V a, V b) { return _mm_cmpge_ps(a, b); }
+    static V And(V a, V b) { return _mm_and_ps(a, b); }
+    static V Or(V a, V b) { return _mm_or_ps(a, b); }
+    static V Select(V a, V b, V m) { return _mm_or_ps(_mm_and_ps(m, b), _mm_andnot_ps(m, a)); }
+    static UINT Mask(V v) { return (UINT)_mm_movemask_ps(v); }
+};
+
+struct LanesAVX
+{
+    typedef __m256 V;
+    enum { W = 8 };
+    static V Set(float f) { return _mm256_set1_ps(f); }
+    static V Load(const float* p) { return _mm256_loadu_ps(p); }
+    static void Store(float* p, V v) { _mm256_storeu_ps(p, v); }
+    static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+    static V Min(V a, V b) { return _mm256_min_ps(a, b); }
+    static V Max(V a, V b) { return _mm256_max_ps(a, b); }
+    static V Lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static V Gt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static V Le(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static V Ge(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static V And(V a, V b) { return _mm256_and_ps(a, b); }
+    static V Or(V a, V b) { return _mm256_or_ps(a, b); }
+    static V Select(V a, V b, V m) { return _mm256_blendv_ps(a, b, m); }
+    static UINT Mask(V v) { return (UINT)_mm256_movemask_ps(v); }
+};
+
+// One packet of up to L::W rays, SoA in dx/dy/dz/len. Returns the lanes that hit something.
+template <class L>
+static UINT CastPacket(const BSPFlatNode* nodes, const BSPShadowTri* tris, const D3DXVECTOR3& start,
+    const float* dx, const float* dy, const float* dz, const float* len, UINT laneMask)
+{
+    typedef typename L::V V;
+    struct Entry
+    {
+        int   node;
+        UINT  mask;
+        float tmin[L::W];
+        float tmax[L::W];
+    };
+    Entry stack[BSP_RAY_STACK_DEPTH];
+    int sp = 0;
+
+    const V dirX = L::Load(dx), dirY = L::Load(dy), dirZ = L::Load(dz);
+    const V zero = L::Set(0.0f), one = L::Set(1.0f);
+    const V eps = L::Set(RAY_EPSILON), negEps = L::Set(-RAY_EPSILON);
+    const V slack = L::Set(SPLIT_SLACK);
+    const V tLimit = L::Add(L::Load(len), eps);
+
+    int nodeIndex = 0;
+    UINT mask = laneMask;
+    UINT hits = 0;
+    V tmin = zero, tmax = L::Load(len);
+
+    for (;;)
+    {
+        mask &= ~hits;
+        if (mask && nodeIndex != -1)
+        {
+            const BSPFlatNode& node = nodes[nodeIndex];
+            const BSPShadowTri* tri = tris + node.firstTri;
+            for (UINT t = 0; t < node.triCount; t++, tri++)
+            {
+                // Origin side of Möller–Trumbore, the same for every lane
+                D3DXVECTOR3 tvec = start - tri->v0;
+                D3DXVECTOR3 qvec;
+                D3DXVec3Cross(&qvec, &tvec, &tri->edge1);
+                const D3DXVECTOR3& e1 = tri->edge1;
+                const D3DXVECTOR3& e2 = tri->edge2;
+
+                // pvec = dir x edge2
+                V px = L::Sub(L::Mul(dirY, L::Set(e2.z)), L::Mul(dirZ, L::Set(e2.y)));
+                V py = L::Sub(L::Mul(dirZ, L::Set(e2.x)), L::Mul(dirX, L::Set(e2.z)));
+                V pz = L::Sub(L::Mul(dirX, L::Set(e2.y)), L::Mul(dirY, L::Set(e2.x)));
+                V det = L::Add(L::Add(L::Mul(L::Set(e1.x), px), L::Mul(L::Set(e1.y), py)), L::Mul(L::Set(e1.z), pz));
+                V invDet = L::Div(one, det);
+
+                V u = L::Mul(L::Add(L::Add(L::Mul(L::Set(tvec.x), px), L::Mul(L::Set(tvec.y), py)), L::Mul(L::Set(tvec.z), pz)), invDet);
+                V v = L::Mul(L::Add(L::Add(L::Mul(dirX, L::Set(qvec.x)), L::Mul(dirY, L::Set(qvec.y))), L::Mul(dirZ, L::Set(qvec.z))), invDet);
+                V dist = L::Mul(L::Set(D3DXVec3Dot(&e2, &qvec)), invDet);
+
+                V hit = L::Or(L::Le(det, negEps), L::Ge(det, eps));
+                hit = L::And(hit, L::And(L::Ge(u, zero), L::Le(u, one)));
+                hit = L::And(hit, L::And(L::Ge(v, zero), L::Le(L::Add(u, v), one)));
+                hit = L::And(hit, L::And(L::Gt(dist, eps), L::Lt(dist, tLimit)));
+                hits |= L::Mask(hit) & mask;
+                if ((mask & ~hits) == 0) break;
+            }
+            mask &= ~hits;
+
+            if (mask && !node.isLeaf)
+            {
+                const D3DXPLANE& p = node.plane;
+                float distStart = p.a * start.x + p.b * start.y + p.c * start.z + p.d;
+                V denom = L::Add(L::Add(L::Mul(L::Set(p.a), dirX), L::Mul(L::Set(p.b), dirY)), L::Mul(L::Set(p.c), dirZ));
+                bool nearFront = distStart >= 0.0f;
+                int nearChild = nearFront ? node.iFront : node.iBack;
+                int farChild = nearFront ? node.iBack : node.iFront;
+
+                // Lanes heading towards the plane split their segment there, the rest stay on the near side
+                V toward = nearFront ? L::Lt(denom, zero) : L::Gt(denom, zero);
+                V tSplit = L::Div(L::Set(-distStart), denom);
+                V nearMax = L::Select(tmax, L::Min(tmax, L::Add(tSplit, slack)), toward);
+                V farMin = L::Max(tmin, L::Sub(tSplit, slack));
+                UINT farMask = L::Mask(L::And(toward, L::Le(farMin, tmax))) & mask;
+                if (fabsf(distStart) <= RAY_EPSILON)
+                {
+                    // Starts on the plane, could be either side
+                    farMin = L::Select(tmin, farMin, toward);
+                    farMask = mask;
+                }
+                UINT nearMask = L::Mask(L::Le(tmin, nearMax)) & mask;
+
+                if (farChild != -1 && farMask)
+                {
+                    if (sp < BSP_RAY_STACK_DEPTH)
+                    {
+                        stack[sp].node = farChild;
+                        stack[sp].mask = farMask;
+                        L::Store(stack[sp].tmin, farMin);
+                        L::Store(stack[sp].tmax, tmax);
+                        sp++;
+                    }
+                    else
+                    {
+                        // Out of stack, finish the far side one ray at a time
+                        float fmin[L::W], fmax[L::W];
+                        L::Store(fmin, farMin);
+                        L::Store(fmax, tmax);
+                        for (int lane = 0; lane < L::W; lane++)
+                        {
+                            if (!((farMask >> lane) & 1)) continue;
+                            D3DXVECTOR3 dir(dx[lane], dy[lane], dz[lane]);
+                            if (CastRayFrom(nodes, tris, start, dir, len[lane], farChild, fmin[lane], fmax[lane]))
+                                hits |= 1u << lane;
+                        }
+                    }
+                }
+                if (nearChild != -1 && nearMask)
+                {
+                    nodeIndex = nearChild;
+                    mask = nearMask;
+                    tmax = nearMax;
+                    continue;
+                }
+            }
+        }
+
+        if (sp == 0) break;
+        sp--;
+        nodeIndex = stack[sp].node;
+        mask = stack[sp].mask;
+        tmin = L::Load(stack[sp].tmin);
+        tmax = L::Load(stack[sp].tmax);
+    }
+    return hits;
+}
+
+template <class L>
+static void CastPackets(const BSPFlatNode* nodes, const BSPShadowTri* tris, const D3DXVECTOR3& start,
+    const D3DXVECTOR3* dirs, const float* lengths, UINT count, BYTE* blocked)
+{
+    float dx[L::W], dy[L::W], dz[L::W], len[L::W];
+    for (UINT first = 0; first < count; first += L::W)
+    {
+        UINT n = std::min<UINT>(L::W, count - first);
+        for (UINT lane = 0; lane < (UINT)L::W; lane++)
+        {
+            // Unused lanes get a harmless ray and are masked off
+            UINT i = first + std::min(lane, n - 1);
+            dx[lane] = dirs[i].x;
+            dy[lane] = dirs[i].y;
+            dz[lane] = dirs[i].z;
+            len[lane] = lengths[i];
+        }
+        UINT hits = CastPacket<L>(nodes, tris, start, dx, dy, dz, len, (1u << n) - 1);
+        for (UINT lane = 0; lane < n; lane++)
+            blocked[first + lane] = (BYTE)((hits >> lane) & 1);
+    }
+}
+
+UINT GetRayPacketWidth(eClassifyPath path)
+{
+    if (path == CLASSIFY_AUTO) path = GetBestClassifyPath();
+    switch (path)
+    {
+    case CLASSIFY_AVX:  return LanesAVX::W;
+    case CLASSIFY_SSE:  return LanesSSE::W;
+    default:            return 1;
+    }
+}
+
+void BSPRayCastPacket(const BSPFlatNode* nodes, const BSPShadowTri* tris,
+    const D3DXVECTOR3& start, const D3DXVECTOR3* dirs, const float* lengths, UINT count,
+    BYTE* blocked, eClassifyPath path)
+{
+    if (path == CLASSIFY_AUTO) path = GetBestClassifyPath();
+
+    switch (path)
+    {
+    case CLASSIFY_AVX:
+        CastPackets<LanesAVX>(nodes, tris, start, dirs, lengths, count, blocked);
+        _mm256_zeroupper();
+        break;
+    case CLASSIFY_SSE:
+        CastPackets<LanesSSE>(nodes, tris, start, dirs, lengths, count, blocked);
+        break;
+    default:
+        for (UINT i = 0; i < count; i++)
+            blocked[i] = BSPRayCastAny(nodes, tris, start, dirs[i], lengths[i]) ? 1 : 0;
+        break;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "stdafx.h"
+#include "BSPClassifier.h"
+
+struct BSPFlatNode;
+struct BSPShadowTri;
+
+// Shadow rays against the flattened BSP (CBSPlevel::m_flatNodes / m_flatShadowTris).
+// Both traversals are iterative with a small fixed stack, a ray that needs more than
+// BSP_RAY_STACK_DEPTH pending subtrees finishes the deepest ones recursively.
+static const int BSP_RAY_STACK_DEPTH = 64;
+
+// True if a triangle is hit at 0 < t < length. 'dir' must be normalized.
+bool BSPRayCastAny(const BSPFlatNode* nodes, const BSPShadowTri* tris,
+    const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length);
+
+// 'count' rays from one origin (a shooter and its receivers, a patch and its sky samples).
+// Rays go down the tree together in packets of 4 (SSE) or 8 (AVX), each node's
+// triangles are tested against the whole packet at once (Möller–Trumbore per lane).
+// With one origin the triangle side of the test (origin - v0, its cross with edge1)
+// is shared by every lane. blocked[i] is set to 1 or 0. SCALAR casts them one by one.
+void BSPRayCastPacket(const BSPFlatNode* nodes, const BSPShadowTri* tris,
+    const D3DXVECTOR3& start, const D3DXVECTOR3* dirs, const float* lengths, UINT count,
+    BYTE* blocked, eClassifyPath path = CLASSIFY_AUTO);
+
+// Rays per packet for 'path' (1 for scalar)
+UINT GetRayPacketWidth(eClassifyPath path);
@@ -75,15 +75,32 @@ Q3BSPVertex BezierTessellator::Interpolate(const drawVert_t& p0, const drawVert_
 
     return out;
 }
+void BezierTessellator::CountPatch(int cpWidth, int cpHeight, int levelU, int levelV, int& numVerts, int& numIndices)
+{
+    // One (levelU+1) x (levelV+1) grid per 3x3 block, see TessellatePatch
+    int blocks = ((cpWidth - 1) / 2) * ((cpHeight - 1) / 2);
+    numVerts = blocks * (levelU + 1) * (levelV + 1);
+    numIndices = blocks * levelU * levelV * 6;
+}
+
 void BezierTessellator::TessellatePatch(const drawVert_t* controls, int cpWidth, int cpHeight, int level)
+{
+    int numVerts, numIndices;
+    CountPatch(cpWidth, cpHeight, level, level, numVerts, numIndices);
+    m_outVerts.resize(numVerts);
+    m_outIndices.resize(numIndices);
+    TessellatePatch(controls, cpWidth, cpHeight, level, level, m_outVerts.data(), m_outIndices.data(), 0);
+}
+
+void BezierTessellator::TessellatePatch(const drawVert_t* controls, int cpWidth, int cpHeight, int levelU, int levelV,
+    Q3BSPVertex* outVerts, int* outIndices, int baseVertex)
 {
     // Q3 patches are grids of (width * height) control points.
     // However, they are composed of fused 3x3 bezier surfaces.
     // Example: A 3x5 patch is actually TWO 3x3 patches sharing the middle row.
     // Step size is 2.
-
-    m_outVerts.clear();
-    m_outIndices.clear();
+    const int blockVerts = (levelU + 1) * (levelV + 1);
+    const int blockIndices = levelU * levelV * 6;
 
     // Loop through the patch in 3x3 blocks
     for (int i = 0; i < cpWidth - 1; i += 2) {
@@ -98,21 +115,23 @@ void BezierTessellator::TessellatePatch(const drawVert_t* controls, int cpWidth,
                     chunk[y * 3 + x] = controls[index];
                 }
             }
-            Tessellate3x3(chunk, level);
+            Tessellate3x3(chunk, levelU, levelV, outVerts, outIndices, baseVertex);
+            outVerts += blockVerts;
+            outIndices += blockIndices;
+            baseVertex += blockVerts;
         }
     }
 }
 
-void BezierTessellator::Tessellate3x3(const drawVert_t cp[9], int level)
+void BezierTessellator::Tessellate3x3(const drawVert_t cp[9], int levelU, int levelV, Q3BSPVertex* outVerts, int* outIndices, int baseVertex)
 {
-    int startVertIndex = (int)m_outVerts.size();
-    int L = level;
+    int startVertIndex = baseVertex;
 
     // 1. Generate Vertices
     // We compute rows, then columns (Bi-quadratic)
-    for (int i = 0; i <= L; ++i)
+    for (int i = 0; i <= levelV; ++i)
     {
-        float a = (float)i / L;
+        float a = (float)i / levelV;
 
         // Calculate 3 points along the vertical columns
         drawVert_t temp[3];
@@ -121,20 +140,20 @@ void BezierTessellator::Tessellate3x3(const drawVert_t cp[9], int level)
         temp[2] = InterpolateD(cp[2], cp[5], cp[8], a);
 
         // Now interpolate across those 3 to get the row
-        for (int j = 0; j <= L; ++j)
+        for (int j = 0; j <= levelU; ++j)
         {
-            float b = (float)j / L;
-            m_outVerts.push_back(Interpolate(temp[0], temp[1], temp[2], b));
+            float b = (float)j / levelU;
+            *outVerts++ = Interpolate(temp[0], temp[1], temp[2], b);
         }
     }
 
     // 2. Generate Indices (Triangle List)
-    // Grid size is (L+1) * (L+1)
-    int rowLen = L + 1;
+    // Grid size is (levelU+1) * (levelV+1)
+    int rowLen = levelU + 1;
 
-    for (int i = 0; i < L; ++i)
+    for (int i = 0; i < levelV; ++i)
     {
-        for (int j = 0; j < L; ++j)
+        for (int j = 0; j < levelU; ++j)
         {
             int v0 = startVertIndex + i * rowLen + j;
             int v1 = startVertIndex + (i + 1) * rowLen + j;
@@ -142,14 +161,14 @@ void BezierTessellator::Tessellate3x3(const drawVert_t cp[9], int level)
             int v3 = startVertIndex + (i + 1) * rowLen + (j + 1);
 
             // Triangle 1
-            m_outIndices.push_back(v0);
-            m_outIndices.push_back(v1); // Q3 Winding might need swap depending on cull mode
-            m_outIndices.push_back(v2);
+            *outIndices++ = v0;
+            *outIndices++ = v1; // Q3 Winding might need swap depending on cull mode
+            *outIndices++ = v2;
 
             // Triangle 2
-            m_outIndices.push_back(v1);
-            m_outIndices.push_back(v3);
-            m_outIndices.push_back(v2);
+            *outIndices++ = v1;
+            *outIndices++ = v3;
+            *outIndices++ = v2;
         }
     }
 }
\ No newline at end of file
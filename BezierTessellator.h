@@ -13,12 +13,20 @@ public:
     // level = Level of Detail (e.g., 5 to 10)
     void TessellatePatch(const drawVert_t* controls, int cpWidth, int cpHeight, int level);
 
+    // Exact output size of a patch, so callers can size their arrays up front.
+    // levelU subdivides along the width, levelV along the height.
+    static void CountPatch(int cpWidth, int cpHeight, int levelU, int levelV, int& numVerts, int& numIndices);
+    // Writes CountPatch's numbers of vertices and indices, indices start at baseVertex.
+    // No state, any number of threads can run it at once.
+    static void TessellatePatch(const drawVert_t* controls, int cpWidth, int cpHeight, int levelU, int levelV,
+        Q3BSPVertex* outVerts, int* outIndices, int baseVertex);
+
 private:
     // Interpolates a single vertex between 3 control points at value t (0.0 to 1.0)
-    drawVert_t InterpolateD(const drawVert_t& p0, const drawVert_t& p1, const drawVert_t& p2, float t);
-    Q3BSPVertex Interpolate(const drawVert_t& p0, const drawVert_t& p1, const drawVert_t& p2, float t);    // Helper to linear interpolate basic types
+    static drawVert_t InterpolateD(const drawVert_t& p0, const drawVert_t& p1, const drawVert_t& p2, float t);
+    static Q3BSPVertex Interpolate(const drawVert_t& p0, const drawVert_t& p1, const drawVert_t& p2, float t);    // Helper to linear interpolate basic types
     float Lerp(float a, float b, float t) { return a + (b - a) * t; }
 
     // Q3 uses 3x3 control point grids. We split large patches into 3x3 chunks.
-    void Tessellate3x3(const drawVert_t cp[9], int level);
+    static void Tessellate3x3(const drawVert_t cp[9], int levelU, int levelV, Q3BSPVertex* outVerts, int* outIndices, int baseVertex);
 };
\ No newline at end of file
@@ -4,6 +4,14 @@
 #include "tiny_obj_loader.h"
 
 #include "CBSPlevel.h"
+#include "MappedFile.h"
+#include "OBJStreamLoader.h"
+#include "RadiosityHierarchy.h"
+#include "ShadowBVH.h"
+#include "RadiosityHemicube.h"
+#include "RadiosityCheckpoint.h"
+#include "RadiositySampler.h"
+#include "LightmapAtlas.h"
 
 #ifndef FtoDW
 #define FtoDW(f) (*(DWORD*)&(f))
@@ -14,12 +22,16 @@
 CBSPlevel::CBSPlevel()
 {
     nodePool.clear();
-	nodePool.reserve(500000);
 	m_pMeshVB = NULL;
     // Initialize Threading Vars
     m_eState = BS_IDLE;
     m_fProgress = 0.0f;
     m_bStopRequested = false;
+    m_iActiveTasks = 0;
+    m_iSplitCount = 0;
+    m_iOutputAllocs = 0;
+    m_iTrisPlaced = 0;
+    m_iTrisPending = 0;
     m_offset = btVector3(0, 0, 0);
 	m_pLevelObject = nullptr;
 	m_pdworld = nullptr;
@@ -31,6 +43,7 @@ CBSPlevel::CBSPlevel()
 CBSPlevel::~CBSPlevel()
 {
 	SAFE_RELEASE(m_pMeshVB);
+	SAFE_RELEASE(m_pLightmapTex);
 
 	CleanupPhysics();
     // Signal thread to stop
@@ -51,6 +64,9 @@ void CBSPlevel::StartBackgroundBuild()
     // Reset State
     m_fProgress = 0.0f;
     m_bStopRequested = false;
+    // A new bake brings its own lightmap, if any
+    m_bLightmapReady = false;
+    SAFE_RELEASE(m_pLightmapTex);
     // If a thread is already finished but not joined, join it now
     if (m_workerThread.joinable()) 
     {
@@ -62,8 +78,109 @@ void CBSPlevel::StartBackgroundBuild()
 }
 BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filename)
 {
-    // Define your scale factor
-    float importScale = 0.01f;
+    auto t0 = std::chrono::steady_clock::now();
+    m_pipelineStats = BSPPipelineStats();
+
+    // A compiled cache built from the same files and settings skips everything below
+    m_cachePath = filename + ".bspc";
+    m_checkpointBase = filename;
+    if (HashSourceFiles(filename, m_sourceHash) && m_bUseCache && LoadCompiledCache(dynamicsWorld))
+    {
+        m_pipelineStats.loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        return TRUE;
+    }
+
+	mObjVertices.clear();
+	m_triangles_temp.clear();
+    BOOL ret = m_bStreamingLoad ? LoadOBJStreaming(filename, m_materials, m_triangles) :
+        LoadOBJTinyObj(filename, m_materials, m_triangles);
+    if (!ret) return FALSE;
+    m_pipelineStats.loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+	_log(L"Total Triangles Loaded: %d \n", (int)m_triangles.size());
+	InitPhysics(dynamicsWorld);
+	return TRUE;
+}
+
+// Kd is the wall color, Ka is (ab)used as the light emission
+static void ConvertMaterials(const std::vector<tinyobj::material_t>& materials, std::vector<BSPMaterial>& out)
+{
+    out.clear();
+    for (const auto& mat : materials)
+    {
+        BSPMaterial bspMat;
+        // Diffuse (Kd)
+        bspMat.diffuse = D3DXCOLOR(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2], 1.0f);
+        // Emissive (Ke) - THE KEY PART
+        // We multiply by a scalar (e.g., 5.0f) because raw 1.0 is often too dim for global illumination
+        float intensity = 1.0f;
+        bspMat.emissive = D3DXCOLOR(mat.ambient[0] * intensity, mat.ambient[1] * intensity, mat.ambient[2] * intensity, 1.0f);
+        out.push_back(bspMat);
+    }
+    // Default material (Index 0) if none exist
+    if (out.empty()) {
+        BSPMaterial def;
+        def.diffuse = D3DXCOLOR(0.5f, 0.5f, 0.5f, 1.0f);
+        def.emissive = D3DXCOLOR(0, 0, 0, 0);
+        out.push_back(def);
+    }
+}
+
+BOOL CBSPlevel::LoadOBJStreaming(const std::string& filename, std::vector<BSPMaterial>& outMaterials, std::vector<BSPTriangle>& outTris)
+{
+    COBJStreamLoader loader;
+    std::vector<tinyobj::material_t> materials;
+    if (!loader.Load(filename, OBJ_IMPORT_SCALE, materials, outTris)) return FALSE;
+
+    ConvertMaterials(materials, outMaterials);
+    for (auto& tri : outTris)
+    {
+        // Handle negative/missing IDs
+        if (tri.matIndex < 0 || tri.matIndex >= (int)outMaterials.size()) tri.matIndex = 0;
+    }
+
+    _log(L"Streamed .obj file: %hs, %d triangles, %d materials in %.1f ms\n", filename.c_str(),
+        (int)outTris.size(), (int)materials.size(), loader.GetLoadMs());
+    return TRUE;
+}
+
+void CBSPlevel::BenchmarkOBJLoad(const std::string& filename, int runs)
+{
+    CMappedFile file;
+    if (!file.Open(filename))
+    {
+        _log(L"BenchmarkOBJLoad: can't open %hs\n", filename.c_str());
+        return;
+    }
+    const double mb = file.GetSize() / (1024.0 * 1024.0);
+    file.Close();
+
+    const char* names[2] = { "tinyobj", "streaming" };
+    size_t triCounts[2] = { 0, 0 };
+    for (int path = 0; path < 2; path++)
+    {
+        double best = DBL_MAX;
+        for (int r = 0; r < runs; r++)
+        {
+            std::vector<BSPMaterial> materials;
+            std::vector<BSPTriangle> tris;
+            auto t0 = std::chrono::steady_clock::now();
+            BOOL ok = (path == 0) ? LoadOBJTinyObj(filename, materials, tris) : LoadOBJStreaming(filename, materials, tris);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (!ok) return;
+            best = std::min(best, ms);
+            triCounts[path] = tris.size();
+        }
+        _log(L"OBJ bench %hs: %.1f MB, %d tris, %.1f ms, %.1f MB/s, %.2f Mtris/s\n", names[path], mb,
+            (int)triCounts[path], best, mb / (best / 1000.0), triCounts[path] / (best / 1000.0) / 1e6);
+    }
+    if (triCounts[0] != triCounts[1])
+        _log(L"OBJ bench: triangle counts differ (%d vs %d)\n", (int)triCounts[0], (int)triCounts[1]);
+}
+
+// Original tinyobj path, kept for comparison (SetStreamingLoad(false))
+BOOL CBSPlevel::LoadOBJTinyObj(const std::string& filename, std::vector<BSPMaterial>& outMaterials, std::vector<BSPTriangle>& outTris)
+{
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
@@ -87,28 +204,11 @@ BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filena
     // -------------------------------------------------------
     // 1. CONVERT MATERIALS
     // -------------------------------------------------------
-    m_materials.clear();
-    for (const auto& mat : materials)
-    {
-        BSPMaterial bspMat;
-        // Diffuse (Kd)
-        bspMat.diffuse = D3DXCOLOR(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2], 1.0f);
-        // Emissive (Ke) - THE KEY PART
-        // We multiply by a scalar (e.g., 5.0f) because raw 1.0 is often too dim for global illumination
-        float intensity = 1.0f;
-        bspMat.emissive = D3DXCOLOR(mat.ambient[0] * intensity, mat.ambient[1] * intensity, mat.ambient[2] * intensity, 1.0f);
-        m_materials.push_back(bspMat);
-    }
-    // Default material (Index 0) if none exist
-    if (m_materials.empty()) {
-        BSPMaterial def;
-        def.diffuse = D3DXCOLOR(0.5f, 0.5f, 0.5f, 1.0f);
-        def.emissive = D3DXCOLOR(0, 0, 0, 0);
-        m_materials.push_back(def);
-    }
-	mObjVertices.clear();
-    m_triangles.clear();
-	m_triangles_temp.clear();
+    ConvertMaterials(materials, outMaterials);
+    outTris.clear();
+    size_t faceCount = 0;
+    for (const auto& shape : shapes) faceCount += shape.mesh.num_face_vertices.size();
+    outTris.reserve(faceCount);
     // Loop over shapes (the file might contain multiple objects)
     for (const auto& shape : shapes) 
     {
@@ -124,10 +224,11 @@ BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filena
                 matId = shape.mesh.material_ids[f];
 
             // Handle negative/missing IDs
-            if (matId < 0 || matId >= m_materials.size()) matId = 0;
+            if (matId < 0 || matId >= outMaterials.size()) matId = 0;
 
             BSPTriangle tri;
             tri.matIndex = matId; // <--- Store it!
+            tri.objectId = (int)(&shape - &shapes[0]);
 
             // Loop over the 3 vertices of this face
             for (size_t v = 0; v < fv; v++)
@@ -136,9 +237,9 @@ BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filena
 
                 OBJVertex vert;
                 // ... [Copy Position, Normal, UV as before] ...
-                vert.x = attrib.vertices[3 * idx.vertex_index + 0] * importScale;
-                vert.y = attrib.vertices[3 * idx.vertex_index + 1] * importScale;
-                vert.z = attrib.vertices[3 * idx.vertex_index + 2] * importScale;
+                vert.x = attrib.vertices[3 * idx.vertex_index + 0] * OBJ_IMPORT_SCALE;
+                vert.y = attrib.vertices[3 * idx.vertex_index + 1] * OBJ_IMPORT_SCALE;
+                vert.z = attrib.vertices[3 * idx.vertex_index + 2] * OBJ_IMPORT_SCALE;
 
                 if (idx.normal_index >= 0) {
                     vert.nx = attrib.normals[3 * idx.normal_index + 0];
@@ -157,21 +258,290 @@ BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filena
 
                 // Store in our temporary triangle
                 tri.v[v] = vert;
-
-                // Keep the flat list for legacy render if needed
-                mObjVertices.push_back(vert);
             }
 
-            m_triangles.push_back(tri);
+            outTris.push_back(tri);
             index_offset += fv;
         }
     }
 
-	_log(L"Total Triangles Loaded: %d \n", (int)m_triangles.size());
-	InitPhysics(dynamicsWorld);
 	return TRUE;
 }
 
+// Hashes the OBJ and every MTL it references
+BOOL CBSPlevel::HashSourceFiles(const std::string& filename, uint64_t& outHash)
+{
+    CMappedFile obj;
+    if (!obj.Open(filename)) return FALSE;
+
+    FNV1aHash hash;
+    hash.Add(obj.GetData(), obj.GetSize());
+
+    // Material libraries are resolved relative to the OBJ, same as tinyobj
+    std::string baseDir;
+    size_t slash = filename.find_last_of("/\\");
+    if (slash != std::string::npos) baseDir = filename.substr(0, slash + 1);
+
+    const char* text = (const char*)obj.GetData();
+    const size_t size = obj.GetSize();
+    for (size_t pos = 0; pos < size; )
+    {
+        size_t end = pos;
+        while (end < size && text[end] != '\n') end++;
+
+        if (end - pos > 7 && strncmp(text + pos, "mtllib", 6) == 0 && (text[pos + 6] == ' ' || text[pos + 6] == '\t'))
+        {
+            std::string name(text + pos + 7, end - pos - 7);
+            while (!name.empty() && isspace((unsigned char)name.back())) name.pop_back();
+            while (!name.empty() && isspace((unsigned char)name.front())) name.erase(0, 1);
+
+            CMappedFile mtl;
+            if (mtl.Open(baseDir + name))
+                hash.Add(mtl.GetData(), mtl.GetSize());
+            else
+                hash.Add(name.data(), name.size()); // Missing MTL, still key on the name
+        }
+        pos = end + 1;
+    }
+
+    outHash = hash.value;
+    return TRUE;
+}
+
+// Everything that changes what ends up in the cache
+uint64_t CBSPlevel::GetCacheKey() const
+{
+    FNV1aHash hash;
+    hash.AddValue(BSPCACHE_VERSION);
+    hash.AddValue(m_sourceHash);
+    hash.AddValue(OBJ_IMPORT_SCALE);
+    hash.AddValue(MAX_EDGE_SQ);
+    hash.AddValue(MIN_EDGE_LENGTH_SQ);
+    hash.AddValue(SKY_SAMPLES);
+    // Parallel cutoff and classify path only change speed, not the tree
+    const BSPBuildOptions& opt = m_buildOptions;
+    hash.AddValue((int)opt.splitter);
+    hash.AddValue(opt.candidateBudget);
+    hash.AddValue(opt.splitWeight);
+    hash.AddValue(opt.balanceWeight);
+    hash.AddValue(opt.seed);
+    hash.AddValue(opt.leafSize);
+    hash.AddValue((int)opt.subdivMode);
+    hash.AddValue(opt.gradientThreshold);
+    hash.AddValue((int)opt.radSolver);
+    if (opt.radSolver == RAD_PROGRESSIVE)
+    {
+        hash.AddValue(opt.radShootBatch);
+        hash.AddValue(opt.radConvergence);
+        hash.AddValue(opt.radMaxShots);
+        hash.AddValue(opt.radHemicube);
+        if (opt.radHemicube) hash.AddValue(opt.hemicubeResolution);
+    }
+    hash.AddValue(opt.radDeterministic);
+    hash.AddValue(opt.skyStratified);
+    if (opt.skyStratified)
+    {
+        hash.AddValue(opt.skyMinSamples);
+        hash.AddValue(opt.skyMaxSamples);
+        hash.AddValue(opt.skyMaxError);
+    }
+    hash.AddValue(opt.lightmap);
+    if (opt.lightmap)
+    {
+        hash.AddValue(opt.lightmapTexelSize);
+        hash.AddValue(opt.lightmapMaxSize);
+        hash.AddValue(LIGHTMAP_SPLIT);
+        hash.AddValue(LIGHTMAP_MAX_SPLITS);
+    }
+    if (opt.radSolver == RAD_HIERARCHICAL)
+    {
+        hash.AddValue(opt.hierarchicalError);
+        hash.AddValue(RAD_HR_MAX_SWEEPS);
+        hash.AddValue(RAD_HR_TOLERANCE);
+    }
+    return hash.value;
+}
+
+template <typename T>
+static BOOL ReadCacheSection(const CMappedFile& file, const BSPCacheSection& sec, std::vector<T>& out)
+{
+    if (sec.elemSize != sizeof(T)) return FALSE;
+    if (sec.offset > file.GetSize() || sec.count > (file.GetSize() - sec.offset) / sizeof(T)) return FALSE;
+
+    const T* src = (const T*)(file.GetData() + sec.offset);
+    out.assign(src, src + (size_t)sec.count);
+    return TRUE;
+}
+
+BOOL CBSPlevel::LoadCompiledCache(btDynamicsWorld* dynamicsWorld)
+{
+    CMappedFile file;
+    if (!file.Open(m_cachePath)) return FALSE;
+
+    const size_t tableEnd = sizeof(BSPCacheHeader) + BSPC_SECTION_COUNT * sizeof(BSPCacheSection);
+    if (file.GetSize() < tableEnd) return FALSE;
+
+    const BSPCacheHeader* header = (const BSPCacheHeader*)file.GetData();
+    if (memcmp(header->magic, BSPCACHE_MAGIC, 4) != 0 || header->version != BSPCACHE_VERSION ||
+        header->sectionCount != BSPC_SECTION_COUNT)
+    {
+        _log(L"BSP cache %S is from another version, rebuilding\n", m_cachePath.c_str());
+        return FALSE;
+    }
+    if (header->key != GetCacheKey())
+    {
+        _log(L"BSP cache %S is out of date, rebuilding\n", m_cachePath.c_str());
+        return FALSE;
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    const BSPCacheSection* table = (const BSPCacheSection*)(file.GetData() + sizeof(BSPCacheHeader));
+    for (int i = 0; i < BSPC_SECTION_COUNT; i++)
+        if (table[i].id != (UINT)i) return FALSE;
+
+    BOOL ok = ReadCacheSection(file, table[BSPC_MATERIALS], m_materials) &&
+        ReadCacheSection(file, table[BSPC_FLAT_NODES], m_flatNodes) &&
+        ReadCacheSection(file, table[BSPC_FLAT_VERTS], m_flatVerts) &&
+        ReadCacheSection(file, table[BSPC_FLAT_MATINDEX], m_flatMatIndex) &&
+        ReadCacheSection(file, table[BSPC_FLAT_OBJECTID], m_flatObjectId) &&
+        ReadCacheSection(file, table[BSPC_SOURCE_TRIS], m_triangles);
+    std::vector<UINT> lightmapSize;
+    ok = ok && ReadCacheSection(file, table[BSPC_LIGHTMAP_SIZE], lightmapSize) &&
+        ReadCacheSection(file, table[BSPC_LIGHTMAP], m_lightmapPixels);
+
+    // A damaged file must not send the renderer out of bounds
+    if (ok && (m_flatVerts.size() != m_flatMatIndex.size() * 3 || m_flatObjectId.size() != m_flatMatIndex.size())) ok = FALSE;
+    if (ok && lightmapSize.empty() != m_lightmapPixels.empty()) ok = FALSE;
+    if (ok && !lightmapSize.empty() &&
+        (lightmapSize.size() != 2 || (size_t)lightmapSize[0] * lightmapSize[1] != m_lightmapPixels.size()))
+        ok = FALSE;
+    for (size_t n = 0; ok && n < m_flatNodes.size(); n++)
+    {
+        const BSPFlatNode& node = m_flatNodes[n];
+        if ((size_t)node.firstTri + node.triCount > m_flatMatIndex.size() ||
+            node.iFront < -1 || node.iFront >= (int)m_flatNodes.size() ||
+            node.iBack < -1 || node.iBack >= (int)m_flatNodes.size())
+            ok = FALSE;
+    }
+    for (size_t t = 0; ok && t < m_flatMatIndex.size(); t++)
+        if (m_flatMatIndex[t] < 0 || m_flatMatIndex[t] >= (int)m_materials.size()) ok = FALSE;
+    if (!ok)
+    {
+        _log(L"BSP cache %S is damaged, rebuilding\n", m_cachePath.c_str());
+        m_flatNodes.clear();
+        m_flatVerts.clear();
+        m_flatMatIndex.clear();
+        m_flatObjectId.clear();
+        m_triangles.clear();
+        m_lightmapPixels.clear();
+        return FALSE;
+    }
+
+    m_lightmapWidth = lightmapSize.empty() ? 0 : lightmapSize[0];
+    m_lightmapHeight = lightmapSize.empty() ? 0 : lightmapSize[1];
+    SAFE_RELEASE(m_pLightmapTex);
+    m_bLightmapReady = !m_lightmapPixels.empty();
+
+    RebuildShadowTris();
+    mObjVertices.clear();
+    m_patches.clear();
+    std::vector<BSPNode>().swap(nodePool);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    _log(L"Loaded BSP cache %S: %d nodes, %d triangles in %.2f ms\n", m_cachePath.c_str(),
+        (int)m_flatNodes.size(), (int)m_flatMatIndex.size(), ms);
+
+    InitPhysics(dynamicsWorld);
+    bPointsDraw = false;
+    m_fProgress = 1.0f;
+    m_eState = BS_READY;
+    return TRUE;
+}
+
+template <typename T>
+static void AddCacheSection(std::vector<BSPCacheSection>& table, uint64_t& offset, UINT id, const std::vector<T>& data)
+{
+    BSPCacheSection sec;
+    sec.id = id;
+    sec.elemSize = sizeof(T);
+    sec.offset = (offset + 15) & ~15ull; // Keep sections 16 byte aligned in the mapping
+    sec.count = data.size();
+    offset = sec.offset + sec.count * sizeof(T);
+    table.push_back(sec);
+}
+
+// Written to a temp file first, so a crash never leaves a half written cache behind.
+// 'colors' (one per flat vertex) replaces the vertex colors in the file.
+BOOL CBSPlevel::SaveCompiledCache(const std::vector<DWORD>* colors)
+{
+    if (m_cachePath.empty() || m_flatNodes.empty()) return FALSE;
+
+    BSPCacheHeader header = {};
+    memcpy(header.magic, BSPCACHE_MAGIC, 4);
+    header.version = BSPCACHE_VERSION;
+    header.key = GetCacheKey();
+    header.sectionCount = BSPC_SECTION_COUNT;
+
+    std::vector<BSPCacheSection> table;
+    uint64_t offset = sizeof(BSPCacheHeader) + BSPC_SECTION_COUNT * sizeof(BSPCacheSection);
+    AddCacheSection(table, offset, BSPC_MATERIALS, m_materials);
+    AddCacheSection(table, offset, BSPC_FLAT_NODES, m_flatNodes);
+    AddCacheSection(table, offset, BSPC_FLAT_VERTS, m_flatVerts);
+    AddCacheSection(table, offset, BSPC_FLAT_MATINDEX, m_flatMatIndex);
+    AddCacheSection(table, offset, BSPC_FLAT_OBJECTID, m_flatObjectId);
+    AddCacheSection(table, offset, BSPC_SOURCE_TRIS, m_triangles);
+    // Empty unless this is a lightmap bake
+    std::vector<UINT> lightmapSize;
+    if (!m_lightmapPixels.empty()) lightmapSize = { m_lightmapWidth, m_lightmapHeight };
+    AddCacheSection(table, offset, BSPC_LIGHTMAP_SIZE, lightmapSize);
+    AddCacheSection(table, offset, BSPC_LIGHTMAP, m_lightmapPixels);
+
+    // The render thread writes colors into m_flatVerts while a background bake runs
+    std::vector<OBJVertex> verts;
+    {
+        std::lock_guard<std::mutex> lock(m_flatMutex);
+        verts = m_flatVerts;
+    }
+    if (colors && colors->size() == verts.size())
+        for (size_t i = 0; i < verts.size(); i++) verts[i].color = (*colors)[i];
+    const void* data[BSPC_SECTION_COUNT] = {
+        m_materials.data(), m_flatNodes.data(), verts.data(), m_flatMatIndex.data(), m_flatObjectId.data(),
+        m_triangles.data(), lightmapSize.data(), m_lightmapPixels.data() };
+
+    std::string tempPath = m_cachePath + ".tmp";
+    FILE* f = fopen(tempPath.c_str(), "wb");
+    if (!f)
+    {
+        _log(L"Could not write BSP cache %S\n", tempPath.c_str());
+        return FALSE;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(table.data(), sizeof(BSPCacheSection), table.size(), f) == table.size();
+
+    static const BYTE zeros[16] = {};
+    for (int i = 0; ok && i < BSPC_SECTION_COUNT; i++)
+    {
+        long pad = (long)table[i].offset - ftell(f);
+        if (pad > 0) ok = fwrite(zeros, 1, pad, f) == (size_t)pad;
+
+        size_t bytes = (size_t)table[i].count * table[i].elemSize;
+        if (ok && bytes) ok = fwrite(data[i], 1, bytes, f) == bytes;
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || !MoveFileExA(tempPath.c_str(), m_cachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        _log(L"Could not write BSP cache %S\n", m_cachePath.c_str());
+        DeleteFileA(tempPath.c_str());
+        return FALSE;
+    }
+
+    _log(L"Saved BSP cache %S (%.1f MB)\n", m_cachePath.c_str(), offset / (1024.0 * 1024.0));
+    return TRUE;
+}
+
 //void CBSPlevel::ExtractTriangles()
 //{
 //    m_triangles.clear();
@@ -192,7 +562,251 @@ BOOL CBSPlevel::LoadOBJ(btDynamicsWorld* dynamicsWorld, const std::string filena
 //
 //}
 
+// Bit-exact vertex key for welding
+struct WeldKey
+{
+    float f[11];
+    bool operator==(const WeldKey& o) const { return memcmp(f, o.f, sizeof(f)) == 0; }
+};
+struct WeldKeyHash
+{
+    size_t operator()(const WeldKey& k) const { FNV1aHash h; h.Add(k.f, sizeof(k.f)); return (size_t)h.value; }
+};
+struct PosKeyHash
+{
+    size_t operator()(const std::pair<uint64_t, UINT>& k) const { return (size_t)(k.first * 0x9E3779B97F4A7C15ull ^ k.second); }
+};
+
+static inline uint64_t EdgeKey(UINT a, UINT b)
+{
+    return (a < b) ? (((uint64_t)a << 32) | b) : (((uint64_t)b << 32) | a);
+}
+
+static inline float LumaOf(DWORD c)
+{
+    return (0.299f * ((c >> 16) & 0xFF) + 0.587f * ((c >> 8) & 0xFF) + 0.114f * (c & 0xFF)) / 255.0f;
+}
+
+void CBSPlevel::WeldTriangles(const std::vector<BSPTriangle>& tris, BSPIndexedMesh& mesh)
+{
+    mesh = BSPIndexedMesh();
+    mesh.indices.reserve(tris.size() * 3);
+    mesh.matIndex.reserve(tris.size());
+    mesh.objectId.reserve(tris.size());
+
+    std::unordered_map<WeldKey, UINT, WeldKeyHash> vertMap;
+    std::unordered_map<std::pair<uint64_t, UINT>, UINT, PosKeyHash> posMap; // (x,y bits), z bits
+    vertMap.reserve(tris.size());
+    posMap.reserve(tris.size());
+
+    for (const auto& tri : tris)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            const OBJVertex& v = tri.v[i];
+            WeldKey key;
+            static_assert(sizeof(OBJVertex) == sizeof(key.f), "WeldKey must cover OBJVertex");
+            memcpy(key.f, &v, sizeof(key.f));
+
+            auto it = vertMap.find(key);
+            if (it == vertMap.end())
+            {
+                UINT px, py, pz;
+                memcpy(&px, &v.x, 4); memcpy(&py, &v.y, 4); memcpy(&pz, &v.z, 4);
+                auto pit = posMap.emplace(std::make_pair(((uint64_t)px << 32) | py, pz), (UINT)mesh.positions.size());
+                if (pit.second) mesh.positions.push_back(D3DXVECTOR3(v.x, v.y, v.z));
+
+                it = vertMap.emplace(key, (UINT)mesh.verts.size()).first;
+                mesh.verts.push_back(v);
+                mesh.posId.push_back(pit.first->second);
+            }
+            mesh.indices.push_back(it->second);
+        }
+        mesh.matIndex.push_back(tri.matIndex);
+        mesh.objectId.push_back(tri.objectId);
+    }
+}
+
+// Rivara style longest-edge bisection. A triangle with a marked (or too long) edge
+// always bisects its LONGEST edge and marks it, so the neighbour across it splits
+// the same edge. Midpoints come from an edge hash, so both sides share the vertex.
+// Like SubdivideUniform, length alone doesn't split a triangle with an edge under
+// MIN_EDGE_LENGTH, so slivers aren't cut into ever thinner ones.
+int CBSPlevel::RefineLongestEdge(BSPIndexedMesh& mesh, std::unordered_set<uint64_t>& marked, float maxEdgeSq)
+{
+    // Degenerate slivers are left alone, they would never get shorter
+    const float MIN_SPLIT_SQ = 1e-8f;
+    const int MAX_PASSES = 64;
+
+    std::unordered_map<uint64_t, UINT> posMidpoints;  // posId edge -> posId
+    std::unordered_map<uint64_t, UINT> vertMidpoints; // vertex edge -> vertex
+
+    auto midpoint = [&](UINT a, UINT b) -> UINT
+        {
+            auto vit = vertMidpoints.find(EdgeKey(a, b));
+            if (vit != vertMidpoints.end()) return vit->second;
+
+            // The position only depends on the posId pair, so every vertex on this edge lands on the same spot
+            UINT pa = mesh.posId[a], pb = mesh.posId[b];
+            auto pit = posMidpoints.find(EdgeKey(pa, pb));
+            UINT pm;
+            if (pit == posMidpoints.end())
+            {
+                const D3DXVECTOR3& p0 = mesh.positions[std::min(pa, pb)];
+                const D3DXVECTOR3& p1 = mesh.positions[std::max(pa, pb)];
+                pm = (UINT)mesh.positions.size();
+                mesh.positions.push_back((p0 + p1) * 0.5f);
+                posMidpoints.emplace(EdgeKey(pa, pb), pm);
+            }
+            else pm = pit->second;
+
+            OBJVertex v = LerpVertex(mesh.verts[std::min(a, b)], mesh.verts[std::max(a, b)], 0.5f);
+            v.x = mesh.positions[pm].x;
+            v.y = mesh.positions[pm].y;
+            v.z = mesh.positions[pm].z;
+
+            UINT vm = (UINT)mesh.verts.size();
+            mesh.verts.push_back(v);
+            mesh.posId.push_back(pm);
+            vertMidpoints.emplace(EdgeKey(a, b), vm);
+            return vm;
+        };
+
+    int splits = 0;
+    for (int pass = 0; pass < MAX_PASSES; pass++)
+    {
+        int passSplits = 0;
+        // Children are appended and handled later in the same pass
+        for (UINT t = 0; t < mesh.GetTriangleCount(); t++)
+        {
+            for (;;)
+            {
+                UINT idx[3] = { mesh.indices[t * 3 + 0], mesh.indices[t * 3 + 1], mesh.indices[t * 3 + 2] };
+                bool needed = false, tooLong = false;
+                int longest = 0;
+                float longestSq = -1.0f, shortestSq = FLT_MAX;
+                uint64_t longestKey = 0;
+                for (int e = 0; e < 3; e++)
+                {
+                    UINT pa = mesh.posId[idx[e]], pb = mesh.posId[idx[(e + 1) % 3]];
+                    D3DXVECTOR3 d = mesh.positions[pa] - mesh.positions[pb];
+                    float lenSq = D3DXVec3LengthSq(&d);
+                    uint64_t key = EdgeKey(pa, pb);
+                    if (marked.count(key)) needed = true;
+                    if (lenSq > maxEdgeSq) tooLong = true;
+                    shortestSq = std::min(shortestSq, lenSq);
+                    // Ties go to the larger key, so both neighbours pick the same edge
+                    if (lenSq > longestSq || (lenSq == longestSq && key > longestKey))
+                    {
+                        longest = e;
+                        longestSq = lenSq;
+                        longestKey = key;
+                    }
+                }
+                if (tooLong && shortestSq > MIN_EDGE_LENGTH_SQ) needed = true;
+                if (!needed || longestSq < MIN_SPLIT_SQ) break;
+
+                marked.insert(longestKey);
+                UINT a = idx[longest], b = idx[(longest + 1) % 3], c = idx[(longest + 2) % 3];
+                UINT m = midpoint(a, b);
+
+                // (a, b, c) -> (a, m, c) + (m, b, c), winding kept
+                mesh.indices[t * 3 + 0] = a;
+                mesh.indices[t * 3 + 1] = m;
+                mesh.indices[t * 3 + 2] = c;
+                mesh.indices.push_back(m);
+                mesh.indices.push_back(b);
+                mesh.indices.push_back(c);
+                mesh.matIndex.push_back(mesh.matIndex[t]);
+                mesh.objectId.push_back(mesh.objectId[t]);
+                passSplits++;
+            }
+        }
+        splits += passSplits;
+        // A later triangle may have marked an edge of one we already passed
+        if (passSplits == 0) break;
+    }
+    return splits;
+}
+
+// Splits triangles whose baked vertex colors disagree by more than 'threshold'
+int CBSPlevel::RefineByGradient(BSPIndexedMesh& mesh, float threshold)
+{
+    std::unordered_set<uint64_t> marked;
+    for (UINT t = 0; t < mesh.GetTriangleCount(); t++)
+    {
+        const UINT* idx = &mesh.indices[t * 3];
+        float l0 = LumaOf(mesh.verts[idx[0]].color);
+        float l1 = LumaOf(mesh.verts[idx[1]].color);
+        float l2 = LumaOf(mesh.verts[idx[2]].color);
+        if (std::max(l0, std::max(l1, l2)) - std::min(l0, std::min(l1, l2)) <= threshold) continue;
+
+        for (int e = 0; e < 3; e++)
+        {
+            UINT pa = mesh.posId[idx[e]], pb = mesh.posId[idx[(e + 1) % 3]];
+            D3DXVECTOR3 d = mesh.positions[pa] - mesh.positions[pb];
+            if (D3DXVec3LengthSq(&d) > MIN_EDGE_LENGTH_SQ) marked.insert(EdgeKey(pa, pb));
+        }
+    }
+    if (marked.empty()) return 0;
+    return RefineLongestEdge(mesh, marked, FLT_MAX);
+}
+
+// Pulls the smoothed colors from the last bake back onto the welded vertices
+void CBSPlevel::CaptureBakedColors(BSPIndexedMesh& mesh, const std::vector<DWORD>& colors)
+{
+    std::map<SmoothKey, DWORD> baked;
+    for (size_t i = 0; i < m_flatVerts.size() && i < colors.size(); i++)
+    {
+        const OBJVertex& v = m_flatVerts[i];
+        SmoothKey k;
+        k.x = v.x; k.y = v.y; k.z = v.z;
+        k.nx = v.nx; k.ny = v.ny; k.nz = v.nz;
+        baked[k] = colors[i];
+    }
+    for (auto& v : mesh.verts)
+    {
+        SmoothKey k;
+        k.x = v.x; k.y = v.y; k.z = v.z;
+        k.nx = v.nx; k.ny = v.ny; k.nz = v.nz;
+        auto it = baked.find(k);
+        if (it != baked.end()) v.color = it->second;
+    }
+}
+
+void CBSPlevel::ExpandIndexedMesh(const BSPIndexedMesh& mesh, std::vector<BSPTriangle>& out)
+{
+    out.clear();
+    out.resize(mesh.GetTriangleCount());
+    for (UINT t = 0; t < mesh.GetTriangleCount(); t++)
+    {
+        BSPTriangle& tri = out[t];
+        for (int i = 0; i < 3; i++) tri.v[i] = mesh.verts[mesh.indices[t * 3 + i]];
+        tri.matIndex = mesh.matIndex[t];
+        tri.objectId = mesh.objectId[t];
+    }
+}
+
 void CBSPlevel::SubdivideGeometry(std::vector<BSPTriangle>& tris)
+{
+    if (m_buildOptions.subdivMode == SUBDIV_UNIFORM)
+    {
+        SubdivideUniform(tris);
+        return;
+    }
+
+    BSPIndexedMesh mesh;
+    WeldTriangles(tris, mesh);
+    std::unordered_set<uint64_t> marked;
+    RefineLongestEdge(mesh, marked, MAX_EDGE_SQ);
+
+    _log(L"Longest-edge subdivision: %d -> %d triangles, %d shared vertices (%d unwelded)\n",
+        (int)tris.size(), (int)mesh.GetTriangleCount(), (int)mesh.verts.size(), (int)mesh.GetTriangleCount() * 3);
+    ExpandIndexedMesh(mesh, m_subd_triangles);
+}
+
+// 4-way split of every triangle with an edge over MAX_EDGE_SQ
+void CBSPlevel::SubdivideUniform(std::vector<BSPTriangle>& tris)
 {
     // We will build a new list of triangles
 	m_subd_triangles.clear();
@@ -221,19 +835,19 @@ void CBSPlevel::SubdivideGeometry(std::vector<BSPTriangle>& tris)
 
             // Push 4 new triangles (Triangle 1, 2, 3, 4)
             // 1. Top
-            BSPTriangle t1; t1.v[0] = tri.v[0]; t1.v[1] = m01; t1.v[2] = m20; t1.matIndex = tri.matIndex;
+            BSPTriangle t1; t1.v[0] = tri.v[0]; t1.v[1] = m01; t1.v[2] = m20; t1.matIndex = tri.matIndex; t1.objectId = tri.objectId;
             m_subd_triangles.push_back(t1);
 
             // 2. Left
-            BSPTriangle t2; t2.v[0] = m01; t2.v[1] = tri.v[1]; t2.v[2] = m12; t2.matIndex = tri.matIndex;
+            BSPTriangle t2; t2.v[0] = m01; t2.v[1] = tri.v[1]; t2.v[2] = m12; t2.matIndex = tri.matIndex; t2.objectId = tri.objectId;
             m_subd_triangles.push_back(t2);
 
             // 3. Right
-            BSPTriangle t3; t3.v[0] = m20; t3.v[1] = m12; t3.v[2] = tri.v[2]; t3.matIndex = tri.matIndex;
+            BSPTriangle t3; t3.v[0] = m20; t3.v[1] = m12; t3.v[2] = tri.v[2]; t3.matIndex = tri.matIndex; t3.objectId = tri.objectId;
             m_subd_triangles.push_back(t3);
 
             // 4. Center
-            BSPTriangle t4; t4.v[0] = m01; t4.v[1] = m12; t4.v[2] = m20; t4.matIndex = tri.matIndex;
+            BSPTriangle t4; t4.v[0] = m01; t4.v[1] = m12; t4.v[2] = m20; t4.matIndex = tri.matIndex; t4.objectId = tri.objectId;
             m_subd_triangles.push_back(t4);
 
             splitCount++;
@@ -255,7 +869,7 @@ void CBSPlevel::SubdivideGeometry(std::vector<BSPTriangle>& tris)
     if (splitCount > 0 && depth < 64)
     {
         depth++;
-        SubdivideGeometry(m_triangles_temp);
+        SubdivideUniform(m_triangles_temp);
         depth--;
     }
 }
@@ -321,18 +935,85 @@ void CBSPlevel::Render(IDirect3DDevice9* device, const D3DXVECTOR3& cameraPos)
     device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
     device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE); // 'DIFFUSE' here means Vertex Color
    
-    if (!nodePool.empty()) 
+    // The worker only replaces the flat arrays under this lock, so they stay whole for the frame
+    std::lock_guard<std::mutex> flatLock(m_flatMutex);
+    if (!m_flatNodes.empty()) 
+    {
+        // Colors the radiosity worker published since the last frame
+        SyncPublishedColors();
+        // Lightmap bakes: the atlas goes up once the worker is done with it, and replaces the
+        // vertex colors from then on
+        if (m_bLightmapReady && !m_pLightmapTex) CreateLightmapTexture(device);
+        if (m_pLightmapTex)
+        {
+            device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+            device->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 1);
+            device->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
+            device->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
+            device->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+            device->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+        }
+
+        // Flat vertices are drawn straight from memory, so the level offset goes in the world matrix,
+        // applied before whatever world transform is set (row vectors: offset * old)
+        D3DXMATRIX matOld, matOffset, matWorld;
+        device->GetTransform(D3DTS_WORLD, &matOld);
+        D3DXMatrixTranslation(&matOffset, (FLOAT)m_offset.getX(), (FLOAT)m_offset.getY(), (FLOAT)m_offset.getZ());
+        D3DXMatrixMultiply(&matWorld, &matOffset, &matOld);
+        device->SetTransform(D3DTS_WORLD, &matWorld);
+
+        // Camera is in world space, the tree is in level space
+        D3DXVECTOR3 localCam = cameraPos;
+        D3DXMATRIX matInv;
+        if (D3DXMatrixInverse(&matInv, NULL, &matWorld))
+            D3DXVec3TransformCoord(&localCam, &cameraPos, &matInv);
+        RenderBSP(device, 0, localCam, 0, 2);
+
+        device->SetTransform(D3DTS_WORLD, &matOld);
+        if (m_pLightmapTex)
+        {
+            device->SetTexture(0, NULL);
+            device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+            device->SetTextureStageState(0, D3DTSS_TEXCOORDINDEX, 0);
+            device->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_WRAP);
+            device->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_WRAP);
+        }
+    }
+}
+
+// Uploads m_lightmapPixels like CHL1BSP's lightmap atlas. Render thread only.
+void CBSPlevel::CreateLightmapTexture(IDirect3DDevice9* device)
+{
+    if (m_lightmapPixels.empty()) return;
+
+    if (FAILED(device->CreateTexture(m_lightmapWidth, m_lightmapHeight, 1, 0, D3DFMT_X8R8G8B8, D3DPOOL_MANAGED, &m_pLightmapTex, NULL)))
+    {
+        _log(L"Could not create the %ux%u lightmap\n", m_lightmapWidth, m_lightmapHeight);
+        m_bLightmapReady = false;
+        return;
+    }
+
+    D3DLOCKED_RECT rect;
+    if (SUCCEEDED(m_pLightmapTex->LockRect(0, &rect, NULL, 0)))
     {
-        RenderBSP(device, 0, cameraPos, 0, 2);
+        BYTE* dest = (BYTE*)rect.pBits;
+        const DWORD* src = m_lightmapPixels.data();
+        for (UINT y = 0; y < m_lightmapHeight; y++)
+        {
+            memcpy(dest, src, m_lightmapWidth * sizeof(DWORD));
+            dest += rect.Pitch;
+            src += m_lightmapWidth;
+        }
+        m_pLightmapTex->UnlockRect(0);
     }
 }
 
 void CBSPlevel::RenderBSP(IDirect3DDevice9* device, int nodeIndex, const D3DXVECTOR3& cameraPos, int depth, int debugMode)
 {
     // 1. Safety Check
-    if (nodeIndex == -1 || nodeIndex >= nodePool.size()) return;
+    if (nodeIndex == -1 || nodeIndex >= (int)m_flatNodes.size()) return;
 
-    BSPNode& node = nodePool[nodeIndex];
+    const BSPFlatNode& node = m_flatNodes[nodeIndex];
 
     // -----------------------------------------------------
     // VISUALIZATION LOGIC
@@ -359,7 +1040,7 @@ void CBSPlevel::RenderBSP(IDirect3DDevice9* device, int nodeIndex, const D3DXVEC
     mtrl.Emissive = debugColor;
     mtrl.Diffuse = debugColor;
     //device->SetMaterial(&mtrl);
-	device->SetTexture(0, NULL); // Disable texture
+	device->SetTexture(0, m_pLightmapTex); // No texture unless a lightmap is up
 
     // 2. Leaf Node Case
     // If it's a leaf, it has no children. Just draw it.
@@ -392,115 +1073,152 @@ void CBSPlevel::RenderBSP(IDirect3DDevice9* device, int nodeIndex, const D3DXVEC
     }
 }
 // Helper to actually issue the Draw command
-void CBSPlevel::RenderNodeGeometry(IDirect3DDevice9* device, const BSPNode& node)
-{
-    if (node.members.empty()) return;
-
-    // 1. Create a temporary buffer for PURE vertex data
-    // Static vector prevents re-allocating memory every single frame (Optimization)
-    static std::vector<OBJVertex> renderBuffer;
-    renderBuffer.clear();
-    renderBuffer.reserve(node.members.size() * 3);
-
-    // 2. Extract only the vertices, skipping the 'matIndex' integer
-    for (const auto& tri : node.members)
-    {
-		OBJVertex v0 = tri.v[0];
-        OBJVertex v1 = tri.v[1];
-        OBJVertex v2 = tri.v[2];
-		// apply offset
-		v0.x += (FLOAT)m_offset.getX();
-        v0.y += (FLOAT)m_offset.getY();
-        v0.z += (FLOAT)m_offset.getZ();
-        v1.x += (FLOAT)m_offset.getX();
-        v1.y += (FLOAT)m_offset.getY();
-        v1.z += (FLOAT)m_offset.getZ();
-        v2.x += (FLOAT)m_offset.getX();
-        v2.y += (FLOAT)m_offset.getY();
-        v2.z += (FLOAT)m_offset.getZ();
-
-        renderBuffer.push_back(v0);
-        renderBuffer.push_back(v1);
-        renderBuffer.push_back(v2);
-    }
+void CBSPlevel::RenderNodeGeometry(IDirect3DDevice9* device, const BSPFlatNode& node)
+{
+    if (node.triCount == 0) return;
+
+    // The node's triangles are contiguous OBJVertex triples, no copy needed
+    const OBJVertex* verts = &m_flatVerts[(size_t)node.firstTri * 3];
+
     if (bPointsDraw) {
         device->SetRenderState(D3DRS_POINTSPRITEENABLE, TRUE);
         device->SetRenderState(D3DRS_POINTSIZE, *((DWORD*)&ptSize));
 
-        device->DrawPrimitiveUP(D3DPT_POINTLIST, (UINT)node.members.size()*3,
-            renderBuffer.data(), sizeof(OBJVertex));
+        device->DrawPrimitiveUP(D3DPT_POINTLIST, (UINT)node.triCount * 3,
+            verts, sizeof(OBJVertex));
 
     }
     else {
-        // Because 'BSPTriangle' is just 3 'OBJVertex' structs back-to-back,
-        // the memory layout is identical to a standard Vertex Buffer.
-        // We can cast the pointer directly.
-        device->SetFVF(FVF_OBJVERTEX);
+        device->SetFVF(m_pLightmapTex ? FVF_OBJVERTEX_LIGHTMAP : FVF_OBJVERTEX);
         // DrawPrimitiveUP is slow for final games, but perfect for this stage.
         device->DrawPrimitiveUP(D3DPT_TRIANGLELIST,
-            (UINT)node.members.size(),        // Primitive Count (Triangles)
-            renderBuffer.data(),        // Pointer to vertex data
+            (UINT)node.triCount,        // Primitive Count (Triangles)
+            verts,                      // Pointer to vertex data
             sizeof(OBJVertex));         // Stride
     }
 }
 
-UINT CBSPlevel::ChooseSplitter(std::vector<BSPTriangle>& polys)
+// Picks the triangles whose planes ChooseSplitter will score.
+// Sampling is seeded from the node itself, so serial and parallel builds agree.
+void CBSPlevel::GatherSplitCandidates(const BSPArenaVector<BSPTriangle>& polys, BSPArenaVector<UINT>& out, CBSPArena& arena)
 {
-	UINT nBestScore = 0xffffffff;
-	UINT nBestIndex = 0;
-	UINT nSplitMul = 8;
-	UINT uTestCount = 1;
+    const BSPBuildOptions& opt = m_buildOptions;
+    const UINT count = (UINT)polys.size();
+    out.clear();
+    out.reserve(count);
 
-	for (UINT i = 0; i < polys.size(); i += uTestCount)
-	{
-		UINT nFront = 0;
-		UINT nBack = 0;
-		UINT nSplits = 0;
-		UINT nScore = 0;
+    if (opt.splitter == SPLIT_EXHAUSTIVE || count <= opt.candidateBudget)
+    {
+        out.resize(count);
+        for (UINT i = 0; i < count; i++) out[i] = i;
+        return;
+    }
 
-		//if (polys[i].bUsed)
-		//	continue;
+    std::mt19937 rng(opt.seed ^ (count * 2654435761u));
+    // Stratified: split the list into 'budget' even ranges and take one random entry from each
+    auto sample = [&](const BSPArenaVector<UINT>* list, UINT listSize, UINT budget)
+        {
+            for (UINT k = 0; k < budget; k++)
+            {
+                UINT lo = (UINT)((unsigned long long)listSize * k / budget);
+                UINT hi = (UINT)((unsigned long long)listSize * (k + 1) / budget);
+                UINT pick = lo + ((hi > lo) ? (UINT)(rng() % (hi - lo)) : 0);
+                out.push_back(list ? (*list)[pick] : pick);
+            }
+        };
 
-		D3DXPLANE plane = polys[i].GetPlane();
+    if (opt.splitter == SPLIT_AXIS_FIRST)
+    {
+        // Axis-aligned walls/floors make the cleanest splitters in architectural levels
+        BSPArenaVector<UINT> axis((BSPArenaAllocator<UINT>(arena))), other((BSPArenaAllocator<UINT>(arena)));
+        axis.reserve(count);
+        other.reserve(count);
+        for (UINT i = 0; i < count; i++)
+        {
+            D3DXPLANE p = polys[i].GetPlane();
+            if (fabs(p.a) > 0.999f || fabs(p.b) > 0.999f || fabs(p.c) > 0.999f)
+                axis.push_back(i);
+            else
+                other.push_back(i);
+        }
+        if (axis.size() >= opt.candidateBudget)
+        {
+            sample(&axis, (UINT)axis.size(), opt.candidateBudget);
+            return;
+        }
+        out = axis;
+        UINT rest = opt.candidateBudget - (UINT)axis.size();
+        if (other.size() <= rest)
+            out.insert(out.end(), other.begin(), other.end());
+        else
+            sample(&other, (UINT)other.size(), rest);
+        return;
+    }
 
-		for (UINT j = 0; j < polys.size(); j++)
-		{
-			if (i == j)continue;
-
-			eSide res = ClassifyTriangle(polys[j], plane);
-
-			switch (res)
-			{
-			case S_FRONT:
-				nFront += 1;
-				break;
-
-			case S_BACK:
-				nBack += 1;
-				break;
-
-			case S_SPLIT:
-				nSplits += 1;
-				nFront += 1;
-				nBack += 1;
-				break;
-			}
-		}
+    sample(nullptr, count, opt.candidateBudget);
+}
+
+UINT CBSPlevel::ChooseSplitter(const BSPArenaVector<BSPTriangle>& polys, const BSPTriSoA& soa, CBSPArena& arena)
+{
+    const BSPBuildOptions& opt = m_buildOptions;
+	float fBestScore = FLT_MAX;
+	UINT nBestIndex = 0;
+
+    CBSPArenaScope scope(arena);
+    BSPArenaVector<UINT> candidates((BSPArenaAllocator<UINT>(arena)));
+    GatherSplitCandidates(polys, candidates, arena);
+
+    // Walls are usually many coplanar triangles, don't score the same plane twice.
+    // (Skipped for the exhaustive strategy where it would be quadratic on its own)
+    BSPArenaVector<D3DXPLANE> tested((BSPArenaAllocator<D3DXPLANE>(arena)));
+    bool bDedupe = (opt.splitter != SPLIT_EXHAUSTIVE);
+    if (bDedupe) tested.reserve(candidates.size());
+
+	for (UINT i : candidates)
+	{
+		D3DXPLANE plane = polys[i].GetPlane();
+
+        if (bDedupe)
+        {
+            bool seen = false;
+            for (const D3DXPLANE& p : tested)
+            {
+                if (fabs(p.a - plane.a) < 0.0001f && fabs(p.b - plane.b) < 0.0001f &&
+                    fabs(p.c - plane.c) < 0.0001f && fabs(p.d - plane.d) < 0.001f)
+                {
+                    seen = true;
+                    break;
+                }
+            }
+            if (seen) continue;
+            tested.push_back(plane);
+        }
+
+        // One batched pass over every triangle, then take the candidate itself back out
+        BSPClassifyCounts counts;
+        ClassifyTriangles(soa, plane, counts, nullptr, opt.classifyPath);
+        switch (ClassifyTriangle(polys[i], plane))
+        {
+        case S_FRONT: counts.front--; break;
+        case S_BACK:  counts.back--;  break;
+        case S_SPLIT: counts.split--; break;
+        default: break;
+        }
 
-		//if (nBack < 1)
-		//	continue;
+        // A split triangle ends up on both sides
+		UINT nSplits = counts.split;
+		UINT nFront = counts.front + nSplits;
+		UINT nBack = counts.back + nSplits;
 
-		nScore = abs((int)nFront - (int)nBack) + (nSplits * nSplitMul);
-		//_log("%d: Front %d, Back %d, Coplanar %d, Splits %d   Score %d\r\n", i, nFront, nBack, nCoplanar, nSplits, nScore);
+		float fScore = opt.balanceWeight * (float)abs((int)nFront - (int)nBack) + opt.splitWeight * (float)nSplits;
 
-		if (nScore < nBestScore)
+		if (fScore < fBestScore)
 		{
-			nBestScore = nScore;
+			fBestScore = fScore;
 			nBestIndex = i;
-            if (nScore < 5)break;
+            if (fScore < 5.0f)break;
 		}
 	}
-	//_log(L"Best splitter: Index %d, Score %d\r", nBestIndex, nBestScore);
 
 	return nBestIndex;
 }
@@ -544,12 +1262,14 @@ OBJVertex CBSPlevel::LerpVertex(const OBJVertex& v1, const OBJVertex& v2, float
     // 3. UVs
     out.u = v1.u + (v2.u - v1.u) * t;
     out.v = v1.v + (v2.v - v1.v) * t;
+    out.lu = v1.lu + (v2.lu - v1.lu) * t;
+    out.lv = v1.lv + (v2.lv - v1.lv) * t;
 
     return out;
 }
 
 // Helper to add a fresh node to the pool and return its index
-int CBSPlevel::AllocateNode()
+int CBSPlevel::AllocateNode(std::vector<BSPNode>& pool)
 {
     if (m_bStopRequested) return -1; // Fail gracefully
 
@@ -557,17 +1277,118 @@ int CBSPlevel::AllocateNode()
     newNode.iFront = -1;
     newNode.iBack = -1;
     newNode.isLeaf = false;
-    // Important: Reserve space in member vector to avoid small re-allocations
-    newNode.members.reserve(4);
-    nodePool.push_back(newNode);
-    return (int)nodePool.size() - 1;
+    // Members are sized once in BuildTree, an empty vector costs nothing here
+    if (pool.size() == pool.capacity()) m_iOutputAllocs++;
+    pool.push_back(newNode);
+    return (int)pool.size() - 1;
+}
+
+// Converts the build-time tree into the flat arrays and frees it. The arrays are built on the
+// side and swapped in, so a frame being drawn (the refine pass rebuilds during a bake) keeps
+// the old ones until then.
+void CBSPlevel::FlattenTree(std::vector<BSPNode>& pool)
+{
+    std::vector<BSPFlatNode> nodes;
+    std::vector<OBJVertex> verts;
+    std::vector<int> matIndex, objectId;
+    FlattenPool(pool, nodes, verts, matIndex, objectId);
+    {
+        std::lock_guard<std::mutex> lock(m_flatMutex);
+        m_flatNodes.swap(nodes);
+        m_flatVerts.swap(verts);
+        m_flatMatIndex.swap(matIndex);
+        m_flatObjectId.swap(objectId);
+    }
+    RebuildShadowTris();
+
+    size_t triCount = m_flatMatIndex.size();
+    size_t bytes = m_flatNodes.size() * sizeof(BSPFlatNode) + triCount * (3 * sizeof(OBJVertex) + 2 * sizeof(int) + sizeof(BSPShadowTri));
+    _log(L"Flattened BSP: %d nodes, %d triangles, %.1f MB\n", (int)m_flatNodes.size(), (int)triCount, bytes / (1024.0 * 1024.0));
+}
+
+// Appends 'pool' to the given flat arrays and frees it. Child indices and
+// firstTri are relative to the start of the output, the caller rebases them.
+// The pool is in pre-order, so walking it by index packs the triangles in traversal order.
+void CBSPlevel::FlattenPool(std::vector<BSPNode>& pool, std::vector<BSPFlatNode>& nodes, std::vector<OBJVertex>& verts,
+    std::vector<int>& matIndex, std::vector<int>& objectId)
+{
+    size_t triCount = 0;
+    for (const auto& node : pool) triCount += node.members.size();
+
+    nodes.reserve(nodes.size() + pool.size());
+    verts.reserve(verts.size() + triCount * 3);
+    matIndex.reserve(matIndex.size() + triCount);
+    objectId.reserve(objectId.size() + triCount);
+
+    for (auto& node : pool)
+    {
+        BSPFlatNode flat;
+        flat.plane = node.plane;
+        flat.iFront = node.iFront;
+        flat.iBack = node.iBack;
+        flat.firstTri = (UINT)matIndex.size();
+        flat.triCount = (UINT)node.members.size();
+        flat.isLeaf = node.isLeaf ? 1 : 0;
+        nodes.push_back(flat);
+
+        for (const auto& tri : node.members)
+        {
+            verts.push_back(tri.v[0]);
+            verts.push_back(tri.v[1]);
+            verts.push_back(tri.v[2]);
+            matIndex.push_back(tri.matIndex);
+            objectId.push_back(tri.objectId);
+        }
+        std::vector<BSPTriangle>().swap(node.members); // Free as we go
+    }
+    std::vector<BSPNode>().swap(pool);
+}
+
+// Shadow rays only need positions, with the edges precomputed
+void CBSPlevel::RebuildShadowTris()
+{
+    m_flatShadowTris.resize(m_flatMatIndex.size());
+    UpdateShadowTris(0, m_flatMatIndex.size());
+}
+
+void CBSPlevel::UpdateShadowTris(size_t first, size_t count)
+{
+    m_bShadowBVHValid = false;
+    for (size_t t = first; t < first + count; t++)
+    {
+        const OBJVertex* tri = &m_flatVerts[t * 3];
+        BSPShadowTri& st = m_flatShadowTris[t];
+        st.v0 = D3DXVECTOR3(tri[0].x, tri[0].y, tri[0].z);
+        st.edge1 = D3DXVECTOR3(tri[1].x, tri[1].y, tri[1].z) - st.v0;
+        st.edge2 = D3DXVECTOR3(tri[2].x, tri[2].y, tri[2].z) - st.v0;
+    }
+}
+
+// Appends a subtree built in its own pool to 'dst' and returns the index of its root.
+// Nodes are stored in pre-order (node, front subtree, back subtree), so appending
+// the front pool and then the back pool gives exactly the serial layout.
+int CBSPlevel::SpliceSubtree(std::vector<BSPNode>& dst, std::vector<BSPNode>& src)
+{
+    if (src.empty()) return -1;
+
+    int offset = (int)dst.size();
+    if (dst.size() + src.size() > dst.capacity()) m_iOutputAllocs++;
+    for (auto& node : src)
+    {
+        if (node.iFront != -1) node.iFront += offset;
+        if (node.iBack != -1)  node.iBack += offset;
+    }
+    dst.insert(dst.end(), std::make_move_iterator(src.begin()), std::make_move_iterator(src.end()));
+    src.clear();
+    return offset;
 }
 
-void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, std::vector<BSPTriangle>& outFront,std::vector<BSPTriangle>& outBack)
+void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, BSPArenaVector<BSPTriangle>& outFront, BSPArenaVector<BSPTriangle>& outBack)
 {
     // Temporary storage for the polygon loops (could be 3 or 4 points)
-    std::vector<OBJVertex> frontPoly;
-    std::vector<OBJVertex> backPoly;
+    OBJVertex frontPoly[4];
+    OBJVertex backPoly[4];
+    size_t numFront = 0, numBack = 0;
     // Test the 3 edges: (0->1), (1->2), (2->0)
     OBJVertex a = inTri.v[0];
     OBJVertex b = inTri.v[1];
@@ -591,8 +1412,8 @@ void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, std::vec
         float d2 = dists[j];
 
         // 1. Put current vertex in the correct list
-        if (d1 >= 0) frontPoly.push_back(v1);
-        if (d1 <= 0) backPoly.push_back(v1);
+        if (d1 >= 0) frontPoly[numFront++] = v1;
+        if (d1 <= 0) backPoly[numBack++] = v1;
 
         // 2. Check for intersection (crossing the plane)
         // If signs are different (one pos, one neg)
@@ -605,19 +1426,20 @@ void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, std::vec
             OBJVertex vMid = LerpVertex(v1, v2, t);
 
             // Add to BOTH lists (it's the hinge)
-            frontPoly.push_back(vMid);
-            backPoly.push_back(vMid);
+            frontPoly[numFront++] = vMid;
+            backPoly[numBack++] = vMid;
         }
     }
     // ---------------------------------------------------------
     // Triangulate the resulting polygons (Turn Quads into Triangles)
     // ---------------------------------------------------------
     // Front Side
-    if (frontPoly.size() >= 3) {
+    if (numFront >= 3) {
         // Fan Triangulation: Connect vertex 0 to i and i+1
-        for (size_t i = 1; i < frontPoly.size() - 1; i++) {
+        for (size_t i = 1; i < numFront - 1; i++) {
             BSPTriangle newTri;
 			newTri.matIndex = inTri.matIndex;
+			newTri.objectId = inTri.objectId;
             newTri.v[0] = frontPoly[0];
             newTri.v[1] = frontPoly[i];
             newTri.v[2] = frontPoly[i + 1];
@@ -626,10 +1448,11 @@ void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, std::vec
     }
 
     // Back Side
-    if (backPoly.size() >= 3) {
-        for (size_t i = 1; i < backPoly.size() - 1; i++) {
+    if (numBack >= 3) {
+        for (size_t i = 1; i < numBack - 1; i++) {
             BSPTriangle newTri;
             newTri.matIndex = inTri.matIndex;
+            newTri.objectId = inTri.objectId;
             newTri.v[0] = backPoly[0];
             newTri.v[1] = backPoly[i];
             newTri.v[2] = backPoly[i + 1];
@@ -638,80 +1461,165 @@ void CBSPlevel::Split(const D3DXPLANE& plane, const BSPTriangle& inTri, std::vec
     }
 }
 
-BOOL CBSPlevel::BuildTree(UINT nodeIndex, std::vector<BSPTriangle>& polys)
+BOOL CBSPlevel::BuildTree(std::vector<BSPNode>& pool, UINT nodeIndex, BSPArenaVector<BSPTriangle>& polys, CBSPArena& arena)
 {
     if (m_bStopRequested) return FALSE;
     // 1. STOP CONDITION: If few polys or max depth, make this a LEAF.
     // (Adjust '10' and '20' based on your needs)
-    if (polys.size() <= 10 )//|| depth > 20)
+    if (polys.size() <= m_buildOptions.leafSize)
     {
-        nodePool[nodeIndex].isLeaf = true;
-        nodePool[nodeIndex].members = polys; // Store all remaining polys here
+        pool[nodeIndex].isLeaf = true;
+        if (!polys.empty()) m_iOutputAllocs++;
+        pool[nodeIndex].members.assign(polys.begin(), polys.end()); // Store all remaining polys here
+        m_iTrisPlaced += (int)polys.size();
+        m_iTrisPending -= (int)polys.size();
+        UpdateBuildProgress();
         return TRUE;
     }
 
-    UINT splitterIndex = ChooseSplitter(polys);
-    // 3. Store the Splitter Plane in the Node
-    D3DXPLANE splitPlane = polys[splitterIndex].GetPlane();
-    nodePool[nodeIndex].plane = splitPlane;
-
-    std::vector<BSPTriangle> frontList, backList;
-    // We reserve memory to prevent constant resizing during push_back
-    frontList.reserve(polys.size());
-    backList.reserve(polys.size());
-
-    for (UINT i = 0; i < polys.size(); i++)
+    // Everything this call and its serial children take from the arena goes back on return
+    CBSPArenaScope scope(arena);
+    BSPArenaVector<BSPTriangle> frontList((BSPArenaAllocator<BSPTriangle>(arena)));
+    BSPArenaVector<BSPTriangle> backList((BSPArenaAllocator<BSPTriangle>(arena)));
+    D3DXPLANE splitPlane;
     {
-        eSide res = ClassifyTriangle(polys[i], polys[splitterIndex].GetPlane());
-
-        switch (res)
+        // 2. Corner positions in SoA form, shared by splitter scoring and partitioning
+        BSPTriSoA soa;
+        soa.Build(polys.data(), (UINT)polys.size(), arena.AllocArray<float>(polys.size() * 9));
+
+        UINT splitterIndex = ChooseSplitter(polys, soa, arena);
+        // 3. Store the Splitter Plane in the Node
+        splitPlane = polys[splitterIndex].GetPlane();
+        pool[nodeIndex].plane = splitPlane;
+
+        BSPClassifyCounts counts;
+        BYTE* sides = arena.AllocArray<BYTE>(polys.size());
+        ClassifyTriangles(soa, splitPlane, counts, sides, m_buildOptions.classifyPath);
+
+        // A sliver's plane can miss its own corners by more than the epsilon.
+        // The splitter always stays in this node, so every level makes progress.
+        switch ((eSide)sides[splitterIndex])
         {
-        case S_FRONT:
-            frontList.push_back(polys[i]);
-        break;
-
-        case S_BACK:
-            backList.push_back(polys[i]);
-        break;
-
-        case S_COPLANAR:
-            // These form the "wall" at this split.
-            nodePool[nodeIndex].members.push_back(polys[i]);
-        break;
+        case S_FRONT: counts.front--; counts.coplanar++; break;
+        case S_BACK:  counts.back--;  counts.coplanar++; break;
+        case S_SPLIT: counts.split--; counts.coplanar++; break;
+        default: break;
+        }
+        sides[splitterIndex] = S_COPLANAR;
 
-        case S_SPLIT:
+        // Exact sizes up front: the arena can't grow a list in place
+        // (a split triangle becomes at most 2 triangles on each side)
+        frontList.reserve(counts.front + counts.split * 2);
+        backList.reserve(counts.back + counts.split * 2);
+        if (counts.coplanar > 0)
         {
-            std::vector<BSPTriangle> splitFront, splitBack;
-            Split(splitPlane, polys[i], splitFront, splitBack);
-            // Append ALL resulting triangles to the main lists
-            frontList.insert(frontList.end(), splitFront.begin(), splitFront.end());
-            backList.insert(backList.end(), splitBack.begin(), splitBack.end());
+            m_iOutputAllocs++;
+            pool[nodeIndex].members.reserve(counts.coplanar);
         }
-        break;
+
+        for (UINT i = 0; i < polys.size(); i++)
+        {
+            eSide res = (eSide)sides[i];
+
+            switch (res)
+            {
+            case S_FRONT:
+                frontList.push_back(polys[i]);
+            break;
+
+            case S_BACK:
+                backList.push_back(polys[i]);
+            break;
+
+            case S_COPLANAR:
+                // These form the "wall" at this split.
+                pool[nodeIndex].members.push_back(polys[i]);
+            break;
+
+            case S_SPLIT:
+                m_iSplitCount++;
+                // Appends the resulting triangles straight to the main lists
+                Split(splitPlane, polys[i], frontList, backList);
+            break;
+            }
         }
+        m_iTrisPlaced += (int)counts.coplanar;
+        m_iTrisPending += (int)(frontList.size() + backList.size()) - (int)polys.size();
+    }
+
+    // 5. Parallel Recursion
+    // Both halves are big enough to be worth a task: the front subtree goes to a
+    // worker while this thread builds the back one. Each side fills its own pool
+    // and gets spliced back in pre-order, so the result matches the serial build.
+    // The worker reads frontList from this arena but allocates from its own.
+    static const int maxTasks = (int)std::max(1u, std::thread::hardware_concurrency());
+    size_t cutoff = m_buildOptions.parallelCutoff;
+    bool bigSplit = m_bParallelBuild && frontList.size() >= cutoff && backList.size() >= cutoff;
+    if (bigSplit && m_iActiveTasks.fetch_add(1) < maxTasks)
+    {
+        std::vector<BSPNode> frontPool, backPool;
+        std::future<BOOL> frontTask = std::async(std::launch::async, [&]()
+            {
+                CBSPArena* taskArena = AcquireArena();
+                BOOL ok = AllocateNode(frontPool) >= 0 && BuildTree(frontPool, 0, frontList, *taskArena);
+                ReleaseArena(taskArena);
+                m_iActiveTasks--;
+                return ok;
+            });
+        BOOL backOk = AllocateNode(backPool) >= 0 && BuildTree(backPool, 0, backList, arena);
+        BOOL frontOk = frontTask.get();
+        if (!frontOk || !backOk) return FALSE;
+
+        // Splicing can reallocate 'pool', so don't hold a reference to the node across it
+        int frontIndex = SpliceSubtree(pool, frontPool);
+        int backIndex = SpliceSubtree(pool, backPool);
+        pool[nodeIndex].iFront = frontIndex;
+        pool[nodeIndex].iBack = backIndex;
+        return TRUE;
     }
-    // Free memory of the source list (optional, but good for recursion depth memory usage)
-    polys.clear();
+    if (bigSplit)
+        m_iActiveTasks--; // Over the task budget, give the slot back and stay serial
 
-    // 5. Recursion - Front
+    // 6. Serial Recursion - Front
     if (frontList.size() > 0)
     {
-        int newFrontIndex = AllocateNode();
+        int newFrontIndex = AllocateNode(pool);
+        if (newFrontIndex == -1) return FALSE;
         // IMPORTANT: Set link immediately via index
-        nodePool[nodeIndex].iFront = newFrontIndex;
-        BuildTree(newFrontIndex, frontList);
+        pool[nodeIndex].iFront = newFrontIndex;
+        if (!BuildTree(pool, newFrontIndex, frontList, arena)) return FALSE;
     }
-    // 6. Recursion - Back
+    // 7. Serial Recursion - Back
     if (backList.size() > 0)
     {
-        int newBackIndex = AllocateNode();
-        nodePool[nodeIndex].iBack = newBackIndex;
-        BuildTree(newBackIndex, backList);
+        int newBackIndex = AllocateNode(pool);
+        if (newBackIndex == -1) return FALSE;
+        pool[nodeIndex].iBack = newBackIndex;
+        if (!BuildTree(pool, newBackIndex, backList, arena)) return FALSE;
     }
 
     return TRUE;
 }
 
+CBSPArena* CBSPlevel::AcquireArena()
+{
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    if (m_freeArenas.empty())
+    {
+        m_buildArenas.push_back(std::unique_ptr<CBSPArena>(new CBSPArena()));
+        return m_buildArenas.back().get();
+    }
+    CBSPArena* arena = m_freeArenas.back();
+    m_freeArenas.pop_back();
+    return arena;
+}
+
+void CBSPlevel::ReleaseArena(CBSPArena* arena)
+{
+    std::lock_guard<std::mutex> lock(m_arenaMutex);
+    m_freeArenas.push_back(arena);
+}
+
 
 void CBSPlevel::BuildBSP()
 {
@@ -720,182 +1628,816 @@ void CBSPlevel::BuildBSP()
 
 	SubdivideGeometry(m_triangles);
     
-	// Example: Choose a splitter for the entire set
-	UINT splitterIndex = ChooseSplitter(m_subd_triangles);
-	_log(L"Chosen Splitter Index: %d\n", splitterIndex);
-	// Further BSP construction logic would go here...
-
-    nodePool.clear();
-    nodePool.reserve(500000);
-
-    // Create Root Node
-    int rootIndex = AllocateNode();
-
-    // Start Recursion
-    BuildTree(rootIndex, m_subd_triangles);
+    RunBuild(nodePool, m_subd_triangles, m_buildStats);
+    _log(L"BSP built with %hs splitter in %.1f ms: %d nodes, %d splits, depth %d\n",
+        GetSplitterName(m_buildOptions.splitter), m_buildStats.buildMs,
+        m_buildStats.nodeCount, m_buildStats.splitCount, m_buildStats.maxDepth);
+    _log(L"BSP build memory: %d temp allocs, %d tree allocs, %.1f MB arena peak\n",
+        m_buildStats.tempAllocs, m_buildStats.outputAllocs, m_buildStats.arenaPeakBytes / (1024.0 * 1024.0));
+    FlattenTree(nodePool);
 }
 
-void CBSPlevel::BuildRAD()
+// Builds 'polys' into 'pool' from a fresh root and fills 'stats'
+void CBSPlevel::RunBuild(std::vector<BSPNode>& pool, std::vector<BSPTriangle>& polys, BSPBuildStats& stats,
+    float progressFrom, float progressTo)
 {
-    _log(L"Preparing Radiosity...\n");
-    PrepareRadiosity();
+    auto t0 = std::chrono::steady_clock::now();
+    stats = BSPBuildStats();
+    stats.inputTriangles = (int)polys.size();
+    m_iActiveTasks = 0;
+    m_iSplitCount = 0;
+    m_iOutputAllocs = 0;
+    m_iTrisPlaced = 0;
+    m_iTrisPending = (int)polys.size();
+    m_buildProgressFrom = progressFrom;
+    m_buildProgressTo = progressTo;
+
+    // Arenas from the previous build are reused, only new blocks count as allocations
+    size_t arenasBefore = m_buildArenas.size();
+    for (auto& a : m_buildArenas) a->Reset();
+
+    pool.clear();
+    int rootIndex = AllocateNode(pool);
+    if (rootIndex != -1)
+    {
+        CBSPArena* arena = AcquireArena();
+        {
+            BSPArenaVector<BSPTriangle> rootList((BSPArenaAllocator<BSPTriangle>(*arena)));
+            rootList.assign(polys.begin(), polys.end());
+            // The input is consumed by the build
+            polys.clear();
+            BuildTree(pool, rootIndex, rootList, *arena);
+        }
+        ReleaseArena(arena);
+    }
 
-    _log(L"Running Radiosity Iterations...\n");
-    const int maxIterations = 256;
-    for (int i = 0; i < maxIterations; i++)
+    m_buildProgressTo = m_buildProgressFrom = -1.0f;
+    stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    stats.splitCount = m_iSplitCount;
+    stats.outputAllocs = m_iOutputAllocs;
+    stats.tempAllocs = (int)(m_buildArenas.size() - arenasBefore);
+    for (auto& a : m_buildArenas)
     {
-        if (!RunRadiosityIteration())
-            break; // No more energy to distribute
-        _log(L"Completed Radiosity Iteration %d\n", i + 1);
+        stats.tempAllocs += a->GetHeapAllocs();
+        stats.arenaPeakBytes += a->GetPeakBytes();
     }
-    _log(L"Applying Radiosity to Mesh...\n");
-    
-	ApplyRadiosityToMesh();
+    GatherTreeStats(pool, stats);
 }
 
-// convert m_triangles into "Patches" that store light energy.
-float CBSPlevel::CalculateArea(const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2)
+// Splits keep adding triangles, so the fraction is placed / (placed + pending)
+// rather than placed / input. It can dip a little after a big split, progress only moves forward.
+void CBSPlevel::UpdateBuildProgress()
 {
-    D3DXVECTOR3 edge1 = v1 - v0;
-    D3DXVECTOR3 edge2 = v2 - v0;
-    D3DXVECTOR3 cross;
-    D3DXVec3Cross(&cross, &edge1, &edge2);
-    return D3DXVec3Length(&cross) * 0.5f;
+    if (m_buildProgressTo < 0.0f) return;
+    int placed = m_iTrisPlaced;
+    int pending = m_iTrisPending;
+    if (placed + pending <= 0) return;
+
+    float f = (float)placed / (float)(placed + pending);
+    float p = m_buildProgressFrom + f * (m_buildProgressTo - m_buildProgressFrom);
+    if (p > m_fProgress) m_fProgress = p;
 }
 
-float CBSPlevel::CalculateFormFactor(const RADPATCH& src, const RADPATCH& dest)
+void CBSPlevel::GatherTreeStats(const std::vector<BSPNode>& pool, BSPBuildStats& stats)
 {
-    // 1. Vector Setup
-    D3DXVECTOR3 vec = dest.center - src.center;
-    float distSq = D3DXVec3LengthSq(&vec);
-    //if (distSq > 100.0f) return 0.0f;
+    stats.nodeCount = (int)pool.size();
+    stats.leafCount = 0;
+    stats.maxDepth = 0;
+    stats.avgLeafDepth = 0.0f;
+    stats.leafHistogram.clear();
+    if (pool.empty()) return;
+
+    double depthSum = 0.0;
+
+    std::vector<std::pair<int, int>> stack; // (node, depth)
+    stack.push_back(std::make_pair(0, 1));
+    while (!stack.empty())
+    {
+        std::pair<int, int> top = stack.back();
+        stack.pop_back();
+        const BSPNode& node = pool[top.first];
+        stats.maxDepth = std::max(stats.maxDepth, top.second);
+        if (node.isLeaf)
+        {
+            stats.leafCount++;
+            depthSum += top.second;
+            size_t bucket = 0;
+            for (size_t n = node.members.size(); n > 0; n >>= 1) bucket++;
+            if (stats.leafHistogram.size() <= bucket) stats.leafHistogram.resize(bucket + 1, 0);
+            stats.leafHistogram[bucket]++;
+        }
+        if (node.iFront != -1) stack.push_back(std::make_pair(node.iFront, top.second + 1));
+        if (node.iBack != -1)  stack.push_back(std::make_pair(node.iBack, top.second + 1));
+    }
+    if (stats.leafCount > 0) stats.avgLeafDepth = (float)(depthSum / stats.leafCount);
+}
 
-    float dist = sqrtf(distSq);
-    // Safety: Don't calculate if patches are on top of each other
-    //if (dist < 0.001f) return 0.0f;
+// Jittered grid of boxes. Every other box is rotated about Y so the
+// scene is not purely axis-aligned and the splitters have something to chew on.
+void CBSPlevel::GenerateSyntheticScene(int triCount, std::vector<BSPTriangle>& out)
+{
+    static const int quads[6][4] = {
+        { 0, 2, 6, 4 }, { 1, 5, 7, 3 },   // -X, +X
+        { 0, 4, 5, 1 }, { 2, 3, 7, 6 },   // -Y, +Y
+        { 0, 1, 3, 2 }, { 4, 6, 7, 5 } }; // -Z, +Z
 
-    // Normalize direction vector (Source -> Dest)
-    D3DXVECTOR3 dir = vec / dist;
+    out.clear();
+    out.reserve(triCount);
 
-    // 2. Orientation Checks (Cosine Law)
-    // Angle at Shooter (Lambert's cosine law for emission)
-    float cosSrc = D3DXVec3Dot(&src.normal, &dir);
-    // Angle at Receiver (Lambert's cosine law for incidence)
-    // We negate 'dir' because the receiver normal should point TOWARDS the shooter
-    float cosDest = D3DXVec3Dot(&dest.normal, &-dir);
-    // Backface Culling:
-    // If Source is facing away (cosSrc < 0) or Dest is facing away (cosDest < 0),
-    // light cannot physically travel between them.
-    if (cosSrc <= 0.0f || cosDest <= 0.0f) return 0.0f;
-    // 3. Visibility Check (The Optimization)
-    // We need to check if a wall exists between Src and Dest.
-    // 
-    // OPTIMIZATION 2: Calculate Potential Factor BEFORE Raycast
-    // Formula: (cos1 * cos2 * Area) / (PI * r^2)
-    float potentialFactor = (cosSrc * cosDest * dest.area) / (D3DX_PI * distSq + dest.area);
-    // If the energy transfer is tiny, don't waste time checking walls
-    //if (potentialFactor < 0.00001f) return 0.0f;
-    // A. Start slightly off the Source surface (0.05 units) to avoid hitting itself.
-    D3DXVECTOR3 startPos = src.center + (src.normal * 0.05f);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> jitter(-0.3f, 0.3f);
+    std::uniform_real_distribution<float> extent(0.2f, 0.45f);
+    std::uniform_real_distribution<float> angle(0.0f, D3DX_PI);
 
-    // B. End slightly before the Dest surface (0.1 units total) to avoid hitting the destination.
-    float checkLength = dist - 0.001f;
+    int boxes = (triCount + 11) / 12;
+    int side = (int)ceil(cbrt((double)boxes));
 
-    // C. Perform the BSP Raycast
-    if (checkLength > 0.0f)
+    for (int b = 0; b < boxes; b++)
     {
-        // If RayCastAny returns true, it means we hit a wall -> Occluded
-        if (RayCastAny(startPos, dir, checkLength))
+        D3DXVECTOR3 c((float)(b % side) + jitter(rng), (float)((b / side) % side) + jitter(rng), (float)(b / (side * side)) + jitter(rng));
+        float h = extent(rng);
+        float a = (b & 1) ? angle(rng) : 0.0f;
+        float ca = cosf(a), sa = sinf(a);
+
+        D3DXVECTOR3 corners[8];
+        for (int k = 0; k < 8; k++)
         {
-            return 0.0f;
+            float x = (k & 1) ? h : -h;
+            float y = (k & 2) ? h : -h;
+            float z = (k & 4) ? h : -h;
+            corners[k] = D3DXVECTOR3(c.x + x * ca - z * sa, c.y + y, c.z + x * sa + z * ca);
+        }
+
+        for (int q = 0; q < 6; q++)
+        {
+            for (int t = 0; t < 2 && (int)out.size() < triCount; t++)
+            {
+                int idx[3] = { quads[q][0], quads[q][t + 1], quads[q][t + 2] };
+                BSPTriangle tri;
+                tri.matIndex = 0;
+                tri.objectId = b;
+                for (int v = 0; v < 3; v++)
+                {
+                    tri.v[v].x = corners[idx[v]].x;
+                    tri.v[v].y = corners[idx[v]].y;
+                    tri.v[v].z = corners[idx[v]].z;
+                }
+                out.push_back(tri);
+            }
         }
     }
-    // Safety clamp
-    //if (potentialFactor > 1.0f) potentialFactor = 1.0f;
+}
 
-    return potentialFactor;
+// First node where two built pools differ, -1 if they are the same. Leaves never set their plane.
+static int FirstPoolDifference(const std::vector<BSPNode>& a, const std::vector<BSPNode>& b)
+{
+    const size_t common = std::min(a.size(), b.size());
+    for (size_t n = 0; n < common; n++)
+    {
+        const BSPNode& x = a[n];
+        const BSPNode& y = b[n];
+        if (x.iFront != y.iFront || x.iBack != y.iBack || x.isLeaf != y.isLeaf ||
+            (!x.isLeaf && memcmp(&x.plane, &y.plane, sizeof(D3DXPLANE)) != 0) || x.members.size() != y.members.size() ||
+            (!x.members.empty() && memcmp(x.members.data(), y.members.data(), x.members.size() * sizeof(BSPTriangle)) != 0))
+            return (int)n;
+    }
+    return a.size() == b.size() ? -1 : (int)common;
 }
 
+void CBSPlevel::BenchmarkSplitters(int syntheticTriangles)
+{
+    // The exhaustive splitter is quadratic, past this it would run for hours
+    const int EXHAUSTIVE_LIMIT = 50000;
 
+    if (m_eState == BS_BUILDING_BSP || m_eState == BS_CALC_RAD)
+    {
+        _log(L"BenchmarkSplitters: build in progress, skipped\n");
+        return;
+    }
 
-int CBSPlevel::FindBrightestPatch()
-{
-    int bestIndex = -1;
-    float maxEnergy = 0.0f;
+    const char* sceneNames[2] = { "level", "synthetic" };
+    std::vector<BSPTriangle> scenes[2];
+    if (!m_triangles.empty())
+    {
+        // SubdivideGeometry writes into the members the live tree was built from, keep those
+        std::vector<BSPTriangle> liveSubd, liveTemp;
+        liveSubd.swap(m_subd_triangles);
+        liveTemp.swap(m_triangles_temp);
+        std::vector<BSPTriangle> level = m_triangles;
+        SubdivideGeometry(level);
+        scenes[0].swap(m_subd_triangles);
+        m_subd_triangles.swap(liveSubd);
+        m_triangles_temp.swap(liveTemp);
+    }
+    GenerateSyntheticScene(syntheticTriangles, scenes[1]);
 
-    for (int i = 0; i < m_patches.size(); i++)
+    // The SIMD plane tests have to agree with the scalar one, side for side
+    const eClassifyPath best = GetBestClassifyPath();
+    for (int sc = 0; sc < 2 && best > CLASSIFY_SCALAR; sc++)
     {
-        // Energy = Intensity (r+g+b)
-        float energy = m_patches[i].unshot.x + m_patches[i].unshot.y + m_patches[i].unshot.z;
-        if (energy > maxEnergy) {
-            maxEnergy = energy;
-            bestIndex = i;
+        const std::vector<BSPTriangle>& scene = scenes[sc];
+        if (scene.empty()) continue;
+        BSPTriSoA soa;
+        soa.Build(scene.data(), (UINT)scene.size());
+        std::vector<BYTE> scalarSides(scene.size()), sides(scene.size());
+        const UINT planes = std::min<UINT>(64, (UINT)scene.size());
+        int differ[CLASSIFY_AVX + 1] = {};
+        for (UINT p = 0; p < planes; p++)
+        {
+            D3DXPLANE plane = scene[(size_t)p * scene.size() / planes].GetPlane();
+            BSPClassifyCounts reference;
+            ClassifyTriangles(soa, plane, reference, scalarSides.data(), CLASSIFY_SCALAR);
+            for (int path = CLASSIFY_SSE; path <= best; path++)
+            {
+                BSPClassifyCounts counts;
+                ClassifyTriangles(soa, plane, counts, sides.data(), (eClassifyPath)path);
+                if (counts.front != reference.front || counts.back != reference.back || counts.split != reference.split ||
+                    counts.coplanar != reference.coplanar || sides != scalarSides)
+                    differ[path]++;
+            }
         }
+        for (int path = CLASSIFY_SSE; path <= best; path++)
+            _log(L"BSP bench %hs: %hs classify differs from scalar on %d of %u planes\n", sceneNames[sc],
+                GetClassifyPathName((eClassifyPath)path), differ[path], planes);
     }
-    return bestIndex;
+
+    BSPBuildOptions saved = m_buildOptions;
+    for (int sc = 0; sc < 2; sc++)
+    {
+        if (scenes[sc].empty()) continue;
+
+        for (int st = 0; st < SPLIT_COUNT; st++)
+        {
+            m_buildOptions.splitter = (eSplitterStrategy)st;
+            if (st == SPLIT_EXHAUSTIVE && (int)scenes[sc].size() > EXHAUSTIVE_LIMIT)
+            {
+                _log(L"BSP bench %hs/%hs: skipped (%d tris)\n", sceneNames[sc], GetSplitterName(m_buildOptions.splitter), (int)scenes[sc].size());
+                continue;
+            }
+
+            std::vector<BSPTriangle> polys = scenes[sc];
+            std::vector<BSPNode> pool;
+            BSPBuildStats stats;
+            RunBuild(pool, polys, stats);
+
+            _log(L"BSP bench %hs/%hs: %d tris, %.1f ms, %d nodes, %d leaves, %d splits, depth %d\n",
+                sceneNames[sc], GetSplitterName(m_buildOptions.splitter), stats.inputTriangles,
+                stats.buildMs, stats.nodeCount, stats.leafCount, stats.splitCount, stats.maxDepth);
+
+            // The parallel build has to lay the pool out exactly like the serial one
+            if (m_bParallelBuild)
+            {
+                std::vector<BSPTriangle> serialPolys = scenes[sc];
+                std::vector<BSPNode> serialPool;
+                BSPBuildStats serialStats;
+                m_bParallelBuild = false;
+                RunBuild(serialPool, serialPolys, serialStats);
+                m_bParallelBuild = true;
+
+                int differ = FirstPoolDifference(pool, serialPool);
+                if (differ < 0)
+                    _log(L"BSP bench %hs/%hs: serial build %.1f ms, same nodePool\n",
+                        sceneNames[sc], GetSplitterName(m_buildOptions.splitter), serialStats.buildMs);
+                else
+                    _log(L"BSP bench %hs/%hs: serial build %.1f ms, nodePool differs from node %d (%d vs %d nodes)\n",
+                        sceneNames[sc], GetSplitterName(m_buildOptions.splitter), serialStats.buildMs, differ,
+                        (int)pool.size(), (int)serialPool.size());
+            }
+        }
+    }
+    m_buildOptions = saved;
 }
 
-void CBSPlevel::PrepareRadiosity()
+// Walks down from the root while the box is strictly on one side of the plane.
+// The node it stops at is the smallest subtree that can hold every triangle in the box.
+int CBSPlevel::FindEditRoot(const D3DXVECTOR3& boxMin, const D3DXVECTOR3& boxMax) const
 {
-    m_patches.clear();
-    // Reserve estimate: Assuming roughly 1 patch per triangle in the pool
-    m_patches.reserve(nodePool.size() * 4);
-
-    // 1. PRE-CALCULATE RANDOM VECTORS (Optimization)
-    m_randomDirTable.clear();
-    m_randomDirTable.reserve(4096);
+    // Twice the classify epsilon, so float noise in the box test can't disagree with ClassifyTriangle
+    const float margin = 0.002f;
+    const D3DXVECTOR3 center = (boxMin + boxMax) * 0.5f;
+    const D3DXVECTOR3 extent = (boxMax - boxMin) * 0.5f;
 
-    for (int i = 0; i < 4096; i++)
+    int n = 0;
+    for (;;)
     {
-        D3DXVECTOR3 v;
-        // Generate uniform points on sphere correctly
-        do {
-            // Random float -1.0 to 1.0
-            float x = ((rand() % 2000) / 1000.0f) - 1.0f;
-            float y = ((rand() % 2000) / 1000.0f) - 1.0f;
-            float z = ((rand() % 2000) / 1000.0f) - 1.0f;
-            v = D3DXVECTOR3(x, y, z);
-        } while (D3DXVec3LengthSq(&v) > 1.0f || D3DXVec3LengthSq(&v) < 0.01f); // Rejection
+        const BSPFlatNode& node = m_flatNodes[n];
+        if (node.isLeaf) return n;
 
-        D3DXVec3Normalize(&v, &v);
-        m_randomDirTable.push_back(v);
+        const D3DXPLANE& p = node.plane;
+        float dist = p.a * center.x + p.b * center.y + p.c * center.z + p.d;
+        float radius = fabsf(p.a) * extent.x + fabsf(p.b) * extent.y + fabsf(p.c) * extent.z;
+
+        int child;
+        if (dist - radius > margin)       child = node.iFront;
+        else if (dist + radius < -margin) child = node.iBack;
+        else                              return n; // Box touches this plane
+
+        if (child == -1) return n; // Side is empty, this node has to grow a child
+        n = child;
     }
+}
 
-    // Iterate over the ENTIRE BSP Tree
-    for (size_t n = 0; n < nodePool.size(); n++)
+// One past the last node of the subtree (pre-order: the last child's subtree comes last)
+int CBSPlevel::GetSubtreeEnd(int nodeIndex) const
+{
+    int n = nodeIndex;
+    for (;;)
     {
-        BSPNode& node = nodePool[n];
-        // Skip nodes that have no geometry
-        if (node.members.empty()) continue;
+        const BSPFlatNode& node = m_flatNodes[n];
+        int next = (node.iBack != -1) ? node.iBack : node.iFront;
+        if (next == -1) return n + 1;
+        n = next;
+    }
+}
 
-        // Iterate over all triangles in this node
-        for (size_t t = 0; t < node.members.size(); t++)
-        {
-            const BSPTriangle& tri = node.members[t];
-            RADPATCH patch;
+// Rebuilds the subtree at 'root' without the triangles of 'objectId', plus 'added',
+// and splices it back in place of the old one.
+BOOL CBSPlevel::RebuildSubtree(int root, int objectId, const std::vector<BSPTriangle>& added)
+{
+    const int oldEnd = GetSubtreeEnd(root);
+    const UINT t0 = m_flatNodes[root].firstTri;
+    const UINT t1 = (oldEnd < (int)m_flatNodes.size()) ? m_flatNodes[oldEnd].firstTri : (UINT)m_flatMatIndex.size();
+
+    // Subtree triangles are contiguous, gather everything that stays
+    std::vector<BSPTriangle> polys;
+    polys.reserve((t1 - t0) + added.size());
+    for (UINT t = t0; t < t1; t++)
+    {
+        if (m_flatObjectId[t] == objectId) continue;
+        BSPTriangle tri;
+        tri.v[0] = m_flatVerts[t * 3 + 0];
+        tri.v[1] = m_flatVerts[t * 3 + 1];
+        tri.v[2] = m_flatVerts[t * 3 + 2];
+        tri.matIndex = m_flatMatIndex[t];
+        tri.objectId = m_flatObjectId[t];
+        polys.push_back(tri);
+    }
+    polys.insert(polys.end(), added.begin(), added.end());
+
+    std::vector<BSPNode> pool;
+    BSPBuildStats stats;
+    RunBuild(pool, polys, stats);
+    if (pool.empty()) return FALSE;
+
+    std::vector<BSPFlatNode> nodes;
+    std::vector<OBJVertex> verts;
+    std::vector<int> matIndex, objIds;
+    FlattenPool(pool, nodes, verts, matIndex, objIds);
+
+    // Rebase the new nodes, then shift everything behind the old range
+    const int nodeDelta = (int)nodes.size() - (oldEnd - root);
+    const int triDelta = (int)matIndex.size() - (int)(t1 - t0);
+    for (auto& node : nodes)
+    {
+        if (node.iFront != -1) node.iFront += root;
+        if (node.iBack != -1)  node.iBack += root;
+        node.firstTri += t0;
+    }
+    for (int i = 0; i < (int)m_flatNodes.size(); i++)
+    {
+        if (i >= root && i < oldEnd) continue;
+        BSPFlatNode& node = m_flatNodes[i];
+        if (node.iFront >= oldEnd) node.iFront += nodeDelta;
+        if (node.iBack >= oldEnd)  node.iBack += nodeDelta;
+        if (i >= oldEnd) node.firstTri += triDelta;
+    }
 
-            // 1. Geometry Setup
-            D3DXVECTOR3 p0(tri.v[0].x, tri.v[0].y, tri.v[0].z);
-            D3DXVECTOR3 p1(tri.v[1].x, tri.v[1].y, tri.v[1].z);
-            D3DXVECTOR3 p2(tri.v[2].x, tri.v[2].y, tri.v[2].z);
+    m_flatNodes.erase(m_flatNodes.begin() + root, m_flatNodes.begin() + oldEnd);
+    m_flatNodes.insert(m_flatNodes.begin() + root, nodes.begin(), nodes.end());
+    m_flatVerts.erase(m_flatVerts.begin() + (size_t)t0 * 3, m_flatVerts.begin() + (size_t)t1 * 3);
+    m_flatVerts.insert(m_flatVerts.begin() + (size_t)t0 * 3, verts.begin(), verts.end());
+    m_flatMatIndex.erase(m_flatMatIndex.begin() + t0, m_flatMatIndex.begin() + t1);
+    m_flatMatIndex.insert(m_flatMatIndex.begin() + t0, matIndex.begin(), matIndex.end());
+    m_flatObjectId.erase(m_flatObjectId.begin() + t0, m_flatObjectId.begin() + t1);
+    m_flatObjectId.insert(m_flatObjectId.begin() + t0, objIds.begin(), objIds.end());
+    m_flatShadowTris.erase(m_flatShadowTris.begin() + t0, m_flatShadowTris.begin() + t1);
+    m_flatShadowTris.insert(m_flatShadowTris.begin() + t0, matIndex.size(), BSPShadowTri());
+    UpdateShadowTris(t0, matIndex.size());
+    return TRUE;
+}
 
-            patch.area = CalculateArea(p0, p1, p2);
-            //if (patch.area <= 0.0001f) continue; // Skip degenerate/tiny slivers
+// Tree part of an object edit: 'newTris' are already subdivided.
+// The old and new positions are handled separately, so moving an object
+// across the level rebuilds two small subtrees instead of their common ancestor.
+BOOL CBSPlevel::RebuildObjectRegion(int objectId, const std::vector<BSPTriangle>& newTris)
+{
+    if (m_flatNodes.empty()) return FALSE;
+    SyncPublishedColors();
 
-            patch.center = (p0 + p1 + p2) / 3.0f;
+    D3DXVECTOR3 oldMin(FLT_MAX, FLT_MAX, FLT_MAX), oldMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    D3DXVECTOR3 newMin = oldMin, newMax = oldMax;
+    bool hasOld = false;
+    for (size_t t = 0; t < m_flatObjectId.size(); t++)
+    {
+        if (m_flatObjectId[t] != objectId) continue;
+        hasOld = true;
+        for (int i = 0; i < 3; i++)
+        {
+            const OBJVertex& v = m_flatVerts[t * 3 + i];
+            D3DXVECTOR3 p(v.x, v.y, v.z);
+            D3DXVec3Minimize(&oldMin, &oldMin, &p);
+            D3DXVec3Maximize(&oldMax, &oldMax, &p);
+        }
+    }
+    for (const auto& tri : newTris)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            D3DXVECTOR3 p(tri.v[i].x, tri.v[i].y, tri.v[i].z);
+            D3DXVec3Minimize(&newMin, &newMin, &p);
+            D3DXVec3Maximize(&newMax, &newMax, &p);
+        }
+    }
 
-            // Calculate Normal
-            D3DXVECTOR3 e1 = p1 - p0;
-            D3DXVECTOR3 e2 = p2 - p0;
-            D3DXVec3Cross(&patch.normal, &e1, &e2);
-            D3DXVec3Normalize(&patch.normal, &patch.normal);
-			//patch.normal = D3DXVECTOR3(tri.v[1].nx, tri.v[1].ny, tri.v[1].nz);
+    int oldRoot = hasOld ? FindEditRoot(oldMin, oldMax) : -1;
+    int newRoot = newTris.empty() ? -1 : FindEditRoot(newMin, newMax);
 
-            // Helper Lambda to setup a patch
-            auto CreatePatch = [&](D3DXVECTOR3 no, D3DXVECTOR3 co, bool isBackFace)
-                {
-                    RADPATCH autopatch;
-                    autopatch.area = patch.area;
+    // One subtree inside the other: the outer one covers both
+    if (oldRoot != -1 && newRoot != -1)
+    {
+        if (newRoot >= oldRoot && newRoot < GetSubtreeEnd(oldRoot)) newRoot = oldRoot;
+        if (oldRoot >= newRoot && oldRoot < GetSubtreeEnd(newRoot)) oldRoot = -1;
+    }
+
+    // Splicing shifts everything behind a subtree, so rebuild the later one first
+    static const std::vector<BSPTriangle> none;
+    BOOL ok = TRUE;
+    if (oldRoot > newRoot)
+    {
+        ok = RebuildSubtree(oldRoot, objectId, none);
+        if (ok && newRoot != -1) ok = RebuildSubtree(newRoot, objectId, newTris);
+    }
+    else
+    {
+        if (newRoot != -1) ok = RebuildSubtree(newRoot, objectId, newTris);
+        if (ok && oldRoot != -1) ok = RebuildSubtree(oldRoot, objectId, none);
+    }
+    return ok;
+}
+
+BOOL CBSPlevel::ReplaceObject(int objectId, const std::vector<BSPTriangle>& newTris)
+{
+    if (m_eState == BS_BUILDING_BSP || m_eState == BS_CALC_RAD)
+    {
+        _log(L"ReplaceObject: build in progress, skipped\n");
+        return FALSE;
+    }
+    if (m_flatNodes.empty()) return FALSE;
+
+    auto t0 = std::chrono::steady_clock::now();
+
+    std::vector<BSPTriangle> source = newTris;
+    for (auto& tri : source) tri.objectId = objectId;
+
+    SubdivideGeometry(source);
+    std::vector<BSPTriangle> subd;
+    subd.swap(m_subd_triangles);
+
+    size_t oldNodes = m_flatNodes.size();
+    if (!RebuildObjectRegion(objectId, subd))
+    {
+        _log(L"ReplaceObject: rebuild of object %d failed\n", objectId);
+        return FALSE;
+    }
+
+    // Source mesh, used by full rebuilds and physics
+    m_triangles.erase(std::remove_if(m_triangles.begin(), m_triangles.end(),
+        [objectId](const BSPTriangle& tri) { return tri.objectId == objectId; }), m_triangles.end());
+    m_triangles.insert(m_triangles.end(), source.begin(), source.end());
+
+    // Patches point at triangle indices that just moved
+    m_patches.clear();
+
+    if (m_pdworld)
+    {
+        btDynamicsWorld* world = m_pdworld;
+        CleanupPhysics();
+        InitPhysics(world);
+        m_pLevelObject->setWorldTransform(btTransform(btQuaternion(0, 0, 0, 1), m_offset));
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    _log(L"Object %d rebuilt in %.2f ms (%d -> %d nodes)\n", objectId, ms, (int)oldNodes, (int)m_flatNodes.size());
+    return TRUE;
+}
+
+BOOL CBSPlevel::TranslateObject(int objectId, const D3DXVECTOR3& delta)
+{
+    std::vector<BSPTriangle> moved;
+    for (const auto& tri : m_triangles)
+    {
+        if (tri.objectId != objectId) continue;
+        BSPTriangle t = tri;
+        for (int i = 0; i < 3; i++)
+        {
+            t.v[i].x += delta.x;
+            t.v[i].y += delta.y;
+            t.v[i].z += delta.z;
+        }
+        moved.push_back(t);
+    }
+    if (moved.empty()) return FALSE;
+    return ReplaceObject(objectId, moved);
+}
+
+void CBSPlevel::BenchmarkIncrementalEdit(int syntheticTriangles, int edits)
+{
+    if (m_eState == BS_BUILDING_BSP || m_eState == BS_CALC_RAD)
+    {
+        _log(L"BenchmarkIncrementalEdit: build in progress, skipped\n");
+        return;
+    }
+
+    // Park the level's tree, the benchmark works on the member arrays
+    std::vector<BSPFlatNode> savedNodes;
+    std::vector<OBJVertex> savedVerts;
+    std::vector<int> savedMat, savedObj;
+    std::vector<BSPShadowTri> savedShadow;
+    savedNodes.swap(m_flatNodes);
+    savedVerts.swap(m_flatVerts);
+    savedMat.swap(m_flatMatIndex);
+    savedObj.swap(m_flatObjectId);
+    savedShadow.swap(m_flatShadowTris);
+    BSPBuildStats savedStats = m_buildStats;
+
+    std::vector<BSPTriangle> scene;
+    GenerateSyntheticScene(syntheticTriangles, scene);
+    int numObjects = scene.empty() ? 0 : scene.back().objectId + 1;
+
+    // Full rebuild, same steps as ThreadWorker
+    auto t0 = std::chrono::steady_clock::now();
+    SubdivideGeometry(scene);
+    std::vector<BSPNode> pool;
+    RunBuild(pool, m_subd_triangles, m_buildStats);
+    FlattenTree(pool);
+    double fullMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    std::mt19937 rng(99);
+    std::uniform_int_distribution<int> pickObject(0, std::max(0, numObjects - 1));
+    std::uniform_real_distribution<float> offset(-0.25f, 0.25f);
+
+    double totalMs = 0.0, worstMs = 0.0;
+    int done = 0;
+    for (int e = 0; e < edits && numObjects > 0; e++)
+    {
+        int id = pickObject(rng);
+        D3DXVECTOR3 delta(offset(rng), offset(rng), offset(rng));
+
+        std::vector<BSPTriangle> moved;
+        for (auto& tri : scene)
+        {
+            if (tri.objectId != id) continue;
+            for (int i = 0; i < 3; i++)
+            {
+                tri.v[i].x += delta.x;
+                tri.v[i].y += delta.y;
+                tri.v[i].z += delta.z;
+            }
+            moved.push_back(tri);
+        }
+
+        auto e0 = std::chrono::steady_clock::now();
+        SubdivideGeometry(moved);
+        std::vector<BSPTriangle> subd;
+        subd.swap(m_subd_triangles);
+        BOOL ok = RebuildObjectRegion(id, subd);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - e0).count();
+        if (!ok) break;
+
+        totalMs += ms;
+        worstMs = std::max(worstMs, ms);
+        done++;
+    }
+
+    if (done > 0)
+    {
+        _log(L"BSP edit bench: %d tris, full rebuild %.1f ms, single object edit avg %.2f ms (worst %.2f ms) over %d edits, %.0fx faster\n",
+            (int)scene.size(), fullMs, totalMs / done, worstMs, done, fullMs / std::max(totalMs / done, 0.001));
+    }
+
+    m_flatNodes.swap(savedNodes);
+    m_flatVerts.swap(savedVerts);
+    m_flatMatIndex.swap(savedMat);
+    m_flatObjectId.swap(savedObj);
+    m_flatShadowTris.swap(savedShadow);
+    m_bShadowBVHValid = false;
+    m_buildStats = savedStats;
+}
+
+void CBSPlevel::BuildRAD()
+{
+    _log(L"Preparing Radiosity...\n");
+    PrepareRadiosity();
+
+    _log(L"Running Radiosity Iterations...\n");
+    const int maxIterations = 256;
+    for (int i = 0; i < maxIterations; i++)
+    {
+        if (!RunRadiosityIteration())
+            break; // No more energy to distribute
+        _log(L"Completed Radiosity Iteration %d\n", i + 1);
+    }
+    _log(L"Applying Radiosity to Mesh...\n");
+    
+	ApplyRadiosityToMesh();
+}
+
+// convert m_triangles into "Patches" that store light energy.
+float CBSPlevel::CalculateArea(const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2)
+{
+    D3DXVECTOR3 edge1 = v1 - v0;
+    D3DXVECTOR3 edge2 = v2 - v0;
+    D3DXVECTOR3 cross;
+    D3DXVec3Cross(&cross, &edge1, &edge2);
+    return D3DXVec3Length(&cross) * 0.5f;
+}
+
+// CalculateFormFactor for the receivers [first, first + count), the visibility rays go out
+// as one packet from the shooter. 'skip' (the shooter itself) gets 0.
+void CBSPlevel::CalculateFormFactors(const RADPATCH& src, int skip, int first, int count, float* ff)
+{
+    D3DXVECTOR3 dirs[RAD_FF_PACKET];
+    float lengths[RAD_FF_PACKET];
+    BYTE blocked[RAD_FF_PACKET];
+    int lane[RAD_FF_PACKET];
+    int rays = 0;
+
+    for (int k = 0; k < count; k++)
+    {
+        ff[k] = 0.0f;
+        int i = first + k;
+        if (i == skip) continue;
+        const RADPATCH& dest = m_patches[i];
+
+        // Same steps as CalculateFormFactor
+        D3DXVECTOR3 vec = dest.center - src.center;
+        float distSq = D3DXVec3LengthSq(&vec);
+        float dist = sqrtf(distSq);
+        D3DXVECTOR3 dir = vec / dist;
+        float cosSrc = D3DXVec3Dot(&src.normal, &dir);
+        float cosDest = D3DXVec3Dot(&dest.normal, &-dir);
+        if (cosSrc <= 0.0f || cosDest <= 0.0f) continue;
+
+        ff[k] = (cosSrc * cosDest * dest.area) / (D3DX_PI * distSq + dest.area);
+        float checkLength = dist - 0.001f;
+        if (checkLength > 0.0f)
+        {
+            dirs[rays] = dir;
+            lengths[rays] = checkLength;
+            lane[rays] = k;
+            rays++;
+        }
+    }
+    if (rays == 0) return;
+
+    D3DXVECTOR3 startPos = src.center + (src.normal * 0.05f);
+    RayCastPacket(startPos, dirs, lengths, rays, blocked);
+    for (int r = 0; r < rays; r++)
+        if (blocked[r]) ff[lane[r]] = 0.0f;
+}
+
+float CBSPlevel::CalculateFormFactor(const RADPATCH& src, const RADPATCH& dest)
+{
+    // 1. Vector Setup
+    D3DXVECTOR3 vec = dest.center - src.center;
+    float distSq = D3DXVec3LengthSq(&vec);
+    //if (distSq > 100.0f) return 0.0f;
+
+    float dist = sqrtf(distSq);
+    // Safety: Don't calculate if patches are on top of each other
+    //if (dist < 0.001f) return 0.0f;
+
+    // Normalize direction vector (Source -> Dest)
+    D3DXVECTOR3 dir = vec / dist;
+
+    // 2. Orientation Checks (Cosine Law)
+    // Angle at Shooter (Lambert's cosine law for emission)
+    float cosSrc = D3DXVec3Dot(&src.normal, &dir);
+    // Angle at Receiver (Lambert's cosine law for incidence)
+    // We negate 'dir' because the receiver normal should point TOWARDS the shooter
+    float cosDest = D3DXVec3Dot(&dest.normal, &-dir);
+    // Backface Culling:
+    // If Source is facing away (cosSrc < 0) or Dest is facing away (cosDest < 0),
+    // light cannot physically travel between them.
+    if (cosSrc <= 0.0f || cosDest <= 0.0f) return 0.0f;
+    // 3. Visibility Check (The Optimization)
+    // We need to check if a wall exists between Src and Dest.
+    // 
+    // OPTIMIZATION 2: Calculate Potential Factor BEFORE Raycast
+    // Formula: (cos1 * cos2 * Area) / (PI * r^2)
+    float potentialFactor = (cosSrc * cosDest * dest.area) / (D3DX_PI * distSq + dest.area);
+    // If the energy transfer is tiny, don't waste time checking walls
+    //if (potentialFactor < 0.00001f) return 0.0f;
+    // A. Start slightly off the Source surface (0.05 units) to avoid hitting itself.
+    D3DXVECTOR3 startPos = src.center + (src.normal * 0.05f);
+
+    // B. End slightly before the Dest surface (0.1 units total) to avoid hitting the destination.
+    float checkLength = dist - 0.001f;
+
+    // C. Perform the BSP Raycast
+    if (checkLength > 0.0f)
+    {
+        // If RayCastAny returns true, it means we hit a wall -> Occluded
+        if (RayCastAny(startPos, dir, checkLength))
+        {
+            return 0.0f;
+        }
+    }
+    // Safety clamp
+    //if (potentialFactor > 1.0f) potentialFactor = 1.0f;
+
+    return potentialFactor;
+}
+
+
+
+int CBSPlevel::FindBrightestPatch()
+{
+    int bestIndex = -1;
+    float maxEnergy = 0.0f;
+
+    for (int i = 0; i < m_patches.size(); i++)
+    {
+        // Energy = Intensity (r+g+b)
+        float energy = m_patches[i].unshot.x + m_patches[i].unshot.y + m_patches[i].unshot.z;
+        if (energy > maxEnergy) {
+            maxEnergy = energy;
+            bestIndex = i;
+        }
+    }
+    return bestIndex;
+}
+
+void CBSPlevel::PrepareRadiosity()
+{
+    m_patches.clear();
+    m_bShooterQueueValid = false;
+    m_bHemicubeValid = false;
+    m_colorGroup.clear();
+    UpdateShadowBVH();
+    // One patch per triangle in the tree
+    m_patches.reserve(m_flatMatIndex.size());
+
+    // 1. PRE-CALCULATE RANDOM VECTORS (Optimization)
+    m_randomDirTable.clear();
+    m_randomDirTable.reserve(4096);
+    // Deterministic bakes don't depend on whoever called rand() before
+    const bool deterministic = m_buildOptions.radDeterministic;
+    std::mt19937 rng(m_buildOptions.seed);
+    auto next = [&]() { return deterministic ? (int)(rng() % 2000) : rand() % 2000; };
+
+    for (int i = 0; i < 4096; i++)
+    {
+        D3DXVECTOR3 v;
+        // Generate uniform points on sphere correctly
+        do {
+            // Random float -1.0 to 1.0
+            float x = (next() / 1000.0f) - 1.0f;
+            float y = (next() / 1000.0f) - 1.0f;
+            float z = (next() / 1000.0f) - 1.0f;
+            v = D3DXVECTOR3(x, y, z);
+        } while (D3DXVec3LengthSq(&v) > 1.0f || D3DXVec3LengthSq(&v) < 0.01f); // Rejection
+
+        D3DXVec3Normalize(&v, &v);
+        m_randomDirTable.push_back(v);
+    }
+
+    // Iterate over the ENTIRE BSP Tree
+    for (size_t n = 0; n < m_flatNodes.size(); n++)
+    {
+        const BSPFlatNode& node = m_flatNodes[n];
+        // Skip nodes that have no geometry
+        if (node.triCount == 0) continue;
+
+        // Iterate over all triangles in this node
+        for (size_t t = node.firstTri; t < node.firstTri + node.triCount; t++)
+        {
+            const OBJVertex* tri = &m_flatVerts[t * 3];
+            const int matIndex = m_flatMatIndex[t];
+            RADPATCH patch;
+
+            // 1. Geometry Setup
+            D3DXVECTOR3 p0(tri[0].x, tri[0].y, tri[0].z);
+            D3DXVECTOR3 p1(tri[1].x, tri[1].y, tri[1].z);
+            D3DXVECTOR3 p2(tri[2].x, tri[2].y, tri[2].z);
+
+            patch.area = CalculateArea(p0, p1, p2);
+            //if (patch.area <= 0.0001f) continue; // Skip degenerate/tiny slivers
+
+            patch.center = (p0 + p1 + p2) / 3.0f;
+
+            // Calculate Normal
+            D3DXVECTOR3 e1 = p1 - p0;
+            D3DXVECTOR3 e2 = p2 - p0;
+            D3DXVec3Cross(&patch.normal, &e1, &e2);
+            D3DXVec3Normalize(&patch.normal, &patch.normal);
+			//patch.normal = D3DXVECTOR3(tri.v[1].nx, tri.v[1].ny, tri.v[1].nz);
+
+            // Helper Lambda to setup a patch
+            auto CreatePatch = [&](D3DXVECTOR3 no, D3DXVECTOR3 co, bool isBackFace)
+                {
+                    RADPATCH autopatch;
+                    autopatch.area = patch.area;
                     autopatch.normal = no;
                     autopatch.center = co;
                     // A. Material Logic
@@ -909,9 +2451,9 @@ void CBSPlevel::PrepareRadiosity()
                     else 
                     {
                         // LOOKUP MATERIAL
-                        if (tri.matIndex >= 0 && tri.matIndex < m_materials.size())
+                        if (matIndex >= 0 && matIndex < m_materials.size())
                         {
-                            const BSPMaterial& mat = m_materials[tri.matIndex];
+                            const BSPMaterial& mat = m_materials[matIndex];
                             autopatch.emission = mat.emissive;
                             autopatch.reflectivity = mat.diffuse;
                         }
@@ -954,80 +2496,204 @@ void CBSPlevel::PrepareRadiosity()
         }
     }
     // 2. Inject Skylight
-    // Color: Light Blue
-    // Intensity: 2.0f (Make it bright so it bounces nicely)
-    AddHemisphereLight(D3DXCOLOR(1.0f, 1.0f, 1.0f, 1.0f), 4.0f, SKY_SAMPLES);
+    // Intensity: Make it bright so it bounces nicely
+    AddHemisphereLight(SKY_COLOR, SKY_INTENSITY, SKY_SAMPLES);
 }
 
 BOOL CBSPlevel::RunRadiosityIteration()
 {
-    if (m_bStopRequested) return FALSE;
-    // 1. Pick the Shooter
-    int shooterIdx = FindBrightestPatch();
-    if (shooterIdx == -1) return FALSE; // Convergence reached
+    return ShootPatches(1) > 0;
+}
 
-    RADPATCH& shooter = m_patches[shooterIdx];
+// Brightest first, NaN and negative energy never shoot
+static inline float ShooterKey(const RADPATCH& patch)
+{
+    float energy = patch.unshot.x + patch.unshot.y + patch.unshot.z;
+    return (energy > 0.0f) ? energy : 0.0f;
+}
 
-    // If energy is tiny, stop to save time
-    if ((shooter.unshot.x + shooter.unshot.y + shooter.unshot.z) < 0.001f)
-        return FALSE;
-    // Cache shooter values to avoid reading shared memory constantly
-    D3DXVECTOR3 shooterUnshot = shooter.unshot;
+void CBSPlevel::BuildShooterQueue()
+{
+    std::vector<float> keys(m_patches.size());
+    for (size_t i = 0; i < m_patches.size(); i++) keys[i] = ShooterKey(m_patches[i]);
+    m_shooterQueue.Build(keys);
+    m_bShooterQueueValid = true;
+}
+
+// Shoots the 'maxShooters' brightest patches in one parallel pass over the receivers.
+// Each receiver gathers from all of them, the shooters' energy is taken as it was before
+// the pass (what they receive from each other waits for their next turn).
+// Returns the number of patches shot, 0 once converged.
+int CBSPlevel::ShootPatches(int maxShooters)
+{
+    if (m_bStopRequested) return 0;
+    const bool useQueue = m_buildOptions.radShooterQueue;
+    if (useQueue && (!m_bShooterQueueValid || m_shooterQueue.Size() != m_patches.size()))
+        BuildShooterQueue();
+
+    // 1. Pick the Shooters
+    int shooterIdx[RAD_MAX_SHOOT_BATCH];
+    D3DXVECTOR3 shooterUnshot[RAD_MAX_SHOOT_BATCH];
+    maxShooters = std::max(1, std::min(maxShooters, (int)RAD_MAX_SHOOT_BATCH));
+    int shooterCount = 0;
+    while (shooterCount < maxShooters)
+    {
+        int idx = useQueue ? m_shooterQueue.Top() : FindBrightestPatch();
+        if (idx == -1) break; // Convergence reached
+
+        RADPATCH& shooter = m_patches[idx];
+        // If energy is tiny, stop to save time
+        if ((shooter.unshot.x + shooter.unshot.y + shooter.unshot.z) < 0.001f)
+            break;
+        // Cache shooter values to avoid reading shared memory constantly
+        shooterIdx[shooterCount] = idx;
+        shooterUnshot[shooterCount] = shooter.unshot;
+        shooterCount++;
+
+        // 3. Reset Shooter (now, so the next pick is a different patch)
+        shooter.unshot = D3DXVECTOR3(0, 0, 0);
+        if (useQueue) m_shooterQueue.Update(idx, 0.0f);
+    }
+    if (shooterCount == 0) return 0;
+    m_pipelineStats.radFormFactors += (long long)shooterCount * ((long long)m_patches.size() - 1);
+
+    // Hemicube rows up front, each one is already parallel over the cube faces
+    const bool hemicube = m_buildOptions.radHemicube;
+    if (hemicube)
+    {
+        if (!m_hemicube) m_hemicube.reset(new CRadHemicube());
+        if (!m_bHemicubeValid || m_hemicube->GetItemCount() != m_patches.size())
+        {
+            m_hemicube->SetGeometry(m_patches, m_flatVerts);
+            m_bHemicubeValid = true;
+        }
+        m_hemicube->SetResolution(m_buildOptions.hemicubeResolution);
+        m_hemicubeFF.resize((size_t)shooterCount * m_patches.size());
+        for (int k = 0; k < shooterCount; k++)
+        {
+            const RADPATCH& src = m_patches[shooterIdx[k]];
+            m_hemicube->Compute(src.center + src.normal * RAD_HEMICUBE_EYE_OFFSET, src.normal, shooterIdx[k],
+                &m_hemicubeFF[(size_t)k * m_patches.size()]);
+        }
+    }
 
     // PARALLEL LOOP
-    // We cast .size() to int because OpenMP works best with signed integers
+    // Receivers go in groups of RAD_FF_PACKET, so each shooter's visibility rays to them are one packet
+    const int patchCount = (int)m_patches.size();
+    const int groupCount = (patchCount + RAD_FF_PACKET - 1) / RAD_FF_PACKET;
+
+    // Receivers per thread, their keys go back into the queue after the loop. Deterministic
+    // bakes list them per group instead, so they go back in patch order: the heap's ties and
+    // its running total then come out the same whichever thread took which group.
+    const bool deterministic = m_buildOptions.radDeterministic;
+    if (useQueue)
+    {
+        m_radReceived.resize(deterministic ? groupCount : omp_get_max_threads());
+        for (auto& list : m_radReceived) list.clear();
+    }
     #pragma omp parallel for schedule(dynamic)
     // 2. Shoot to everyone else
-    for (int i = 0; i < m_patches.size(); i++)
+    for (int g = 0; g < groupCount; g++)
     {
-        if (i == shooterIdx) continue;
-        RADPATCH& receiver = m_patches[i];
-
-        float ff = CalculateFormFactor(shooter, receiver);
-        if (ff <= 0.0f) continue;
-        // ENERGY TRANSFER FORMULA:
-        // DeltaReceived = (ShooterUnshotEnergy * FormFactor) * ReceiverReflectivity
-        // Note: FormFactor here accounts for Receiver Area implicitly via Reciprocity logic used above
-        D3DXVECTOR3 incidentLight = shooter.unshot * ff;
-
-        // Apply material color (Reflectivity)
-        D3DXVECTOR3 reflectedLight;
-        reflectedLight.x = incidentLight.x * receiver.reflectivity.r;
-        reflectedLight.y = incidentLight.y * receiver.reflectivity.g;
-        reflectedLight.z = incidentLight.z * receiver.reflectivity.b;
-        // 1. Convert Flux to Radiosity for the visual mesh (Divide by Area)
-            // Safety check to avoid divide by zero, though unlikely with your setup
-        if (receiver.area > 1e-6f)
+        const int first = g * RAD_FF_PACKET;
+        const int count = std::min((int)RAD_FF_PACKET, patchCount - first);
+        D3DXVECTOR3 incident[RAD_FF_PACKET];
+        bool received[RAD_FF_PACKET] = {};
+        for (int k = 0; k < shooterCount; k++)
+        {
+            float rayFF[RAD_FF_PACKET];
+            const float* ff = rayFF;
+            if (hemicube)
+                ff = &m_hemicubeFF[(size_t)k * patchCount + first];
+            else
+                CalculateFormFactors(m_patches[shooterIdx[k]], shooterIdx[k], first, count, rayFF);
+            for (int r = 0; r < count; r++)
+            {
+                if (ff[r] <= 0.0f) continue;
+                // ENERGY TRANSFER FORMULA:
+                // DeltaReceived = (ShooterUnshotEnergy * FormFactor) * ReceiverReflectivity
+                // Note: FormFactor here accounts for Receiver Area implicitly via Reciprocity logic used above
+                if (!received[r]) incident[r] = D3DXVECTOR3(0, 0, 0);
+                incident[r] += shooterUnshot[k] * ff[r];
+                received[r] = true;
+            }
+        }
+        for (int r = 0; r < count; r++)
         {
-            receiver.accumulated += reflectedLight / receiver.area;
-        }        // Add to unshot (so it can bounce next frame)
-        receiver.unshot += reflectedLight;
+            if (!received[r]) continue;
+            const int i = first + r;
+            RADPATCH& receiver = m_patches[i];
+            const D3DXVECTOR3& incidentLight = incident[r];
+
+            // Apply material color (Reflectivity)
+            D3DXVECTOR3 reflectedLight;
+            reflectedLight.x = incidentLight.x * receiver.reflectivity.r;
+            reflectedLight.y = incidentLight.y * receiver.reflectivity.g;
+            reflectedLight.z = incidentLight.z * receiver.reflectivity.b;
+            // 1. Convert Flux to Radiosity for the visual mesh (Divide by Area)
+                // Safety check to avoid divide by zero, though unlikely with your setup
+            if (receiver.area > 1e-6f)
+            {
+                receiver.accumulated += reflectedLight / receiver.area;
+            }        // Add to unshot (so it can bounce next frame)
+            receiver.unshot += reflectedLight;
+            if (useQueue) m_radReceived[deterministic ? g : omp_get_thread_num()].push_back(i);
+        }
     }
 
-    // 3. Reset Shooter
-    shooter.unshot = D3DXVECTOR3(0, 0, 0);
+    if (useQueue)
+    {
+        size_t receivedCount = 0;
+        for (const auto& list : m_radReceived) receivedCount += list.size();
+        // Past ~1/8 of the patches sifting every receiver up costs more than scanning,
+        // the queue goes unordered and picks by scan until the shots get local again
+        bool dense = receivedCount * 8 > m_patches.size();
+        if (!dense && !m_shooterQueue.IsOrdered()) m_shooterQueue.Rebuild();
+        for (const auto& list : m_radReceived)
+        {
+            for (int i : list)
+            {
+                if (dense) m_shooterQueue.SetKeyDeferred(i, ShooterKey(m_patches[i]));
+                else m_shooterQueue.Update(i, ShooterKey(m_patches[i]));
+            }
+        }
+    }
 
-    return TRUE; // Continue iterating
+    return shooterCount;
 }
 
-void CBSPlevel::ApplyRadiosityToMesh()
+// Vertices that share a position and (roughly) a normal get the same color. The groups only
+// depend on the flat vertices, so they're found once instead of on every color update.
+void CBSPlevel::BuildColorGroups()
 {
-    // Map to store sum of colors for every unique vertex
-    std::map<SmoothKey, ColorAccumulator> smoothMap;
-
-    // ---------------------------------------------------------
+    std::map<SmoothKey, int> groups;
+    m_colorGroup.resize(m_flatVerts.size());
+    for (size_t i = 0; i < m_flatVerts.size(); i++)
+    {
+        const OBJVertex& vert = m_flatVerts[i];
+        SmoothKey k;
+        k.x = vert.x; k.y = vert.y; k.z = vert.z;
+        k.nx = vert.nx; k.ny = vert.ny; k.nz = vert.nz;
+        auto it = groups.insert(std::make_pair(k, (int)groups.size())).first;
+        m_colorGroup[i] = it->second;
+    }
+    m_colorGroupCount = (int)groups.size();
+}
+
+// Tone mapped patch radiosity averaged over each smoothing group, one color per flat vertex.
+// Vertices no patch touches come out white.
+void CBSPlevel::ComputeRadiosityColors(std::vector<DWORD>& out)
+{
+    if (m_colorGroup.size() != m_flatVerts.size()) BuildColorGroups();
+    m_colorSums.assign(m_colorGroupCount, ColorAccumulator());
+
+    // ---------------------------------------------------------
     // PASS 1: GATHER COLORS
     // ---------------------------------------------------------
     for (const auto& patch : m_patches)
     {
         if (patch.triIndex == -1) continue; // Skip backfaces
-        if (patch.nodeIndex >= nodePool.size()) continue;
-
-        BSPNode& node = nodePool[patch.nodeIndex];
-        if (patch.triIndex >= node.members.size()) continue;
-
-        // Get the triangle
-        BSPTriangle& tri = node.members[patch.triIndex];
+        if (patch.triIndex >= (int)m_flatMatIndex.size()) continue;
 
         // Calculate Tone-Mapped Color for this PATCH
         D3DXVECTOR3 finalColor = patch.accumulated;
@@ -1037,39 +2703,29 @@ void CBSPlevel::ApplyRadiosityToMesh()
         finalColor.z = finalColor.z / (1.0f + finalColor.z);
         D3DXCOLOR c(finalColor.x, finalColor.y, finalColor.z, 1.0f);
 
-        // Add this color to all 3 vertices in our map
+        // Add this color to the groups of all 3 vertices
         for (int i = 0; i < 3; i++)
-        {
-            SmoothKey k;
-            k.x = tri.v[i].x; k.y = tri.v[i].y; k.z = tri.v[i].z;
-            k.nx = tri.v[i].nx; k.ny = tri.v[i].ny; k.nz = tri.v[i].nz;
-
-            smoothMap[k].Add(c);
-        }
+            m_colorSums[m_colorGroup[(size_t)patch.triIndex * 3 + i]].Add(c);
     }
 
     // ---------------------------------------------------------
-    // PASS 2: APPLY AVERAGED COLORS
+    // PASS 2: AVERAGED COLORS
     // ---------------------------------------------------------
-    for (auto& node : nodePool)
+    out.resize(m_flatVerts.size());
+    for (size_t i = 0; i < m_flatVerts.size(); i++)
     {
-        for (auto& tri : node.members)
-        {
-            for (int i = 0; i < 3; i++)
-            {
-                SmoothKey k;
-                k.x = tri.v[i].x; k.y = tri.v[i].y; k.z = tri.v[i].z;
-                k.nx = tri.v[i].nx; k.ny = tri.v[i].ny; k.nz = tri.v[i].nz;
-
-                // Find the accumulated color in the map
-                auto it = smoothMap.find(k);
-                if (it != smoothMap.end())
-                {
-                    tri.v[i].color = it->second.GetAverage();
-                }
-            }
-        }
+        const ColorAccumulator& sum = m_colorSums[m_colorGroup[i]];
+        out[i] = sum.count ? sum.GetAverage() : 0xFFFFFFFF;
     }
+}
+
+// Writes the colors straight into m_flatVerts, only for callers that own the mesh
+// (foreground bakes, benchmarks). Background bakes go through PublishRadiosityColors.
+void CBSPlevel::ApplyRadiosityToMesh()
+{
+    std::vector<DWORD> colors;
+    ComputeRadiosityColors(colors);
+    for (size_t i = 0; i < m_flatVerts.size(); i++) m_flatVerts[i].color = colors[i];
 	// sharp shading for debugging
     //for (const auto& patch : m_patches)
     //{
@@ -1099,43 +2755,98 @@ void CBSPlevel::ApplyRadiosityToMesh()
     //}
 }
 
+// Background bakes: hands the current colors to the render thread once radPublishMs or
+// radPublishShots have passed since the last time (or always with 'force').
+void CBSPlevel::PublishRadiosityColors(bool force, int shots)
+{
+    m_shotsSincePublish += shots;
+    const BSPBuildOptions& opt = m_buildOptions;
+    auto now = std::chrono::steady_clock::now();
+    bool due = force ||
+        (opt.radPublishShots > 0 && m_shotsSincePublish >= (int)opt.radPublishShots) ||
+        (opt.radPublishMs > 0.0f && std::chrono::duration<double, std::milli>(now - m_lastPublish).count() >= opt.radPublishMs);
+    if (!due) return;
+
+    ComputeRadiosityColors(m_colorBuffer.GetBack());
+    m_colorBuffer.Publish();
+    m_lastPublish = std::chrono::steady_clock::now();
+    m_shotsSincePublish = 0;
+    m_pipelineStats.radPublishes++;
+    m_pipelineStats.radPublishMs += std::chrono::duration<double, std::milli>(m_lastPublish - now).count();
+}
+
+// Render thread: takes the newest published colors, if there are any, into m_flatVerts
+void CBSPlevel::SyncPublishedColors()
+{
+    if (!m_colorBuffer.Acquire()) return;
+    const std::vector<DWORD>& colors = m_colorBuffer.GetFront();
+    // A publish from before gradient refinement doesn't fit the new mesh
+    if (colors.size() != m_flatVerts.size()) return;
+    for (size_t i = 0; i < colors.size(); i++) m_flatVerts[i].color = colors[i];
+}
+
 // --------------------------------------------------------------------------
 // OPTIMIZED RAYCAST: Uses BSP Tree O(log N) instead of O(N)
 // --------------------------------------------------------------------------
+// Builds the shadow BVH if it's enabled and the triangles changed since the last build
+void CBSPlevel::UpdateShadowBVH()
+{
+    if (!m_buildOptions.shadowBVH || m_bShadowBVHValid) return;
+    if (!m_shadowBVH) m_shadowBVH.reset(new CShadowBVH());
+    m_shadowBVH->Build(m_flatShadowTris);
+    m_bShadowBVHValid = true;
+    _log(L"Shadow BVH: %d triangles, %d nodes, %.1f MB, built in %.1f ms\n", (int)m_flatShadowTris.size(),
+        (int)m_shadowBVH->GetNodeCount(), m_shadowBVH->GetMemoryBytes() / (1024.0 * 1024.0), m_shadowBVH->GetBuildMs());
+}
+
 bool CBSPlevel::RayCastAny(const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length)
 {
-    if (nodePool.empty()) return false;
+    if (m_bShadowBVHValid && m_buildOptions.shadowBVH) return m_shadowBVH->RayCastAny(start, dir, length);
+    if (m_flatNodes.empty()) return false;
+    // Iterative walk, see BSPRayPacket.cpp
+    return BSPRayCastAny(m_flatNodes.data(), m_flatShadowTris.data(), start, dir, length);
+}
 
-    D3DXVECTOR3 end = start + (dir * length);
-    D3DXVECTOR3 rayDir = dir;
-    // Start recursion at Root (Node 0)
-    return CheckNodeVisibility(0, start, end);
+void CBSPlevel::RayCastPacket(const D3DXVECTOR3& start, const D3DXVECTOR3* dirs, const float* lengths, UINT count, BYTE* blocked)
+{
+    if (m_bShadowBVHValid && m_buildOptions.shadowBVH)
+    {
+        // One ray at a time, every step already tests four boxes
+        for (UINT i = 0; i < count; i++)
+            blocked[i] = m_shadowBVH->RayCastAny(start, dirs[i], lengths[i]) ? 1 : 0;
+        return;
+    }
+    if (m_flatNodes.empty())
+    {
+        memset(blocked, 0, count);
+        return;
+    }
+    BSPRayCastPacket(m_flatNodes.data(), m_flatShadowTris.data(), start, dirs, lengths, count, blocked, m_buildOptions.rayPath);
 }
 
+// The original recursive walk, splits the segment at every plane it crosses.
+// Only BenchmarkRayCasts uses it now, as the reference for the iterative and packet walks.
 bool CBSPlevel::CheckNodeVisibility(int nodeIndex,  const D3DXVECTOR3& start, const D3DXVECTOR3& end)
 {
     const float EPSILON = 0.00001f;
 
     // 1. Safety / Empty Check
     if (nodeIndex == -1) return false;
-    const BSPNode& node = nodePool[nodeIndex];
+    const BSPFlatNode& node = m_flatNodes[nodeIndex];
 
-    if (!node.members.empty())
+    if (node.triCount > 0)
     {
         D3DXVECTOR3 dir = end - start;
         float rayLen = D3DXVec3Length(&dir);
         D3DXVec3Normalize(&dir, &dir);
 
-        for (const auto& tri : node.members)
+        const BSPShadowTri* tris = &m_flatShadowTris[node.firstTri];
+        for (UINT t = 0; t < node.triCount; t++)
         {
-            D3DXVECTOR3 v0(tri.v[0].x, tri.v[0].y, tri.v[0].z);
-            D3DXVECTOR3 v1(tri.v[1].x, tri.v[1].y, tri.v[1].z);
-            D3DXVECTOR3 v2(tri.v[2].x, tri.v[2].y, tri.v[2].z);
-
-            float u, v, dist;
+            const BSPShadowTri& tri = tris[t];
             // Use your DoubleSided intersection if you have it, otherwise D3DXIntersectTri
             //if (IntersectTriDoubleSided(start, dir,  v0, v1, v2, dist, u,v))
-            if (IntersectTriangleShadow(start, dir, rayLen + EPSILON, v0, v1, v2))
+            if (IntersectTriangleShadowEdges(start, dir, rayLen + EPSILON, tri.v0, tri.edge1, tri.edge2))
             {
                 // Check if hit is strictly between Start and End
                 //if ( dist < rayLen)
@@ -1198,82 +2909,367 @@ bool CBSPlevel::CheckNodeVisibility(int nodeIndex,  const D3DXVECTOR3& start, co
     }
 }
 
-void CBSPlevel::AddHemisphereLight(const D3DXCOLOR& skyColor, float intensity, int numSamples)
+// Sky seen along a ray that got out: dir.y = 1.0 is straight up, dir.y = -1.0 is straight down
+static D3DXVECTOR3 SkyRadiance(const D3DXVECTOR3& dir, const D3DXCOLOR& skyColor)
 {
-    float skyDist = 100000.0f; // Far away
-    if (m_bStopRequested) return;
+    D3DXCOLOR groundColor = D3DXCOLOR(0.99f, 0.00f, 0.00f, 1.0f);
+    float t = 0.5f * (dir.y + 1.0f); // Map -1...1 to 0...1
+    return D3DXVECTOR3(groundColor.r + t * (skyColor.r - groundColor.r),
+        groundColor.g + t * (skyColor.g - groundColor.g),
+        groundColor.b + t * (skyColor.b - groundColor.b));
+}
 
-    #pragma omp parallel for schedule(dynamic)
+long long CBSPlevel::GatherSkyLight(const D3DXCOLOR& skyColor, int numSamples, std::vector<D3DXVECTOR3>& incoming)
+{
+    const float skyDist = 100000.0f; // Far away
+    const BSPBuildOptions& opt = m_buildOptions;
+    const bool stratified = opt.skyStratified;
+    const int packet = stratified ? (int)std::max(opt.skyMinSamples, opt.skyMaxSamples) : numSamples;
+
+    incoming.assign(m_patches.size(), D3DXVECTOR3(0, 0, 0));
+    if (packet <= 0) return 0;
 
-    for (int j = 0; j < m_patches.size(); j++)
+    long long rays = 0;
+    #pragma omp parallel reduction(+:rays)
     {
-        RADPATCH& patch = m_patches[j];
-        D3DXVECTOR3 incomingLight(0, 0, 0);
-        int hitsSky = 0;
+        // All samples of a patch share the origin, they go down the tree as packets
+        std::vector<D3DXVECTOR3> dirs(packet);
+        std::vector<float> lengths(packet, skyDist);
+        std::vector<BYTE> blocked(packet);
 
-        for (int i = 0; i < numSamples; i++)
+        #pragma omp for schedule(dynamic)
+        for (int j = 0; j < (int)m_patches.size(); j++)
         {
-            // 1. Get Random Direction
-            D3DXVECTOR3 dir = GetRandomHemisphereVector(patch.normal);
-            // 2. Raycast (Offset start slightly to avoid self-intersection)
+            const RADPATCH& patch = m_patches[j];
+            // Offset start slightly to avoid self-intersection
             D3DXVECTOR3 start = patch.center + (patch.normal * 0.005f);
+            D3DXVECTOR3 sum(0, 0, 0);
 
-            // Use your BSP Optimized RayCast
-            if (!RayCastAny(start, dir, skyDist))
+            if (!stratified)
             {
-                D3DXCOLOR sampleColor = D3DXCOLOR(0,0,0,1);
-                // HIT SKY!
-                // Determine color based on Y direction of the ray
-                // dir.y = 1.0 is straight up, dir.y = -1.0 is straight down
-                /*if (dir.y > 0.0f) {
-                    sampleColor = skyColor;
+                // Deterministic: the patch picks its start in the table, not the thread
+                int idx = (int)(CRadSkySampler::Hash((uint32_t)j + opt.seed * 0x9e3779b9u) % 4096);
+                for (int i = 0; i < numSamples; i++)
+                    dirs[i] = opt.radDeterministic ? GetRandomHemisphereVector(patch.normal, idx) : GetRandomHemisphereVector(patch.normal);
+                RayCastPacket(start, dirs.data(), lengths.data(), numSamples, blocked.data());
+                for (int i = 0; i < numSamples; i++)
+                {
+                    if (blocked[i]) continue;
+                    // Lambert's Law: light from straight up is stronger than light from the horizon
+                    float NdotL = D3DXVec3Dot(&patch.normal, &dirs[i]);
+                    if (NdotL > 0.0f) sum += SkyRadiance(dirs[i], skyColor) * NdotL;
                 }
-                else {
-                    sampleColor = D3DXCOLOR(0.00f, 0.00f, 0.00f, 0.0f);
-                }*/
-                D3DXCOLOR groundColor = D3DXCOLOR(0.99f, 0.00f, 0.00f, 1.0f);
-                float t = 0.5f * (dir.y + 1.0f); // Map -1...1 to 0...1
-                sampleColor.r = groundColor.r + t * (skyColor.r - groundColor.r);
-                sampleColor.g = groundColor.g + t * (skyColor.g - groundColor.g);
-                sampleColor.b = groundColor.b + t * (skyColor.b - groundColor.b);
-                // Lambert's Law: Light hitting at an angle is weaker
-                // (Light coming from straight up is stronger than light from the horizon)
-                float NdotL = D3DXVec3Dot(&patch.normal, &dir);
-                if (NdotL < 0.0f) NdotL = 0.0f; // Should not happen due to GetRandomHemisphereVector, but safety first
-
-                incomingLight.x += sampleColor.r * NdotL;
-                incomingLight.y += sampleColor.g * NdotL;
-                incomingLight.z += sampleColor.b * NdotL;
-
-                hitsSky++;
+                // Uniform over the hemisphere, pdf 1 / 2pi
+                incoming[j] = sum * (2.0f * D3DX_PI / (float)numSamples);
+                rays += numSamples;
+                continue;
             }
+
+            int n = 0;
+            incoming[j] = SampleSky(start, patch.normal, CRadSkySampler::Hash((uint32_t)j + opt.seed * 0x9e3779b9u), skyColor,
+                dirs.data(), lengths.data(), blocked.data(), n);
+            rays += n;
         }
+    }
+    return rays;
+}
+
+// Cosine-weighted, the directions already carry Lambert's cosine. The count doubles until the
+// new half agrees with everything before it: both are stratified blocks of the sequence, so
+// their gap tracks the error far better than the sample variance.
+D3DXVECTOR3 CBSPlevel::SampleSky(const D3DXVECTOR3& start, const D3DXVECTOR3& normal, uint32_t seed, const D3DXCOLOR& skyColor,
+    D3DXVECTOR3* dirs, float* lengths, BYTE* blocked, int& rays)
+{
+    const BSPBuildOptions& opt = m_buildOptions;
+    const int minSamples = (int)std::max(1u, opt.skyMinSamples);
+    const int maxSamples = std::max(minSamples, (int)opt.skyMaxSamples);
+
+    CRadSkySampler sampler(normal, seed);
+    D3DXVECTOR3 sum(0, 0, 0);
+    double lumDone = 0.0;
+    int n = 0;
+    for (int count = minSamples; ; count = std::min(maxSamples, n * 2))
+    {
+        const int batch = count - n;
+        for (int i = 0; i < batch; i++)
+            dirs[i] = sampler.Direction((uint32_t)(n + i));
+        RayCastPacket(start, dirs, lengths, batch, blocked);
+        D3DXVECTOR3 batchSum(0, 0, 0);
+        for (int i = 0; i < batch; i++)
+            if (!blocked[i]) batchSum += SkyRadiance(dirs[i], skyColor);
+        sum += batchSum;
+        double lumBatch = 0.2126 * batchSum.x + 0.7152 * batchSum.y + 0.0722 * batchSum.z;
+        bool settled = n > 0 && fabs(lumBatch / batch - lumDone / n) * 0.5 <= opt.skyMaxError;
+        lumDone += lumBatch;
+        n = count;
+        if (settled || n >= maxSamples) break;
+    }
+    rays = n;
+    // pdf cos / pi
+    return sum * (D3DX_PI / (float)n);
+}
+
+void CBSPlevel::AddHemisphereLight(const D3DXCOLOR& skyColor, float intensity, int numSamples)
+{
+    if (m_bStopRequested) return;
+
+    std::vector<D3DXVECTOR3>& incoming = m_patchSky;
+    m_pipelineStats.skyRays += GatherSkyLight(skyColor, numSamples, incoming);
 
-        // 3. Average the result
-        if (hitsSky > 0)
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < (int)m_patches.size(); j++)
+    {
+        RADPATCH& patch = m_patches[j];
+        if (incoming[j].x <= 0.0f && incoming[j].y <= 0.0f && incoming[j].z <= 0.0f) continue;
+
+        // 1. Multiply by intensity scalar
+        D3DXVECTOR3 incomingFlux = incoming[j] * intensity * patch.area;
+        // 2. Apply Reflectivity (Albedo)
+        D3DXVECTOR3 reflectedFlux;
+        reflectedFlux.x = incomingFlux.x * patch.reflectivity.r;
+        reflectedFlux.y = incomingFlux.y * patch.reflectivity.g;
+        reflectedFlux.z = incomingFlux.z * patch.reflectivity.b;
+
+        // 3. Update Visuals(Radiosity = Flux / Area)
+        // This makes large walls dimmer and small detailed spots brighter for the same energy.
+        if (patch.area > 1e-6f)
         {
-            // Divide total gathered light by the number of samples we took
-            // Multiply by intensity scalar
-            //float scale = intensity / ((float)numSamples * D3DX_PI); // Added PI here
-            float scale = (intensity * 2.0f * D3DX_PI) / (float)numSamples;
-            D3DXVECTOR3 incomingFlux = incomingLight * scale * patch.area;
-            // 2. Apply Reflectivity (Albedo)
-            D3DXVECTOR3 reflectedFlux;
-            reflectedFlux.x = incomingFlux.x * patch.reflectivity.r;
-            reflectedFlux.y = incomingFlux.y * patch.reflectivity.g;
-            reflectedFlux.z = incomingFlux.z * patch.reflectivity.b;
+            patch.accumulated += reflectedFlux / patch.area;
+        }
 
-            // 3. Update Visuals(Radiosity = Flux / Area)
-                // This makes large walls dimmer and small detailed spots brighter for the same energy.
-                if (patch.area > 1e-6f)
-                {
-                    patch.accumulated += reflectedFlux / patch.area;
-                }
+        // 4. Update Physics (Unshot Energy = Flux)
+        patch.unshot += reflectedFlux;
+    }
+}
+
+// Lightmap bakes run on the source triangles as they are, the atlas gives them their resolution.
+// False when there is no atlas to bake into.
+bool CBSPlevel::UnwrapLightmap()
+{
+    m_subd_triangles = m_triangles;
+    m_lightmapAtlas.reset(new CLightmapAtlas());
+    if (!m_lightmapAtlas->Build(m_subd_triangles, m_buildOptions.lightmapTexelSize, m_buildOptions.lightmapMaxSize))
+    {
+        _log(L"Lightmap unwrap: %d charts don't fit into %ux%u\n", m_lightmapAtlas->GetChartCount(),
+            m_buildOptions.lightmapMaxSize, m_buildOptions.lightmapMaxSize);
+        m_lightmapAtlas.reset();
+        return false;
+    }
+    const CLightmapAtlas& atlas = *m_lightmapAtlas;
+    m_pipelineStats.lightmapWidth = (int)atlas.GetWidth();
+    m_pipelineStats.lightmapHeight = (int)atlas.GetHeight();
+    m_pipelineStats.lightmapCharts = atlas.GetChartCount();
+    _log(L"Lightmap unwrap: %d triangles, %d charts, %ux%u atlas at %.3f units per texel\n", (int)m_subd_triangles.size(),
+        atlas.GetChartCount(), atlas.GetWidth(), atlas.GetHeight(), atlas.GetTexelSize());
+    return true;
+}
+
+// Light from the emitter patches arriving at a point, with the solver's form factor. Emitters
+// that are large seen from the point are split into four, up to LIGHTMAP_MAX_SPLITS times, so
+// their penumbras and falloff show at texel scale. One visibility ray per piece.
+D3DXVECTOR3 CBSPlevel::GatherEmitterLight(const D3DXVECTOR3& pos, const D3DXVECTOR3& normal, const std::vector<int>& emitters, int& rays)
+{
+    struct Piece { D3DXVECTOR3 p[3]; int depth; };
+    std::vector<Piece> stack;
+    D3DXVECTOR3 dirs[RAD_FF_PACKET];
+    float lengths[RAD_FF_PACKET];
+    BYTE blocked[RAD_FF_PACKET];
+    D3DXVECTOR3 light[RAD_FF_PACKET];
+    int count = 0;
+    D3DXVECTOR3 sum(0, 0, 0);
+    auto flush = [&]()
+        {
+            RayCastPacket(pos, dirs, lengths, count, blocked);
+            for (int r = 0; r < count; r++)
+                if (!blocked[r]) sum += light[r];
+            rays += count;
+            count = 0;
+        };
+
+    for (int e : emitters)
+    {
+        const RADPATCH& emitter = m_patches[e];
+        const D3DXVECTOR3 emission(emitter.emission.r, emitter.emission.g, emitter.emission.b);
+        const OBJVertex* v = &m_flatVerts[(size_t)emitter.triIndex * 3];
+        Piece root = { { D3DXVECTOR3(v[0].x, v[0].y, v[0].z), D3DXVECTOR3(v[1].x, v[1].y, v[1].z), D3DXVECTOR3(v[2].x, v[2].y, v[2].z) }, 0 };
+        stack.push_back(root);
+        while (!stack.empty())
+        {
+            Piece piece = stack.back();
+            stack.pop_back();
+
+            D3DXVECTOR3 center = (piece.p[0] + piece.p[1] + piece.p[2]) / 3.0f;
+            D3DXVECTOR3 vec = center - pos;
+            float distSq = D3DXVec3LengthSq(&vec);
+            if (distSq < 1e-8f) continue;
+            float area = CalculateArea(piece.p[0], piece.p[1], piece.p[2]);
+            if (area > LIGHTMAP_SPLIT * distSq && piece.depth < LIGHTMAP_MAX_SPLITS)
+            {
+                // Midpoint split, the same as SubdivideUniform
+                D3DXVECTOR3 m01 = (piece.p[0] + piece.p[1]) * 0.5f;
+                D3DXVECTOR3 m12 = (piece.p[1] + piece.p[2]) * 0.5f;
+                D3DXVECTOR3 m20 = (piece.p[2] + piece.p[0]) * 0.5f;
+                const int depth = piece.depth + 1;
+                stack.push_back({ { piece.p[0], m01, m20 }, depth });
+                stack.push_back({ { m01, piece.p[1], m12 }, depth });
+                stack.push_back({ { m20, m12, piece.p[2] }, depth });
+                stack.push_back({ { m01, m12, m20 }, depth });
+                continue;
+            }
 
-            // 4. Update Physics (Unshot Energy = Flux)
-            patch.unshot += reflectedFlux;
+            float dist = sqrtf(distSq);
+            D3DXVECTOR3 dir = vec / dist;
+            float cosRecv = D3DXVec3Dot(&normal, &dir);
+            float cosEmit = -D3DXVec3Dot(&emitter.normal, &dir);
+            if (cosRecv <= 0.0f || cosEmit <= 0.0f || dist <= 0.001f) continue;
+
+            // As ShootPatches: emitted flux times the form factor, per receiver area
+            dirs[count] = dir;
+            lengths[count] = dist - 0.001f;
+            light[count] = emission * (cosRecv * cosEmit * area / (D3DX_PI * distSq + area));
+            if (++count == RAD_FF_PACKET) flush();
         }
     }
+    if (count) flush();
+    return sum;
+}
+
+// Fills the atlas from the solved patches. Sky and emitters are gathered again at every texel,
+// that's where the sharp detail is; the bounced rest is smooth enough to interpolate from the
+// patches, over the same smoothing groups as the vertex colors.
+void CBSPlevel::BakeLightmap()
+{
+    if (!m_lightmapAtlas || m_patchSky.size() != m_patches.size() || m_flatVerts.empty()) return;
+    const CLightmapAtlas& atlas = *m_lightmapAtlas;
+    const int patchCount = (int)m_patches.size();
+
+    std::vector<LightmapTexel> texels;
+    std::vector<BYTE> covered;
+    atlas.GatherTexels(m_flatVerts, texels, covered);
+
+    std::vector<int> emitters;
+    std::vector<int> patchOfTri(m_flatMatIndex.size(), -1);
+    for (int j = 0; j < patchCount; j++)
+    {
+        const RADPATCH& patch = m_patches[j];
+        if (patch.triIndex < 0 || patch.triIndex >= (int)patchOfTri.size()) continue;
+        patchOfTri[patch.triIndex] = j;
+        if (patch.emission.r + patch.emission.g + patch.emission.b > 0.0f) emitters.push_back(j);
+    }
+
+    // 1. Direct light of every patch as the solve saw it: the sky from PrepareRadiosity and the
+    //    emitters' first shot, with the same form factors
+    std::vector<D3DXVECTOR3> direct(patchCount);
+    for (int j = 0; j < patchCount; j++) direct[j] = m_patchSky[j] * SKY_INTENSITY;
+    const int groupCount = (patchCount + RAD_FF_PACKET - 1) / RAD_FF_PACKET;
+    #pragma omp parallel for schedule(dynamic)
+    for (int g = 0; g < groupCount; g++)
+    {
+        const int first = g * RAD_FF_PACKET;
+        const int count = std::min(RAD_FF_PACKET, patchCount - first);
+        float ff[RAD_FF_PACKET];
+        for (int e : emitters)
+        {
+            const RADPATCH& emitter = m_patches[e];
+            const D3DXVECTOR3 flux = D3DXVECTOR3(emitter.emission.r, emitter.emission.g, emitter.emission.b) * emitter.area;
+            CalculateFormFactors(emitter, e, first, count, ff);
+            for (int r = 0; r < count; r++)
+                if (ff[r] > 0.0f && m_patches[first + r].area > 1e-6f)
+                    direct[first + r] += flux * (ff[r] / m_patches[first + r].area);
+        }
+    }
+
+    // 2. Bounced light = what the patch collected minus emission and direct, per smoothing group
+    if (m_colorGroup.size() != m_flatVerts.size()) BuildColorGroups();
+    std::vector<D3DXVECTOR3> groupSum(m_colorGroupCount, D3DXVECTOR3(0, 0, 0));
+    std::vector<int> groupVerts(m_colorGroupCount, 0);
+    for (int j = 0; j < patchCount; j++)
+    {
+        const RADPATCH& patch = m_patches[j];
+        if (patch.triIndex < 0 || patch.triIndex >= (int)m_flatMatIndex.size()) continue;
+        D3DXVECTOR3 bounced = patch.accumulated - D3DXVECTOR3(patch.emission.r, patch.emission.g, patch.emission.b);
+        bounced.x = std::max(0.0f, bounced.x - patch.reflectivity.r * direct[j].x);
+        bounced.y = std::max(0.0f, bounced.y - patch.reflectivity.g * direct[j].y);
+        bounced.z = std::max(0.0f, bounced.z - patch.reflectivity.b * direct[j].z);
+        for (int i = 0; i < 3; i++)
+        {
+            int group = m_colorGroup[(size_t)patch.triIndex * 3 + i];
+            groupSum[group] += bounced;
+            groupVerts[group]++;
+        }
+    }
+    std::vector<D3DXVECTOR3> vertBounced(m_flatVerts.size(), D3DXVECTOR3(0, 0, 0));
+    for (size_t i = 0; i < m_flatVerts.size(); i++)
+    {
+        int group = m_colorGroup[i];
+        if (groupVerts[group]) vertBounced[i] = groupSum[group] / (float)groupVerts[group];
+    }
+
+    // 3. The texels, each on its own, so any thread can take any of them
+    std::vector<DWORD> pixels((size_t)atlas.GetWidth() * atlas.GetHeight(), 0xFF000000);
+    for (int y = 0; y < CLightmapAtlas::UNLIT_BLOCK; y++)
+        for (int x = 0; x < CLightmapAtlas::UNLIT_BLOCK; x++)
+        {
+            pixels[(size_t)y * atlas.GetWidth() + x] = 0xFFFFFFFF;
+            covered[(size_t)y * atlas.GetWidth() + x] = 1;
+        }
+
+    const float skyDist = 100000.0f; // Far away, as in GatherSkyLight
+    const int packet = (int)std::max(m_buildOptions.skyMinSamples, m_buildOptions.skyMaxSamples);
+    const int texelCount = (int)texels.size();
+    long long skyRays = 0, emitterRays = 0;
+    #pragma omp parallel reduction(+:skyRays, emitterRays)
+    {
+        std::vector<D3DXVECTOR3> dirs(std::max(packet, 1));
+        std::vector<float> lengths(dirs.size(), skyDist);
+        std::vector<BYTE> blocked(dirs.size());
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < texelCount; i++)
+        {
+            if (m_bStopRequested) continue;
+            const LightmapTexel& texel = texels[i];
+            const int j = patchOfTri[texel.tri];
+            if (j < 0) continue;
+            const RADPATCH& patch = m_patches[j];
+
+            D3DXVECTOR3 start = texel.pos + texel.normal * 0.005f;
+            int n = 0;
+            D3DXVECTOR3 light = SampleSky(start, texel.normal, CRadSkySampler::Hash(texel.pixel + m_buildOptions.seed * 0x9e3779b9u),
+                SKY_COLOR, dirs.data(), lengths.data(), blocked.data(), n) * SKY_INTENSITY;
+            skyRays += n;
+            n = 0;
+            light += GatherEmitterLight(start, texel.normal, emitters, n);
+            emitterRays += n;
+
+            const D3DXVECTOR3* bounced = &vertBounced[(size_t)texel.tri * 3];
+            D3DXVECTOR3 b = bounced[0] * texel.b[0] + bounced[1] * texel.b[1] + bounced[2] * texel.b[2];
+            b.x += patch.emission.r + patch.reflectivity.r * light.x;
+            b.y += patch.emission.g + patch.reflectivity.g * light.y;
+            b.z += patch.emission.b + patch.reflectivity.b * light.z;
+
+            // Reinhard, as ComputeRadiosityColors
+            pixels[texel.pixel] = D3DCOLOR_COLORVALUE(b.x / (1.0f + b.x), b.y / (1.0f + b.y), b.z / (1.0f + b.z), 1.0f);
+
+            if ((i & 1023) == 0)
+            {
+                float progress = 0.6f + 0.4f * (float)i / (float)texelCount;
+                if (progress > m_fProgress) m_fProgress = progress;
+            }
+        }
+    }
+    if (m_bStopRequested) return;
+    atlas.Dilate(pixels, covered, 2);
+
+    m_pipelineStats.lightmapTexels = texelCount;
+    m_pipelineStats.skyRays += skyRays;
+    _log(L"Lightmap bake: %d texels, %d emitter patches, %.1f sky and %.1f emitter rays per texel\n", texelCount,
+        (int)emitters.size(), texelCount ? (double)skyRays / texelCount : 0.0, texelCount ? (double)emitterRays / texelCount : 0.0);
+
+    m_lightmapWidth = atlas.GetWidth();
+    m_lightmapHeight = atlas.GetHeight();
+    m_lightmapPixels.swap(pixels);
+    m_bLightmapReady = true;
 }
 
 // Helper: Returns a random normalized vector inside the hemisphere of the normal
@@ -1305,6 +3301,11 @@ D3DXVECTOR3 CBSPlevel::GetRandomHemisphereVector(const D3DXVECTOR3& normal)
     // Thread-Local Index: Each thread keeps its own counter.
     // No locks. No waiting.
     static thread_local int idx = 0;
+    return GetRandomHemisphereVector(normal, idx);
+}
+
+D3DXVECTOR3 CBSPlevel::GetRandomHemisphereVector(const D3DXVECTOR3& normal, int& idx)
+{
     // 1. Pick a pseudo-random index using a prime number stride
     // (This acts as a fast random generator)
     idx = (idx + 12345) % 4096; // 4096 must match table size
@@ -1366,26 +3367,43 @@ BOOL CBSPlevel::IntersectTriDoubleSided(
 void CBSPlevel::ThreadWorker()
 {
     _log(L"Background Thread Started.\n");
+    auto tStart = std::chrono::steady_clock::now();
+    auto tPhase = tStart;
+    double loadMs = m_pipelineStats.loadMs;
+    m_pipelineStats = BSPPipelineStats();
+    m_pipelineStats.loadMs = loadMs;
+    m_pipelineStats.sourceTriangles = (int)m_triangles.size();
 
     // --- PHASE 1: BUILD BSP ---
     m_eState = BS_BUILDING_BSP;
     m_fProgress = 0.0f;
 
-    // Note: We cannot easily track exact progress of recursion, 
-    // so we just pulse it or set it to fixed milestones.
     //ExtractTriangles();
     if (m_bStopRequested) return;
 	bPointsDraw = true;
-    SubdivideGeometry(m_triangles);
+    bool lightmap = m_buildOptions.lightmap;
+    m_lightmapPixels.clear();
+    if (lightmap)
+    {
+        lightmap = UnwrapLightmap();
+        EndPhase("lightmap_unwrap", tPhase);
+        if (!lightmap) _log(L"No lightmap for this level, baking vertex colors instead\n");
+    }
+    if (!lightmap)
+    {
+        SubdivideGeometry(m_triangles);
+        EndPhase("subdivide", tPhase);
+    }
     if (m_bStopRequested) return;
-    m_fProgress = 0.1f; // Subdiv done
+    m_pipelineStats.subdivTriangles = (int)m_subd_triangles.size();
+    m_fProgress = 0.05f; // Subdiv done
 
-    // Re-implement BuildBSP logic here slightly to avoid calling the old void function
-    // or just call your existing internal helpers.
-    nodePool.clear();
-    nodePool.reserve(50000);
-    int rootIndex = AllocateNode();
-    BuildTree(rootIndex, m_subd_triangles);
+    // Progress follows the triangles as they settle into nodes
+    RunBuild(nodePool, m_subd_triangles, m_buildStats, 0.05f, 0.28f);
+    if (m_bStopRequested) return;
+    EndPhase("bsp_build", tPhase);
+    FlattenTree(nodePool);
+    EndPhase("flatten", tPhase);
 
     m_fProgress = 0.3f; // BSP Tree Built
     if (m_bStopRequested) return;
@@ -1394,30 +3412,1003 @@ void CBSPlevel::ThreadWorker()
     m_eState = BS_CALC_RAD;
     _log(L"Preparing Radiosity...\n");
     PrepareRadiosity();
+    m_pipelineStats.patchCount = (int)m_patches.size();
+    EndPhase("rad_prepare", tPhase);
     bPointsDraw = false;
 
-    const int maxIterations = 4096;
-    for (int i = 0; i < maxIterations; i++)
+    // The lightmap has its own resolution, refining the mesh wouldn't add to it
+    bool refine = !lightmap && m_buildOptions.subdivMode == SUBDIV_LONGEST_EDGE && m_buildOptions.gradientThreshold > 0.0f;
+    SolveRadiosity(0.3f, (refine || lightmap) ? 0.6f : 1.0f, true);
+    if (m_bStopRequested) return;
+    EndPhase("rad_solve", tPhase);
+
+    // --- PHASE 3 (lightmap bakes): FILL THE TEXELS ---
+    if (lightmap)
     {
+        BakeLightmap();
         if (m_bStopRequested) return;
-
-        if (!RunRadiosityIteration())
-            break; // Convergence reached
-
-        // Update Progress: Map iterations to 0.3 -> 1.0 range
-        float radProgress = (float)i / (float)maxIterations;
-        m_fProgress = 0.3f + (radProgress * 0.7f);
-        ApplyRadiosityToMesh();
-
+        EndPhase("lightmap_bake", tPhase);
     }
 
+    // --- PHASE 4 (optional): REFINE WHERE THE LIGHTING CHANGES FAST, BAKE AGAIN ---
+    if (refine)
+    {
+        BSPIndexedMesh mesh;
+        WeldTriangles(m_triangles, mesh);
+        std::unordered_set<uint64_t> marked;
+        RefineLongestEdge(mesh, marked, MAX_EDGE_SQ);
+        std::vector<DWORD> baked;
+        ComputeRadiosityColors(baked);
+        CaptureBakedColors(mesh, baked);
+        int splits = RefineByGradient(mesh, m_buildOptions.gradientThreshold);
+        _log(L"Gradient refinement: %d splits, %d triangles\n", splits, (int)mesh.GetTriangleCount());
+        EndPhase("refine_subdivide", tPhase);
+
+        if (splits > 0)
+        {
+            for (auto& v : mesh.verts) v.color = 0xFFFFFFFF;
+            ExpandIndexedMesh(mesh, m_subd_triangles);
+            m_pipelineStats.subdivTriangles = (int)m_subd_triangles.size();
+
+            m_eState = BS_BUILDING_BSP;
+            RunBuild(nodePool, m_subd_triangles, m_buildStats, 0.6f, 0.68f);
+            if (m_bStopRequested) return;
+            FlattenTree(nodePool);
+            EndPhase("refine_bsp_build", tPhase);
+            m_fProgress = 0.7f;
+
+            m_eState = BS_CALC_RAD;
+            PrepareRadiosity();
+            m_pipelineStats.patchCount = (int)m_patches.size();
+            SolveRadiosity(0.7f, 1.0f, true, 1);
+            if (m_bStopRequested) return;
+            EndPhase("refine_rad_solve", tPhase);
+        }
+    }
 
     // --- DONE ---
+    if (!m_checkpointBase.empty())
+    {
+        DeleteFileA(GetCheckpointPath(0).c_str());
+        DeleteFileA(GetCheckpointPath(1).c_str());
+    }
+    if (m_bUseCache)
+    {
+        // m_flatVerts gets the colors on the render thread, the cache takes them from the patches
+        std::vector<DWORD> baked;
+        ComputeRadiosityColors(baked);
+        SaveCompiledCache(&baked);
+        EndPhase("cache_save", tPhase);
+    }
+    m_pipelineStats.build = m_buildStats;
+    m_pipelineStats.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+    _log(L"Build stats: %.1f ms total, %d nodes (%d leaves, avg depth %.1f, max %d), %d patches, %d shots\n",
+        m_pipelineStats.totalMs, m_buildStats.nodeCount, m_buildStats.leafCount, m_buildStats.avgLeafDepth,
+        m_buildStats.maxDepth, m_pipelineStats.patchCount, m_pipelineStats.radIterations);
+    if (!m_statsPath.empty() && !SaveStatsJSON(m_statsPath))
+        _log(L"Could not write build stats to %hs\n", m_statsPath.c_str());
+
     m_fProgress = 1.0f;
     m_eState = BS_READY;
     _log(L"Background Build Complete.\n");
 }
 
+void CBSPlevel::EndPhase(const char* name, std::chrono::steady_clock::time_point& start)
+{
+    auto now = std::chrono::steady_clock::now();
+    BSPPhaseTime phase;
+    phase.name = name;
+    phase.ms = std::chrono::duration<double, std::milli>(now - start).count();
+    m_pipelineStats.phases.push_back(phase);
+    start = now;
+}
+
+// Sum of r+g+b unshot over all patches, plus the largest single patch (the next shooter)
+float CBSPlevel::GetUnshotEnergy(float& maxPatchEnergy) const
+{
+    if (m_buildOptions.radShooterQueue && m_bShooterQueueValid && m_shooterQueue.Size() == m_patches.size())
+    {
+        maxPatchEnergy = m_shooterQueue.TopKey();
+        return (float)m_shooterQueue.GetTotal();
+    }
+
+    double total = 0.0;
+    maxPatchEnergy = 0.0f;
+    for (const auto& patch : m_patches)
+    {
+        float energy = patch.unshot.x + patch.unshot.y + patch.unshot.z;
+        total += energy;
+        maxPatchEnergy = std::max(maxPatchEnergy, energy);
+    }
+    return (float)total;
+}
+
+// Shoots until the total unshot energy is below radConvergence of where it started (or the
+// brightest patch is below 0.001, see ShootPatches), radMaxShots at most. Progress maps onto
+// [progressFrom, progressTo], how far the total has fallen towards the target on a log scale
+// or the shot count if that's further.
+// 'background' (ThreadWorker): a matching checkpoint is resumed first, the patch state is saved
+// every radCheckpointSeconds and once more if the bake is stopped, colors go to the renderer
+// through PublishRadiosityColors. Otherwise the colors are applied to the mesh once at the end.
+// 'pass' picks the checkpoint file, so the refined bake doesn't overwrite the first one's.
+void CBSPlevel::SolveRadiosity(float progressFrom, float progressTo, bool background, int pass)
+{
+    m_pipelineStats.radSolver = GetRadiositySolverName(m_buildOptions.radSolver);
+    m_lastPublish = std::chrono::steady_clock::now();
+    m_shotsSincePublish = 0;
+    if (m_buildOptions.radSolver == RAD_HIERARCHICAL)
+    {
+        SolveHierarchical(progressFrom, progressTo, background);
+        return;
+    }
+
+    const int maxShots = (int)std::max(1u, m_buildOptions.radMaxShots);
+    float maxEnergy = 0.0f;
+    float startEnergy = GetUnshotEnergy(maxEnergy);
+    int done = 0;
+    if (background && LoadRadiosityCheckpoint(pass, done, startEnergy))
+    {
+        m_pipelineStats.radResumedShots += done;
+        m_pipelineStats.radIterations += done;
+        PublishRadiosityColors(true, 0);
+    }
+    const float stopEnergy = startEnergy * std::max(0.0f, m_buildOptions.radConvergence);
+    float logRange = (stopEnergy > 0.0f && startEnergy > stopEnergy) ? logf(startEnergy / stopEnergy) : 0.0f;
+    m_pipelineStats.radConverged = false;
+
+    auto lastSave = std::chrono::steady_clock::now();
+    const double saveMs = m_buildOptions.radCheckpointSeconds * 1000.0;
+    while (done < maxShots)
+    {
+        if (m_bStopRequested)
+        {
+            if (background)
+            {
+                SaveRadiosityCheckpoint(pass, done, startEnergy);
+                PublishRadiosityColors(true, 0);
+            }
+            return;
+        }
+        float total = GetUnshotEnergy(maxEnergy);
+        if (total <= stopEnergy)
+        {
+            m_pipelineStats.radConverged = true;
+            break;
+        }
+
+        int shots = ShootPatches(std::min((int)m_buildOptions.radShootBatch, maxShots - done));
+        if (shots == 0)
+        {
+            m_pipelineStats.radConverged = true; // Nothing left above the per-patch floor
+            break;
+        }
+        done += shots;
+
+        total = GetUnshotEnergy(maxEnergy);
+        m_pipelineStats.radEnergy.push_back(total);
+        m_pipelineStats.radIterations += shots;
+
+        float radProgress = (float)done / (float)maxShots;
+        if (logRange > 0.0f && total > 0.0f)
+            radProgress = std::max(radProgress, std::min(1.0f, logf(startEnergy / std::max(total, stopEnergy)) / logRange));
+        // Bounces can lift the total for a while, don't move the bar backwards
+        float progress = progressFrom + (radProgress * (progressTo - progressFrom));
+        if (progress > m_fProgress) m_fProgress = progress;
+        if (background) PublishRadiosityColors(false, shots);
+
+        if (background && saveMs > 0.0 &&
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lastSave).count() >= saveMs)
+        {
+            SaveRadiosityCheckpoint(pass, done, startEnergy);
+            lastSave = std::chrono::steady_clock::now();
+        }
+    }
+    if (background)
+        PublishRadiosityColors(true, 0);
+    else
+        ApplyRadiosityToMesh();
+    float total = GetUnshotEnergy(maxEnergy);
+    _log(L"Progressive radiosity: %d shots (%d resumed), unshot %.4f of %.4f, %hs\n", done,
+        m_pipelineStats.radResumedShots, total, startEnergy,
+        m_pipelineStats.radConverged ? "converged" : "stopped at radMaxShots");
+}
+
+// Patch geometry the checkpoint belongs to. The cache key covers the files and settings,
+// this catches a refined mesh that came out different from the checkpointed one.
+uint64_t CBSPlevel::GetPatchKey() const
+{
+    FNV1aHash hash;
+    for (const RADPATCH& patch : m_patches)
+    {
+        hash.AddValue(patch.center);
+        hash.AddValue(patch.normal);
+        hash.AddValue(patch.area);
+        hash.AddValue(patch.triIndex);
+    }
+    return hash.value;
+}
+
+std::string CBSPlevel::GetCheckpointPath(int pass) const
+{
+    if (m_checkpointBase.empty()) return std::string();
+    return m_checkpointBase + (pass == 0 ? ".radck" : ".refine.radck");
+}
+
+// Same temp file and rename as the compiled cache, a crash mid-write keeps the last checkpoint
+BOOL CBSPlevel::SaveRadiosityCheckpoint(int pass, int shots, float startEnergy)
+{
+    const std::string path = GetCheckpointPath(pass);
+    if (path.empty() || m_patches.empty()) return FALSE;
+    auto t0 = std::chrono::steady_clock::now();
+
+    RadCheckpointHeader header = {};
+    memcpy(header.magic, RADCHECKPOINT_MAGIC, 4);
+    header.version = RADCHECKPOINT_VERSION;
+    header.key = GetCacheKey();
+    header.patchKey = GetPatchKey();
+    header.patchCount = (UINT)m_patches.size();
+    header.shots = shots;
+    header.startEnergy = startEnergy;
+
+    std::vector<RadCheckpointPatch> state(m_patches.size());
+    for (size_t i = 0; i < m_patches.size(); i++)
+    {
+        state[i].accumulated = m_patches[i].accumulated;
+        state[i].unshot = m_patches[i].unshot;
+    }
+
+    std::string tempPath = path + ".tmp";
+    FILE* f = fopen(tempPath.c_str(), "wb");
+    if (!f)
+    {
+        _log(L"Could not write radiosity checkpoint %S\n", tempPath.c_str());
+        return FALSE;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(state.data(), sizeof(RadCheckpointPatch), state.size(), f) == state.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || !MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        _log(L"Could not write radiosity checkpoint %S\n", path.c_str());
+        DeleteFileA(tempPath.c_str());
+        return FALSE;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    _log(L"Saved radiosity checkpoint %S: %d shots, %d patches in %.1f ms\n", path.c_str(),
+        shots, (int)m_patches.size(), ms);
+    return TRUE;
+}
+
+// Restores accumulated/unshot from a checkpoint of the same level, settings and patches
+BOOL CBSPlevel::LoadRadiosityCheckpoint(int pass, int& shots, float& startEnergy)
+{
+    const std::string path = GetCheckpointPath(pass);
+    if (path.empty()) return FALSE;
+    CMappedFile file;
+    if (!file.Open(path)) return FALSE;
+
+    if (file.GetSize() < sizeof(RadCheckpointHeader)) return FALSE;
+    const RadCheckpointHeader* header = (const RadCheckpointHeader*)file.GetData();
+    if (memcmp(header->magic, RADCHECKPOINT_MAGIC, 4) != 0 || header->version != RADCHECKPOINT_VERSION ||
+        header->key != GetCacheKey())
+    {
+        _log(L"Radiosity checkpoint %S is from another build, ignored\n", path.c_str());
+        return FALSE;
+    }
+    // Not an error, the refined mesh came out different this time
+    if (header->patchCount != m_patches.size() || header->patchKey != GetPatchKey()) return FALSE;
+    if ((file.GetSize() - sizeof(RadCheckpointHeader)) / sizeof(RadCheckpointPatch) < header->patchCount)
+    {
+        _log(L"Radiosity checkpoint %S is damaged, ignored\n", path.c_str());
+        return FALSE;
+    }
+
+    const RadCheckpointPatch* state = (const RadCheckpointPatch*)(file.GetData() + sizeof(RadCheckpointHeader));
+    for (size_t i = 0; i < m_patches.size(); i++)
+    {
+        m_patches[i].accumulated = state[i].accumulated;
+        m_patches[i].unshot = state[i].unshot;
+    }
+    m_bShooterQueueValid = false;
+    shots = header->shots;
+    startEnergy = header->startEnergy;
+    _log(L"Resuming radiosity from %S: %d shots done\n", path.c_str(), shots);
+    return TRUE;
+}
+
+void CBSPlevel::StopBackgroundBuild()
+{
+    m_bStopRequested = true;
+    if (m_workerThread.joinable())
+        m_workerThread.join();
+    if (m_eState != BS_READY) m_eState = BS_IDLE;
+}
+
+// Hierarchical solve over the patches PrepareRadiosity made (sky already in).
+// Progress follows the per-sweep change on a log scale, down to RAD_HR_TOLERANCE.
+void CBSPlevel::SolveHierarchical(float progressFrom, float progressTo, bool background)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    CRadiosityHierarchy hierarchy;
+    hierarchy.Build(m_patches, m_flatVerts);
+
+    auto formFactor = [this](const RADPATCH& src, const RADPATCH& dest) { return CalculateFormFactor(src, dest); };
+    auto visible = [this](const D3DXVECTOR3& from, const D3DXVECTOR3& to)
+        {
+            D3DXVECTOR3 d = to - from;
+            float len = D3DXVec3Length(&d);
+            return len <= 0.0f || !RayCastAny(from, d / len, len);
+        };
+
+    const float stopChange = RAD_HR_TOLERANCE * hierarchy.GetSourceFlux();
+    float firstChange = 0.0f;
+    int sweeps = 0;
+    for (; sweeps < RAD_HR_MAX_SWEEPS; sweeps++)
+    {
+        if (m_bStopRequested)
+        {
+            if (background) PublishRadiosityColors(true, 0);
+            return;
+        }
+
+        float change = hierarchy.Iterate(m_patches, m_buildOptions.hierarchicalError, formFactor, visible);
+        m_pipelineStats.radEnergy.push_back(change);
+        m_pipelineStats.radIterations++;
+        hierarchy.Apply(m_patches);
+        m_bShooterQueueValid = false;
+        if (background) PublishRadiosityColors(false, 1);
+
+        if (sweeps == 0) firstChange = change;
+        float radProgress = (float)(sweeps + 1) / (float)RAD_HR_MAX_SWEEPS;
+        if (firstChange > stopChange && change > 0.0f)
+            radProgress = std::max(radProgress, std::min(1.0f, logf(firstChange / std::max(change, stopChange)) / logf(firstChange / stopChange)));
+        float progress = progressFrom + (radProgress * (progressTo - progressFrom));
+        if (progress > m_fProgress) m_fProgress = progress;
+
+        // Converged once the links stopped changing and a sweep barely moves anything
+        if (hierarchy.GetNewLinks() == 0 && change <= stopChange) { sweeps++; break; }
+    }
+
+    if (background)
+        PublishRadiosityColors(true, 0);
+    else
+        ApplyRadiosityToMesh();
+
+    const RadHierarchyStats& hs = hierarchy.GetStats();
+    m_pipelineStats.radFormFactors += hs.formFactors;
+    m_pipelineStats.radLinks = hs.links;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    _log(L"Hierarchical radiosity: %d patches, %d clusters, %d links (%d refined), %d form factors, %d cluster rays, %d sweeps, %.1f ms\n",
+        (int)m_patches.size(), hs.clusters, hs.links, hs.refinedLinks, hs.formFactors, hs.rays, sweeps, ms);
+}
+
+// Compare* entry check. No bakes next to the worker, and the tree has to be built unless
+// 'needTree' is off, then the source triangles do.
+bool CBSPlevel::CanCompare(const char* name, bool needTree)
+{
+    if (m_eState == BS_BUILDING_BSP || m_eState == BS_CALC_RAD)
+    {
+        _log(L"%hs: build in progress, skipped\n", name);
+        return false;
+    }
+    if (needTree && m_flatNodes.empty())
+    {
+        _log(L"%hs: no level built\n", name);
+        return false;
+    }
+    if (!needTree && m_triangles.empty())
+    {
+        _log(L"%hs: no level loaded\n", name);
+        return false;
+    }
+    return true;
+}
+
+BSPComparisonBake CBSPlevel::RunComparisonBake(const BSPBuildOptions& options, bool solve)
+{
+    SyncPublishedColors();
+    std::vector<DWORD> saved(m_flatVerts.size());
+    for (size_t i = 0; i < m_flatVerts.size(); i++) saved[i] = m_flatVerts[i].color;
+    BSPPipelineStats savedStats = m_pipelineStats;
+    BSPBuildOptions savedOptions = m_buildOptions;
+    float savedProgress = m_fProgress;
+
+    m_buildOptions = options;
+    m_pipelineStats = BSPPipelineStats();
+
+    // Same patches and sky every run, PrepareRadiosity reseeds from rand()
+    BSPComparisonBake bake;
+    srand(1);
+    auto t0 = std::chrono::steady_clock::now();
+    PrepareRadiosity();
+    auto t1 = std::chrono::steady_clock::now();
+    if (solve) SolveRadiosity(0.0f, 0.0f);
+    bake.prepareMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    bake.solveMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+
+    bake.stats = m_pipelineStats;
+    bake.colors.resize(m_flatVerts.size());
+    for (size_t i = 0; i < m_flatVerts.size(); i++) bake.colors[i] = m_flatVerts[i].color;
+    bake.patchLight.resize(m_patches.size());
+    for (size_t j = 0; j < m_patches.size(); j++) bake.patchLight[j] = m_patches[j].accumulated;
+
+    for (size_t i = 0; i < m_flatVerts.size(); i++) m_flatVerts[i].color = saved[i];
+    m_pipelineStats = savedStats;
+    m_buildOptions = savedOptions;
+    m_fProgress = savedProgress;
+    return bake;
+}
+
+// Per channel 0..255 differences between two bakes of the same mesh
+struct BSPColorDiff
+{
+    double mean = 0.0;
+    int    max = 0;
+    double over8 = 0.0;     // Percent of the vertices off by more than 8 in some channel
+};
+
+static BSPColorDiff DiffBakeColors(const std::vector<DWORD>& a, const std::vector<DWORD>& b)
+{
+    BSPColorDiff diff;
+    const size_t count = std::min(a.size(), b.size());
+    if (count == 0) return diff;
+    double sum = 0.0;
+    int over8 = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        int worst = 0;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            int d = abs((int)((a[i] >> shift) & 0xFF) - (int)((b[i] >> shift) & 0xFF));
+            sum += d;
+            worst = std::max(worst, d);
+        }
+        diff.max = std::max(diff.max, worst);
+        if (worst > 8) over8++;
+    }
+    diff.mean = sum / (count * 3.0);
+    diff.over8 = 100.0 * over8 / count;
+    return diff;
+}
+
+void CBSPlevel::CompareRadiositySolvers()
+{
+    if (!CanCompare("CompareRadiositySolvers")) return;
+
+    BSPComparisonBake bakes[RAD_SOLVER_COUNT];
+    for (int sv = 0; sv < RAD_SOLVER_COUNT; sv++)
+    {
+        BSPBuildOptions options = m_buildOptions;
+        options.radSolver = (eRadiositySolver)sv;
+        bakes[sv] = RunComparisonBake(options);
+        _log(L"RAD compare %hs: %d patches, prepare %.1f ms, solve %.1f ms, %lld form factors, %d iterations\n",
+            GetRadiositySolverName((eRadiositySolver)sv), (int)m_patches.size(), bakes[sv].prepareMs, bakes[sv].solveMs,
+            bakes[sv].stats.radFormFactors, bakes[sv].stats.radIterations);
+    }
+
+    BSPColorDiff diff = DiffBakeColors(bakes[RAD_PROGRESSIVE].colors, bakes[RAD_HIERARCHICAL].colors);
+    _log(L"RAD compare: mean channel difference %.2f / 255, max %d, %.1f%% of vertices off by more than 8\n",
+        diff.mean, diff.max, diff.over8);
+}
+
+void CBSPlevel::CompareShadowStructures()
+{
+    if (!CanCompare("CompareShadowStructures")) return;
+
+    // Whole bake both times, the BVH build counts towards its side
+    BSPComparisonBake bakes[2];
+    double bakeMs[2] = {};
+    for (int useBVH = 0; useBVH < 2; useBVH++)
+    {
+        BSPBuildOptions options = m_buildOptions;
+        options.shadowBVH = (useBVH != 0);
+        m_bShadowBVHValid = false;
+        bakes[useBVH] = RunComparisonBake(options);
+        bakeMs[useBVH] = bakes[useBVH].prepareMs + bakes[useBVH].solveMs;
+        _log(L"Shadow compare %hs: %hs, %d patches, %lld form factors, %d iterations, bake %.1f ms\n",
+            useBVH ? "BVH4" : "BSP", GetRadiositySolverName(options.radSolver), (int)m_patches.size(),
+            bakes[useBVH].stats.radFormFactors, bakes[useBVH].stats.radIterations, bakeMs[useBVH]);
+    }
+    m_bShadowBVHValid = false;
+
+    BSPColorDiff diff = DiffBakeColors(bakes[0].colors, bakes[1].colors);
+    _log(L"Shadow compare: BVH4 bake %.2fx the BSP's speed, mean channel difference %.2f / 255, max %d\n",
+        bakeMs[1] > 0.0 ? bakeMs[0] / bakeMs[1] : 0.0, diff.mean, diff.max);
+}
+
+void CBSPlevel::CompareFormFactors(int shooters, int refSamples)
+{
+    if (!CanCompare("CompareFormFactors")) return;
+
+    BSPBuildOptions options = m_buildOptions;
+    options.radSolver = RAD_PROGRESSIVE;
+    RunComparisonBake(options, false);
+    const int n = (int)m_patches.size();
+    shooters = std::max(1, std::min(shooters, n));
+    refSamples = std::max(1, refSamples);
+
+    // 1. Rows of evenly spaced shooters. The reference integrates both triangles with
+    // 'refSamples' random point pairs per patch pair, one visibility ray each.
+    std::vector<int> rows(shooters);
+    for (int r = 0; r < shooters; r++) rows[r] = (int)((long long)r * n / shooters);
+
+    auto random01 = [](UINT& state)
+        {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            return (state >> 8) * (1.0f / 16777216.0f);
+        };
+    auto samplePoint = [&](const RADPATCH& patch, UINT& state)
+        {
+            const OBJVertex* tri = &m_flatVerts[(size_t)patch.triIndex * 3];
+            float su = sqrtf(random01(state)), sv = random01(state);
+            float a = 1.0f - su, b = su * (1.0f - sv), c = su * sv;
+            return D3DXVECTOR3(a * tri[0].x + b * tri[1].x + c * tri[2].x,
+                a * tri[0].y + b * tri[1].y + c * tri[2].y,
+                a * tri[0].z + b * tri[1].z + c * tri[2].z);
+        };
+
+    std::vector<float> reference((size_t)shooters * n, 0.0f);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < shooters; r++)
+    {
+        const RADPATCH& src = m_patches[rows[r]];
+        if (src.triIndex < 0) continue;
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int j = 0; j < n; j++)
+        {
+            const RADPATCH& dest = m_patches[j];
+            if (j == rows[r] || dest.triIndex < 0) continue;
+            UINT state = ((UINT)rows[r] * 73856093u) ^ ((UINT)j * 19349663u) ^ 0x9E3779B9u;
+            if (state == 0) state = 1;
+            double sum = 0.0;
+            for (int k = 0; k < refSamples; k++)
+            {
+                D3DXVECTOR3 x = samplePoint(src, state);
+                D3DXVECTOR3 y = samplePoint(dest, state);
+                D3DXVECTOR3 d = y - x;
+                float distSq = D3DXVec3LengthSq(&d);
+                if (distSq <= 1e-12f) continue;
+                float dist = sqrtf(distSq);
+                D3DXVECTOR3 dir = d / dist;
+                float cosSrc = D3DXVec3Dot(&src.normal, &dir);
+                float cosDest = -D3DXVec3Dot(&dest.normal, &dir);
+                if (cosSrc <= 0.0f || cosDest <= 0.0f) continue;
+                if (dist > 0.002f && RayCastAny(x + src.normal * 0.001f, dir, dist - 0.002f)) continue;
+                // Each sample stands for 1/refSamples of the receiver, same disc term as CalculateFormFactor
+                sum += cosSrc * cosDest / (D3DX_PI * distSq + dest.area / refSamples);
+            }
+            reference[(size_t)r * n + j] = (float)(sum * dest.area / refSamples);
+        }
+    }
+    double refMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    double refTotal = 0.0;
+    for (float f : reference) refTotal += f;
+    _log(L"FF compare reference: %d shooters x %d patches, %d samples per pair, mean row sum %.3f, %.0f ms\n",
+        shooters, n, refSamples, refTotal / shooters, refMs);
+
+    std::vector<float> row(n);
+    auto logRow = [&](const char* name, const std::vector<float>& all, double ms)
+        {
+            double total = 0.0, error = 0.0;
+            for (size_t i = 0; i < all.size(); i++)
+            {
+                total += all[i];
+                error += fabs((double)all[i] - reference[i]);
+            }
+            _log(L"FF compare %hs: %.2f ms per row, mean row sum %.3f, error %.1f%% (L1 against the reference)\n",
+                name, ms / shooters, total / shooters, refTotal > 0.0 ? 100.0 * error / refTotal : 0.0);
+        };
+
+    std::vector<float> all((size_t)shooters * n);
+    const int groupCount = (n + RAD_FF_PACKET - 1) / RAD_FF_PACKET;
+    t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < shooters; r++)
+    {
+        float* out = &all[(size_t)r * n];
+        #pragma omp parallel for schedule(dynamic)
+        for (int g = 0; g < groupCount; g++)
+        {
+            const int first = g * RAD_FF_PACKET;
+            CalculateFormFactors(m_patches[rows[r]], rows[r], first, std::min((int)RAD_FF_PACKET, n - first), out + first);
+        }
+    }
+    logRow("rays", all, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+
+    static const UINT resolutions[] = { 32, 64, 128, 256 };
+    for (UINT res : resolutions)
+    {
+        CRadHemicube hemicube;
+        hemicube.SetGeometry(m_patches, m_flatVerts);
+        hemicube.SetResolution(res);
+        t0 = std::chrono::steady_clock::now();
+        for (int r = 0; r < shooters; r++)
+        {
+            const RADPATCH& src = m_patches[rows[r]];
+            hemicube.Compute(src.center + src.normal * RAD_HEMICUBE_EYE_OFFSET, src.normal, rows[r], &all[(size_t)r * n]);
+        }
+        char name[32];
+        sprintf_s(name, "hemicube %u", res);
+        logRow(name, all, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    // 2. Whole bakes, with skyStratified off the sky isn't repeatable and some difference is noise
+    BSPComparisonBake bakes[2];
+    for (int useHemicube = 0; useHemicube < 2; useHemicube++)
+    {
+        options.radHemicube = (useHemicube != 0);
+        bakes[useHemicube] = RunComparisonBake(options);
+        float maxEnergy = 0.0f;
+        float unshot = GetUnshotEnergy(maxEnergy);
+        _log(L"FF compare bake %hs: %d iterations, unshot left %.3f, %.1f ms\n", useHemicube ? "hemicube" : "rays",
+            bakes[useHemicube].stats.radIterations, unshot, bakes[useHemicube].prepareMs + bakes[useHemicube].solveMs);
+    }
+
+    BSPColorDiff diff = DiffBakeColors(bakes[0].colors, bakes[1].colors);
+    _log(L"FF compare bake: mean channel difference %.2f / 255, max %d\n", diff.mean, diff.max);
+}
+
+void CBSPlevel::CompareSkySampling(int refSamples)
+{
+    if (!CanCompare("CompareSkySampling")) return;
+
+    // The sampling options change per config below, the patches stay as prepared
+    const BSPBuildOptions savedOptions = m_buildOptions;
+    const D3DXCOLOR skyColor = SKY_COLOR;
+    RunComparisonBake(savedOptions, false);
+    const int n = (int)m_patches.size();
+    if (n == 0) return;
+
+    // 1. Reference, stratified at a fixed high count
+    m_buildOptions.skyStratified = true;
+    m_buildOptions.skyMinSamples = m_buildOptions.skyMaxSamples = (UINT)std::max(refSamples, 1);
+    std::vector<D3DXVECTOR3> reference;
+    auto t0 = std::chrono::steady_clock::now();
+    long long refRays = GatherSkyLight(skyColor, SKY_SAMPLES, reference);
+    _log(L"Sky compare reference: %d patches, %.0f rays per patch, %.0f ms\n", n, (double)refRays / n,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+
+    // 2. Errors in luminance, as a share of an open patch under a white sky (pi)
+    // Table configs use tableSamples, stratified ones the min/max/error options
+    struct Config { const char* name; bool stratified; int tableSamples; UINT minSamples, maxSamples; float maxError; };
+    const Config configs[] = {
+        { "table 64",             false, 64,  0,  0,  0.0f },
+        { "table 256",            false, 256, 0,  0,  0.0f },
+        { "stratified 16",        true,  0,   16, 16, 0.0f },
+        { "stratified 32",        true,  0,   32, 32, 0.0f },
+        { "stratified 64",        true,  0,   64, 64, 0.0f },
+        { "adaptive",             true,  0,   savedOptions.skyMinSamples, savedOptions.skyMaxSamples, savedOptions.skyMaxError },
+        { "adaptive, half error", true,  0,   savedOptions.skyMinSamples, savedOptions.skyMaxSamples * 2, savedOptions.skyMaxError * 0.5f },
+    };
+    std::vector<D3DXVECTOR3> incoming;
+    for (const Config& config : configs)
+    {
+        m_buildOptions.skyStratified = config.stratified;
+        m_buildOptions.skyMinSamples = config.minSamples;
+        m_buildOptions.skyMaxSamples = config.maxSamples;
+        m_buildOptions.skyMaxError = config.maxError;
+
+        t0 = std::chrono::steady_clock::now();
+        long long rays = GatherSkyLight(skyColor, config.tableSamples, incoming);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        double sq = 0.0, maxError = 0.0;
+        for (int j = 0; j < n; j++)
+        {
+            D3DXVECTOR3 d = incoming[j] - reference[j];
+            double e = fabs(0.2126 * d.x + 0.7152 * d.y + 0.0722 * d.z) / D3DX_PI;
+            sq += e * e;
+            maxError = std::max(maxError, e);
+        }
+        _log(L"Sky compare %hs: %.1f rays per patch, %.0f ms, RMS error %.2f%%, max %.2f%%\n",
+            config.name, (double)rays / n, ms, 100.0 * sqrt(sq / n), 100.0 * maxError);
+    }
+    m_buildOptions = savedOptions;
+}
+
+void CBSPlevel::CompareThreadCounts()
+{
+    if (!CanCompare("CompareThreadCounts")) return;
+
+    const int maxThreads = omp_get_max_threads();
+    // An odd count too, so the receiver groups fall on the threads differently
+    const int threadCounts[] = { 1, 3, std::max(4, maxThreads) };
+
+    for (int deterministic = 0; deterministic < 2; deterministic++)
+    {
+        BSPBuildOptions options = m_buildOptions;
+        options.radDeterministic = (deterministic != 0);
+        std::vector<D3DXVECTOR3> first;
+        for (int threads : threadCounts)
+        {
+            omp_set_num_threads(threads);
+            BSPComparisonBake bake = RunComparisonBake(options);
+            const std::vector<D3DXVECTOR3>& result = bake.patchLight;
+
+            FNV1aHash hash;
+            for (const D3DXVECTOR3& light : result) hash.AddValue(light);
+            if (first.empty()) first = result;
+            int differ = 0;
+            for (size_t j = 0; j < result.size() && j < first.size(); j++)
+                if (memcmp(&result[j], &first[j], sizeof(D3DXVECTOR3)) != 0) differ++;
+            _log(L"Thread compare %hs, %d threads: %d shots, %.0f ms, hash %016llx, %d of %d patches differ from 1 thread\n",
+                deterministic ? "deterministic" : "default", threads, bake.stats.radIterations, bake.prepareMs + bake.solveMs,
+                (unsigned long long)hash.value, differ, (int)result.size());
+        }
+    }
+    omp_set_num_threads(maxThreads);
+}
+
+void CBSPlevel::CompareLightmapBake()
+{
+    if (!CanCompare("CompareLightmapBake", false)) return;
+
+    // Same source and options on both, only the output differs. Gradient refinement would
+    // give the vertex color bake a second solve the lightmap never gets.
+    for (int lightmap = 0; lightmap < 2; lightmap++)
+    {
+        std::unique_ptr<CBSPlevel> level(new CBSPlevel());
+        level->m_materials = m_materials;
+        level->m_triangles = m_triangles;
+        level->m_buildOptions = m_buildOptions;
+        level->m_buildOptions.lightmap = (lightmap != 0);
+        level->m_buildOptions.gradientThreshold = 0.0f;
+        level->SetUseCache(false);
+        level->ThreadWorker();
+
+        const BSPPipelineStats& stats = level->m_pipelineStats;
+        std::string phases;
+        for (const BSPPhaseTime& phase : stats.phases)
+        {
+            char text[64];
+            snprintf(text, sizeof(text), "%s%s %.0f", phases.empty() ? "" : ", ", phase.name.c_str(), phase.ms);
+            phases += text;
+        }
+        _log(L"Lightmap compare %hs: %d source -> %d drawn triangles, %d patches, %.0f ms total (%hs)\n",
+            lightmap ? "lightmap" : "vertex colors", stats.sourceTriangles, (int)level->m_flatMatIndex.size(),
+            stats.patchCount, stats.totalMs, phases.c_str());
+        if (lightmap && stats.lightmapWidth == 0)
+            _log(L"Lightmap compare atlas: none, the lightmap run baked vertex colors\n");
+        else if (lightmap)
+            _log(L"Lightmap compare atlas: %dx%d, %d charts, %d texels\n", stats.lightmapWidth, stats.lightmapHeight,
+                stats.lightmapCharts, stats.lightmapTexels);
+    }
+}
+
+void CBSPlevel::BenchmarkShooterSelection(int shots, int syntheticPatches)
+{
+    if (m_eState == BS_BUILDING_BSP || m_eState == BS_CALC_RAD)
+    {
+        _log(L"BenchmarkShooterSelection: build in progress, skipped\n");
+        return;
+    }
+
+    // 1. Whole shots on the level. Colors aren't applied, that cost is the same for all of them.
+    if (!m_flatNodes.empty())
+    {
+        SyncPublishedColors();
+        std::vector<DWORD> saved(m_flatVerts.size());
+        for (size_t i = 0; i < m_flatVerts.size(); i++) saved[i] = m_flatVerts[i].color;
+        BSPPipelineStats savedStats = m_pipelineStats;
+        BSPBuildOptions savedOptions = m_buildOptions;
+
+        // Prepared once (the table sky isn't repeatable), every run starts from the same copy
+        PrepareRadiosity();
+        const std::vector<RADPATCH> start = m_patches;
+
+        struct Config { const char* name; bool queue; int batch; };
+        const Config configs[] = { { "scan", false, 1 }, { "queue", true, 1 }, { "queue, batch 8", true, 8 }, { "queue, batch 32", true, 32 } };
+        for (const Config& config : configs)
+        {
+            m_buildOptions.radSolver = RAD_PROGRESSIVE;
+            m_buildOptions.radShooterQueue = config.queue;
+            m_patches = start;
+            m_bShooterQueueValid = false;
+
+            int done = 0;
+            float maxEnergy = 0.0f, unshot = 0.0f;
+            auto t0 = std::chrono::steady_clock::now();
+            while (done < shots)
+            {
+                int n = ShootPatches(std::min(config.batch, shots - done));
+                if (n == 0) break;
+                done += n;
+                unshot = GetUnshotEnergy(maxEnergy); // SolveRadiosity asks after every pass
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            _log(L"Shooter bench %hs: %d patches, %d shots in %.1f ms, %.1f shots/s, unshot left %.2f\n",
+                config.name, (int)m_patches.size(), done, ms, done * 1000.0 / std::max(ms, 0.001), unshot);
+        }
+
+        for (size_t i = 0; i < m_flatVerts.size(); i++) m_flatVerts[i].color = saved[i];
+        m_pipelineStats = savedStats;
+        m_buildOptions = savedOptions;
+        m_patches = start;
+        m_bShooterQueueValid = false;
+    }
+
+    // 2. Selection alone on a large synthetic patch set: pick the brightest, zero it, raise the
+    // receivers. In a big occluded level a shot reaches a small share, in one open room most patches.
+    if (syntheticPatches <= 0) return;
+    const float receiverShares[] = { 0.02f, 0.5f };
+    for (float share : receiverShares)
+    {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> energy(0.0f, 1.0f);
+        std::uniform_int_distribution<int> pick(0, syntheticPatches - 1);
+        std::vector<float> keys(syntheticPatches);
+        for (auto& k : keys) k = energy(rng);
+        const int receivers = std::max(1, (int)(syntheticPatches * share));
+        // Same receivers for both
+        std::vector<int> received((size_t)receivers * shots);
+        for (auto& r : received) r = pick(rng);
+
+        double sum = 0.0;
+        auto t0 = std::chrono::steady_clock::now();
+        {
+            std::vector<float> scan = keys;
+            for (int s = 0; s < shots; s++)
+            {
+                int best = 0;
+                for (int i = 1; i < syntheticPatches; i++)
+                    if (scan[i] > scan[best]) best = i;
+                sum += scan[best];
+                scan[best] = 0.0f;
+                for (int r = 0; r < receivers; r++) scan[received[(size_t)s * receivers + r]] += 0.01f;
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        double check = 0.0;
+        {
+            CRadShooterQueue queue;
+            queue.Build(keys);
+            const bool dense = (size_t)receivers * 8 > (size_t)syntheticPatches;
+            for (int s = 0; s < shots; s++)
+            {
+                int best = queue.Top();
+                check += queue.TopKey();
+                queue.Update(best, 0.0f);
+                for (int r = 0; r < receivers; r++)
+                {
+                    int i = received[(size_t)s * receivers + r];
+                    if (dense) queue.SetKeyDeferred(i, queue.GetKey(i) + 0.01f);
+                    else queue.Update(i, queue.GetKey(i) + 0.01f);
+                }
+            }
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        double scanMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        double queueMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        _log(L"Shooter selection, %d patches, %.0f%% receivers: scan %.0f picks/s, queue %.0f picks/s (%.1fx)%hs\n",
+            syntheticPatches, share * 100.0f, shots * 1000.0 / std::max(scanMs, 0.001), shots * 1000.0 / std::max(queueMs, 0.001),
+            scanMs / std::max(queueMs, 0.001), fabs(sum - check) > 1e-3 * sum ? ", picks differ!" : "");
+    }
+}
+
+void CBSPlevel::BenchmarkRayCasts(int shooters)
+{
+    if (m_eState == BS_BUILDING_BSP || m_flatNodes.empty() || shooters <= 0)
+    {
+        _log(L"BenchmarkRayCasts: no level built\n");
+        return;
+    }
+
+    // Triangles stand in for patches, rays are set up like CalculateFormFactor does
+    const size_t triCount = m_flatShadowTris.size();
+    struct RaySet
+    {
+        D3DXVECTOR3 start;
+        std::vector<D3DXVECTOR3> dirs;
+        std::vector<float> lengths;
+    };
+    std::vector<RaySet> sets;
+    size_t rayCount = 0;
+    auto triFrame = [this](size_t t, D3DXVECTOR3& center, D3DXVECTOR3& normal)
+        {
+            const BSPShadowTri& tri = m_flatShadowTris[t];
+            center = tri.v0 + (tri.edge1 + tri.edge2) / 3.0f;
+            D3DXVec3Cross(&normal, &tri.edge1, &tri.edge2);
+            float len = D3DXVec3Length(&normal);
+            if (len <= 0.0f) return false;
+            normal /= len;
+            return true;
+        };
+    for (int s = 0; s < shooters; s++)
+    {
+        size_t src = (triCount * (2 * (size_t)s + 1)) / (2 * (size_t)shooters);
+        D3DXVECTOR3 srcCenter, srcNormal;
+        if (!triFrame(src, srcCenter, srcNormal)) continue;
+
+        RaySet set;
+        set.start = srcCenter + srcNormal * 0.05f;
+        for (size_t t = 0; t < triCount; t++)
+        {
+            D3DXVECTOR3 center, normal;
+            if (t == src || !triFrame(t, center, normal)) continue;
+            D3DXVECTOR3 vec = center - srcCenter;
+            float dist = D3DXVec3Length(&vec);
+            if (dist <= 0.001f) continue;
+            D3DXVECTOR3 dir = vec / dist;
+            if (D3DXVec3Dot(&srcNormal, &dir) <= 0.0f || -D3DXVec3Dot(&normal, &dir) <= 0.0f) continue;
+            set.dirs.push_back(dir);
+            set.lengths.push_back(dist - 0.001f);
+        }
+        rayCount += set.dirs.size();
+        sets.push_back(std::move(set));
+    }
+    if (rayCount == 0) return;
+
+    std::vector<BYTE> reference(rayCount), result(rayCount);
+    auto report = [&](const char* name, double ms, const std::vector<BYTE>& r)
+        {
+            size_t blocked = 0, differ = 0;
+            for (size_t i = 0; i < rayCount; i++)
+            {
+                blocked += r[i];
+                differ += (r[i] != reference[i]);
+            }
+            _log(L"Ray bench %hs: %d rays in %.1f ms, %.2f Mrays/s, %.1f%% blocked, %d differ from recursive\n",
+                name, (int)rayCount, ms, rayCount / (ms * 1000.0), 100.0 * blocked / rayCount, (int)differ);
+        };
+
+    // 1. Original recursive walk
+    auto t0 = std::chrono::steady_clock::now();
+    size_t k = 0;
+    for (const RaySet& set : sets)
+        for (size_t i = 0; i < set.dirs.size(); i++)
+            reference[k++] = CheckNodeVisibility(0, set.start, set.start + set.dirs[i] * set.lengths[i]) ? 1 : 0;
+    report("recursive", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(), reference);
+
+    // 2. Iterative, one ray at a time
+    t0 = std::chrono::steady_clock::now();
+    k = 0;
+    for (const RaySet& set : sets)
+        for (size_t i = 0; i < set.dirs.size(); i++)
+            result[k++] = RayCastAny(set.start, set.dirs[i], set.lengths[i]) ? 1 : 0;
+    report("iterative", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(), result);
+    // The packets must give exactly what the scalar walk gives, lane for lane
+    const std::vector<BYTE> scalar = result;
+
+    // 3. Packets, up to the widest the CPU has
+    const eClassifyPath best = GetBestClassifyPath();
+    const eClassifyPath paths[] = { CLASSIFY_SSE, CLASSIFY_AVX };
+    for (eClassifyPath path : paths)
+    {
+        if (path > best) break;
+        t0 = std::chrono::steady_clock::now();
+        k = 0;
+        for (const RaySet& set : sets)
+        {
+            BSPRayCastPacket(m_flatNodes.data(), m_flatShadowTris.data(), set.start, set.dirs.data(), set.lengths.data(),
+                (UINT)set.dirs.size(), &result[k], path);
+            k += set.dirs.size();
+        }
+        char name[32];
+        sprintf_s(name, "packet %u (%s)", GetRayPacketWidth(path), GetClassifyPathName(path));
+        report(name, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(), result);
+
+        size_t differ = 0;
+        for (size_t i = 0; i < rayCount; i++) differ += (result[i] != scalar[i]);
+        _log(L"Ray bench %hs: %d of %d rays differ from the scalar walk\n", name, (int)differ, (int)rayCount);
+    }
+}
+
+std::string CBSPlevel::GetStatsJSON() const
+{
+    json j = m_pipelineStats;
+    j["splitter"] = GetSplitterName(m_buildOptions.splitter);
+    return j.dump(4);
+}
+
+BOOL CBSPlevel::SaveStatsJSON(const std::string& filename) const
+{
+    std::ofstream outFile(filename.c_str());
+    if (!outFile.is_open()) return FALSE;
+    outFile << GetStatsJSON();
+    return outFile.good() ? TRUE : FALSE;
+}
+
 void CBSPlevel::InitPhysics(btDynamicsWorld* dynamicsWorld)
 {
 	m_pdworld = dynamicsWorld;
@@ -1456,6 +4447,7 @@ void CBSPlevel::CleanupPhysics()
         m_pdworld->removeCollisionObject(m_pLevelObject);
         delete m_pLevelObject;
     }
+    m_pLevelObject = nullptr;
     SAFE_DELETE( m_pCollisionShape);
     SAFE_DELETE( m_pTriangleMesh);
 }
\ No newline at end of file
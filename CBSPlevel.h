@@ -2,7 +2,18 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <future>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <cfloat>
 #include <omp.h>
+#include "BSPClassifier.h"
+#include "BSPCache.h"
+#include "BSPArena.h"
+#include "RadiosityShooterQueue.h"
+#include "BSPRayPacket.h"
+#include "RadiosityColorBuffer.h"
 
 struct SmoothKey
 {
@@ -124,13 +135,12 @@ inline D3DXCOLOR GetRandomColor(int index)
 
 // Fast "Shadow Ray" Intersection (Möller–Trumbore)
 // Returns TRUE if we hit something strictly within range [0, maxDist]
-inline bool IntersectTriangleShadow(
+// This version takes precomputed edges (v1 - v0, v2 - v0)
+inline bool IntersectTriangleShadowEdges(
     const D3DXVECTOR3& orig, const D3DXVECTOR3& dir, float maxDist,
-    const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2)
+    const D3DXVECTOR3& v0, const D3DXVECTOR3& edge1, const D3DXVECTOR3& edge2)
 {
     const float EPSILON = 0.00001f;
-    D3DXVECTOR3 edge1 = v1 - v0;
-    D3DXVECTOR3 edge2 = v2 - v0;
     D3DXVECTOR3 pvec;
     D3DXVec3Cross(&pvec, &dir, &edge2);
     float det = D3DXVec3Dot(&edge1, &pvec);
@@ -154,6 +164,13 @@ inline bool IntersectTriangleShadow(
     return (t > EPSILON && t < maxDist);
 }
 
+inline bool IntersectTriangleShadow(
+    const D3DXVECTOR3& orig, const D3DXVECTOR3& dir, float maxDist,
+    const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2)
+{
+    return IntersectTriangleShadowEdges(orig, dir, maxDist, v0, v1 - v0, v2 - v0);
+}
+
 enum eBuildState
 {
     BS_IDLE,
@@ -169,6 +186,177 @@ enum eSide
     S_COPLANAR,
     S_SPLIT
 };
+
+// How ChooseSplitter picks its candidate planes
+enum eSplitterStrategy
+{
+    SPLIT_EXHAUSTIVE,   // Every triangle is a candidate, O(N^2) per node (original behaviour)
+    SPLIT_SAMPLED,      // Stratified random sample of 'candidateBudget' triangles
+    SPLIT_AXIS_FIRST,   // Axis-aligned planes first, remaining budget filled by sampling
+    SPLIT_COUNT
+};
+
+inline const char* GetSplitterName(eSplitterStrategy s)
+{
+    switch (s)
+    {
+    case SPLIT_EXHAUSTIVE: return "exhaustive";
+    case SPLIT_SAMPLED:    return "sampled";
+    case SPLIT_AXIS_FIRST: return "axis-first";
+    default:               return "unknown";
+    }
+}
+
+// How SubdivideGeometry breaks up long triangles before the build
+enum eSubdivMode
+{
+    SUBDIV_UNIFORM,         // 4-way split of any triangle with a long edge (original behaviour)
+    SUBDIV_LONGEST_EDGE     // Bisect the longest edge only, welded indexed mesh, no T-junctions
+};
+
+// How SolveRadiosity distributes the light
+enum eRadiositySolver
+{
+    RAD_PROGRESSIVE,        // Brightest patch shoots to every other patch (original behaviour)
+    RAD_HIERARCHICAL,       // Cluster hierarchy, links refined down to an error bound (CRadiosityHierarchy)
+    RAD_SOLVER_COUNT
+};
+
+inline const char* GetRadiositySolverName(eRadiositySolver s)
+{
+    switch (s)
+    {
+    case RAD_PROGRESSIVE:  return "progressive";
+    case RAD_HIERARCHICAL: return "hierarchical";
+    default:               return "unknown";
+    }
+}
+
+struct BSPBuildOptions
+{
+    eSplitterStrategy splitter = SPLIT_EXHAUSTIVE;
+    UINT   candidateBudget = 32;    // Max planes tested per node (sampled strategies)
+    // Cost = splitWeight * splits + balanceWeight * |front - back|
+    float  splitWeight = 8.0f;
+    float  balanceWeight = 1.0f;
+    UINT   seed = 1337;             // Sampling is seeded per node, so builds are repeatable
+    UINT   leafSize = 10;           // Nodes with this many triangles or less become leaves
+    size_t parallelCutoff = 2048;   // Subtrees smaller than this on either side are built serially
+    eClassifyPath classifyPath = CLASSIFY_AUTO; // SIMD kernel for the plane tests
+    eClassifyPath rayPath = CLASSIFY_AUTO;      // Packet width of the shadow rays, SCALAR = one at a time
+    bool   shadowBVH = false;       // Shadow rays through a BVH4 over the flat triangles instead of the BSP
+    eSubdivMode subdivMode = SUBDIV_UNIFORM;
+    // Longest-edge mode only: > 0 runs a second bake after splitting triangles whose
+    // vertex luminance differs by more than this (0..1), down to MIN_EDGE_LENGTH
+    float  gradientThreshold = 0.0f;
+    eRadiositySolver radSolver = RAD_PROGRESSIVE;
+    // Progressive only: pick shooters from an indexed max-heap instead of scanning every patch
+    bool   radShooterQueue = true;
+    // Progressive only: brightest patches shot together in one parallel pass (1..RAD_MAX_SHOOT_BATCH)
+    UINT   radShootBatch = 1;
+    // Progressive only: done once the total unshot energy is below this share of where it
+    // started (sky included), 0 = until no patch has energy left. radMaxShots is a safety
+    // net for levels that never settle (reflectivity 1 in a closed room).
+    float  radConvergence = 0.001f;
+    UINT   radMaxShots = 65536;
+    // Progressive only: background bakes save the patch state this often (0 = only when stopped)
+    float  radCheckpointSeconds = 60.0f;
+    // Bit-identical bakes on any number of threads: the random sky table is drawn from 'seed'
+    // and every patch walks it from its own start, receivers reach the shooter queue in patch order
+    bool   radDeterministic = false;
+    // Background bakes hand the vertex colors to the renderer every radPublishMs and/or every
+    // radPublishShots shots (sweeps for hierarchical), 0 turns a trigger off. The final colors always go out.
+    float  radPublishMs = 100.0f;
+    UINT   radPublishShots = 0;
+    // Progressive only: each shooter's form factors from a software hemicube (item-ID z-buffer)
+    // instead of a point-to-point estimate and visibility ray per receiver
+    bool   radHemicube = false;
+    UINT   hemicubeResolution = 128;    // Pixels along the top face, the sides are half as high
+    // Sky light: cosine-weighted Sobol directions scrambled per patch (see RadiositySampler.h).
+    // skyMinSamples first, then the count doubles until the estimate moves less than skyMaxError
+    // (share of what an open patch under a white sky gets) or reaches skyMaxSamples.
+    // Powers of two keep every step stratified. false = SKY_SAMPLES rays from the shared random table.
+    bool   skyStratified = true;
+    UINT   skyMinSamples = 16;
+    UINT   skyMaxSamples = 64;
+    float  skyMaxError = 0.01f;
+    // Bake into a lightmap atlas instead of vertex colors. The mesh isn't subdivided, the solve
+    // runs on the source triangles (as split by the tree) and every texel then gathers the sky
+    // and the emitters itself, the bounced light comes from the patches. See BakeLightmap.
+    bool   lightmap = false;
+    float  lightmapTexelSize = 0.1f;    // World units per texel, coarser if the atlas doesn't fit
+    UINT   lightmapMaxSize = 2048;      // Atlas edge limit
+    // Hierarchical only: a link may carry at most this fraction of the level's source flux
+    // before it's split into finer links. Smaller is closer to the progressive result.
+    float  hierarchicalError = 0.0005f;
+};
+
+struct BSPBuildStats
+{
+    double buildMs = 0.0;
+    int    inputTriangles = 0;
+    int    nodeCount = 0;
+    int    leafCount = 0;
+    int    splitCount = 0;          // Triangles cut by a splitter plane
+    int    maxDepth = 0;
+    int    tempAllocs = 0;          // Heap allocations for build temporaries (arena blocks)
+    int    outputAllocs = 0;        // Heap allocations for the node pool and member lists
+    size_t arenaPeakBytes = 0;      // Summed over the build threads' arenas
+    float  avgLeafDepth = 0.0f;
+    // [0] empty leaves, [k] leaves holding 2^(k-1) .. 2^k - 1 triangles
+    std::vector<int> leafHistogram;
+};
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BSPBuildStats, buildMs, inputTriangles, nodeCount, leafCount, splitCount,
+    maxDepth, tempAllocs, outputAllocs, arenaPeakBytes, avgLeafDepth, leafHistogram)
+
+struct BSPPhaseTime
+{
+    std::string name;
+    double ms = 0.0;
+};
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BSPPhaseTime, name, ms)
+
+// Everything ThreadWorker measured on the last build, see CBSPlevel::GetStatsJSON.
+// Only read it from another thread once the level is BS_READY.
+struct BSPPipelineStats
+{
+    double loadMs = 0.0;            // LoadOBJ, main thread
+    double totalMs = 0.0;           // ThreadWorker, start to BS_READY
+    std::vector<BSPPhaseTime> phases;
+    int    sourceTriangles = 0;
+    int    subdivTriangles = 0;
+    BSPBuildStats build;            // Last tree build (the refined one if gradient refinement ran)
+    int    patchCount = 0;
+    std::string radSolver;
+    int    radIterations = 0;           // Shots (progressive) or gather sweeps (hierarchical)
+    long long radFormFactors = 0;       // Form factors evaluated, including cluster link samples
+    int    radLinks = 0;                // Hierarchical only
+    int    radResumedShots = 0;         // Progressive: shots restored from a checkpoint
+    bool   radConverged = false;        // Progressive: reached radConvergence before radMaxShots
+    int    radPublishes = 0;            // Color sets handed to the renderer
+    double radPublishMs = 0.0;          // Worker time spent computing them
+    long long skyRays = 0;              // Rays cast for the sky light, refinement pass included
+    int    lightmapWidth = 0;           // Lightmap bakes: atlas size, charts and texels on the level
+    int    lightmapHeight = 0;
+    int    lightmapCharts = 0;
+    int    lightmapTexels = 0;
+    // Progressive: total unshot energy (r+g+b) after each shot.
+    // Hierarchical: change in reflected flux per sweep. All passes back to back.
+    std::vector<float> radEnergy;
+};
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BSPPipelineStats, loadMs, totalMs, phases, sourceTriangles, subdivTriangles,
+    build, patchCount, radSolver, radIterations, radFormFactors, radLinks, radResumedShots, radConverged, radPublishes, radPublishMs, skyRays,
+    lightmapWidth, lightmapHeight, lightmapCharts, lightmapTexels, radEnergy)
+
+// One bake of the built level for the Compare* benchmarks, see CBSPlevel::RunComparisonBake
+struct BSPComparisonBake
+{
+    std::vector<DWORD>       colors;        // Per m_flatVerts entry
+    std::vector<D3DXVECTOR3> patchLight;    // Per patch, its accumulated radiosity
+    BSPPipelineStats         stats;         // What this bake counted
+    double prepareMs = 0.0;
+    double solveMs = 0.0;
+};
 struct BSPMaterial
 {
     D3DXCOLOR diffuse = D3DXCOLOR(0.5f,0.5f,0.5f,1.0f);  // Kd
@@ -186,15 +374,18 @@ struct OBJVertex
     float nx, ny, nz;
     DWORD color;
     float u, v;
+    float lu, lv;   // Lightmap atlas, lightmap bakes only
     OBJVertex()
         {
         x = y = z = 0.0f;
         nx = ny = nz = 0.0f;
         color = 0xFFFFFFFF; // Default white
         u = v = 0.0f;
+        lu = lv = 0.0f;
 	    }
 };
 #define FVF_OBJVERTEX (D3DFVF_XYZ | D3DFVF_NORMAL | D3DFVF_DIFFUSE | D3DFVF_TEX0)
+#define FVF_OBJVERTEX_LIGHTMAP (D3DFVF_XYZ | D3DFVF_NORMAL | D3DFVF_DIFFUSE | D3DFVF_TEX2)
 
 //struct BSPVertex {
 //    float x, y, z;
@@ -205,6 +396,7 @@ struct BSPTriangle
 {
     OBJVertex v[3]; // The 3 corners of the triangle
     int matIndex;
+    int objectId = -1; // OBJ shape it came from, used by incremental rebuilds
     // Helper: Compute the plane defined by this triangle
     D3DXPLANE GetPlane() const 
     {
@@ -217,7 +409,21 @@ struct BSPTriangle
         return plane;
     }
 };
+// Welded triangle mesh written by longest-edge subdivision.
+// Vertices with the same position share a posId, so edges are matched across hard normals and UV seams.
+struct BSPIndexedMesh
+{
+    std::vector<OBJVertex>   verts;
+    std::vector<UINT>        posId;     // 1 per vertex
+    std::vector<D3DXVECTOR3> positions; // 1 per posId
+    std::vector<UINT>        indices;   // 3 per triangle
+    std::vector<int>         matIndex;  // 1 per triangle
+    std::vector<int>         objectId;  // 1 per triangle
+
+    UINT GetTriangleCount() const { return (UINT)matIndex.size(); }
+};
 // Use indices instead of pointers
+// Build-time node. After the build the tree is flattened into BSPFlatNode.
 struct BSPNode 
 {
     int iFront = -1; // -1 means NULL (no child)
@@ -227,6 +433,25 @@ struct BSPNode
     std::vector<BSPTriangle> members;
     bool isLeaf = false;
 };
+// Flattened node: plain 32 byte POD, nodes stay in pre-order.
+// Its triangles are the range [firstTri, firstTri + triCount) of the flat triangle arrays.
+struct BSPFlatNode
+{
+    D3DXPLANE plane;
+    int  iFront;
+    int  iBack;
+    UINT firstTri;
+    UINT triCount : 31;
+    UINT isLeaf : 1;
+};
+static_assert(sizeof(BSPFlatNode) == 32, "BSPFlatNode should stay 32 bytes");
+// Position-only copy of a flat triangle for shadow rays, edges precomputed
+struct BSPShadowTri
+{
+    D3DXVECTOR3 v0;
+    D3DXVECTOR3 edge1; // v1 - v0
+    D3DXVECTOR3 edge2; // v2 - v0
+};
 // -----------------------------------------------------------------------
 // RADIOSITY STRUCTURES
 // -----------------------------------------------------------------------
@@ -246,8 +471,8 @@ struct RADPATCH
     D3DXVECTOR3 unshot;       // Light waiting to be shot (dB)
 
     // LINKING: Where does this patch live in the BSP Tree?
-    int nodeIndex = 0; // Index in nodePool
-    int triIndex = 0;  // Index in nodePool[nodeIndex].members vector
+    int nodeIndex = 0; // Index in m_flatNodes
+    int triIndex = 0;  // Index into the flat triangle arrays (m_flatVerts / 3)
     RADPATCH() 
     {
         center = D3DXVECTOR3(0,0,0);
@@ -263,12 +488,26 @@ struct RADPATCH
 };
 
 
+class CShadowBVH;
+class CRadHemicube;
+class CLightmapAtlas;
+
 class CBSPlevel
 {
 private:
     const float MAX_EDGE_SQ = 1.5f * 1.5f;
     const float MIN_EDGE_LENGTH_SQ = 0.75f * 0.75f;
     const int SKY_SAMPLES = 64;
+    const D3DXCOLOR SKY_COLOR = D3DXCOLOR(1.0f, 1.0f, 1.0f, 1.0f);
+    const float SKY_INTENSITY = 4.0f;
+    const float OBJ_IMPORT_SCALE = 0.01f;
+    static const int RAD_MAX_SHOOT_BATCH = 64; // Progressive: upper limit for radShootBatch
+    static const int RAD_FF_PACKET = 32;       // Receivers per CalculateFormFactors call
+    const int RAD_HR_MAX_SWEEPS = 64;    // Hierarchical: gather sweeps
+    const float RAD_HR_TOLERANCE = 0.0001f; // Hierarchical: stop when a sweep changes less than this share of the source flux
+    const float RAD_HEMICUBE_EYE_OFFSET = 0.005f; // Hemicube eye above the shooter's center, like the sky rays' start
+    const float LIGHTMAP_SPLIT = 0.25f;  // Lightmap texels: emitter pieces larger than this * distance^2 are split in four
+    const int LIGHTMAP_MAX_SPLITS = 4;   // Levels of that, 4^n pieces at most
      
     bool bPointsDraw = false;
     float ptSize = 4.0f;
@@ -280,15 +519,51 @@ private:
     std::vector<OBJVertex> mObjVertices;
     std::vector<unsigned long> mObjIndices;
     std::vector<BSPMaterial> m_materials; // Stores all loaded materials
-    // Fast & Cache Friendly
+    // Build-time tree, emptied by FlattenTree once the build is done
     std::vector<BSPNode> nodePool;
+    // Fast & Cache Friendly: flattened tree, triangles packed in traversal order
+    std::vector<BSPFlatNode>  m_flatNodes;
+    std::vector<OBJVertex>    m_flatVerts;      // 3 per triangle, drawable as-is
+    std::vector<int>          m_flatMatIndex;   // 1 per triangle
+    std::vector<int>          m_flatObjectId;   // 1 per triangle
+    std::vector<BSPShadowTri> m_flatShadowTris; // 1 per triangle
+    // Render holds this for the whole frame. The worker takes it whenever it replaces the flat
+    // arrays or copies m_flatVerts (whose colors the render thread writes).
+    std::mutex m_flatMutex;
     std::vector<BSPTriangle> m_triangles; // Store this for BSP building
     std::vector<BSPTriangle> m_triangles_temp; // Store this for BSP building
 
     std::vector<BSPTriangle> m_subd_triangles;
     std::vector<RADPATCH> m_patches;
+    // Optional any-hit structure for RayCastAny, built by PrepareRadiosity when shadowBVH is on
+    std::unique_ptr<CShadowBVH> m_shadowBVH;
+    bool m_bShadowBVHValid = false;
+    // Progressive shooter selection, rebuilt whenever the patches change outside ShootPatches()
+    CRadShooterQueue m_shooterQueue;
+    bool m_bShooterQueueValid = false;
+    std::vector<std::vector<int>> m_radReceived; // Per OpenMP thread (per receiver group when deterministic), receivers of the current pass
+    // Hemicube form factors: patch triangles taken at the first shot after PrepareRadiosity,
+    // one row of m_patches.size() per shooter of the current pass
+    std::unique_ptr<CRadHemicube> m_hemicube;
+    bool m_bHemicubeValid = false;
+    std::vector<float> m_hemicubeFF;
+    // Background bake colors: worker -> render thread, see PublishRadiosityColors / SyncPublishedColors
+    CRadColorBuffer m_colorBuffer;
+    std::vector<int> m_colorGroup;              // Smoothing group per flat vertex
+    int m_colorGroupCount = 0;
+    std::vector<ColorAccumulator> m_colorSums;  // Per group, ComputeRadiosityColors scratch
+    std::chrono::steady_clock::time_point m_lastPublish;
+    int m_shotsSincePublish = 0;
     // Optimization: Precomputed Random Directions
     std::vector<D3DXVECTOR3> m_randomDirTable;
+    std::vector<D3DXVECTOR3> m_patchSky;    // Per patch, GatherSkyLight's result from PrepareRadiosity
+    // Lightmap bakes: the worker fills m_lightmapPixels and sets m_bLightmapReady, the render
+    // thread uploads them once and draws with them instead of the vertex colors.
+    std::unique_ptr<CLightmapAtlas> m_lightmapAtlas;
+    std::vector<DWORD> m_lightmapPixels;
+    UINT m_lightmapWidth = 0, m_lightmapHeight = 0;
+    std::atomic<bool> m_bLightmapReady{ false };
+    IDirect3DTexture9* m_pLightmapTex = nullptr;
 
     // Bullet Collision Objects
     btDynamicsWorld* m_pdworld;
@@ -296,35 +571,91 @@ private:
     btBvhTriangleMeshShape* m_pCollisionShape;
     btCollisionObject* m_pLevelObject;
 
-	BOOL BuildTree(UINT nodeIndex, std::vector<BSPTriangle>& polys);
+	BOOL BuildTree(std::vector<BSPNode>& pool, UINT nodeIndex, BSPArenaVector<BSPTriangle>& polys, CBSPArena& arena);
     //void ExtractTriangles();
     eSide ClassifyTriangle(const BSPTriangle& tri, const D3DXPLANE& plane);
-    UINT ChooseSplitter(std::vector<BSPTriangle>& polys);
+    UINT ChooseSplitter(const BSPArenaVector<BSPTriangle>& polys, const BSPTriSoA& soa, CBSPArena& arena);
     void Split(const D3DXPLANE& plane, const BSPTriangle& inTri,
-        std::vector<BSPTriangle>& outFront,
-        std::vector<BSPTriangle>& outBack);
-
-    int AllocateNode();
+        BSPArenaVector<BSPTriangle>& outFront,
+        BSPArenaVector<BSPTriangle>& outBack);
+
+    void GatherSplitCandidates(const BSPArenaVector<BSPTriangle>& polys, BSPArenaVector<UINT>& out, CBSPArena& arena);
+    // One arena per build thread, handed out by AcquireArena and kept between builds
+    CBSPArena* AcquireArena();
+    void ReleaseArena(CBSPArena* arena);
+    // With a progress range, BuildTree maps the share of triangles placed so far onto it
+    void RunBuild(std::vector<BSPNode>& pool, std::vector<BSPTriangle>& polys, BSPBuildStats& stats,
+        float progressFrom = -1.0f, float progressTo = -1.0f);
+    void UpdateBuildProgress();
+    void GatherTreeStats(const std::vector<BSPNode>& pool, BSPBuildStats& stats);
+    static void GenerateSyntheticScene(int triCount, std::vector<BSPTriangle>& out);
+    int AllocateNode(std::vector<BSPNode>& pool);
+    void FlattenTree(std::vector<BSPNode>& pool);
+    void FlattenPool(std::vector<BSPNode>& pool, std::vector<BSPFlatNode>& nodes, std::vector<OBJVertex>& verts,
+        std::vector<int>& matIndex, std::vector<int>& objectId);
+    // Incremental rebuilds
+    int  FindEditRoot(const D3DXVECTOR3& boxMin, const D3DXVECTOR3& boxMax) const;
+    int  GetSubtreeEnd(int nodeIndex) const;
+    BOOL RebuildSubtree(int root, int objectId, const std::vector<BSPTriangle>& added);
+    BOOL RebuildObjectRegion(int objectId, const std::vector<BSPTriangle>& newTris);
+    int SpliceSubtree(std::vector<BSPNode>& dst, std::vector<BSPNode>& src);
     OBJVertex LerpVertex(const OBJVertex& v1, const OBJVertex& v2, float t);
-    void RenderNodeGeometry(IDirect3DDevice9* device, const BSPNode& node);
+    void RenderNodeGeometry(IDirect3DDevice9* device, const BSPFlatNode& node);
     void RenderBSP(IDirect3DDevice9* device, int nodeIndex, const D3DXVECTOR3& cameraPos, int depth, int debugMode);
     BOOL RadIteration();
     // RAD Helpers
     float CalculateArea(const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2);
     float CalculateFormFactor(const RADPATCH& src, const RADPATCH& dest);
+    void  CalculateFormFactors(const RADPATCH& src, int skip, int first, int count, float* ff);
     int   FindBrightestPatch();
     // RAD Main Functions
     void  PrepareRadiosity(); // Call this AFTER LoadOBJ
     BOOL  RunRadiosityIteration(); // Call this in a loop (e.g., 100 times)
+    int   ShootPatches(int maxShooters);
+    void  BuildShooterQueue();
     void  ApplyRadiosityToMesh(); // Bake colors to Vertex Buffer
+    void  BuildColorGroups();
+    void  ComputeRadiosityColors(std::vector<DWORD>& out);
+    void  PublishRadiosityColors(bool force, int shots);
     void SubdivideGeometry(std::vector<BSPTriangle>& tris);
+    void SubdivideUniform(std::vector<BSPTriangle>& tris);
+    void WeldTriangles(const std::vector<BSPTriangle>& tris, BSPIndexedMesh& mesh);
+    // Longest-edge bisection until no edge is marked or longer than maxEdgeSq, returns the number of splits
+    int  RefineLongestEdge(BSPIndexedMesh& mesh, std::unordered_set<uint64_t>& marked, float maxEdgeSq);
+    int  RefineByGradient(BSPIndexedMesh& mesh, float threshold);
+    void CaptureBakedColors(BSPIndexedMesh& mesh, const std::vector<DWORD>& colors);
+    void ExpandIndexedMesh(const BSPIndexedMesh& mesh, std::vector<BSPTriangle>& out);
+    void SolveRadiosity(float progressFrom, float progressTo, bool background = false, int pass = 0);
+    void SolveHierarchical(float progressFrom, float progressTo, bool background = false);
+    // Logs why not if a Compare* can't run now, see CBSPlevel.cpp
+    bool CanCompare(const char* name, bool needTree = true);
+    // PrepareRadiosity from srand(1) and SolveRadiosity with 'options', or only the prepare.
+    // The level's colors, stats, options and progress are put back, m_patches keeps the bake.
+    BSPComparisonBake RunComparisonBake(const BSPBuildOptions& options, bool solve = true);
 
     // New Helper: Recursive BSP Raycast
     bool CheckNodeVisibility(int nodeIndex, const D3DXVECTOR3& start, const D3DXVECTOR3& end);
     // Update the main function to use the tree
     bool RayCastAny(const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length);
+    // 'count' rays from one point, blocked[i] = 1 if ray i hits something (BSPRayCastPacket)
+    void RayCastPacket(const D3DXVECTOR3& start, const D3DXVECTOR3* dirs, const float* lengths, UINT count, BYTE* blocked);
+    void UpdateShadowBVH();
     void AddHemisphereLight(const D3DXCOLOR& skyColor, float intensity, int numSamples);
+    // Sky radiance times cos reaching each patch, integrated over its hemisphere (white
+    // ground-to-sky gradient, before intensity and reflectivity). Returns the rays cast.
+    long long GatherSkyLight(const D3DXCOLOR& skyColor, int numSamples, std::vector<D3DXVECTOR3>& incoming);
+    // The same for one point, stratified and adaptive as set in the options.
+    // dirs / lengths / blocked hold skyMaxSamples, lengths already set far.
+    D3DXVECTOR3 SampleSky(const D3DXVECTOR3& start, const D3DXVECTOR3& normal, uint32_t seed, const D3DXCOLOR& skyColor,
+        D3DXVECTOR3* dirs, float* lengths, BYTE* blocked, int& rays);
+    // Lightmap bakes: charts m_subd_triangles, then fills the texels from the solved patches
+    bool UnwrapLightmap();
+    void BakeLightmap();
+    D3DXVECTOR3 GatherEmitterLight(const D3DXVECTOR3& pos, const D3DXVECTOR3& normal, const std::vector<int>& emitters, int& rays);
+    void CreateLightmapTexture(IDirect3DDevice9* device);
     D3DXVECTOR3 GetRandomHemisphereVector(const D3DXVECTOR3& normal);
+    // The same from a caller-owned position in m_randomDirTable
+    D3DXVECTOR3 GetRandomHemisphereVector(const D3DXVECTOR3& normal, int& idx);
     BOOL IntersectTriDoubleSided(
         const D3DXVECTOR3& orig, const D3DXVECTOR3& dir,
         const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2,
@@ -335,8 +666,47 @@ private:
     std::atomic<eBuildState> m_eState;
     std::atomic<float> m_fProgress; // 0.0f to 1.0f
     std::atomic<bool> m_bStopRequested;
+    // Parallel build: number of subtree tasks currently running
+    std::atomic<int> m_iActiveTasks;
+    std::atomic<int> m_iSplitCount;
+    std::atomic<int> m_iOutputAllocs;  // Heap allocations for the tree itself (node pool, member lists)
+    // Build progress: triangles in a leaf or node already, triangles still in lists waiting for a node
+    std::atomic<int> m_iTrisPlaced;
+    std::atomic<int> m_iTrisPending;
+    float m_buildProgressFrom = -1.0f;
+    float m_buildProgressTo = -1.0f;
+    BSPPipelineStats m_pipelineStats;
+    std::string m_statsPath;
+    std::vector<std::unique_ptr<CBSPArena>> m_buildArenas;
+    std::vector<CBSPArena*> m_freeArenas;
+    std::mutex m_arenaMutex;
+    bool m_bParallelBuild = true;
+    BSPBuildOptions m_buildOptions;
+    BSPBuildStats   m_buildStats;
+    // Compiled cache (.bspc next to the OBJ)
+    bool        m_bUseCache = true;
+    std::string m_cachePath;
+    uint64_t    m_sourceHash = 0; // OBJ + MTL contents
+    bool        m_bStreamingLoad = true;
+    BOOL LoadOBJStreaming(const std::string& filename, std::vector<BSPMaterial>& outMaterials, std::vector<BSPTriangle>& outTris);
+    BOOL LoadOBJTinyObj(const std::string& filename, std::vector<BSPMaterial>& outMaterials, std::vector<BSPTriangle>& outTris);
+    BOOL HashSourceFiles(const std::string& filename, uint64_t& outHash);
+    uint64_t GetCacheKey() const;
+    BOOL LoadCompiledCache(btDynamicsWorld* dynamicsWorld);
+    BOOL SaveCompiledCache(const std::vector<DWORD>* colors = nullptr);
+    void RebuildShadowTris();
+    void UpdateShadowTris(size_t first, size_t count);
     // Helper function that runs inside the new thread
     void ThreadWorker();
+    void EndPhase(const char* name, std::chrono::steady_clock::time_point& start);
+    float GetUnshotEnergy(float& maxPatchEnergy) const;
+    // Progressive bake checkpoints next to the OBJ, see RadiosityCheckpoint.h. 'pass' 0 is the
+    // first bake (.radck), 1 the one after gradient refinement (.refine.radck).
+    std::string m_checkpointBase;
+    std::string GetCheckpointPath(int pass) const;
+    uint64_t GetPatchKey() const;
+    BOOL SaveRadiosityCheckpoint(int pass, int shots, float startEnergy);
+    BOOL LoadRadiosityCheckpoint(int pass, int& shots, float& startEnergy);
 
 public:
     CBSPlevel();
@@ -346,10 +716,69 @@ public:
 	void BuildBSP();
     void BuildRAD();
     void StartBackgroundBuild();
+    // Stops the worker and waits for it. A progressive bake writes a checkpoint first,
+    // the next StartBackgroundBuild of the same level picks up from it.
+    void StopBackgroundBuild();
+    // Copies the colors a background bake published into m_flatVerts. Render() does this every
+    // frame, call it yourself when reading vertex colors without rendering (headless bakes).
+    void SyncPublishedColors();
 
     // Check this in your Main Loop to draw a progress bar
     float GetProgress() const { return m_fProgress; }
     eBuildState GetState() const { return m_eState; }
+    // Serial and parallel builds produce the same nodePool (BenchmarkSplitters checks), this only changes speed
+    void SetParallelBuild(bool enable) { m_bParallelBuild = enable; }
+    void SetBuildOptions(const BSPBuildOptions& options) { m_buildOptions = options; }
+    const BSPBuildOptions& GetBuildOptions() const { return m_buildOptions; }
+    const BSPBuildStats& GetBuildStats() const { return m_buildStats; }
+    const BSPPipelineStats& GetPipelineStats() const { return m_pipelineStats; }
+    std::string GetStatsJSON() const;
+    BOOL SaveStatsJSON(const std::string& filename) const;
+    // ThreadWorker writes the stats JSON here when the build finishes (empty = off)
+    void SetStatsOutput(const std::string& filename) { m_statsPath = filename; }
+    // Memory mapped multithreaded OBJ parser (default) or the original tinyobj path
+    void SetStreamingLoad(bool enable) { m_bStreamingLoad = enable; }
+    // Loads 'filename' with both parsers and logs MB/s and triangles/s, level state is untouched
+    void BenchmarkOBJLoad(const std::string& filename, int runs = 3);
+    // When enabled (default) LoadOBJ reuses a matching .bspc and skips straight to BS_READY
+    void SetUseCache(bool enable) { m_bUseCache = enable; }
+    // Builds the loaded level and a synthetic scene with every splitter strategy and logs the results.
+    // Parallel builds are also redone serially and the two node pools compared.
+    void BenchmarkSplitters(int syntheticTriangles = 1000000);
+
+    // Editor: replaces one object's triangles (objectId = OBJ shape index) and rebuilds
+    // only the subtrees whose half-spaces touch the old or new bounds.
+    // Triangles are in level space and get subdivided like a full build.
+    // Radiosity patches are dropped, untouched triangles keep their baked colors.
+    BOOL ReplaceObject(int objectId, const std::vector<BSPTriangle>& newTris);
+    BOOL TranslateObject(int objectId, const D3DXVECTOR3& delta);
+    // Times single object moves against full rebuilds on a synthetic scene
+    void BenchmarkIncrementalEdit(int syntheticTriangles = 200000, int edits = 16);
+    // Bakes the built level with both radiosity solvers and logs time, form factor
+    // counts and how far the vertex colors are apart. The level's colors are restored.
+    void CompareRadiositySolvers();
+    // Progressive shots per second on the built level with the linear scan, the shooter
+    // queue and batched shooting, plus selection alone on 'syntheticPatches' random patches
+    void BenchmarkShooterSelection(int shots = 512, int syntheticPatches = 500000);
+    // Shooter to receiver shadow rays on the built level, single threaded:
+    // recursive walk, iterative walk and the packet widths the CPU supports
+    void BenchmarkRayCasts(int shooters = 64);
+    // Full bake (PrepareRadiosity + SolveRadiosity) with shadow rays through the BSP and
+    // through the BVH, logs both times and the color difference. The level's colors are restored.
+    void CompareShadowStructures();
+    // Form factor rows of a few shooters from the rays and from hemicubes of several sizes,
+    // against an area-to-area Monte Carlo reference, then a full bake each way.
+    // Progressive solver, the level's colors are restored.
+    void CompareFormFactors(int shooters = 16, int refSamples = 64);
+    // Sky light of every patch from the random table and from stratified sampling at fixed and
+    // adaptive counts, rays cast and RMS error against a 'refSamples' stratified reference
+    void CompareSkySampling(int refSamples = 4096);
+    // Solves the built level with 1 thread and with all of them, deterministic and not, and
+    // logs how many patches differ in any bit
+    void CompareThreadCounts();
+    // Builds and bakes the level's source triangles twice on temporary levels, subdivided with
+    // vertex colors and coarse with a lightmap, and logs triangle counts and phase times
+    void CompareLightmapBake();
 
     // Call this after the BSP and Radiosity are baked
     void InitPhysics(btDynamicsWorld* dynamicsWorld);
@@ -1,6 +1,15 @@
 #include "CQ3BSP.h"
 #include "D3DRender.h"
 #include "BezierTessellator.h"
+#include "Logger.h"
+#include <chrono>
+#include <psapi.h>
+#include <cfloat>
+#include <omp.h>
+#include <memory>
+
+static const UINT IB_RESTART = ~0u;   // m_ibUsed: the next upload discards
+
 // ----------------------------------------------------------------------------
 // ----------------------------------------------------------------------------
 CQ3BSP::CQ3BSP(void)
@@ -9,12 +18,17 @@ CQ3BSP::CQ3BSP(void)
 	m_pDevice = NULL;
 	m_pVB_World = NULL;
 	m_pIB_World = NULL;
-	m_pVB_Patch = NULL;
-	m_pIB_Patch = NULL;
 	m_pdworld = NULL;
 	m_pCollisionShape = NULL;
 	m_pTriangleMesh = NULL;
 	m_pLevelObject = NULL;
+	m_bCulling = true;
+	m_bMappedLoad = true;
+	m_bPatchLod = true;
+	m_bRecordPath = false;
+	m_vbVerts = m_ibIndexes = 0;
+	m_ibUsed = IB_RESTART;
+	m_tessLevel = 8; // 10 is decent quality.
 	Clear();
 	OnLostDevice();
 }
@@ -38,29 +52,40 @@ void CQ3BSP::Clear()
 	m_models.clear();
 	m_leafs.clear();
 	m_nodes.clear();
+	m_leafSurfaces.clear();
+	m_visData.clear();
 	m_planes.clear();
 	m_lightBytes.clear();
-	m_patchVertices.clear();
-	m_patchIndices.clear();
-	m_patchRenderInfos.clear();
+	// The generated data can be bigger than the file, give it back instead of keeping the capacity
+	std::vector<Q3BSPVertex>().swap(m_patchVertices);
+	std::vector<int>().swap(m_patchIndices);
+	std::vector<PatchRenderInfo>().swap(m_patchRenderInfos);
+	std::vector<int>().swap(m_surfacePatch);
+	std::vector<int>().swap(m_patchLevelU);
+	std::vector<int>().swap(m_patchLevelV);
+	std::vector<Q3BSPVertex>().swap(m_spareVertices);
+	std::vector<int>().swap(m_spareIndices);
+	std::vector<int>().swap(m_allSurfaces);
+	m_patchLod.Clear();
+	m_batches.Clear();
+	std::vector<UINT>().swap(m_batchFirst);
+	m_ibUsed = IB_RESTART;
+	m_vis.Clear();
+	m_file.Close();
 }
 
 // ----------------------------------------------------------------------------
 // LOAD ENTITIES (Parses the ASCII buffer)
 // ----------------------------------------------------------------------------
-BOOL CQ3BSP::LoadEntities(FILE* f, const dheader_t& h)
+BOOL CQ3BSP::LoadEntities(const char* text, int fileLen)
 {
 	m_entities.clear();
 
-	int fileLen = h.lumps[LUMP_ENTITIES].filelen;
-	int fileOfs = h.lumps[LUMP_ENTITIES].fileofs;
-
 	if (fileLen == 0) return true; // No entities is technically valid
 
-	// 1. Read the raw string data
+	// 1. Copy the raw string data, the lump isn't terminated
 	std::vector<char> buffer(fileLen + 1); // +1 for null terminator
-	if (fseek(f, fileOfs, SEEK_SET) != 0) return FALSE;
-	if (fread(buffer.data(), 1, fileLen, f) != (size_t)fileLen) return FALSE;
+	memcpy(buffer.data(), text, fileLen);
 	buffer[fileLen] = '\0'; // Ensure null termination
 
 	// 2. Parse the buffer
@@ -135,25 +160,42 @@ BOOL CQ3BSP::LoadEntities(FILE* f, const dheader_t& h)
 	return TRUE;
 }
 
-// Template to safely load a lump into a vector
+// Template to safely load a lump into its own copy
 template <typename T>
-BOOL CQ3BSP::LoadLump(FILE* f, const dheader_t& h, int lumpIndex, std::vector<T>& destVector)
+BOOL CQ3BSP::LoadLump(FILE* f, const dheader_t& h, int lumpIndex, Q3Lump<T>& dest)
 {
 	int fileLen = h.lumps[lumpIndex].filelen;
 	int fileOfs = h.lumps[lumpIndex].fileofs;
 
-	if (fileLen % sizeof(T) != 0) return false; // Corrupt data size
+	if (fileLen < 0 || fileLen % sizeof(T) != 0)
+	{
+		_log(L"Q3 BSP: lump %d is damaged\n", lumpIndex);
+		return false; // Corrupt data size
+	}
 
 	int numElements = fileLen / sizeof(T);
-	destVector.resize(numElements);
-
 	if (numElements > 0)
 	{
 		fseek(f, fileOfs, SEEK_SET);
-		size_t read = fread(destVector.data(), sizeof(T), numElements, f);
+		size_t read = fread(dest.Alloc(numElements), sizeof(T), numElements, f);
 
-		if (read != numElements) 
+		if (read != numElements)
+		{
+			_log(L"Q3 BSP: lump %d is damaged\n", lumpIndex);
 			return false; // Read error
+		}
+	}
+	return TRUE;
+}
+
+// Same, in place in the mapped file
+template <typename T>
+BOOL CQ3BSP::MapLump(const dheader_t& h, int lumpIndex, Q3Lump<T>& dest)
+{
+	if (!dest.Map(m_file.GetData(), m_file.GetSize(), h.lumps[lumpIndex]))
+	{
+		_log(L"Q3 BSP: lump %d is damaged\n", lumpIndex);
+		return FALSE;
 	}
 	return TRUE;
 }
@@ -201,9 +243,144 @@ int CQ3BSP::CopyLump(dheader_t header, int lump, void* dest, int size)
 // ----------------------------------------------------------------------------
 BOOL CQ3BSP::Load(btDynamicsWorld* dynamicsWorld, const std::wstring & filename)
 {
-	Clear();
 	OnLostDevice();
 
+	BOOL success = LoadMap(filename);
+	if (!success) return false;
+
+	success &= InitGraphics(d3d9->GetDevice());
+
+	InitPhysics(dynamicsWorld);
+
+	return success;
+}
+
+BOOL CQ3BSP::LoadMap(const std::wstring& filename)
+{
+	Clear();
+
+	BOOL success = m_bMappedLoad ? MapLumps(filename) : ReadLumps(filename);
+	success = success && CheckSurfaces();
+	if (!success)
+	{
+		Clear();
+		return false;
+	}
+
+	TessellatePatches(m_tessLevel);
+	m_patchLod.Init(m_surfaces.data(), m_vertices.data(), m_patchRenderInfos);
+
+	m_allSurfaces.resize(m_surfaces.size());
+	for (int i = 0; i < (int)m_surfaces.size(); i++) m_allSurfaces[i] = i;
+	BuildBatches();
+
+	// Without a usable tree Render falls back to every surface
+	Q3VisLumps lumps;
+	lumps.nodes = m_nodes.data();               lumps.numNodes = (int)m_nodes.size();
+	lumps.planes = m_planes.data();             lumps.numPlanes = (int)m_planes.size();
+	lumps.leafs = m_leafs.data();               lumps.numLeafs = (int)m_leafs.size();
+	lumps.leafSurfaces = m_leafSurfaces.data(); lumps.numLeafSurfaces = (int)m_leafSurfaces.size();
+	lumps.models = m_models.data();             lumps.numModels = (int)m_models.size();
+	lumps.vis = m_visData.data();               lumps.visLen = (int)m_visData.size();
+	lumps.numSurfaces = (int)m_surfaces.size();
+	if (!m_vis.Init(lumps))
+		_log(L"Q3 BSP: damaged node tree, visibility culling off\n");
+
+	return true;
+}
+
+// Every patch at the same level, the way Load starts out
+void CQ3BSP::TessellatePatches(int tessLevel)
+{
+	std::vector<Q3BSPVertex>().swap(m_patchVertices);
+	std::vector<int>().swap(m_patchIndices);
+	m_patchRenderInfos.clear();
+	m_surfacePatch.assign(m_surfaces.size(), -1);
+
+	for (int i = 0; i < (int)m_surfaces.size(); ++i)
+	{
+		if (m_surfaces[i].surfaceType != MST_PATCH) continue;
+		PatchRenderInfo info = {};
+		info.originalSurfaceIndex = i;
+		m_surfacePatch[i] = (int)m_patchRenderInfos.size();
+		m_patchRenderInfos.push_back(info);
+	}
+
+	// Nothing is tessellated yet, so nothing gets kept
+	m_patchLevelU.assign(m_patchRenderInfos.size(), 0);
+	m_patchLevelV.assign(m_patchRenderInfos.size(), 0);
+	std::vector<int> levels(m_patchRenderInfos.size(), tessLevel);
+	RetessellatePatches(levels, levels);
+}
+
+// Sizes every patch first, so each one gets its own part of m_patchVertices and m_patchIndices
+// (a prefix sum over the patches) and they can all be tessellated at once, straight into place.
+// A patch already at its levels is only moved over, its indexes shifted to where it lands now.
+int CQ3BSP::RetessellatePatches(const std::vector<int>& levelU, const std::vector<int>& levelV)
+{
+	std::vector<PatchRenderInfo> infos(m_patchRenderInfos);
+	int numVerts = 0, numIndices = 0;
+	for (int p = 0; p < (int)infos.size(); p++)
+	{
+		const dsurface_t& surf = m_surfaces[infos[p].originalSurfaceIndex];
+		int verts, indices;
+		BezierTessellator::CountPatch(surf.patchWidth, surf.patchHeight, levelU[p], levelV[p], verts, indices);
+
+		PatchRenderInfo& info = infos[p];
+		info.startIndex = numIndices;   // Offset in the patch index array
+		info.minVertIndex = numVerts;   // Offset in the patch vertex array
+		info.numVerts = verts;
+		info.primitiveCount = indices / 3;
+		numVerts += verts;
+		numIndices += indices;
+	}
+
+	// Into the arrays from the last time, already allocated and paged in
+	std::vector<Q3BSPVertex>& vertices = m_spareVertices;
+	std::vector<int>& indices = m_spareIndices;
+	vertices.resize(numVerts);
+	indices.resize(numIndices);
+	int tessellated = 0;
+
+	// Patch sizes vary a lot, small chunks keep the threads even
+	#pragma omp parallel for schedule(dynamic, 16) reduction(+:tessellated)
+	for (int p = 0; p < (int)infos.size(); p++)
+	{
+		const PatchRenderInfo& info = infos[p];
+		if (levelU[p] == m_patchLevelU[p] && levelV[p] == m_patchLevelV[p])
+		{
+			const PatchRenderInfo& old = m_patchRenderInfos[p];
+			std::copy_n(&m_patchVertices[old.minVertIndex], info.numVerts, &vertices[info.minVertIndex]);
+			const int shift = info.minVertIndex - old.minVertIndex;
+			for (int i = 0; i < info.primitiveCount * 3; i++)
+				indices[info.startIndex + i] = m_patchIndices[old.startIndex + i] + shift;
+			continue;
+		}
+		const dsurface_t& surf = m_surfaces[info.originalSurfaceIndex];
+		// Indices are absolute in m_patchVertices, like the serial version made them
+		BezierTessellator::TessellatePatch(&m_vertices[surf.firstVert], surf.patchWidth, surf.patchHeight, levelU[p], levelV[p],
+			&vertices[info.minVertIndex], &indices[info.startIndex], info.minVertIndex);
+		tessellated++;
+	}
+
+	m_patchVertices.swap(vertices);
+	m_patchIndices.swap(indices);
+	// The old arrays are the spares now, unless they are far bigger than what's in use (the level
+	// the map was loaded at, before the LOD brought it down)
+	if (m_spareVertices.capacity() > 2 * m_patchVertices.size() + 4096)
+	{
+		std::vector<Q3BSPVertex>().swap(m_spareVertices);
+		std::vector<int>().swap(m_spareIndices);
+	}
+	m_patchRenderInfos.swap(infos);
+	m_patchLevelU = levelU;
+	m_patchLevelV = levelV;
+	return tessellated;
+}
+
+// Every lump copied out of the file, the way it was loaded before MapLumps
+BOOL CQ3BSP::ReadLumps(const std::wstring& filename)
+{
 	FILE* file = _wfopen(filename.c_str(), L"rb");
 	if (!file) return false;
 
@@ -220,95 +397,110 @@ BOOL CQ3BSP::Load(btDynamicsWorld* dynamicsWorld, const std::wstring & filename)
 		return false;
 	}
 
-	// Load lumps directly from file into vectors
-	// No massive buffer allocation, no hardcoded limits
 	BOOL success = true;
-	success &= LoadEntities(file, header);
+	int entLen = header.lumps[LUMP_ENTITIES].filelen;
+	if (entLen > 0)
+	{
+		std::vector<char> text(entLen);
+		fseek(file, header.lumps[LUMP_ENTITIES].fileofs, SEEK_SET);
+		success &= (fread(text.data(), 1, entLen, file) == (size_t)entLen) && LoadEntities(text.data(), entLen);
+	}
 	success &= LoadLump(file, header, LUMP_SHADERS, m_shaders);
 	success &= LoadLump(file, header, LUMP_MODELS, m_models);
 	success &= LoadLump(file, header, LUMP_PLANES, m_planes);
 	success &= LoadLump(file, header, LUMP_LEAFS, m_leafs);
 	success &= LoadLump(file, header, LUMP_NODES, m_nodes);
+	success &= LoadLump(file, header, LUMP_LEAFSURFACES, m_leafSurfaces);
+	success &= LoadLump(file, header, LUMP_VISIBILITY, m_visData);
 	success &= LoadLump(file, header, LUMP_SURFACES, m_surfaces);
 	success &= LoadLump(file, header, LUMP_DRAWVERTS, m_vertices);
 	success &= LoadLump(file, header, LUMP_DRAWINDEXES, m_indexes);
-
-	BezierTessellator tessellator;
-	int tessLevel = 8; // 10 is decent quality. 
-// We can't easily insert into vectors while iterating indices, 
-// so we append to end and fix offsets.
-	for (int i = 0; i < (int)m_surfaces.size(); ++i)
-	{
-		const dsurface_t& surf = m_surfaces[i];
-
-		if (surf.surfaceType == MST_PATCH)
-		{
-			// Gather controls
-			std::vector<drawVert_t> controls(surf.numVerts);
-			for (int k = 0; k < surf.numVerts; k++) 
-			{
-				controls[k] = m_vertices[surf.firstVert + k];
-			}
-
-			// Generate
-			tessellator.TessellatePatch(controls.data(), surf.patchWidth, surf.patchHeight, tessLevel);
-
-			// Record Render Info
-			PatchRenderInfo info;
-			info.originalSurfaceIndex = i;
-			info.startIndex = (int)m_patchIndices.size(); // Offset in NEW Index Buffer
-			info.minVertIndex = (int)m_patchVertices.size(); // Offset in NEW Vertex Buffer
-			info.numVerts = (int)tessellator.m_outVerts.size();
-			info.primitiveCount = (int)tessellator.m_outIndices.size() / 3;
-
-			// Store Data
-			// Mapped 1:1, indices are 0-based relative to this patch's vertices
-			// We need to offset indices by the current size of m_patchVertices
-			int vertOffset = (int)m_patchVertices.size();
-
-			m_patchVertices.insert(m_patchVertices.end(), tessellator.m_outVerts.begin(), tessellator.m_outVerts.end());
-
-			for (int idx : tessellator.m_outIndices) 
-			{
-				m_patchIndices.push_back(idx + vertOffset);
-			}
-
-			m_patchRenderInfos.push_back(info);
-		}
-	}
-
-	// Lightmaps are just bytes, treat slightly differently or specialize template
 	// Note: Lightmaps are usually 128x128x3 bytes per block
-	int lmLen = header.lumps[LUMP_LIGHTMAPS].filelen;
-	if (lmLen > 0) {
-		m_lightBytes.resize(lmLen);
-		fseek(file, header.lumps[LUMP_LIGHTMAPS].fileofs, SEEK_SET);
-		fread(m_lightBytes.data(), 1, lmLen, file);
-	}
+	success &= LoadLump(file, header, LUMP_LIGHTMAPS, m_lightBytes);
 
 	fclose(file);
+	return success;
+}
 
-	success &= InitGraphics(d3d9->GetDevice());
+// The file stays mapped while the map is loaded, the lumps point into it. Nothing is copied
+// here but the entity text, everything that has to change (vertex swizzle, lightmap RGB to XRGB)
+// is converted on its way into the D3D buffers.
+BOOL CQ3BSP::MapLumps(const std::wstring& filename)
+{
+	if (!m_file.Open(filename)) return false;
+	if (m_file.GetSize() < sizeof(dheader_t)) return false;
 
-	InitPhysics(dynamicsWorld);
+	const dheader_t& header = *(const dheader_t*)m_file.GetData();
+	if (header.ident != BSP_IDENT || header.version != BSP_VERSION)
+		return false;
 
+	Q3Lump<char> entities;
+	BOOL success = MapLump(header, LUMP_ENTITIES, entities) && LoadEntities(entities.data(), (int)entities.size());
+	success = success && MapLump(header, LUMP_SHADERS, m_shaders);
+	success = success && MapLump(header, LUMP_MODELS, m_models);
+	success = success && MapLump(header, LUMP_PLANES, m_planes);
+	success = success && MapLump(header, LUMP_LEAFS, m_leafs);
+	success = success && MapLump(header, LUMP_NODES, m_nodes);
+	success = success && MapLump(header, LUMP_LEAFSURFACES, m_leafSurfaces);
+	success = success && MapLump(header, LUMP_VISIBILITY, m_visData);
+	success = success && MapLump(header, LUMP_SURFACES, m_surfaces);
+	success = success && MapLump(header, LUMP_DRAWVERTS, m_vertices);
+	success = success && MapLump(header, LUMP_DRAWINDEXES, m_indexes);
+	success = success && MapLump(header, LUMP_LIGHTMAPS, m_lightBytes);
 	return success;
 }
 
+// Surfaces index straight into the vertex and index lumps, a bad one must not read past them.
+// Patches are made of 3x3 blocks sharing their edges, so their sides are odd.
+BOOL CQ3BSP::CheckSurfaces() const
+{
+	for (int i = 0; i < (int)m_surfaces.size(); i++)
+	{
+		const dsurface_t& surf = m_surfaces[i];
+		if (surf.firstVert < 0 || surf.numVerts < 0 || (size_t)surf.firstVert + surf.numVerts > m_vertices.size() ||
+			surf.firstIndex < 0 || surf.numIndexes < 0 || (size_t)surf.firstIndex + surf.numIndexes > m_indexes.size() ||
+			(surf.surfaceType == MST_PATCH && (surf.patchWidth < 3 || surf.patchHeight < 3 || !(surf.patchWidth & 1) ||
+				!(surf.patchHeight & 1) || surf.patchWidth * surf.patchHeight > surf.numVerts)))
+		{
+			_log(L"Q3 BSP: surface %d is out of range\n", i);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 BOOL CQ3BSP::InitGraphics(LPDIRECT3DDEVICE9 pDevice)
 {
 	// Quake maps are huge. 0.03f is a common scale for D3D games.
 	m_pDevice = pDevice;
 	if (!pDevice || m_vertices.empty())
 		return false;
-	// --- 1. Create WORLD Buffers (Static BSP geometry) ---
-	if (!m_vertices.empty())
-	{
-		m_pDevice->CreateVertexBuffer((UINT)m_vertices.size() * sizeof(Q3BSPVertex),
-			D3DUSAGE_WRITEONLY, D3DFVF_Q3BSPVERTEX, D3DPOOL_MANAGED, &m_pVB_World, NULL);
+	// --- 1. One vertex buffer: the BSP vertices, then the tessellated patches ---
+	// A batch can then mix both, see BuildBatches
+	if (!CreateWorldVB((UINT)(m_vertices.size() + m_patchVertices.size())))
+		return false;
 
-		Q3BSPVertex* pVerts;
-		m_pVB_World->Lock(0, 0, (void**)&pVerts, 0);
+	// --- 2. Batch index buffer, rewritten a slot at a time as visibility changes ---
+	if (m_batches.GetIndexCount() > 0 && !CreateBatchIB(m_batches.GetIndexCount()))
+		return false;
+
+	CreateLightmaps();
+
+	return true;
+}
+
+BOOL CQ3BSP::CreateWorldVB(UINT numVerts)
+{
+	if (m_pVB_World) { m_pVB_World->Release(); m_pVB_World = NULL; }
+	m_vbVerts = 0;
+	if (FAILED(m_pDevice->CreateVertexBuffer(numVerts * sizeof(Q3BSPVertex),
+		D3DUSAGE_WRITEONLY, D3DFVF_Q3BSPVERTEX, D3DPOOL_MANAGED, &m_pVB_World, NULL)))
+		return false;
+	m_vbVerts = numVerts;
+
+	Q3BSPVertex* pVerts;
+	if (SUCCEEDED(m_pVB_World->Lock(0, 0, (void**)&pVerts, 0)))
+	{
 		for (size_t i = 0; i < m_vertices.size(); i++) {
 			// Convert drawVert_t to BSPVertex here (swizzle coords)
 			//pVerts[i].pos = m_vertices[i].xyz;
@@ -323,67 +515,111 @@ BOOL CQ3BSP::InitGraphics(LPDIRECT3DDEVICE9 pDevice)
 			pVerts[i].uv1[0] = m_vertices[i].lightmap[0];
 			pVerts[i].uv1[1] = m_vertices[i].lightmap[1];
 		}
+
+		WritePatchVertices(pVerts + m_vertices.size());
 		m_pVB_World->Unlock();
+	}
+	return true;
+}
 
-		m_pDevice->CreateIndexBuffer(m_indexes.size() * sizeof(int),
-			D3DUSAGE_WRITEONLY, D3DFMT_INDEX32, D3DPOOL_MANAGED, &m_pIB_World, NULL);
+BOOL CQ3BSP::CreateBatchIB(UINT numIndexes)
+{
+	if (m_pIB_World) { m_pIB_World->Release(); m_pIB_World = NULL; }
+	m_ibIndexes = 0;
+	if (FAILED(m_pDevice->CreateIndexBuffer(numIndexes * sizeof(int),
+		D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, D3DFMT_INDEX32,
+		D3DPOOL_DEFAULT, // Must be DEFAULT for dynamic usage
+		&m_pIB_World, NULL)))
+		return false;
+	m_ibIndexes = numIndexes;
+	m_ibUsed = IB_RESTART;
+	m_batches.Invalidate();
+	return true;
+}
 
-		void* pInds;
-		m_pIB_World->Lock(0, 0, &pInds, 0);
-		memcpy(pInds, m_indexes.data(), m_indexes.size() * sizeof(int));
-		m_pIB_World->Unlock();
+void CQ3BSP::WritePatchVertices(Q3BSPVertex* dst) const
+{
+	for (size_t i = 0; i < m_patchVertices.size(); i++) {
+		// The patch vertices are already BSPVertex, but they are in Q3 space
+		// because the Tessellator calculated them from raw Q3 data.
+		const Q3BSPVertex& src = m_patchVertices[i];
+
+		dst[i] = src; // Init
+		// Apply Scale & Swizzle
+		dst[i].pos.x = src.pos.x * SCALE_FACTOR;
+		dst[i].pos.y = src.pos.z * SCALE_FACTOR; // Swap Y/Z
+		dst[i].pos.z = src.pos.y * -SCALE_FACTOR;
+
+		dst[i].normal.x = src.normal.x;
+		dst[i].normal.y = src.normal.z; // Swap Y/Z
+		dst[i].normal.z = src.normal.y;
 	}
+}
 
-	// --- 2. Create PATCH Buffers (Generated geometry) ---
-	if (!m_patchVertices.empty())
-	{
-		m_pDevice->CreateVertexBuffer((UINT)m_patchVertices.size() * sizeof(Q3BSPVertex),
-			D3DUSAGE_WRITEONLY, D3DFVF_Q3BSPVERTEX, D3DPOOL_MANAGED, &m_pVB_Patch, NULL);
+// The patches changed level: their part of the vertex buffer and the whole batch index buffer.
+// Buffers are only recreated to grow, by a quarter more than needed, so a walk through the map
+// soon stops doing it.
+void CQ3BSP::UploadPatches()
+{
+	if (!m_pDevice || !m_pVB_World) return;
 
-		void* pVerts;
-		Q3BSPVertex* pPatchVerts;
-		if (SUCCEEDED(m_pVB_Patch->Lock(0, 0, (void**)&pPatchVerts, 0)))
+	const UINT numVerts = (UINT)(m_vertices.size() + m_patchVertices.size());
+	if (numVerts > m_vbVerts)
+	{
+		if (!CreateWorldVB(numVerts + numVerts / 4)) return;
+	}
+	else if (!m_patchVertices.empty())
+	{
+		Q3BSPVertex* pVerts;
+		if (SUCCEEDED(m_pVB_World->Lock((UINT)(m_vertices.size() * sizeof(Q3BSPVertex)),
+			(UINT)(m_patchVertices.size() * sizeof(Q3BSPVertex)), (void**)&pVerts, 0)))
 		{
-			for (size_t i = 0; i < m_patchVertices.size(); i++) {
-				// The patch vertices are already BSPVertex, but they are in Q3 space
-				// because the Tessellator calculated them from raw Q3 data.
-				Q3BSPVertex src = m_patchVertices[i]; // Copy original
-
-				pPatchVerts[i] = src; // Init
-				// Apply Scale & Swizzle
-				pPatchVerts[i].pos.x = src.pos.x * SCALE_FACTOR;
-				pPatchVerts[i].pos.y = src.pos.z * SCALE_FACTOR; // Swap Y/Z
-				pPatchVerts[i].pos.z = src.pos.y * -SCALE_FACTOR;
-
-				pPatchVerts[i].normal.x = src.normal.x;
-				pPatchVerts[i].normal.y = src.normal.z; // Swap Y/Z
-				pPatchVerts[i].normal.z = src.normal.y;
-			}
-			m_pVB_Patch->Unlock();
+			WritePatchVertices(pVerts);
+			m_pVB_World->Unlock();
 		}
-		//memcpy(pVerts, m_patchVertices.data(), m_patchVertices.size() * sizeof(Q3BSPVertex));
-		//m_pVB_Patch->Unlock();
-
-		m_pDevice->CreateIndexBuffer(m_patchIndices.size() * sizeof(int),
-			D3DUSAGE_WRITEONLY, D3DFMT_INDEX32, D3DPOOL_MANAGED, &m_pIB_Patch, NULL);
-
-		void* pInds;
-		m_pIB_Patch->Lock(0, 0, &pInds, 0);
-		memcpy(pInds, m_patchIndices.data(), m_patchIndices.size() * sizeof(int));
-		m_pIB_Patch->Unlock();
 	}
 
-	CreateLightmaps();
+	const UINT numIndexes = m_batches.GetIndexCount();
+	if (numIndexes > m_ibIndexes)
+		CreateBatchIB(numIndexes + numIndexes / 4);
+	m_batches.Invalidate();
+}
 
-	return true;
+// Every drawable surface, planar, soup or patch, into the batch builder. Patch indexes
+// point past the BSP vertices, where InitGraphics puts the patch vertices.
+void CQ3BSP::BuildBatches()
+{
+	std::vector<Q3BatchSurface> surfaces(m_surfaces.size());
+	for (int i = 0; i < (int)m_surfaces.size(); i++)
+	{
+		const dsurface_t& surf = m_surfaces[i];
+		Q3BatchSurface& dst = surfaces[i];
+		dst.shader = surf.shaderNum;
+		dst.lightmap = surf.lightmapNum;
+		if (m_surfacePatch[i] >= 0)
+		{
+			const PatchRenderInfo& info = m_patchRenderInfos[m_surfacePatch[i]];
+			dst.indexes = m_patchIndices.data() + info.startIndex;
+			dst.numIndexes = info.primitiveCount * 3;
+			dst.baseVertex = (int)m_vertices.size();
+		}
+		else if (surf.surfaceType == MST_PLANAR || surf.surfaceType == MST_TRIANGLE_SOUP)
+		{
+			dst.indexes = m_indexes.data() + surf.firstIndex;
+			dst.numIndexes = surf.numIndexes;
+			dst.baseVertex = surf.firstVert;
+		}
+	}
+	m_batches.Build(surfaces);
+	// New batches, where the old ones were written means nothing now
+	m_ibUsed = IB_RESTART;
 }
 
 void CQ3BSP::OnLostDevice()
 {
 	if (m_pVB_World) { m_pVB_World->Release(); m_pVB_World = NULL; }
 	if (m_pIB_World) { m_pIB_World->Release(); m_pIB_World = NULL; }
-	if (m_pVB_Patch) { m_pVB_Patch->Release(); m_pVB_Patch = NULL; }
-	if (m_pIB_Patch) { m_pIB_Patch->Release(); m_pIB_Patch = NULL; }
+	m_vbVerts = m_ibIndexes = 0;
 	for (auto tex : m_pLightmaps) 
 	{
 		if (tex) {
@@ -406,7 +642,7 @@ void CQ3BSP::OnResetDevice()
 // ----------------------------------------------------------------------------
 void CQ3BSP::Render()
 {
-	if (!m_pDevice || !m_pVB_World || !m_pVB_Patch) return;
+	if (!m_pDevice || !m_pVB_World || !m_pIB_World) return;
 
 	m_pDevice->SetFVF(D3DFVF_Q3BSPVERTEX);
 	// Render States (Basic)
@@ -432,69 +668,545 @@ void CQ3BSP::Render()
 	m_pDevice->SetTextureStageState(1, D3DTSS_COLORARG2, D3DTA_CURRENT);
 
 	// --------------------------------------------------------
-	// PASS 1: Static World (Walls, Floors)
+	// One draw per (shader, lightmap) that has something visible
 	// --------------------------------------------------------
-		m_pDevice->SetStreamSource(0, m_pVB_World, 0, sizeof(Q3BSPVertex));
-		m_pDevice->SetIndices(m_pIB_World);
+	D3DXMATRIX view, proj;
+	m_pDevice->GetTransform(D3DTS_VIEW, &view);
+	m_pDevice->GetTransform(D3DTS_PROJECTION, &proj);
+	if (m_bRecordPath) m_cameraPath.push_back(view);
+
+	// Patches that changed level are redone first, that can rebuild the batches and buffers
+	D3DVIEWPORT9 viewport;
+	m_pDevice->GetViewport(&viewport);
+	UpdatePatchLod(view, proj, (float)viewport.Height);
+	if (!m_pVB_World || !m_pIB_World) return;
+
+	const std::vector<Q3IndexRange>& dirty = m_batches.Update(CullSurfaces(view, proj));
+	UploadBatchIndexes(dirty);
+
+	m_pDevice->SetStreamSource(0, m_pVB_World, 0, sizeof(Q3BSPVertex));
+	m_pDevice->SetIndices(m_pIB_World);
+
+	int boundLightmap = -2;
+	const std::vector<Q3Batch>& batches = m_batches.GetBatches();
+	for (size_t b = 0; b < batches.size(); b++)
+	{
+		const Q3Batch& batch = batches[b];
+		if (batch.numIndexes == 0) continue;
 
-		for (const auto& surf : m_surfaces)
+		// BIND LIGHTMAP, batches of one shader sit together so this mostly stays
+		int lightmap = (batch.lightmap >= 0 && batch.lightmap < (int)m_pLightmaps.size()) ? batch.lightmap : -1;
+		if (lightmap != boundLightmap)
 		{
-			if (surf.surfaceType == MST_PLANAR || surf.surfaceType == MST_TRIANGLE_SOUP)
+			m_pDevice->SetTexture(1, lightmap >= 0 ? m_pLightmaps[lightmap] : NULL);
+			boundLightmap = lightmap;
+		}
+
+		m_pDevice->DrawIndexedPrimitive(
+			D3DPT_TRIANGLELIST,
+			0,                  // BaseVertexIndex (the batch indexes are absolute)
+			batch.minVert,
+			batch.numVerts,
+			m_batchFirst[b],
+			batch.numIndexes / 3
+		);
+	}
+
+	//m_pDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW); // Check winding order
+
+}
+
+// The index buffer is a ring: changed batches go behind everything written since the last
+// discard, with NOOVERWRITE, and are drawn from there. What a queued frame reads is never
+// written again until the buffer is full, then one discarding lock starts it over with every
+// visible batch. Without an index buffer only the bookkeeping runs (BenchmarkBatches).
+UINT CQ3BSP::UploadBatchIndexes(const std::vector<Q3IndexRange>& dirty, bool* discarded)
+{
+	const std::vector<Q3Batch>& batches = m_batches.GetBatches();
+	const std::vector<int>& indexes = m_batches.GetIndexes();
+	if (discarded) *discarded = false;
+	if (m_batchFirst.size() != batches.size())
+	{
+		m_batchFirst.assign(batches.size(), 0);
+		m_ibUsed = IB_RESTART;
+	}
+
+	UINT total = 0;
+	for (const Q3IndexRange& range : dirty) total += range.count;
+	if (total == 0 && m_ibUsed != IB_RESTART) return 0;
+
+	const UINT capacity = m_pIB_World ? m_ibIndexes : m_batches.GetIndexCount();
+	if (m_ibUsed == IB_RESTART || m_ibUsed + total > capacity)
+	{
+		int* pInds = NULL;
+		if (m_pIB_World && FAILED(m_pIB_World->Lock(0, 0, (void**)&pInds, D3DLOCK_DISCARD)))
+		{
+			m_ibUsed = IB_RESTART;
+			return 0;
+		}
+		UINT pos = 0;
+		for (size_t b = 0; b < batches.size(); b++)
+		{
+			const Q3Batch& batch = batches[b];
+			m_batchFirst[b] = pos;
+			if (pInds) memcpy(pInds + pos, &indexes[batch.firstIndex], batch.numIndexes * sizeof(int));
+			pos += batch.numIndexes;
+		}
+		if (pInds) m_pIB_World->Unlock();
+		m_ibUsed = pos;
+		if (discarded) *discarded = true;
+		return pos;
+	}
+
+	int* pInds = NULL;
+	if (m_pIB_World && FAILED(m_pIB_World->Lock(m_ibUsed * sizeof(int), total * sizeof(int), (void**)&pInds, D3DLOCK_NOOVERWRITE)))
+	{
+		m_ibUsed = IB_RESTART;
+		return 0;
+	}
+	UINT pos = m_ibUsed;
+	for (const Q3IndexRange& range : dirty)
+	{
+		if (range.count == 0) continue;
+		if (pInds) memcpy(pInds + (pos - m_ibUsed), &indexes[range.first], range.count * sizeof(int));
+		// Batches are in slot order, a range is the visible part of one or of neighbours
+		// that fill their slots, so each keeps its offset in it
+		auto it = std::upper_bound(batches.begin(), batches.end(), range.first,
+			[](UINT first, const Q3Batch& batch) { return first < batch.firstIndex; });
+		if (it != batches.begin()) --it;
+		for (; it != batches.end() && it->firstIndex < range.first + range.count; ++it)
+			m_batchFirst[it - batches.begin()] = pos + (it->firstIndex - range.first);
+		pos += range.count;
+	}
+	if (pInds) m_pIB_World->Unlock();
+	m_ibUsed = pos;
+	return total;
+}
+
+const std::vector<int>& CQ3BSP::CullSurfaces(const D3DXMATRIX& view, const D3DXMATRIX& proj)
+{
+	if (!m_bCulling || !m_vis.IsReady())
+		return m_allSurfaces;
+
+	// Q3 map space to D3D world, the same swizzle and scale as the vertex buffers
+	D3DXMATRIX mapToWorld(
+		SCALE_FACTOR, 0, 0, 0,
+		0, 0, -SCALE_FACTOR, 0,
+		0, SCALE_FACTOR, 0, 0,
+		0, 0, 0, 1);
+	D3DXMATRIX mapToClip = mapToWorld * view * proj;
+
+	return m_vis.Cull(MapPosition(view), mapToClip);
+}
+
+// Camera position back in map space
+D3DXVECTOR3 CQ3BSP::MapPosition(const D3DXMATRIX& view) const
+{
+	D3DXMATRIX invView;
+	D3DXMatrixInverse(&invView, NULL, &view);
+	return D3DXVECTOR3(invView._41 / SCALE_FACTOR, -invView._43 / SCALE_FACTOR, invView._42 / SCALE_FACTOR);
+}
+
+int CQ3BSP::UpdatePatchLod(const D3DXMATRIX& view, const D3DXMATRIX& proj, float viewportHeight)
+{
+	if (m_patchRenderInfos.empty()) return 0;
+
+	// Off means every patch at m_tessLevel, which also undoes what the LOD did
+	const int numPatches = (int)m_patchRenderInfos.size();
+	if (m_bPatchLod)
+		m_patchLod.Update(MapPosition(view), viewportHeight * 0.5f * proj._22);
+	auto levelU = [&](int p) { return m_bPatchLod ? m_patchLod.GetLevelU(p) : m_tessLevel; };
+	auto levelV = [&](int p) { return m_bPatchLod ? m_patchLod.GetLevelV(p) : m_tessLevel; };
+	int p = 0;
+	while (p < numPatches && levelU(p) == m_patchLevelU[p] && levelV(p) == m_patchLevelV[p]) p++;
+	if (p == numPatches) return 0;
+
+	std::vector<int> newU(numPatches), newV(numPatches);
+	for (p = 0; p < numPatches; p++)
+	{
+		newU[p] = levelU(p);
+		newV[p] = levelV(p);
+	}
+
+	// The batches point into the patch indexes, they go with them
+	int tessellated = RetessellatePatches(newU, newV);
+	BuildBatches();
+	UploadPatches();
+	return tessellated;
+}
+
+void CQ3BSP::SetPathRecording(bool record)
+{
+	if (record && !m_bRecordPath) m_cameraPath.clear();
+	m_bRecordPath = record;
+}
+
+void CQ3BSP::CameraPath(int frames, std::vector<D3DXMATRIX>& views) const
+{
+	if (!m_cameraPath.empty())
+	{
+		views.resize(frames);
+		for (int f = 0; f < frames; f++) views[f] = m_cameraPath[f % m_cameraPath.size()];
+		return;
+	}
+
+	std::vector<int> open;
+	for (int i = 0; i < (int)m_leafs.size(); i++)
+		if (m_leafs[i].cluster >= 0 && m_leafs[i].numLeafSurfaces > 0) open.push_back(i);
+	if (open.empty()) open.push_back(0);
+	std::mt19937 rng(1234);
+	std::uniform_int_distribution<int> pickLeaf(0, (int)open.size() - 1);
+	auto leafCenter = [this](int leaf)
+	{
+		const dleaf_t& l = m_leafs[leaf];
+		return D3DXVECTOR3((l.mins[0] + l.maxs[0]) * 0.5f * SCALE_FACTOR, (l.mins[2] + l.maxs[2]) * 0.5f * SCALE_FACTOR,
+			-(l.mins[1] + l.maxs[1]) * 0.5f * SCALE_FACTOR);
+	};
+	const int FRAMES_PER_RUN = 120;
+	views.resize(frames);
+	D3DXVECTOR3 from = leafCenter(open[pickLeaf(rng)]), to = leafCenter(open[pickLeaf(rng)]);
+	for (int f = 0; f < frames; f++)
+	{
+		if (f > 0 && f % FRAMES_PER_RUN == 0)
+		{
+			from = to;
+			to = leafCenter(open[pickLeaf(rng)]);
+		}
+		float t = (f % FRAMES_PER_RUN) / (float)FRAMES_PER_RUN;
+		D3DXVECTOR3 eye = from + (to - from) * t;
+		D3DXVECTOR3 dir = to - from;
+		dir.y = 0.0f;
+		if (D3DXVec3LengthSq(&dir) < 1e-6f) dir = D3DXVECTOR3(1.0f, 0.0f, 0.0f);
+		D3DXVECTOR3 at = eye + dir, up(0.0f, 1.0f, 0.0f);
+		D3DXMatrixLookAtLH(&views[f], &eye, &at, &up);
+	}
+}
+
+void CQ3BSP::BenchmarkTessellation(int runs)
+{
+	if (m_patchRenderInfos.empty())
+	{
+		_log(L"BenchmarkTessellation: no patches in the map\n");
+		return;
+	}
+
+	const int maxThreads = omp_get_max_threads();
+	const int levels[2] = { 8, 16 };
+	for (int level : levels)
+	{
+		// The way Load did it before: one tessellator, appending patch by patch
+		double best = DBL_MAX;
+		size_t appendVerts = 0;
+		for (int r = 0; r < runs; r++)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			BezierTessellator tessellator;
+			std::vector<Q3BSPVertex> verts;
+			std::vector<int> indices;
+			for (const PatchRenderInfo& info : m_patchRenderInfos)
 			{
-				// BIND LIGHTMAP
-				if (surf.lightmapNum >= 0 && surf.lightmapNum < (int)m_pLightmaps.size())
-				{
-					m_pDevice->SetTexture(1, m_pLightmaps[surf.lightmapNum]);
-				}
-				else
-				{
-					m_pDevice->SetTexture(1, NULL); // No lightmap
-				}
+				const dsurface_t& surf = m_surfaces[info.originalSurfaceIndex];
+				std::vector<drawVert_t> controls(m_vertices.begin() + surf.firstVert, m_vertices.begin() + surf.firstVert + surf.numVerts);
+				tessellator.TessellatePatch(controls.data(), surf.patchWidth, surf.patchHeight, level);
+				int vertOffset = (int)verts.size();
+				verts.insert(verts.end(), tessellator.m_outVerts.begin(), tessellator.m_outVerts.end());
+				for (int idx : tessellator.m_outIndices)
+					indices.push_back(idx + vertOffset);
+			}
+			best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+			appendVerts = verts.size();
+		}
+		_log(L"Q3 tessellation level %d: appending %.1f ms\n", level, best);
 
-				m_pDevice->DrawIndexedPrimitive(
-					D3DPT_TRIANGLELIST,
-					surf.firstVert,                  
-					0,     
-					(UINT)m_vertices.size(),
-					surf.firstIndex,    
-					surf.numIndexes / 3 
-				);
+		int threadCounts[2] = { 1, maxThreads };
+		for (int t = 0; t < (maxThreads > 1 ? 2 : 1); t++)
+		{
+			omp_set_num_threads(threadCounts[t]);
+			best = DBL_MAX;
+			for (int r = 0; r < runs; r++)
+			{
+				auto t0 = std::chrono::steady_clock::now();
+				TessellatePatches(level);
+				best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
 			}
+			_log(L"Q3 tessellation level %d: presized, %d threads %.1f ms, %d patches, %d verts, %d triangles\n", level,
+				threadCounts[t], best, (int)m_patchRenderInfos.size(), (int)m_patchVertices.size(), (int)m_patchIndices.size() / 3);
 		}
-	
+		omp_set_num_threads(maxThreads);
+		if (appendVerts != m_patchVertices.size())
+			_log(L"Q3 tessellation level %d: vertex counts differ (%d vs %d)\n", level, (int)appendVerts, (int)m_patchVertices.size());
+	}
 
-	// --------------------------------------------------------
-	// PASS 2: Bezier Patches
-	// --------------------------------------------------------
-	if (m_pVB_Patch && !m_patchRenderInfos.empty())
+	// Back to what the map was loaded with, the batches point into the patch indexes.
+	// UploadPatches rewrites the patch vertices in place, the lightmaps stay as they are.
+	TessellatePatches(m_tessLevel);
+	BuildBatches();
+	UploadPatches();
+}
+
+void CQ3BSP::BenchmarkPatchLod(int frames)
+{
+	if (m_patchRenderInfos.empty() || frames <= 0)
 	{
-		m_pDevice->SetStreamSource(0, m_pVB_Patch, 0, sizeof(Q3BSPVertex));
-		m_pDevice->SetIndices(m_pIB_Patch);
+		_log(L"BenchmarkPatchLod: no patches in the map\n");
+		return;
+	}
+
+	D3DXMATRIX proj;
+	D3DXMatrixPerspectiveFovLH(&proj, D3DX_PI / 3.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+	const float viewportHeight = 1080.0f;
+	std::vector<D3DXMATRIX> viewMats;
+	CameraPath(frames, viewMats);
 
-		for (const auto& info : m_patchRenderInfos)
+	// Patch triangles of the visible surfaces, as the patches are tessellated right now
+	auto patchTriangles = [this](const std::vector<int>& visible)
+	{
+		long long tris = 0;
+		for (int surf : visible)
+			if (m_surfacePatch[surf] >= 0) tris += m_patchRenderInfos[m_surfacePatch[surf]].primitiveCount;
+		return tris;
+	};
+
+	// Fixed level first, the LOD run starts from there like after a load
+	const bool lod = m_bPatchLod;
+	m_bPatchLod = false;
+	UpdatePatchLod(viewMats[0], proj, viewportHeight);
+	long long fixedTris = 0;
+	for (int f = 0; f < frames; f++)
+		fixedTris += patchTriangles(CullSurfaces(viewMats[f], proj));
+	const long long fixedAll = (long long)m_patchIndices.size() / 3;
+
+	m_bPatchLod = true;
+	m_patchLod.Init(m_surfaces.data(), m_vertices.data(), m_patchRenderInfos);
+	long long lodTris = 0, lodAll = 0, tessellated = 0;
+	int changes = 0, firstPatches = 0;
+	double pickMs = 0, changeMs = 0, worstMs = 0, firstMs = 0;
+	for (int f = 0; f < frames; f++)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		int patches = UpdatePatchLod(viewMats[f], proj, viewportHeight);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		if (f == 0)
 		{
-			// Get original surface to find lightmap index
-			int originalIndex = info.originalSurfaceIndex;
-			int lmNum = m_surfaces[originalIndex].lightmapNum;
-
-			if (lmNum >= 0 && lmNum < (int)m_pLightmaps.size())
-				m_pDevice->SetTexture(1, m_pLightmaps[lmNum]);
-			else
-				m_pDevice->SetTexture(1, NULL);
-
-			m_pDevice->DrawIndexedPrimitive(
-				D3DPT_TRIANGLELIST,
-				0,                  // BaseVertexIndex (Indices are already offset in our list)
-				0,  // MinVertexIndex
-				(UINT)m_patchVertices.size(),       // NumVertices
-				info.startIndex,    // StartIndex in IB
-				info.primitiveCount // PrimitiveCount
-			);
+			firstMs = ms;
+			firstPatches = patches;
 		}
+		else if (patches > 0)
+		{
+			changes++;
+			tessellated += patches;
+			changeMs += ms;
+			worstMs = std::max(worstMs, ms);
+		}
+		else
+		{
+			pickMs += ms;
+		}
+		lodTris += patchTriangles(CullSurfaces(viewMats[f], proj));
+		lodAll += (long long)m_patchIndices.size() / 3;
 	}
+	m_bPatchLod = lod;
+
+	const int quiet = frames - 1 - changes;
+	_log(L"Q3 patch LOD: %d frames, %d patches, %d shared edges, %d edge classes\n",
+		frames, (int)m_patchRenderInfos.size(), m_patchLod.GetSharedEdges(), m_patchLod.GetNumClasses());
+	_log(L"Q3 patch LOD: %.0f visible patch triangles per frame (%.0f in the map) against %.0f (%lld) at level %d\n",
+		(double)lodTris / frames, (double)lodAll / frames, (double)fixedTris / frames, fixedAll, m_tessLevel);
+	_log(L"Q3 patch LOD: picking %.3f ms per frame, %d frames changed %.1f patches each in %.2f ms (worst %.2f), the first %d in %.1f ms\n",
+		quiet ? pickMs / quiet : 0.0, changes, changes ? (double)tessellated / changes : 0.0,
+		changes ? changeMs / changes : 0.0, worstMs, firstPatches, firstMs);
+}
 
-	//m_pDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW); // Check winding order
+void CQ3BSP::BenchmarkBatches(int frames)
+{
+	if (m_batches.GetBatches().empty() || frames <= 0)
+	{
+		_log(L"BenchmarkBatches: no map loaded\n");
+		return;
+	}
+
+	D3DXMATRIX proj;
+	D3DXMatrixPerspectiveFovLH(&proj, D3DX_PI / 3.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+	std::vector<D3DXMATRIX> viewMats;
+	CameraPath(frames, viewMats);
+
+	const bool culling = m_bCulling;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		m_bCulling = (pass == 0);
+		m_batches.Invalidate();
+		long long surfaceDraws = 0, batchDraws = 0, textureChanges = 0, uploaded = 0, rangeCount = 0;
+		int discards = 0;
+		double updateMs = 0;
+		for (int f = 0; f < frames; f++)
+		{
+			const std::vector<int>& visible = CullSurfaces(viewMats[f], proj);
+			for (int surf : visible)
+			{
+				const dsurface_t& s = m_surfaces[surf];
+				if (m_surfacePatch[surf] >= 0 || s.surfaceType == MST_PLANAR || s.surfaceType == MST_TRIANGLE_SOUP)
+					surfaceDraws++;
+			}
+
+			auto t0 = std::chrono::steady_clock::now();
+			const std::vector<Q3IndexRange>& dirty = m_batches.Update(visible);
+			updateMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+			// What Render does with it
+			bool discarded;
+			uploaded += UploadBatchIndexes(dirty, &discarded);
+			if (discarded) discards++;
+			rangeCount += dirty.size();
+			int bound = -2;
+			for (const Q3Batch& batch : m_batches.GetBatches())
+			{
+				if (batch.numIndexes == 0) continue;
+				batchDraws++;
+				if (batch.lightmap != bound) textureChanges++;
+				bound = batch.lightmap;
+			}
+		}
+		_log(L"Q3 batches, culling %hs: %.1f draws per frame per surface, %.1f batched (%.1f texture changes), %d batches in all\n",
+			pass == 0 ? "on" : "off", (double)surfaceDraws / frames, (double)batchDraws / frames,
+			(double)textureChanges / frames, (int)m_batches.GetBatches().size());
+		_log(L"Q3 batches, culling %hs: update %.3f ms, %.0f of %u indexes (%.1f KB) uploaded per frame in %.1f ranges, %d discards\n",
+			pass == 0 ? "on" : "off", updateMs / frames, (double)uploaded / frames, m_batches.GetIndexCount(),
+			uploaded * sizeof(int) / 1024.0 / frames, (double)rangeCount / frames, discards);
+	}
+	m_bCulling = culling;
+	m_batches.Invalidate();
+	m_ibUsed = IB_RESTART;
+}
+
+void CQ3BSP::BenchmarkLoad(const std::wstring& filename, int runs)
+{
+	// Loads into a scratch map, Clear and LoadMap on this one would drop the live level
+	std::unique_ptr<CQ3BSP> scratch(new CQ3BSP());
+	CQ3BSP& map = *scratch;
+	const char* names[2] = { "fread", "mapped" };
+	for (int path = 0; path < 2; path++)
+	{
+		map.m_bMappedLoad = (path == 1);
+		double best = DBL_MAX;
+		double privateMB = 0, workingMB = 0, copiedMB = 0, viewedMB = 0;
+		for (int r = 0; r < runs; r++)
+		{
+			map.Clear();
+			auto t0 = std::chrono::steady_clock::now();
+			BOOL ok = map.LoadMap(filename);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+			if (!ok)
+			{
+				_log(L"BenchmarkLoad: can't load %s\n", filename.c_str());
+				return;
+			}
+			best = std::min(best, ms);
+
+			size_t copied = 0, viewed = 0;
+			auto count = [&](size_t bytes, bool copy) { (copy ? copied : viewed) += bytes; };
+			count(map.m_shaders.Bytes(), map.m_shaders.IsCopy());
+			count(map.m_models.Bytes(), map.m_models.IsCopy());
+			count(map.m_planes.Bytes(), map.m_planes.IsCopy());
+			count(map.m_leafs.Bytes(), map.m_leafs.IsCopy());
+			count(map.m_nodes.Bytes(), map.m_nodes.IsCopy());
+			count(map.m_leafSurfaces.Bytes(), map.m_leafSurfaces.IsCopy());
+			count(map.m_visData.Bytes(), map.m_visData.IsCopy());
+			count(map.m_surfaces.Bytes(), map.m_surfaces.IsCopy());
+			count(map.m_vertices.Bytes(), map.m_vertices.IsCopy());
+			count(map.m_indexes.Bytes(), map.m_indexes.IsCopy());
+			count(map.m_lightBytes.Bytes(), map.m_lightBytes.IsCopy());
+			copiedMB = copied / (1024.0 * 1024.0);
+			viewedMB = viewed / (1024.0 * 1024.0);
+
+			// What the loaded map holds, measured by dropping it: heaps keep freed memory around,
+			// so a before/after pair would read 0 from the second run on. Private bytes are the
+			// committed cost, mapped pages are file backed and only show up in the working set.
+			PROCESS_MEMORY_COUNTERS loaded = { sizeof(loaded) }, cleared = { sizeof(cleared) };
+			GetProcessMemoryInfo(GetCurrentProcess(), &loaded, sizeof(loaded));
+			map.Clear();
+			GetProcessMemoryInfo(GetCurrentProcess(), &cleared, sizeof(cleared));
+			privateMB = ((double)loaded.PagefileUsage - (double)cleared.PagefileUsage) / (1024.0 * 1024.0);
+			workingMB = ((double)loaded.WorkingSetSize - (double)cleared.WorkingSetSize) / (1024.0 * 1024.0);
+		}
+		_log(L"Q3 load %hs: %.1f ms, lumps %.1f MB copied, %.1f MB in place, map holds %.1f MB private, %.1f MB working set\n",
+			names[path], best, copiedMB, viewedMB, privateMB, workingMB);
+	}
+}
 
+void CQ3BSP::BenchmarkVisibility(int views)
+{
+	if (!m_vis.IsReady() || views <= 0)
+	{
+		_log(L"BenchmarkVisibility: no map with a node tree loaded\n");
+		return;
+	}
+
+	// Leafs the player can be in
+	std::vector<int> open;
+	for (int i = 0; i < (int)m_leafs.size(); i++)
+		if (m_leafs[i].cluster >= 0 && m_leafs[i].numLeafSurfaces > 0) open.push_back(i);
+	if (open.empty())
+	{
+		_log(L"BenchmarkVisibility: no open leafs\n");
+		return;
+	}
+
+	// Same views every run
+	std::mt19937 rng(1234);
+	std::uniform_int_distribution<int> pickLeaf(0, (int)open.size() - 1);
+	std::uniform_real_distribution<float> pickYaw(0.0f, 2.0f * D3DX_PI);
+	D3DXMATRIX proj;
+	D3DXMatrixPerspectiveFovLH(&proj, D3DX_PI / 3.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+
+	std::vector<D3DXMATRIX> viewMats(views);
+	for (int i = 0; i < views; i++)
+	{
+		const dleaf_t& leaf = m_leafs[open[pickLeaf(rng)]];
+		D3DXVECTOR3 eye((leaf.mins[0] + leaf.maxs[0]) * 0.5f * SCALE_FACTOR, (leaf.mins[2] + leaf.maxs[2]) * 0.5f * SCALE_FACTOR,
+			-(leaf.mins[1] + leaf.maxs[1]) * 0.5f * SCALE_FACTOR);
+		float yaw = pickYaw(rng);
+		D3DXVECTOR3 at = eye + D3DXVECTOR3(cosf(yaw), 0.0f, sinf(yaw));
+		D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+		D3DXMatrixLookAtLH(&viewMats[i], &eye, &at, &up);
+	}
+
+	auto triangles = [this](int surf) -> long long
+	{
+		const dsurface_t& s = m_surfaces[surf];
+		if (m_surfacePatch[surf] >= 0) return m_patchRenderInfos[m_surfacePatch[surf]].primitiveCount;
+		if (s.surfaceType == MST_PLANAR || s.surfaceType == MST_TRIANGLE_SOUP) return s.numIndexes / 3;
+		return 0;
+	};
+	long long totalTris = 0;
+	for (int i = 0; i < (int)m_surfaces.size(); i++) totalTris += triangles(i);
+
+	const bool culling = m_bCulling;
+	m_bCulling = true;
+	// Timed on its own, then once more for the counts
+	auto t0 = std::chrono::steady_clock::now();
+	size_t check = 0;
+	for (int i = 0; i < views; i++)
+		check += CullSurfaces(viewMats[i], proj).size();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+	long long surfaces = 0, tris = 0, pvsLeafs = 0, drawnLeafs = 0;
+	for (int i = 0; i < views; i++)
+	{
+		const std::vector<int>& visible = CullSurfaces(viewMats[i], proj);
+		const Q3VisStats& stats = m_vis.GetStats();
+		surfaces += visible.size();
+		pvsLeafs += stats.leafsInPVS;
+		drawnLeafs += stats.leafsInFrustum;
+		for (int surf : visible) tris += triangles(surf);
+	}
+	m_bCulling = culling;
+	if ((long long)check != surfaces) _log(L"BenchmarkVisibility: culls differ between runs\n");
+
+	_log(L"Q3 visibility: %d views, %.3f ms per cull, %d leafs, %.1f in PVS, %.1f in frustum\n",
+		views, ms / views, (int)m_leafs.size(), (double)pvsLeafs / views, (double)drawnLeafs / views);
+	_log(L"Q3 visibility: %.1f of %d surfaces (%.1f%%), %.0f of %lld triangles (%.1f%%)\n",
+		(double)surfaces / views, (int)m_surfaces.size(), 100.0 * surfaces / views / m_surfaces.size(),
+		(double)tris / views, totalTris, totalTris ? 100.0 * tris / views / totalTris : 0.0);
 }
 void CQ3BSP::InitPhysics(btDynamicsWorld* dynamicsWorld)
 {
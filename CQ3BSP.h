@@ -2,6 +2,11 @@
 #include "stdafx.h"
 #include "CArkiBlock.h"
 #include "Q3BSPStructures.h"
+#include "Q3Visibility.h"
+#include "Q3Lump.h"
+#include "Q3Batches.h"
+#include "Q3PatchLod.h"
+#include "MappedFile.h"
 
 
 
@@ -10,33 +15,55 @@ class CQ3BSP
 private:
 	BYTE* m_pBuffer;
 
-	// Data stored in dynamic vectors
+	// The lumps, in place in m_file (or copies, see SetMappedLoad)
+	CMappedFile                 m_file;
+	bool                        m_bMappedLoad;
 	std::vector<BSPEntity>		m_entities;
-	std::vector<dshader_t>      m_shaders;
-	std::vector<dmodel_t>       m_models;
-	std::vector<dplane_t>       m_planes;
-	std::vector<dleaf_t>        m_leafs;
-	std::vector<dnode_t>        m_nodes;
-	std::vector<dsurface_t>     m_surfaces;
-	std::vector<drawVert_t>     m_vertices;
-	std::vector<int>            m_indexes;
-	std::vector<BYTE>           m_lightBytes;
+	Q3Lump<dshader_t>           m_shaders;
+	Q3Lump<dmodel_t>            m_models;
+	Q3Lump<dplane_t>            m_planes;
+	Q3Lump<dleaf_t>             m_leafs;
+	Q3Lump<dnode_t>             m_nodes;
+	Q3Lump<int>                 m_leafSurfaces;
+	Q3Lump<BYTE>                m_visData;
+	Q3Lump<dsurface_t>          m_surfaces;
+	Q3Lump<drawVert_t>          m_vertices;
+	Q3Lump<int>                 m_indexes;
+	Q3Lump<BYTE>                m_lightBytes;
 	std::vector<BYTE>           m_lightGrid;
 
 	// --- Generated Patch Data ---
 	std::vector<Q3BSPVertex>      m_patchVertices; // Converted directly to GPU format
 	std::vector<int>            m_patchIndices;
 	std::vector<PatchRenderInfo> m_patchRenderInfos;
+	std::vector<int>            m_surfacePatch;    // Per surface, its m_patchRenderInfos entry or -1
+	std::vector<int>            m_patchLevelU;     // Per patch, what it is tessellated at now
+	std::vector<int>            m_patchLevelV;
+	std::vector<Q3BSPVertex>    m_spareVertices;   // The previous patch arrays, reused by the next RetessellatePatches
+	std::vector<int>            m_spareIndices;
+	int                         m_tessLevel;
+	CQ3PatchLod                 m_patchLod;
+	bool                        m_bPatchLod;
+
+	// --- Visibility ---
+	CQ3Visibility               m_vis;
+	bool                        m_bCulling;
 
 	// --- DirectX 9 Resources ---
 	LPDIRECT3DDEVICE9           m_pDevice;
-	// Group 1: Static World
+	// Static world and Bezier patches in one vertex buffer, the index buffer holds the batches
 	LPDIRECT3DVERTEXBUFFER9     m_pVB_World;
 	LPDIRECT3DINDEXBUFFER9      m_pIB_World;
+	UINT                        m_vbVerts;         // What the buffers have room for
+	UINT                        m_ibIndexes;
+	CQ3BatchBuilder             m_batches;
+	// Per batch, where its visible indexes are in the index buffer, see UploadBatchIndexes
+	std::vector<UINT>           m_batchFirst;
+	UINT                        m_ibUsed;          // Indexes written since the last discard
 
-	// Group 2: Bezier Patches
-	LPDIRECT3DVERTEXBUFFER9     m_pVB_Patch;
-	LPDIRECT3DINDEXBUFFER9      m_pIB_Patch;
+	// View matrices Render saw while recording, for the benchmarks
+	std::vector<D3DXMATRIX>     m_cameraPath;
+	bool                        m_bRecordPath;
 
 	std::vector<LPDIRECT3DTEXTURE9> m_pLightmaps;
 
@@ -52,7 +79,41 @@ public:
 	void Clear();
 
 	BOOL Load(btDynamicsWorld* dynamicsWorld, const std::wstring& filename);
+	// Lumps, patches and visibility only, no device or physics needed
+	BOOL LoadMap(const std::wstring& filename);
 	void Render();
+	// Visible surfaces for a D3D view and projection, all of them when culling is off
+	const std::vector<int>& CullSurfaces(const D3DXMATRIX& view, const D3DXMATRIX& proj);
+	// Patch subdivision for the next load, and for every patch while the LOD is off
+	void SetTessLevel(int level) { m_tessLevel = std::max(1, level); }
+	// Per patch subdivision from the view (CQ3PatchLod), applied from the next Render on
+	void SetPatchLod(bool enable) { m_bPatchLod = enable; }
+	bool GetPatchLod() const { return m_bPatchLod; }
+	void SetPatchLodError(float pixels) { m_patchLod.SetErrorPixels(pixels); }
+	// Levels for a D3D view and projection, and the patches whose level changed tessellated
+	// again. Returns how many were.
+	int UpdatePatchLod(const D3DXMATRIX& view, const D3DXMATRIX& proj, float viewportHeight);
+	// While on, Render keeps every view matrix, the benchmarks then replay them instead of their own path
+	void SetPathRecording(bool record);
+	// false: every lump is read into its own copy instead of viewed in the mapped file
+	void SetMappedLoad(bool enable) { m_bMappedLoad = enable; }
+	void SetCulling(bool enable) { m_bCulling = enable; }
+	bool GetCulling() const { return m_bCulling; }
+	const Q3VisStats& GetVisStats() const { return m_vis.GetStats(); }
+	// Culls from the middle of 'views' random leafs, random heading, and logs the time and what's left
+	void BenchmarkVisibility(int views = 1000);
+	// LoadMap with and without the mapping, best time and the memory the loaded map holds.
+	// Loads into a scratch CQ3BSP, the map loaded here is left alone.
+	void BenchmarkLoad(const std::wstring& filename, int runs = 3);
+	// Draw calls, texture changes and index upload per frame along a camera path,
+	// batched against one draw per surface
+	void BenchmarkBatches(int frames = 1000);
+	// Patch tessellation of the loaded map at levels 8 and 16, appending as Load used to
+	// against presized on one and on all threads
+	void BenchmarkTessellation(int runs = 3);
+	// Patch triangles per frame along the camera path with the view LOD against the fixed level,
+	// and what picking the levels and tessellating the changed patches again costs
+	void BenchmarkPatchLod(int frames = 1000);
 	BOOL InitGraphics(LPDIRECT3DDEVICE9 pDevice);
 	void CreateLightmaps();
 
@@ -79,13 +140,31 @@ protected:
 	BOOL	CopyHeader(dheader_t* header);
 	int		CopyLump(dheader_t header, int lump, void* dest, int size);
 	int		Flength(FILE* f);
-	BOOL	LoadEntities(FILE* f, const dheader_t& h);
+	BOOL	LoadEntities(const char* text, int fileLen);
 	// Helper to load specific lumps
 	template <typename T>
-	BOOL	LoadLump(FILE* f, const dheader_t& h, int lumpIndex, std::vector<T>& destVector);
+	BOOL	LoadLump(FILE* f, const dheader_t& h, int lumpIndex, Q3Lump<T>& dest);
+	template <typename T>
+	BOOL	MapLump(const dheader_t& h, int lumpIndex, Q3Lump<T>& dest);
+	BOOL	ReadLumps(const std::wstring& filename);
+	BOOL	MapLumps(const std::wstring& filename);
+	BOOL	CheckSurfaces() const;
+	void	TessellatePatches(int tessLevel);
+	int		RetessellatePatches(const std::vector<int>& levelU, const std::vector<int>& levelV);
+	void	BuildBatches();
+	BOOL	CreateWorldVB(UINT numVerts);
+	BOOL	CreateBatchIB(UINT numIndexes);
+	void	WritePatchVertices(Q3BSPVertex* dst) const;
+	void	UploadPatches();
+	UINT	UploadBatchIndexes(const std::vector<Q3IndexRange>& dirty, bool* discarded = NULL);
+	D3DXVECTOR3 MapPosition(const D3DXMATRIX& view) const;
+	// The recorded path, or straight runs between random open leafs looking where they go
+	void	CameraPath(int frames, std::vector<D3DXMATRIX>& views) const;
 	// Call this after the BSP and Radiosity are baked
 	void InitPhysics(btDynamicsWorld* dynamicsWorld);
 	void CleanupPhysics();
 
+	std::vector<int> m_allSurfaces;    // What CullSurfaces returns without culling
+
 };
 
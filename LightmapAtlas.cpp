@@ -0,0 +1,301 @@
+#include "stdafx.h"
+#include "LightmapAtlas.h"
+
+// Neighbours share a chart when their planes agree this closely
+static const float CHART_COS = 0.9999f;
+static const float CHART_PLANE_DIST = 0.001f;
+static const float TEXEL_GROWTH = 1.25f;    // Texel size step when the atlas doesn't fit
+static const int MAX_GROWTH_STEPS = 100;     // 1.25^100 is ~10^9 times the asked texel size
+
+struct LightmapPosHash
+{
+    size_t operator()(const std::pair<uint64_t, UINT>& k) const { return (size_t)(k.first * 0x9E3779B97F4A7C15ull ^ k.second); }
+};
+
+static int FindRoot(std::vector<int>& parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static UINT NextPow2(UINT v)
+{
+    UINT p = 1;
+    while (p < v) p <<= 1;
+    return p;
+}
+
+bool CLightmapAtlas::Build(std::vector<BSPTriangle>& tris, float texelSize, UINT maxSize)
+{
+    m_width = m_height = 0;
+    m_chartCount = 0;
+    if (tris.empty() || texelSize <= 0.0f || maxSize < 16) return false;
+
+    // 1. Face planes, and shared edges through bit-exact positions
+    const int triCount = (int)tris.size();
+    std::vector<D3DXPLANE> planes(triCount);
+    std::unordered_map<std::pair<uint64_t, UINT>, UINT, LightmapPosHash> posIds;
+    std::unordered_map<uint64_t, std::vector<int>> edges;
+    posIds.reserve(triCount * 2);
+    for (int t = 0; t < triCount; t++)
+    {
+        const OBJVertex* v = tris[t].v;
+        D3DXVECTOR3 p0(v[0].x, v[0].y, v[0].z), p1(v[1].x, v[1].y, v[1].z), p2(v[2].x, v[2].y, v[2].z);
+        D3DXVECTOR3 e1 = p1 - p0, e2 = p2 - p0, n;
+        D3DXVec3Cross(&n, &e1, &e2);
+        // Slivers still need UVs, any plane will do
+        if (D3DXVec3LengthSq(&n) < 1e-20f) n = D3DXVECTOR3(0, 1, 0);
+        D3DXVec3Normalize(&n, &n);
+        planes[t] = D3DXPLANE(n.x, n.y, n.z, -D3DXVec3Dot(&n, &p0));
+
+        UINT id[3];
+        for (int i = 0; i < 3; i++)
+        {
+            UINT px, py, pz;
+            memcpy(&px, &v[i].x, 4); memcpy(&py, &v[i].y, 4); memcpy(&pz, &v[i].z, 4);
+            id[i] = posIds.emplace(std::make_pair(((uint64_t)px << 32) | py, pz), (UINT)posIds.size()).first->second;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            UINT a = id[i], b = id[(i + 1) % 3];
+            if (a == b) continue;
+            uint64_t key = (a < b) ? (((uint64_t)a << 32) | b) : (((uint64_t)b << 32) | a);
+            edges[key].push_back(t);
+        }
+    }
+
+    // 2. Charts: coplanar neighbours merged
+    std::vector<int> parent(triCount);
+    for (int t = 0; t < triCount; t++) parent[t] = t;
+    for (const auto& edge : edges)
+    {
+        const std::vector<int>& list = edge.second;
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            for (size_t j = i + 1; j < list.size(); j++)
+            {
+                const D3DXPLANE& a = planes[list[i]];
+                const D3DXPLANE& b = planes[list[j]];
+                if (a.a * b.a + a.b * b.b + a.c * b.c < CHART_COS || fabsf(a.d - b.d) > CHART_PLANE_DIST) continue;
+                int ra = FindRoot(parent, list[i]), rb = FindRoot(parent, list[j]);
+                if (ra != rb) parent[std::max(ra, rb)] = std::min(ra, rb);
+            }
+        }
+    }
+
+    std::vector<int> chartOf(triCount, -1);
+    std::vector<Chart> charts;
+    for (int t = 0; t < triCount; t++)
+    {
+        int root = FindRoot(parent, t);
+        if (chartOf[root] < 0)
+        {
+            chartOf[root] = (int)charts.size();
+            Chart chart;
+            // Walls get a horizontal U, floors and ceilings follow Z
+            D3DXVECTOR3 n(planes[root].a, planes[root].b, planes[root].c);
+            D3DXVECTOR3 helper = (fabsf(n.y) < 0.9f) ? D3DXVECTOR3(0, 1, 0) : D3DXVECTOR3(0, 0, 1);
+            D3DXVec3Cross(&chart.axisU, &helper, &n);
+            D3DXVec3Normalize(&chart.axisU, &chart.axisU);
+            D3DXVec3Cross(&chart.axisV, &n, &chart.axisU);
+            chart.minU = chart.minV = FLT_MAX;
+            chart.maxU = chart.maxV = -FLT_MAX;
+            charts.push_back(chart);
+        }
+        chartOf[t] = chartOf[root];
+        Chart& chart = charts[chartOf[t]];
+        for (int i = 0; i < 3; i++)
+        {
+            D3DXVECTOR3 p(tris[t].v[i].x, tris[t].v[i].y, tris[t].v[i].z);
+            float u = D3DXVec3Dot(&p, &chart.axisU), v = D3DXVec3Dot(&p, &chart.axisV);
+            chart.minU = std::min(chart.minU, u); chart.maxU = std::max(chart.maxU, u);
+            chart.minV = std::min(chart.minV, v); chart.maxV = std::max(chart.maxV, v);
+        }
+    }
+    m_chartCount = (int)charts.size();
+
+    // 3. Pack, coarser texels until it fits. Every chart keeps at least one texel inside its
+    // padding, so past that point growing doesn't help: too many charts for maxSize.
+    int width = 0, usedHeight = 0;
+    bool packed = false;
+    float texel = texelSize;
+    for (int step = 0; step < MAX_GROWTH_STEPS && !packed; step++, texel *= TEXEL_GROWTH)
+    {
+        m_texelSize = texel;
+        double area = UNLIT_BLOCK * UNLIT_BLOCK;
+        int widest = UNLIT_BLOCK;
+        bool smallest = true;
+        for (Chart& chart : charts)
+        {
+            chart.w = (int)ceilf((chart.maxU - chart.minU) / texel) + 2 * PADDING;
+            chart.h = (int)ceilf((chart.maxV - chart.minV) / texel) + 2 * PADDING;
+            area += (double)chart.w * chart.h;
+            widest = std::max(widest, chart.w);
+            if (chart.w > 2 * PADDING + 1 || chart.h > 2 * PADDING + 1) smallest = false;
+        }
+        if (widest > (int)maxSize) continue;
+
+        for (width = (int)std::max(NextPow2((UINT)widest), NextPow2((UINT)sqrt(area))); width <= (int)maxSize; width *= 2)
+        {
+            if (Pack(charts, width, (int)maxSize, usedHeight))
+            {
+                packed = true;
+                break;
+            }
+        }
+        if (!packed && smallest) break;
+    }
+    if (!packed)
+    {
+        m_width = m_height = 0;
+        return false;
+    }
+    m_width = (UINT)width;
+    m_height = NextPow2((UINT)usedHeight);
+
+    // 4. Lightmap UVs, texel (x, y) covers [x, x + 1) in pixel units
+    for (int t = 0; t < triCount; t++)
+    {
+        const Chart& chart = charts[chartOf[t]];
+        for (int i = 0; i < 3; i++)
+        {
+            OBJVertex& vert = tris[t].v[i];
+            D3DXVECTOR3 p(vert.x, vert.y, vert.z);
+            float u = (D3DXVec3Dot(&p, &chart.axisU) - chart.minU) / m_texelSize;
+            float v = (D3DXVec3Dot(&p, &chart.axisV) - chart.minV) / m_texelSize;
+            vert.lu = (chart.x + PADDING + u) / m_width;
+            vert.lv = (chart.y + PADDING + v) / m_height;
+        }
+    }
+    return true;
+}
+
+bool CLightmapAtlas::Pack(std::vector<Chart>& charts, int width, int maxHeight, int& usedHeight) const
+{
+    // Tallest first, so every shelf is about as high as its charts
+    std::vector<int> order(charts.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+    std::sort(order.begin(), order.end(), [&](int a, int b)
+        {
+            if (charts[a].h != charts[b].h) return charts[a].h > charts[b].h;
+            return a < b;
+        });
+
+    // The unlit block opens the first shelf
+    int x = UNLIT_BLOCK, y = 0, rowHeight = UNLIT_BLOCK;
+    for (int i : order)
+    {
+        Chart& chart = charts[i];
+        if (x + chart.w > width)
+        {
+            x = 0;
+            y += rowHeight;
+            rowHeight = 0;
+        }
+        if (y + chart.h > maxHeight) return false;
+        chart.x = x;
+        chart.y = y;
+        x += chart.w;
+        rowHeight = std::max(rowHeight, chart.h);
+    }
+    usedHeight = y + rowHeight;
+    return true;
+}
+
+void CLightmapAtlas::GatherTexels(const std::vector<OBJVertex>& flatVerts, std::vector<LightmapTexel>& out, std::vector<BYTE>& covered) const
+{
+    out.clear();
+    covered.assign((size_t)m_width * m_height, 0);
+    if (m_width == 0 || m_height == 0) return;
+
+    const int triCount = (int)(flatVerts.size() / 3);
+    for (int t = 0; t < triCount; t++)
+    {
+        const OBJVertex* v = &flatVerts[(size_t)t * 3];
+        float sx[3], sy[3];
+        for (int i = 0; i < 3; i++)
+        {
+            sx[i] = v[i].lu * m_width;
+            sy[i] = v[i].lv * m_height;
+        }
+        float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+        if (fabsf(area) < 1e-12f) continue;
+        const float invArea = 1.0f / area;
+
+        D3DXVECTOR3 p0(v[0].x, v[0].y, v[0].z), p1(v[1].x, v[1].y, v[1].z), p2(v[2].x, v[2].y, v[2].z);
+        D3DXVECTOR3 e1 = p1 - p0, e2 = p2 - p0, n;
+        D3DXVec3Cross(&n, &e1, &e2);
+        D3DXVec3Normalize(&n, &n);
+
+        int minX = std::max(0, (int)ceilf(std::min(sx[0], std::min(sx[1], sx[2])) - 0.5f));
+        int maxX = std::min((int)m_width - 1, (int)floorf(std::max(sx[0], std::max(sx[1], sx[2])) - 0.5f));
+        int minY = std::max(0, (int)ceilf(std::min(sy[0], std::min(sy[1], sy[2])) - 0.5f));
+        int maxY = std::min((int)m_height - 1, (int)floorf(std::max(sy[0], std::max(sy[1], sy[2])) - 0.5f));
+        for (int py = minY; py <= maxY; py++)
+        {
+            for (int px = minX; px <= maxX; px++)
+            {
+                const float fx = px + 0.5f, fy = py + 0.5f;
+                float b0 = ((sx[1] - fx) * (sy[2] - fy) - (sx[2] - fx) * (sy[1] - fy)) * invArea;
+                float b1 = ((sx[2] - fx) * (sy[0] - fy) - (sx[0] - fx) * (sy[2] - fy)) * invArea;
+                float b2 = 1.0f - b0 - b1;
+                if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f) continue;
+
+                // Pieces of a split triangle share their edges, the first one takes the texel
+                const UINT pixel = (UINT)py * m_width + px;
+                if (covered[pixel]) continue;
+                covered[pixel] = 1;
+
+                LightmapTexel texel;
+                texel.pos = p0 * b0 + p1 * b1 + p2 * b2;
+                texel.normal = n;
+                texel.tri = t;
+                texel.b[0] = b0; texel.b[1] = b1; texel.b[2] = b2;
+                texel.pixel = pixel;
+                out.push_back(texel);
+            }
+        }
+    }
+}
+
+void CLightmapAtlas::Dilate(std::vector<DWORD>& pixels, std::vector<BYTE>& covered, int passes) const
+{
+    const int w = (int)m_width, h = (int)m_height;
+    std::vector<UINT> grown;
+    for (int pass = 0; pass < passes; pass++)
+    {
+        grown.clear();
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const UINT pixel = (UINT)y * w + x;
+                if (covered[pixel]) continue;
+                // Average of the covered 8-neighbours
+                UINT r = 0, g = 0, b = 0, count = 0;
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+                        UINT other = (UINT)ny * w + nx;
+                        if (!covered[other]) continue;
+                        DWORD c = pixels[other];
+                        r += (c >> 16) & 0xFF; g += (c >> 8) & 0xFF; b += c & 0xFF;
+                        count++;
+                    }
+                }
+                if (count == 0) continue;
+                pixels[pixel] = 0xFF000000 | ((r / count) << 16) | ((g / count) << 8) | (b / count);
+                grown.push_back(pixel);
+            }
+        }
+        if (grown.empty()) break;
+        for (UINT pixel : grown) covered[pixel] = 1;
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "stdafx.h"
+#include "CBSPlevel.h"
+
+// A lightmap texel that lies on the level, see CBSPlevel::BakeLightmap
+struct LightmapTexel
+{
+    D3DXVECTOR3 pos;        // Texel center on the triangle, level space
+    D3DXVECTOR3 normal;     // Face normal
+    int         tri;        // Flat triangle (m_flatVerts / 3)
+    float       b[3];       // Barycentrics of pos in it
+    UINT        pixel;      // y * width + x
+};
+
+// Lightmap unwrap for CBSPlevel. Edge-connected coplanar triangles become one chart, projected
+// onto their plane at a fixed world size per texel, and the charts are shelf packed into one
+// atlas like CHL1BSP's lightmap blocks. All CPU side, the texels are filled by the level.
+class CLightmapAtlas
+{
+public:
+    static const int PADDING = 1;       // Texels around every chart, room for Dilate
+    static const int UNLIT_BLOCK = 2;   // White texels at (0,0), for triangles that never got lightmap UVs
+
+    // Charts 'tris' and writes lu/lv into their vertices. The texel size grows until the
+    // atlas fits into maxSize x maxSize. False for an empty mesh, or when the charts don't
+    // fit even at one texel each.
+    bool Build(std::vector<BSPTriangle>& tris, float texelSize, UINT maxSize);
+
+    // Texels whose center lies on one of the triangles (3 vertices each, lu/lv from Build,
+    // split or not). 'covered' gets 1 for them, width * height entries.
+    void GatherTexels(const std::vector<OBJVertex>& flatVerts, std::vector<LightmapTexel>& out, std::vector<BYTE>& covered) const;
+    // Grows the covered texels into their empty neighbours 'passes' times, so bilinear
+    // filtering at chart borders never picks up the background
+    void Dilate(std::vector<DWORD>& pixels, std::vector<BYTE>& covered, int passes) const;
+
+    UINT  GetWidth() const { return m_width; }
+    UINT  GetHeight() const { return m_height; }
+    int   GetChartCount() const { return m_chartCount; }
+    float GetTexelSize() const { return m_texelSize; }
+
+private:
+    struct Chart
+    {
+        D3DXVECTOR3 axisU, axisV;
+        float minU = 0, minV = 0, maxU = 0, maxV = 0;  // World units along the axes
+        int   w = 0, h = 0;                             // Texels, padding included
+        int   x = 0, y = 0;                             // Placement in the atlas
+    };
+
+    // Shelf packs at m_texelSize into 'width', false if it needs more than maxHeight
+    bool Pack(std::vector<Chart>& charts, int width, int maxHeight, int& usedHeight) const;
+
+    UINT  m_width = 0, m_height = 0;
+    int   m_chartCount = 0;
+    float m_texelSize = 0.0f;
+};
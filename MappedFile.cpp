@@ -0,0 +1,73 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+
+CMappedFile::CMappedFile()
+{
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+    m_pData = nullptr;
+    m_size = 0;
+}
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+BOOL CMappedFile::Open(const std::string& filename)
+{
+    Close();
+    HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    return MapHandle(hFile);
+}
+
+BOOL CMappedFile::Open(const std::wstring& filename)
+{
+    Close();
+    HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    return MapHandle(hFile);
+}
+
+BOOL CMappedFile::MapHandle(HANDLE hFile)
+{
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    m_hFile = hFile;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0)
+    {
+        // Empty files can't be mapped
+        Close();
+        return FALSE;
+    }
+    m_size = (size_t)size.QuadPart;
+
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_hMapping)
+    {
+        Close();
+        return FALSE;
+    }
+
+    m_pData = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_pData)
+    {
+        Close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void CMappedFile::Close()
+{
+    if (m_pData) UnmapViewOfFile(m_pData);
+    if (m_hMapping) CloseHandle(m_hMapping);
+    if (m_hFile != INVALID_HANDLE_VALUE) CloseHandle(m_hFile);
+
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+    m_pData = nullptr;
+    m_size = 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "stdafx.h"
+
+// Read-only memory mapped file. The view stays valid until Close() or destruction.
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    BOOL Open(const std::string& filename);
+    BOOL Open(const std::wstring& filename);
+    void Close();
+
+    BOOL IsOpen() const { return m_pData != nullptr; }
+    const BYTE* GetData() const { return m_pData; }
+    size_t GetSize() const { return m_size; }
+
+private:
+    BOOL MapHandle(HANDLE hFile);
+
+    HANDLE      m_hFile;
+    HANDLE      m_hMapping;
+    const BYTE* m_pData;
+    size_t      m_size;
+};
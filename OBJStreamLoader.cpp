@@ -0,0 +1,395 @@
+#include "stdafx.h"
+#include "Logger.h"
+#include "MappedFile.h"
+#include "OBJStreamLoader.h"
+
+// Lines are small, chunks just need to be big enough to keep the threads busy
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+static inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+
+static inline const char* SkipSpace(const char* p, const char* end)
+{
+    while (p < end && IsSpace(*p)) p++;
+    return p;
+}
+
+static inline const char* NextLine(const char* p, const char* end)
+{
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+// Keyword at p, followed by a space (so "v" doesn't match "vn")
+static inline bool IsKeyword(const char* p, const char* lineEnd, const char* word, size_t len)
+{
+    return (size_t)(lineEnd - p) > len && memcmp(p, word, len) == 0 && IsSpace(p[len]);
+}
+
+static inline const char* ParseInt(const char* p, const char* end, int& out)
+{
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    int v = 0;
+    while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    out = neg ? -v : v;
+    return p;
+}
+
+// Plain decimal/exponent float reader, no locale and no allocation
+static inline const char* ParseFloat(const char* p, const char* end, float& out)
+{
+    static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    p = SkipSpace(p, end);
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); digits++; }
+        else exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); digits++; exponent--; }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int e = 0;
+        p = ParseInt(p + 1, end, e);
+        exponent += e;
+    }
+
+    double v = (double)mantissa;
+    if (exponent < 0) v = (exponent >= -22) ? v / POW10[-exponent] : v * pow(10.0, exponent);
+    else if (exponent > 0) v = (exponent <= 22) ? v * POW10[exponent] : v * pow(10.0, exponent);
+    out = (float)(neg ? -v : v);
+    return p;
+}
+
+// OBJ indices are 1 based, negative ones count back from the current end
+static inline int ResolveIndex(int idx, UINT count)
+{
+    if (idx > 0) return (idx <= (int)count) ? idx - 1 : -1;
+    if (idx < 0) return ((int)count + idx >= 0) ? (int)count + idx : -1;
+    return -1;
+}
+
+void COBJStreamLoader::CountChunk(Chunk& chunk)
+{
+    for (const char* line = chunk.begin; line < chunk.end; )
+    {
+        const char* next = NextLine(line, chunk.end);
+        const char* p = SkipSpace(line, next);
+
+        if (p < next)
+        {
+            switch (*p)
+            {
+            case 'v':
+                if (IsKeyword(p, next, "v", 1))        chunk.numV++;
+                else if (IsKeyword(p, next, "vt", 2))  chunk.numVT++;
+                else if (IsKeyword(p, next, "vn", 2))  chunk.numVN++;
+                break;
+            case 'f':
+                if (IsKeyword(p, next, "f", 1))
+                {
+                    // One triangle per corner past the second
+                    int corners = 0;
+                    for (const char* q = p + 1; q < next; )
+                    {
+                        q = SkipSpace(q, next);
+                        if (q >= next || *q == '\r' || *q == '\n') break;
+                        corners++;
+                        while (q < next && !IsSpace(*q) && *q != '\r' && *q != '\n') q++;
+                    }
+                    if (corners >= 3) chunk.numTris += corners - 2;
+                }
+                break;
+            case 'o':
+            case 'g':
+                if (IsKeyword(p, next, "o", 1) || IsKeyword(p, next, "g", 1)) chunk.numGroups++;
+                break;
+            case 'u':
+                if (IsKeyword(p, next, "usemtl", 6))
+                {
+                    const char* s = SkipSpace(p + 7, next);
+                    const char* e = next;
+                    while (e > s && (e[-1] == '\n' || e[-1] == '\r' || IsSpace(e[-1]))) e--;
+                    chunk.lastMaterial.assign(s, e);
+                }
+                break;
+            case 'm':
+                if (IsKeyword(p, next, "mtllib", 6))
+                {
+                    const char* s = SkipSpace(p + 7, next);
+                    const char* e = next;
+                    while (e > s && (e[-1] == '\n' || e[-1] == '\r' || IsSpace(e[-1]))) e--;
+                    chunk.mtlLibs.push_back(std::string(s, e));
+                }
+                break;
+            }
+        }
+        line = next;
+    }
+}
+
+void COBJStreamLoader::ReadAttributes(const Chunk& chunk, float scale)
+{
+    float* pos = m_positions.data() + (size_t)chunk.baseV * 3;
+    float* uv = m_texcoords.data() + (size_t)chunk.baseVT * 2;
+    float* nrm = m_normals.data() + (size_t)chunk.baseVN * 3;
+
+    for (const char* line = chunk.begin; line < chunk.end; )
+    {
+        const char* next = NextLine(line, chunk.end);
+        const char* p = SkipSpace(line, next);
+
+        if (p < next && *p == 'v')
+        {
+            if (IsKeyword(p, next, "v", 1))
+            {
+                p = ParseFloat(p + 1, next, pos[0]);
+                p = ParseFloat(p, next, pos[1]);
+                p = ParseFloat(p, next, pos[2]);
+                pos[0] *= scale; pos[1] *= scale; pos[2] *= scale;
+                pos += 3;
+            }
+            else if (IsKeyword(p, next, "vt", 2))
+            {
+                p = ParseFloat(p + 2, next, uv[0]);
+                p = ParseFloat(p, next, uv[1]);
+                uv[1] = 1.0f - uv[1]; // D3D texture space
+                uv += 2;
+            }
+            else if (IsKeyword(p, next, "vn", 2))
+            {
+                p = ParseFloat(p + 2, next, nrm[0]);
+                p = ParseFloat(p, next, nrm[1]);
+                p = ParseFloat(p, next, nrm[2]);
+                nrm += 3;
+            }
+        }
+        line = next;
+    }
+}
+
+void COBJStreamLoader::ReadFaces(Chunk& chunk, BSPTriangle* out)
+{
+    // Running counts, needed for negative indices
+    UINT countV = chunk.baseV, countVT = chunk.baseVT, countVN = chunk.baseVN;
+    UINT group = chunk.baseGroup;
+    int material = chunk.startMaterial;
+    BSPTriangle* dst = out + chunk.baseTri;
+
+    for (const char* line = chunk.begin; line < chunk.end; )
+    {
+        const char* next = NextLine(line, chunk.end);
+        const char* p = SkipSpace(line, next);
+        if (p >= next) { line = next; continue; }
+
+        if (*p == 'v')
+        {
+            if (IsKeyword(p, next, "v", 1))        countV++;
+            else if (IsKeyword(p, next, "vt", 2))  countVT++;
+            else if (IsKeyword(p, next, "vn", 2))  countVN++;
+        }
+        else if ((*p == 'o' || *p == 'g') && (IsKeyword(p, next, "o", 1) || IsKeyword(p, next, "g", 1)))
+        {
+            group++;
+        }
+        else if (*p == 'u' && IsKeyword(p, next, "usemtl", 6))
+        {
+            // Resolved once per usemtl line, faces just carry the index
+            const char* s = SkipSpace(p + 7, next);
+            const char* e = next;
+            while (e > s && (e[-1] == '\n' || e[-1] == '\r' || IsSpace(e[-1]))) e--;
+            auto it = m_materialMap.find(std::string(s, e));
+            material = (it != m_materialMap.end()) ? it->second : 0;
+        }
+        else if (*p == 'f' && IsKeyword(p, next, "f", 1))
+        {
+            OBJVertex first, prev;
+            int corner = 0;
+            bool valid = true;
+            const char* q = p + 1;
+            for (;;)
+            {
+                q = SkipSpace(q, next);
+                if (q >= next || *q == '\r' || *q == '\n') break;
+
+                int vi = 0, ti = 0, ni = 0;
+                q = ParseInt(q, next, vi);
+                if (q < next && *q == '/')
+                {
+                    q++;
+                    if (q < next && *q != '/') q = ParseInt(q, next, ti);
+                    if (q < next && *q == '/') q = ParseInt(q + 1, next, ni);
+                }
+                while (q < next && !IsSpace(*q) && *q != '\r' && *q != '\n') q++;
+
+                OBJVertex vert;
+                int v = ResolveIndex(vi, countV);
+                if (v < 0) valid = false;
+                else
+                {
+                    vert.x = m_positions[(size_t)v * 3 + 0];
+                    vert.y = m_positions[(size_t)v * 3 + 1];
+                    vert.z = m_positions[(size_t)v * 3 + 2];
+                }
+                int n = (ni != 0) ? ResolveIndex(ni, countVN) : -1;
+                if (n >= 0)
+                {
+                    vert.nx = m_normals[(size_t)n * 3 + 0];
+                    vert.ny = m_normals[(size_t)n * 3 + 1];
+                    vert.nz = m_normals[(size_t)n * 3 + 2];
+                }
+                else { vert.nx = 0; vert.ny = 1; vert.nz = 0; }
+                int t = (ti != 0) ? ResolveIndex(ti, countVT) : -1;
+                if (t >= 0)
+                {
+                    vert.u = m_texcoords[(size_t)t * 2 + 0];
+                    vert.v = m_texcoords[(size_t)t * 2 + 1];
+                }
+
+                // Fan triangulation
+                if (corner == 0) first = vert;
+                else if (corner >= 2 && valid)
+                {
+                    BSPTriangle& tri = dst[chunk.written++];
+                    tri.v[0] = first;
+                    tri.v[1] = prev;
+                    tri.v[2] = vert;
+                    tri.matIndex = material;
+                    tri.objectId = (int)group;
+                }
+                prev = vert;
+                corner++;
+            }
+        }
+        line = next;
+    }
+}
+
+void COBJStreamLoader::LoadMaterialLibs(const std::string& baseDir, const std::vector<Chunk>& chunks,
+    std::vector<tinyobj::material_t>& materials)
+{
+    materials.clear();
+    m_materialMap.clear();
+    for (const auto& chunk : chunks)
+    {
+        for (const auto& lib : chunk.mtlLibs)
+        {
+            std::ifstream file(baseDir + lib);
+            if (!file)
+            {
+                _log(L"WARNING: material library %S not found\n", lib.c_str());
+                continue;
+            }
+            std::string warn, err;
+            tinyobj::LoadMtl(&m_materialMap, &materials, &file, &warn, &err);
+            if (!warn.empty()) _log(L"WARNING: %S\n", warn.c_str());
+            if (!err.empty()) _log(L"ERROR: %S\n", err.c_str());
+        }
+    }
+}
+
+BOOL COBJStreamLoader::Load(const std::string& filename, float scale,
+    std::vector<tinyobj::material_t>& materials, std::vector<BSPTriangle>& tris)
+{
+    auto t0 = std::chrono::steady_clock::now();
+
+    CMappedFile file;
+    if (!file.Open(filename))
+    {
+        _log(L"Failed to open .obj file: %S\n", filename.c_str());
+        return FALSE;
+    }
+    m_fileBytes = file.GetSize();
+
+    // 1. Line aligned chunks
+    const char* data = (const char*)file.GetData();
+    const char* dataEnd = data + file.GetSize();
+    int threads = omp_get_max_threads();
+    size_t chunkBytes = std::max(MIN_CHUNK_BYTES, file.GetSize() / (threads * 8) + 1);
+
+    std::vector<Chunk> chunks;
+    for (const char* p = data; p < dataEnd; )
+    {
+        Chunk chunk;
+        chunk.begin = p;
+        chunk.end = (size_t)(dataEnd - p) > chunkBytes ? NextLine(p + chunkBytes, dataEnd) : dataEnd;
+        chunks.push_back(chunk);
+        p = chunk.end;
+    }
+    const int numChunks = (int)chunks.size();
+
+    // 2. Count
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++)
+        CountChunk(chunks[c]);
+
+    // 3. Materials, then the prefix sums (usemtl state carries over from earlier chunks)
+    std::string baseDir;
+    size_t slash = filename.find_last_of("/\\");
+    if (slash != std::string::npos) baseDir = filename.substr(0, slash + 1);
+    LoadMaterialLibs(baseDir, chunks, materials);
+
+    UINT totalV = 0, totalVT = 0, totalVN = 0, totalTris = 0, totalGroups = 0;
+    int material = 0;
+    for (auto& chunk : chunks)
+    {
+        chunk.baseV = totalV;     totalV += chunk.numV;
+        chunk.baseVT = totalVT;   totalVT += chunk.numVT;
+        chunk.baseVN = totalVN;   totalVN += chunk.numVN;
+        chunk.baseTri = totalTris; totalTris += chunk.numTris;
+        chunk.baseGroup = totalGroups; totalGroups += chunk.numGroups;
+        chunk.startMaterial = material;
+        if (!chunk.lastMaterial.empty())
+        {
+            auto it = m_materialMap.find(chunk.lastMaterial);
+            material = (it != m_materialMap.end()) ? it->second : 0;
+        }
+    }
+
+    // 4. Attributes first, faces may point at vertices from any earlier chunk
+    m_positions.resize((size_t)totalV * 3);
+    m_texcoords.resize((size_t)totalVT * 2);
+    m_normals.resize((size_t)totalVN * 3);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++)
+        ReadAttributes(chunks[c], scale);
+
+    // 5. Faces straight into their slice of the output
+    tris.clear();
+    tris.resize(totalTris);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++)
+        ReadFaces(chunks[c], tris.data());
+
+    // Faces with bad indices leave holes at the end of their chunk's slice
+    UINT dst = 0, dropped = 0;
+    for (const auto& chunk : chunks)
+    {
+        if (dst != chunk.baseTri)
+            std::move(tris.begin() + chunk.baseTri, tris.begin() + chunk.baseTri + chunk.written, tris.begin() + dst);
+        dst += chunk.written;
+        dropped += chunk.numTris - chunk.written;
+    }
+    tris.resize(dst);
+    if (dropped) _log(L"WARNING: %d triangles with bad indices dropped\n", (int)dropped);
+
+    std::vector<float>().swap(m_positions);
+    std::vector<float>().swap(m_texcoords);
+    std::vector<float>().swap(m_normals);
+
+    m_loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return TRUE;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "stdafx.h"
+#include "tiny_obj_loader.h"
+#include "CBSPlevel.h"
+
+// Memory mapped, multithreaded OBJ reader for big scanned levels.
+// The file is cut into line aligned chunks. Pass 1 counts every chunk, the prefix
+// sums give each chunk its slice of the output, then the chunks are parsed in
+// parallel straight into presized arrays. Faces are fan triangulated like tinyobj.
+// objectId is the index of the o/g group the face is in (0 before the first one).
+class COBJStreamLoader
+{
+public:
+    BOOL Load(const std::string& filename, float scale,
+        std::vector<tinyobj::material_t>& materials, std::vector<BSPTriangle>& tris);
+
+    size_t GetFileBytes() const { return m_fileBytes; }
+    double GetLoadMs() const { return m_loadMs; }
+
+private:
+    struct Chunk
+    {
+        const char* begin = nullptr;
+        const char* end = nullptr;
+
+        // Pass 1
+        UINT numV = 0, numVT = 0, numVN = 0;
+        UINT numTris = 0;
+        UINT numGroups = 0;
+        std::string lastMaterial;   // Last usemtl in the chunk, empty if none
+        std::vector<std::string> mtlLibs;
+
+        // Prefix sums of the chunks before this one
+        UINT baseV = 0, baseVT = 0, baseVN = 0;
+        UINT baseTri = 0;
+        UINT baseGroup = 0;
+        int  startMaterial = 0;
+
+        // Pass 3
+        UINT written = 0;           // Triangles actually produced (bad faces are dropped)
+    };
+
+    void CountChunk(Chunk& chunk);
+    void ReadAttributes(const Chunk& chunk, float scale);
+    void ReadFaces(Chunk& chunk, BSPTriangle* out);
+    void LoadMaterialLibs(const std::string& baseDir, const std::vector<Chunk>& chunks,
+        std::vector<tinyobj::material_t>& materials);
+
+    std::vector<float> m_positions; // 3 per v
+    std::vector<float> m_texcoords; // 2 per vt
+    std::vector<float> m_normals;   // 3 per vn
+    std::map<std::string, int> m_materialMap;
+
+    size_t m_fileBytes = 0;
+    double m_loadMs = 0.0;
+};
@@ -0,0 +1,148 @@
+#include "stdafx.h"
+#include "Q3Batches.h"
+#include <climits>
+
+void CQ3BatchBuilder::Clear()
+{
+	m_batches.clear();
+	m_members.clear();
+	m_surfaceMember.clear();
+	m_allIndexes.clear();
+	m_indexes.clear();
+	m_slotMembers.clear();
+	m_frameMembers.clear();
+	m_touched.clear();
+	m_drawn.clear();
+	m_dirty.clear();
+	m_invalid = true;
+}
+
+void CQ3BatchBuilder::Build(const std::vector<Q3BatchSurface>& surfaces)
+{
+	Clear();
+
+	// Drawable surfaces by (shader, lightmap), in map order inside a pair
+	std::vector<int> order;
+	for (int i = 0; i < (int)surfaces.size(); i++)
+		if (surfaces[i].indexes && surfaces[i].numIndexes > 0) order.push_back(i);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		if (surfaces[a].shader != surfaces[b].shader) return surfaces[a].shader < surfaces[b].shader;
+		return surfaces[a].lightmap < surfaces[b].lightmap;
+	});
+
+	m_surfaceMember.assign(surfaces.size(), -1);
+	m_members.reserve(order.size());
+	for (int surf : order)
+	{
+		const Q3BatchSurface& src = surfaces[surf];
+		if (m_batches.empty() || m_batches.back().shader != src.shader || m_batches.back().lightmap != src.lightmap)
+		{
+			Q3Batch batch;
+			batch.shader = src.shader;
+			batch.lightmap = src.lightmap;
+			batch.firstIndex = (UINT)m_allIndexes.size();
+			batch.slotIndexes = 0;
+			batch.numIndexes = 0;
+			batch.minVert = UINT_MAX;
+			batch.numVerts = 0;
+			m_batches.push_back(batch);
+		}
+		Q3Batch& batch = m_batches.back();
+
+		Member member;
+		member.surface = surf;
+		member.batch = (int)m_batches.size() - 1;
+		member.first = (UINT)m_allIndexes.size();
+		member.count = (UINT)src.numIndexes;
+		m_surfaceMember[surf] = (int)m_members.size();
+		m_members.push_back(member);
+
+		// Absolute indexes, and the vertex range the slot can ever touch
+		UINT maxVert = batch.numVerts ? batch.minVert + batch.numVerts - 1 : 0;
+		for (int i = 0; i < src.numIndexes; i++)
+		{
+			UINT v = (UINT)(src.indexes[i] + src.baseVertex);
+			m_allIndexes.push_back((int)v);
+			batch.minVert = std::min(batch.minVert, v);
+			maxVert = std::max(maxVert, v);
+		}
+		batch.numVerts = maxVert - batch.minVert + 1;
+		batch.slotIndexes += member.count;
+	}
+
+	m_indexes.assign(m_allIndexes.size(), 0);
+	m_slotMembers.resize(m_batches.size());
+	m_frameMembers.resize(m_batches.size());
+}
+
+void CQ3BatchBuilder::Invalidate()
+{
+	m_invalid = true;
+}
+
+const std::vector<Q3IndexRange>& CQ3BatchBuilder::Update(const std::vector<int>& visible)
+{
+	m_dirty.clear();
+
+	// Bucket the visible members by batch
+	m_touched.clear();
+	for (int surf : visible)
+	{
+		if (surf < 0 || surf >= (int)m_surfaceMember.size() || m_surfaceMember[surf] < 0) continue;
+		const int member = m_surfaceMember[surf];
+		std::vector<int>& bucket = m_frameMembers[m_members[member].batch];
+		if (bucket.empty()) m_touched.push_back(m_members[member].batch);
+		bucket.push_back(member);
+	}
+
+	// Batches that had something and now have nothing just stop drawing, their slot can stay
+	for (int b : m_drawn)
+	{
+		if (!m_frameMembers[b].empty()) continue;
+		m_batches[b].numIndexes = 0;
+		m_slotMembers[b].clear();
+	}
+
+	for (int b : m_touched)
+	{
+		// Member order is slot order, so the same set compares equal however it was found
+		std::vector<int>& members = m_frameMembers[b];
+		std::sort(members.begin(), members.end());
+		if (!m_invalid && members == m_slotMembers[b])
+		{
+			members.clear();
+			continue;
+		}
+
+		Q3Batch& batch = m_batches[b];
+		UINT pos = batch.firstIndex;
+		for (int member : members)
+		{
+			const Member& m = m_members[member];
+			memcpy(&m_indexes[pos], &m_allIndexes[m.first], m.count * sizeof(int));
+			pos += m.count;
+		}
+		batch.numIndexes = pos - batch.firstIndex;
+
+		Q3IndexRange range = { batch.firstIndex, batch.numIndexes };
+		m_dirty.push_back(range);
+		m_slotMembers[b].swap(members);
+		members.clear();
+	}
+	m_drawn.swap(m_touched);
+	m_invalid = false;
+
+	// Neighbouring slots go up as one range
+	std::sort(m_dirty.begin(), m_dirty.end(), [](const Q3IndexRange& a, const Q3IndexRange& b) { return a.first < b.first; });
+	size_t merged = 0;
+	for (size_t i = 0; i < m_dirty.size(); i++)
+	{
+		if (merged > 0 && m_dirty[merged - 1].first + m_dirty[merged - 1].count == m_dirty[i].first)
+			m_dirty[merged - 1].count += m_dirty[i].count;
+		else
+			m_dirty[merged++] = m_dirty[i];
+	}
+	m_dirty.resize(merged);
+	return m_dirty;
+}
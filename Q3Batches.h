@@ -0,0 +1,80 @@
+#pragma once
+#include "stdafx.h"
+
+// A drawable surface as CQ3BatchBuilder sees it. 'indexes' plus 'baseVertex' address the
+// shared vertex buffer, the pointer has to stay valid until the next Build.
+struct Q3BatchSurface
+{
+	int        shader = -1;
+	int        lightmap = -1;
+	const int* indexes = nullptr;
+	int        numIndexes = 0;
+	int        baseVertex = 0;
+};
+
+// One draw call: the visible surfaces of one (shader, lightmap) pair, packed at the start of
+// the pair's slot in the index buffer
+struct Q3Batch
+{
+	int  shader;
+	int  lightmap;
+	UINT firstIndex;    // Slot start
+	UINT slotIndexes;   // Slot size, every surface of the pair
+	UINT numIndexes;    // Visible this frame
+	UINT minVert;       // Vertex range of the whole slot
+	UINT numVerts;
+};
+
+// Index buffer elements to re-upload, [first, first + count)
+struct Q3IndexRange
+{
+	UINT first;
+	UINT count;
+};
+
+// Merges Q3 world surfaces into one draw call per (shader, lightmap). Build sorts them by that
+// pair and gives every pair a slot big enough for all of its surfaces, with the indexes made
+// absolute so no base vertex is needed. Update fills each slot with the pair's visible surfaces
+// only, and only for the pairs whose visible set changed since the last Update; the ranges it
+// returns are all that has to go to the device. Pure CPU, the renderer owns the index buffer.
+class CQ3BatchBuilder
+{
+public:
+	// 'surfaces' is indexed by surface number, entries without indexes are never drawn
+	void Build(const std::vector<Q3BatchSurface>& surfaces);
+	void Clear();
+
+	// 'visible' are surface numbers in any order, each once. The slots of unchanged batches
+	// keep what they had, so after Invalidate everything counts as changed.
+	const std::vector<Q3IndexRange>& Update(const std::vector<int>& visible);
+	// The device copy is gone (reset), the next Update rewrites every slot
+	void Invalidate();
+
+	const std::vector<Q3Batch>& GetBatches() const { return m_batches; }
+	// CPU copy of the index buffer, GetIndexCount() elements
+	const std::vector<int>& GetIndexes() const { return m_indexes; }
+	UINT GetIndexCount() const { return (UINT)m_indexes.size(); }
+
+private:
+	struct Member
+	{
+		int  surface;
+		int  batch;
+		UINT first;     // In m_allIndexes
+		UINT count;
+	};
+
+	std::vector<Q3Batch>     m_batches;
+	std::vector<Member>      m_members;             // Sorted by batch
+	std::vector<int>         m_surfaceMember;       // Per surface, its member or -1
+	std::vector<int>         m_allIndexes;          // Every member's absolute indexes, in member order
+	std::vector<int>         m_indexes;             // The slots as they are now
+
+	// Visible members per batch, as written into the slot
+	std::vector<std::vector<int>> m_slotMembers;
+	std::vector<std::vector<int>> m_frameMembers;
+	std::vector<int>         m_touched;             // Batches with a visible member this Update
+	std::vector<int>         m_drawn;               // ... and the last one
+	std::vector<Q3IndexRange> m_dirty;
+	bool m_invalid = true;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include "stdafx.h"
+#include "Q3BSPStructures.h"
+
+// One BSP lump as an array of T. Either a view straight into a mapped file (the file has to stay
+// mapped for as long as the lump is used) or its own copy, filled through Alloc. Reads like the
+// std::vector it replaces, but is read-only.
+template <typename T>
+class Q3Lump
+{
+public:
+	// Views the lump in place. FALSE if it runs past the end of the file or isn't a whole number
+	// of T. A lump at an offset T can't be read from directly gets copied instead.
+	BOOL Map(const BYTE* file, size_t fileSize, const lump_t& lump)
+	{
+		clear();
+		if (lump.fileofs < 0 || lump.filelen < 0 || (size_t)lump.fileofs > fileSize ||
+			(size_t)lump.filelen > fileSize - lump.fileofs || lump.filelen % sizeof(T) != 0)
+			return FALSE;
+
+		const size_t count = lump.filelen / sizeof(T);
+		if (count == 0) return TRUE;
+		const BYTE* src = file + lump.fileofs;
+		if ((uintptr_t)src % alignof(T) != 0)
+		{
+			memcpy(Alloc(count), src, lump.filelen);
+			return TRUE;
+		}
+		m_data = (const T*)src;
+		m_count = count;
+		return TRUE;
+	}
+
+	// Own storage for 'count' elements, for the caller to fill
+	T* Alloc(size_t count)
+	{
+		m_copy.resize(count);
+		m_data = m_copy.data();
+		m_count = count;
+		return m_copy.data();
+	}
+
+	void clear()
+	{
+		m_copy.clear();
+		m_copy.shrink_to_fit();
+		m_data = nullptr;
+		m_count = 0;
+	}
+
+	bool IsCopy() const { return !m_copy.empty(); }
+	size_t Bytes() const { return m_count * sizeof(T); }
+
+	const T* data() const { return m_data; }
+	size_t size() const { return m_count; }
+	bool empty() const { return m_count == 0; }
+	const T& operator[](size_t i) const { return m_data[i]; }
+	const T* begin() const { return m_data; }
+	const T* end() const { return m_data + m_count; }
+
+private:
+	const T*       m_data = nullptr;
+	size_t         m_count = 0;
+	std::vector<T> m_copy;
+};
@@ -0,0 +1,183 @@
+#include "stdafx.h"
+#include "Q3PatchLod.h"
+#include <cfloat>
+#include <map>
+#include <numeric>
+
+static const float MIN_DISTANCE = 16.0f;        // Map units, closer (or inside the hull) counts as this
+static const float MIN_SEGMENT_PIXELS = 4.0f;   // Shorter segments don't show any more curve
+static const float DROP_SLACK = 0.75f;          // A level drops once the need is under this much of the lower one
+static const float MIN_MOVE = 8.0f;             // Map units the camera moves before the levels are picked again
+
+void CQ3PatchLod::Init(const dsurface_t* surfaces, const drawVert_t* verts, const std::vector<PatchRenderInfo>& patches)
+{
+	Clear();
+	const int numPatches = (int)patches.size();
+	m_patches.resize(numPatches);
+	m_parent.resize(numPatches * 2);
+	std::iota(m_parent.begin(), m_parent.end(), 0);
+
+	// Block edge control points, in the direction that sorts first, to the first direction that had them
+	std::map<std::vector<float>, int> edges;
+	std::vector<float> key, reversed;
+
+	for (int p = 0; p < numPatches; p++)
+	{
+		const dsurface_t& surf = surfaces[patches[p].originalSurfaceIndex];
+		const drawVert_t* cp = verts + surf.firstVert;
+		const int w = surf.patchWidth, h = surf.patchHeight;
+		Patch& patch = m_patches[p];
+
+		for (int k = 0; k < 3; k++)
+		{
+			patch.mins[k] = FLT_MAX;
+			patch.maxs[k] = -FLT_MAX;
+		}
+		for (int i = 0; i < w * h; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				patch.mins[k] = std::min(patch.mins[k], cp[i].xyz[k]);
+				patch.maxs[k] = std::max(patch.maxs[k], cp[i].xyz[k]);
+			}
+		}
+
+		// A quadratic with n segments is off its chords by at most |P0 - 2 P1 + P2| / (4 n^2).
+		// The curves inside a block blend its three control rows (columns), so the rows bound them.
+		patch.bend[0] = patch.bend[1] = 0.0f;
+		patch.length[0] = patch.length[1] = 0.0f;
+		for (int by = 0; by + 2 < h; by += 2)
+		{
+			for (int bx = 0; bx + 2 < w; bx += 2)
+			{
+				for (int r = 0; r < 3; r++)
+				{
+					const int step[2] = { 1, w };
+					const int start[2] = { (by + r) * w + bx, by * w + bx + r };
+					for (int d = 0; d < 2; d++)
+					{
+						const D3DXVECTOR3& p0 = cp[start[d]].xyz;
+						const D3DXVECTOR3& p1 = cp[start[d] + step[d]].xyz;
+						const D3DXVECTOR3& p2 = cp[start[d] + 2 * step[d]].xyz;
+						D3DXVECTOR3 second = p0 - 2.0f * p1 + p2;
+						D3DXVECTOR3 a = p1 - p0, b = p2 - p1;
+						patch.bend[d] = std::max(patch.bend[d], D3DXVec3Length(&second) * 0.25f);
+						patch.length[d] = std::max(patch.length[d], D3DXVec3Length(&a) + D3DXVec3Length(&b));
+					}
+				}
+			}
+		}
+
+		// The four sides: rows 0 and h-1 run along u, columns 0 and w-1 along v. Each block
+		// tessellates its own stretch of a side, so sides are matched a block (3 control points)
+		// at a time: a patch along part of a longer one's side joins it as well.
+		struct Side { int dir, start, step, count; };
+		const Side sides[4] = { { 0, 0, 1, w }, { 0, (h - 1) * w, 1, w }, { 1, 0, w, h }, { 1, w - 1, w, h } };
+		for (const Side& side : sides)
+		{
+			for (int first = 0; first + 2 < side.count; first += 2)
+			{
+				key.clear();
+				bool degenerate = true;
+				const D3DXVECTOR3& v0 = cp[side.start + first * side.step].xyz;
+				for (int i = first; i < first + 3; i++)
+				{
+					const D3DXVECTOR3& v = cp[side.start + i * side.step].xyz;
+					key.insert(key.end(), { v.x, v.y, v.z });
+					if (v != v0) degenerate = false;
+				}
+				// Collapsed stretches (the tip of a cone) would tie unrelated patches together
+				if (degenerate) continue;
+
+				reversed.clear();
+				for (int i = 2; i >= 0; i--)
+					reversed.insert(reversed.end(), key.begin() + i * 3, key.begin() + i * 3 + 3);
+				if (reversed < key) key.swap(reversed);
+
+				const int node = p * 2 + side.dir;
+				auto found = edges.emplace(key, node);
+				if (found.second) continue;
+				m_sharedEdges++;
+				int a = Find(found.first->second), b = Find(node);
+				if (a != b) m_parent[b] = a;
+			}
+		}
+	}
+
+	m_patchClass.resize(m_parent.size());
+	std::vector<int> rootClass(m_parent.size(), -1);
+	int numClasses = 0;
+	for (int node = 0; node < (int)m_parent.size(); node++)
+	{
+		int root = Find(node);
+		if (rootClass[root] < 0) rootClass[root] = numClasses++;
+		m_patchClass[node] = rootClass[root];
+	}
+	m_classNeed.resize(numClasses);
+	m_classLevel.assign(numClasses, 0);
+}
+
+void CQ3PatchLod::Clear()
+{
+	m_patches.clear();
+	m_parent.clear();
+	m_patchClass.clear();
+	m_classNeed.clear();
+	m_classLevel.clear();
+	m_sharedEdges = 0;
+	m_lastScale = 0.0f;
+}
+
+int CQ3PatchLod::Find(int node)
+{
+	while (m_parent[node] != node)
+	{
+		m_parent[node] = m_parent[m_parent[node]];
+		node = m_parent[node];
+	}
+	return node;
+}
+
+int CQ3PatchLod::Update(const D3DXVECTOR3& mapPos, float pixelScale)
+{
+	// Levels only follow the distance, and a few units don't move it enough to matter
+	D3DXVECTOR3 moved = mapPos - m_lastPos;
+	if (pixelScale == m_lastScale && D3DXVec3LengthSq(&moved) < MIN_MOVE * MIN_MOVE) return 0;
+	m_lastPos = mapPos;
+	m_lastScale = pixelScale;
+
+	std::fill(m_classNeed.begin(), m_classNeed.end(), 0.0f);
+	const float pos[3] = { mapPos.x, mapPos.y, mapPos.z };
+	for (int p = 0; p < (int)m_patches.size(); p++)
+	{
+		const Patch& patch = m_patches[p];
+		float distSq = 0.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			float d = std::max(std::max(patch.mins[k] - pos[k], pos[k] - patch.maxs[k]), 0.0f);
+			distSq += d * d;
+		}
+		const float pixels = pixelScale / std::max(sqrtf(distSq), MIN_DISTANCE); // Per map unit
+
+		for (int d = 0; d < 2; d++)
+		{
+			float flat = sqrtf(patch.bend[d] * pixels / m_errorPixels);
+			float room = patch.length[d] * pixels / MIN_SEGMENT_PIXELS;
+			float& need = m_classNeed[m_patchClass[p * 2 + d]];
+			need = std::max(need, std::min(flat, room));
+		}
+	}
+
+	int changed = 0;
+	for (int c = 0; c < (int)m_classLevel.size(); c++)
+	{
+		const float need = std::min(m_classNeed[c], (float)MAX_LEVEL);
+		int level = 1;
+		while (level < need) level *= 2;
+		const int old = m_classLevel[c];
+		if (level < old && need > level * DROP_SLACK) level = std::min(old, level * 2);
+		if (level != old) changed++;
+		m_classLevel[c] = level;
+	}
+	return changed;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "stdafx.h"
+#include "Q3BSPStructures.h"
+
+// Subdivision levels for the Q3 curved surfaces, from what the camera sees of them. Every patch
+// gets a level along its width (u) and one along its height (v), the number of segments per 3x3
+// block. A direction needs enough segments to keep its curve within a few pixels of the true
+// surface (how much the control hull bends, projected at the patch's distance), and never more
+// than its projected length has room for, so flat trims get one quad per block and a huge arch
+// up close the most. Levels are powers of two and drop with some slack, so a moving camera
+// doesn't flip them every frame.
+// Two patches with the same control points along an edge have to split it the same way or the
+// seam cracks. Init joins the directions that meet that way into one class (union-find, across
+// whole chains of patches) and each class takes the largest level any of its members needs, so
+// both sides of a shared edge always have the same vertices. Edges are matched per 3x3 block,
+// so a 3 wide patch against half of a 5 wide one's side is joined too. Pure CPU, in Q3 map space.
+class CQ3PatchLod
+{
+public:
+	static const int MAX_LEVEL = 16;
+
+	// One entry per patch, the order of 'patches'
+	void Init(const dsurface_t* surfaces, const drawVert_t* verts, const std::vector<PatchRenderInfo>& patches);
+	void Clear();
+
+	// Levels for a camera at 'mapPos'. 'pixelScale' makes size over distance pixels, viewport
+	// height / 2 * projection _22. Returns how many classes changed level, nothing is looked at
+	// again until the camera has moved a little.
+	int Update(const D3DXVECTOR3& mapPos, float pixelScale);
+
+	int GetLevelU(int patch) const { return m_classLevel[m_patchClass[patch * 2]]; }
+	int GetLevelV(int patch) const { return m_classLevel[m_patchClass[patch * 2 + 1]]; }
+
+	// Most a curve may be off on screen, in pixels
+	void SetErrorPixels(float pixels) { m_errorPixels = std::max(0.1f, pixels); m_lastScale = 0.0f; }
+	// Block edges (3 control points) found on more than one patch side
+	int GetSharedEdges() const { return m_sharedEdges; }
+	int GetNumClasses() const { return (int)m_classLevel.size(); }
+
+private:
+	struct Patch
+	{
+		float mins[3], maxs[3];     // Control hull bounds, the surface is inside them
+		float bend[2];              // Per direction, most a block's curve strays from its chord
+		float length[2];            // Per direction, longest block hull along it
+	};
+
+	int Find(int node);
+
+	std::vector<Patch> m_patches;
+	std::vector<int>   m_parent;        // Union-find over patch * 2 + direction
+	std::vector<int>   m_patchClass;    // Per patch * 2 + direction, its class
+	std::vector<float> m_classNeed;     // Segments the class needs this Update
+	std::vector<int>   m_classLevel;    // 0 until the first Update
+	int   m_sharedEdges = 0;
+	float m_errorPixels = 1.0f;
+	D3DXVECTOR3 m_lastPos = D3DXVECTOR3(0.0f, 0.0f, 0.0f);
+	float m_lastScale = 0.0f;           // 0: pick on the next Update
+};
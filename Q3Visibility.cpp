@@ -0,0 +1,239 @@
+#include "stdafx.h"
+#include "Q3Visibility.h"
+
+static const int VIS_HEADER = 2 * sizeof(int);  // numClusters, bytes per cluster row
+static const int CLIP_ALL = 0x3F;               // All six frustum planes
+
+bool CQ3Visibility::Init(const Q3VisLumps& lumps)
+{
+	Clear();
+	if (lumps.numNodes <= 0 || lumps.numLeafs <= 0) return false;
+	m_lumps = lumps;
+
+	// Parents, and a check that every child and plane is in range (a bad map must not send the walk astray)
+	m_nodeParent.assign(lumps.numNodes, -1);
+	m_leafParent.assign(lumps.numLeafs, -1);
+	for (int n = 0; n < lumps.numNodes; n++)
+	{
+		const dnode_t& node = lumps.nodes[n];
+		if (node.planeNum < 0 || node.planeNum >= lumps.numPlanes) return false;
+		for (int c = 0; c < 2; c++)
+		{
+			int child = node.children[c];
+			if (child >= 0)
+			{
+				// Children always come after their parent in q3map2 output, which also rules out cycles
+				if (child <= n || child >= lumps.numNodes) return false;
+				m_nodeParent[child] = n;
+			}
+			else
+			{
+				int leaf = -child - 1;
+				if (leaf >= lumps.numLeafs) return false;
+				m_leafParent[leaf] = n;
+			}
+		}
+	}
+	for (int l = 0; l < lumps.numLeafs; l++)
+	{
+		const dleaf_t& leaf = lumps.leafs[l];
+		if (leaf.firstLeafSurface < 0 || leaf.numLeafSurfaces < 0 ||
+			leaf.firstLeafSurface + leaf.numLeafSurfaces > lumps.numLeafSurfaces)
+			return false;
+	}
+	for (int i = 0; i < lumps.numLeafSurfaces; i++)
+		if (lumps.leafSurfaces[i] < 0 || lumps.leafSurfaces[i] >= lumps.numSurfaces) return false;
+	for (int m = 1; m < lumps.numModels; m++)
+	{
+		const dmodel_t& model = lumps.models[m];
+		if (model.firstSurface < 0 || model.numSurfaces < 0 || model.firstSurface + model.numSurfaces > lumps.numSurfaces)
+			return false;
+	}
+
+	// No or short vis data leaves only the frustum
+	if (lumps.vis && lumps.visLen >= VIS_HEADER)
+	{
+		const int* header = (const int*)lumps.vis;
+		if (header[0] > 0 && header[1] > 0 && header[1] >= (header[0] + 7) / 8 &&
+			(long long)header[0] * header[1] <= lumps.visLen - VIS_HEADER)
+		{
+			m_numClusters = header[0];
+			m_clusterBytes = header[1];
+		}
+	}
+
+	m_nodeVisFrame.assign(lumps.numNodes, 0);
+	m_leafVisFrame.assign(lumps.numLeafs, 0);
+	m_surfaceFrame.assign(lumps.numSurfaces, 0);
+	m_visible.reserve(lumps.numSurfaces);
+	m_ready = true;
+	return true;
+}
+
+void CQ3Visibility::Clear()
+{
+	m_lumps = Q3VisLumps();
+	m_ready = false;
+	m_numClusters = m_clusterBytes = 0;
+	m_nodeParent.clear();
+	m_leafParent.clear();
+	m_nodeVisFrame.clear();
+	m_leafVisFrame.clear();
+	m_surfaceFrame.clear();
+	m_visible.clear();
+	m_visFrame = m_frame = 0;
+	m_markedCluster = -2;
+	m_stats = Q3VisStats();
+}
+
+int CQ3Visibility::FindLeaf(const D3DXVECTOR3& mapPos) const
+{
+	if (!m_ready) return -1;
+	int index = 0;
+	while (index >= 0)
+	{
+		const dnode_t& node = m_lumps.nodes[index];
+		const dplane_t& plane = m_lumps.planes[node.planeNum];
+		float d = plane.normal[0] * mapPos.x + plane.normal[1] * mapPos.y + plane.normal[2] * mapPos.z - plane.dist;
+		index = (d >= 0.0f) ? node.children[0] : node.children[1];
+	}
+	return -index - 1;
+}
+
+bool CQ3Visibility::ClusterVisible(int from, int to) const
+{
+	if (m_numClusters == 0 || from < 0 || from >= m_numClusters) return true;
+	if (to < 0 || to >= m_numClusters) return false;
+	const BYTE* row = m_lumps.vis + VIS_HEADER + (size_t)from * m_clusterBytes;
+	return (row[to >> 3] & (1 << (to & 7))) != 0;
+}
+
+// Only when the camera changes cluster, like R_MarkLeaves
+void CQ3Visibility::MarkLeafs(int cluster)
+{
+	m_visFrame++;
+	m_markedCluster = cluster;
+	m_stats.leafsInPVS = 0;
+
+	const bool all = (m_numClusters == 0 || cluster < 0 || cluster >= m_numClusters);
+	const BYTE* row = all ? nullptr : m_lumps.vis + VIS_HEADER + (size_t)cluster * m_clusterBytes;
+	for (int l = 0; l < m_lumps.numLeafs; l++)
+	{
+		const int c = m_lumps.leafs[l].cluster;
+		if (c < 0 || (!all && (c >= m_numClusters || !(row[c >> 3] & (1 << (c & 7)))))) continue;
+
+		m_leafVisFrame[l] = m_visFrame;
+		m_stats.leafsInPVS++;
+		for (int n = m_leafParent[l]; n >= 0 && m_nodeVisFrame[n] != m_visFrame; n = m_nodeParent[n])
+			m_nodeVisFrame[n] = m_visFrame;
+	}
+}
+
+int CQ3Visibility::ClipBox(const float mins[3], const float maxs[3], int clipMask) const
+{
+	for (int p = 0; p < 6; p++)
+	{
+		if (!(clipMask & (1 << p))) continue;
+		const D3DXPLANE& plane = m_frustum[p];
+		// Corner farthest along the plane normal, then the nearest one
+		float far = plane.a * (plane.a >= 0 ? maxs[0] : mins[0]) + plane.b * (plane.b >= 0 ? maxs[1] : mins[1]) +
+			plane.c * (plane.c >= 0 ? maxs[2] : mins[2]) + plane.d;
+		if (far < 0.0f) return 0;
+		float near = plane.a * (plane.a >= 0 ? mins[0] : maxs[0]) + plane.b * (plane.b >= 0 ? mins[1] : maxs[1]) +
+			plane.c * (plane.c >= 0 ? mins[2] : maxs[2]) + plane.d;
+		if (near >= 0.0f) clipMask &= ~(1 << p);
+	}
+	return clipMask | 0x40; // Never 0 while inside
+}
+
+void CQ3Visibility::AddLeaf(int leaf)
+{
+	const dleaf_t& l = m_lumps.leafs[leaf];
+	m_stats.leafsInFrustum++;
+	for (int i = 0; i < l.numLeafSurfaces; i++)
+	{
+		int surf = m_lumps.leafSurfaces[l.firstLeafSurface + i];
+		if (m_surfaceFrame[surf] == m_frame) continue;
+		m_surfaceFrame[surf] = m_frame;
+		m_visible.push_back(surf);
+	}
+}
+
+void CQ3Visibility::WalkNode(int node, int clipMask)
+{
+	while (node >= 0)
+	{
+		if (m_nodeVisFrame[node] != m_visFrame) return;
+		const dnode_t& n = m_lumps.nodes[node];
+		if (clipMask & CLIP_ALL)
+		{
+			float mins[3] = { (float)n.mins[0], (float)n.mins[1], (float)n.mins[2] };
+			float maxs[3] = { (float)n.maxs[0], (float)n.maxs[1], (float)n.maxs[2] };
+			clipMask = ClipBox(mins, maxs, clipMask);
+			if (!clipMask)
+			{
+				m_stats.nodesCulled++;
+				return;
+			}
+		}
+		// Front side recursively, the back side in the loop
+		WalkNode(n.children[0], clipMask);
+		node = n.children[1];
+	}
+
+	const int leaf = -node - 1;
+	if (m_leafVisFrame[leaf] != m_visFrame) return;
+	const dleaf_t& l = m_lumps.leafs[leaf];
+	if (clipMask & CLIP_ALL)
+	{
+		float mins[3] = { (float)l.mins[0], (float)l.mins[1], (float)l.mins[2] };
+		float maxs[3] = { (float)l.maxs[0], (float)l.maxs[1], (float)l.maxs[2] };
+		if (!ClipBox(mins, maxs, clipMask)) return;
+	}
+	AddLeaf(leaf);
+}
+
+const std::vector<int>& CQ3Visibility::Cull(const D3DXVECTOR3& mapPos, const D3DXMATRIX& mapToClip)
+{
+	m_visible.clear();
+	if (!m_ready) return m_visible;
+
+	// Gribb/Hartmann: the frustum planes straight from the combined matrix, normals point inside.
+	// D3D clip space, so the near plane is z >= 0.
+	const D3DXMATRIX& m = mapToClip;
+	m_frustum[0] = D3DXPLANE(m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41); // Left
+	m_frustum[1] = D3DXPLANE(m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41); // Right
+	m_frustum[2] = D3DXPLANE(m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42); // Bottom
+	m_frustum[3] = D3DXPLANE(m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42); // Top
+	m_frustum[4] = D3DXPLANE(m._13, m._23, m._33, m._43);                                 // Near
+	m_frustum[5] = D3DXPLANE(m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43); // Far
+
+	m_stats.cameraLeaf = FindLeaf(mapPos);
+	m_stats.cameraCluster = (m_numClusters > 0) ? m_lumps.leafs[m_stats.cameraLeaf].cluster : -1;
+	if (m_stats.cameraCluster != m_markedCluster) MarkLeafs(m_stats.cameraCluster);
+
+	if (++m_frame == 0)
+	{
+		// Wrapped, old stamps could match again
+		std::fill(m_surfaceFrame.begin(), m_surfaceFrame.end(), 0);
+		m_frame = 1;
+	}
+	m_stats.leafsInFrustum = 0;
+	m_stats.nodesCulled = 0;
+	WalkNode(0, CLIP_ALL);
+
+	// Inline models (doors, platforms) aren't in any leaf, only their box is tested
+	for (int i = 1; i < m_lumps.numModels; i++)
+	{
+		const dmodel_t& model = m_lumps.models[i];
+		if (!ClipBox(model.mins, model.maxs, CLIP_ALL)) continue;
+		for (int s = model.firstSurface; s < model.firstSurface + model.numSurfaces; s++)
+		{
+			if (m_surfaceFrame[s] == m_frame) continue;
+			m_surfaceFrame[s] = m_frame;
+			m_visible.push_back(s);
+		}
+	}
+	m_stats.surfaces = (int)m_visible.size();
+	return m_visible;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "stdafx.h"
+#include "Q3BSPStructures.h"
+
+// The BSP lumps CQ3Visibility reads. Not owned, they have to outlive it.
+struct Q3VisLumps
+{
+	const dnode_t*  nodes = nullptr;        int numNodes = 0;
+	const dplane_t* planes = nullptr;       int numPlanes = 0;
+	const dleaf_t*  leafs = nullptr;        int numLeafs = 0;
+	const int*      leafSurfaces = nullptr; int numLeafSurfaces = 0;
+	const dmodel_t* models = nullptr;       int numModels = 0;
+	const BYTE*     vis = nullptr;          int visLen = 0;
+	int numSurfaces = 0;
+};
+
+// What the last Cull did
+struct Q3VisStats
+{
+	int cameraLeaf = -1;
+	int cameraCluster = -1;     // -1: outside the map or no vis data, nothing is PVS culled
+	int leafsInPVS = 0;         // Leafs the camera's cluster can see
+	int leafsInFrustum = 0;     // Of those, the ones drawn
+	int nodesCulled = 0;        // Subtrees dropped by their box
+	int surfaces = 0;           // Visible surfaces, each once
+};
+
+// Surface culling for CQ3BSP, the way the Q3 renderer does it (R_MarkLeaves, R_RecursiveWorldNode).
+// The camera's leaf gives its cluster, the leafs whose cluster is set in that cluster's PVS row
+// (Q3 stores the rows as plain bitsets) get the current vis stamp, and so do their parents.
+// The node walk then skips every subtree that has no stamped leaf or whose box is outside the
+// frustum, and collects the surfaces of the leafs it reaches. A surface can sit in many leafs, a per-surface frame stamp keeps it in the list once.
+// Everything is in Q3 map space and needs no device, so it runs headless on a loaded map.
+class CQ3Visibility
+{
+public:
+	// Parents for the walk and the stamps, sized from the lumps. False if the tree is damaged.
+	bool Init(const Q3VisLumps& lumps);
+	void Clear();
+
+	// 'mapToClip' takes Q3 map space to D3D clip space (map-to-world * view * projection).
+	// Returns the visible surfaces in tree order, world first, then the inline models.
+	const std::vector<int>& Cull(const D3DXVECTOR3& mapPos, const D3DXMATRIX& mapToClip);
+
+	int  FindLeaf(const D3DXVECTOR3& mapPos) const;
+	// PVS test, true whenever there's nothing to test against
+	bool ClusterVisible(int from, int to) const;
+
+	const Q3VisStats& GetStats() const { return m_stats; }
+	bool IsReady() const { return m_ready; }
+
+private:
+	void MarkLeafs(int cluster);
+	void WalkNode(int node, int clipMask);
+	void AddLeaf(int leaf);
+	// 0: outside, else the planes the box still straddles
+	int  ClipBox(const float mins[3], const float maxs[3], int clipMask) const;
+
+	Q3VisLumps m_lumps;
+	bool m_ready = false;
+	int  m_numClusters = 0;
+	int  m_clusterBytes = 0;
+
+	std::vector<int>  m_nodeParent;     // -1 for the root
+	std::vector<int>  m_leafParent;
+	std::vector<UINT> m_nodeVisFrame;   // Stamped while some leaf below is in the PVS
+	std::vector<UINT> m_leafVisFrame;
+	std::vector<UINT> m_surfaceFrame;   // Dedup stamp, one per Cull
+	UINT m_visFrame = 0;
+	UINT m_frame = 0;
+	int  m_markedCluster = -2;          // Cluster the stamps are for, -2 = none yet
+
+	D3DXPLANE m_frustum[6];
+	std::vector<int> m_visible;
+	Q3VisStats m_stats;
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include "stdafx.h"
+
+// Progressive radiosity checkpoint (.radck) written next to the source OBJ during a bake,
+// .refine.radck for the bake after gradient refinement.
+// Layout: RadCheckpointHeader, then patchCount RadCheckpointPatch in m_patches order.
+// Anything that changes the layout must bump RADCHECKPOINT_VERSION.
+static const char RADCHECKPOINT_MAGIC[4] = { 'R', 'A', 'D', 'K' };
+static const UINT RADCHECKPOINT_VERSION = 1;
+
+struct RadCheckpointHeader
+{
+    char     magic[4];
+    UINT     version;
+    uint64_t key;           // CBSPlevel::GetCacheKey, same files and settings
+    uint64_t patchKey;      // Patch geometry, a refined mesh can come out different
+    UINT     patchCount;
+    int      shots;         // Shots already taken
+    float    startEnergy;   // Total unshot energy when the bake started, convergence is relative to it
+    UINT     reserved;
+};
+
+struct RadCheckpointPatch
+{
+    D3DXVECTOR3 accumulated;
+    D3DXVECTOR3 unshot;
+};
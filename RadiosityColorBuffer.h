@@ -0,0 +1,42 @@
+#pragma once
+#include "stdafx.h"
+
+// Triple buffered vertex colors between the radiosity worker and the render thread.
+// The worker fills GetBack() and calls Publish(), the render thread calls Acquire() and copies
+// GetFront() into the vertices before it draws. Each side owns one slot, the third is handed
+// over with a single atomic exchange, so neither side waits and the renderer only ever sees
+// a complete set of colors. A publish the renderer never picked up is simply replaced.
+class CRadColorBuffer
+{
+public:
+    // Producer side
+    std::vector<DWORD>& GetBack() { return m_slots[m_back]; }
+    void Publish()
+    {
+        int old = m_middle.exchange(m_back | FRESH);
+        m_back = old & SLOT_MASK;
+        m_publishCount++;
+    }
+
+    // Consumer side. True if a newer publish is now at the front.
+    bool Acquire()
+    {
+        if (!(m_middle.load() & FRESH)) return false;
+        int old = m_middle.exchange(m_front);
+        m_front = old & SLOT_MASK;
+        return true;
+    }
+    const std::vector<DWORD>& GetFront() const { return m_slots[m_front]; }
+
+    int GetPublishCount() const { return m_publishCount; }
+
+private:
+    static const int SLOT_MASK = 3;
+    static const int FRESH = 4;     // Middle slot holds a publish the consumer hasn't taken
+
+    std::vector<DWORD> m_slots[3];
+    int m_back = 0;                 // Producer only
+    int m_front = 1;                // Consumer only
+    std::atomic<int> m_middle{ 2 };
+    std::atomic<int> m_publishCount{ 0 };
+};
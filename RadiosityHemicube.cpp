@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "RadiosityHemicube.h"
+
+static const float NEAR_PLANE = 0.0001f;    // Clip distance in front of the eye
+// Relative depth push for facing-away triangles. Zero-thickness walls have both sides in the
+// same plane, the side facing the eye has to win the depth test.
+static const float BACKFACE_BIAS = 0.001f;
+
+// Local axes (0 = u, 1 = v, 2 = normal) per job: depth axis, its sign, x axis, y axis, first row's y.
+// The top face is split across the normal's plane so its halves cost the same as a side face.
+static const struct { int iz; float sz; int ix, iy; float y0; bool top; } JOB_SETUP[CRadHemicube::JOB_COUNT] =
+{
+    { 2,  1.0f, 0, 1, -1.0f, true  },
+    { 2,  1.0f, 0, 1,  0.0f, true  },
+    { 0,  1.0f, 1, 2,  0.0f, false },
+    { 0, -1.0f, 1, 2,  0.0f, false },
+    { 1,  1.0f, 0, 2,  0.0f, false },
+    { 1, -1.0f, 0, 2,  0.0f, false },
+};
+
+void CRadHemicube::SetGeometry(const std::vector<RADPATCH>& patches, const std::vector<OBJVertex>& flatVerts)
+{
+    m_verts.assign(patches.size() * 3, D3DXVECTOR3(0, 0, 0));
+    m_faceUp.assign(patches.size(), D3DXVECTOR3(0, 0, 0));
+    m_hasTri.assign(patches.size(), 0);
+    for (size_t i = 0; i < patches.size(); i++)
+    {
+        int t = patches[i].triIndex;
+        if (t < 0 || (size_t)t * 3 + 2 >= flatVerts.size()) continue;
+        for (int k = 0; k < 3; k++)
+        {
+            const OBJVertex& v = flatVerts[(size_t)t * 3 + k];
+            m_verts[i * 3 + k] = D3DXVECTOR3(v.x, v.y, v.z);
+        }
+        D3DXVECTOR3 e1 = m_verts[i * 3 + 1] - m_verts[i * 3];
+        D3DXVECTOR3 e2 = m_verts[i * 3 + 2] - m_verts[i * 3];
+        D3DXVec3Cross(&m_faceUp[i], &e1, &e2);
+        m_hasTri[i] = 1;
+    }
+    m_local.resize(patches.size() * 9);
+    m_facing.resize(patches.size());
+}
+
+void CRadHemicube::SetResolution(UINT res)
+{
+    res = std::max(8u, (res + 1) & ~1u);
+    if (res == m_res) return;
+    m_res = res;
+
+    const size_t pixels = (size_t)res * (res / 2);
+    const float pixel = 2.0f / res;
+    double total = 0.0;
+    for (int j = 0; j < JOB_COUNT; j++)
+    {
+        Job& job = m_jobs[j];
+        job.iz = JOB_SETUP[j].iz;
+        job.sz = JOB_SETUP[j].sz;
+        job.ix = JOB_SETUP[j].ix;
+        job.iy = JOB_SETUP[j].iy;
+        job.y0 = JOB_SETUP[j].y0;
+        job.deltaFF.resize(pixels);
+        job.depth.resize(pixels);
+        job.ids.resize(pixels);
+        for (UINT py = 0; py < res / 2; py++)
+        {
+            float y = job.y0 + (py + 0.5f) * pixel;
+            for (UINT px = 0; px < res; px++)
+            {
+                float x = -1.0f + (px + 0.5f) * pixel;
+                float d = x * x + y * y + 1.0f;
+                // Top: dA / (pi d^2), sides also have the cosine to the normal (y)
+                float dff = pixel * pixel / (D3DX_PI * d * d);
+                if (!JOB_SETUP[j].top) dff *= y;
+                job.deltaFF[(size_t)py * res + px] = dff;
+                total += dff;
+            }
+        }
+    }
+    // The pixel sum misses the exact 1 by the discretization, spread the difference
+    float scale = (total > 0.0) ? (float)(1.0 / total) : 1.0f;
+    for (int j = 0; j < JOB_COUNT; j++)
+        for (float& dff : m_jobs[j].deltaFF) dff *= scale;
+}
+
+// One screen triangle into the job's buffers, pixel centers inside (either winding) and nearer
+// (larger 1/z, interpolated linearly in screen space) win.
+static void FillTriangle(const float* sx, const float* sy, const float* sw, int a, int b, int c,
+    int width, int height, float* depth, int* ids, int id)
+{
+    const float x0 = sx[a], y0 = sy[a], x1 = sx[b], y1 = sy[b], x2 = sx[c], y2 = sy[c];
+    float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+    if (fabsf(area) < 1e-12f) return;
+    const float invArea = 1.0f / area;
+
+    int minX = std::max(0, (int)ceilf(std::min(x0, std::min(x1, x2)) - 0.5f));
+    int maxX = std::min(width - 1, (int)floorf(std::max(x0, std::max(x1, x2)) - 0.5f));
+    int minY = std::max(0, (int)ceilf(std::min(y0, std::min(y1, y2)) - 0.5f));
+    int maxY = std::min(height - 1, (int)floorf(std::max(y0, std::max(y1, y2)) - 0.5f));
+    if (minX > maxX || minY > maxY) return;
+
+    // Barycentrics are linear in x, step them along the row
+    const float stepA = (y1 - y2) * invArea;
+    const float stepB = (y2 - y0) * invArea;
+    for (int py = minY; py <= maxY; py++)
+    {
+        const float fy = py + 0.5f;
+        const float fx = minX + 0.5f;
+        float wa = ((x1 - fx) * (y2 - fy) - (x2 - fx) * (y1 - fy)) * invArea;
+        float wb = ((x2 - fx) * (y0 - fy) - (x0 - fx) * (y2 - fy)) * invArea;
+        float* depthRow = depth + (size_t)py * width;
+        int* idRow = ids + (size_t)py * width;
+        for (int px = minX; px <= maxX; px++, wa += stepA, wb += stepB)
+        {
+            float wc = 1.0f - wa - wb;
+            if (wa >= 0.0f && wb >= 0.0f && wc >= 0.0f)
+            {
+                float w = wa * sw[a] + wb * sw[b] + wc * sw[c];
+                if (w > depthRow[px])
+                {
+                    depthRow[px] = w;
+                    idRow[px] = id;
+                }
+            }
+        }
+    }
+}
+
+void CRadHemicube::Rasterize(Job& job, int skip)
+{
+    const int width = (int)m_res, height = (int)m_res / 2;
+    const float half = m_res * 0.5f;
+    const float y1 = job.y0 + 1.0f;
+    std::fill(job.depth.begin(), job.depth.end(), 0.0f);
+    std::fill(job.ids.begin(), job.ids.end(), -1);
+
+    const int items = (int)m_hasTri.size();
+    for (int i = 0; i < items; i++)
+    {
+        if (!m_hasTri[i] || i == skip) continue;
+        const float* lv = &m_local[(size_t)i * 9];
+        float X[3], Y[3], Z[3];
+        for (int k = 0; k < 3; k++)
+        {
+            X[k] = lv[k * 3 + job.ix];
+            Y[k] = lv[k * 3 + job.iy];
+            Z[k] = job.sz * lv[k * 3 + job.iz];
+        }
+
+        // All three vertices outside the same frustum plane
+        if (Z[0] < NEAR_PLANE && Z[1] < NEAR_PLANE && Z[2] < NEAR_PLANE) continue;
+        if (X[0] > Z[0] && X[1] > Z[1] && X[2] > Z[2]) continue;
+        if (X[0] < -Z[0] && X[1] < -Z[1] && X[2] < -Z[2]) continue;
+        if (Y[0] > y1 * Z[0] && Y[1] > y1 * Z[1] && Y[2] > y1 * Z[2]) continue;
+        if (Y[0] < job.y0 * Z[0] && Y[1] < job.y0 * Z[1] && Y[2] < job.y0 * Z[2]) continue;
+
+        // Clip to the near plane, at most one extra vertex
+        float sx[4], sy[4], sw[4];
+        int n = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            int k2 = (k + 1) % 3;
+            bool in1 = Z[k] >= NEAR_PLANE, in2 = Z[k2] >= NEAR_PLANE;
+            if (in1)
+            {
+                sw[n] = 1.0f / Z[k];
+                sx[n] = (X[k] * sw[n] + 1.0f) * half;
+                sy[n] = (Y[k] * sw[n] - job.y0) * half;
+                n++;
+            }
+            if (in1 != in2)
+            {
+                float t = (NEAR_PLANE - Z[k]) / (Z[k2] - Z[k]);
+                float cx = X[k] + (X[k2] - X[k]) * t;
+                float cy = Y[k] + (Y[k2] - Y[k]) * t;
+                sw[n] = 1.0f / NEAR_PLANE;
+                sx[n] = (cx * sw[n] + 1.0f) * half;
+                sy[n] = (cy * sw[n] - job.y0) * half;
+                n++;
+            }
+        }
+
+        // Facing-away triangles only occlude, slightly behind a coplanar front face
+        int id = m_facing[i] ? i : -1;
+        if (id < 0)
+            for (int k = 0; k < n; k++) sw[k] *= 1.0f - BACKFACE_BIAS;
+        for (int k = 1; k + 1 < n; k++)
+            FillTriangle(sx, sy, sw, 0, k, k + 1, width, height, job.depth.data(), job.ids.data(), id);
+    }
+}
+
+void CRadHemicube::Compute(const D3DXVECTOR3& eye, const D3DXVECTOR3& normal, int skip, float* ff)
+{
+    const int items = (int)m_hasTri.size();
+    std::fill(ff, ff + items, 0.0f);
+    if (items == 0 || m_res == 0) return;
+
+    // Shooter frame, u and v are arbitrary around the normal
+    D3DXVECTOR3 n, u, v;
+    D3DXVec3Normalize(&n, &normal);
+    D3DXVECTOR3 helper = (fabsf(n.x) < 0.9f) ? D3DXVECTOR3(1, 0, 0) : D3DXVECTOR3(0, 1, 0);
+    D3DXVec3Cross(&u, &helper, &n);
+    D3DXVec3Normalize(&u, &u);
+    D3DXVec3Cross(&v, &n, &u);
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < items; i++)
+        {
+            float* lv = &m_local[(size_t)i * 9];
+            for (int k = 0; k < 3; k++)
+            {
+                D3DXVECTOR3 d = m_verts[(size_t)i * 3 + k] - eye;
+                lv[k * 3 + 0] = D3DXVec3Dot(&d, &u);
+                lv[k * 3 + 1] = D3DXVec3Dot(&d, &v);
+                lv[k * 3 + 2] = D3DXVec3Dot(&d, &n);
+            }
+            D3DXVECTOR3 toEye = eye - m_verts[(size_t)i * 3];
+            m_facing[i] = D3DXVec3Dot(&m_faceUp[i], &toEye) > 0.0f;
+        }
+        #pragma omp for schedule(dynamic, 1)
+        for (int j = 0; j < JOB_COUNT; j++)
+            Rasterize(m_jobs[j], skip);
+    }
+
+    for (int j = 0; j < JOB_COUNT; j++)
+    {
+        const Job& job = m_jobs[j];
+        for (size_t p = 0; p < job.ids.size(); p++)
+            if (job.ids[p] >= 0) ff[job.ids[p]] += job.deltaFF[p];
+    }
+}
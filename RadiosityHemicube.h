@@ -0,0 +1,50 @@
+#pragma once
+#include "stdafx.h"
+#include "CBSPlevel.h"
+
+// Software hemicube for the progressive solver: all form factors from one shooter in a single
+// pass instead of one point-to-point estimate and visibility ray per receiver.
+// The patches' triangles are rasterized around the shooter into an item-ID buffer with a
+// 1/z depth test, every pixel then adds its delta form factor to the patch it shows.
+// Occlusion comes from the depth test, nothing touches the BSP or the device.
+//
+// The cube is split into six equal jobs of res x res/2 pixels (two halves of the top face
+// and the four half side faces) rasterized in parallel, each with its own buffers.
+class CRadHemicube
+{
+public:
+    static const int JOB_COUNT = 6;
+
+    // Triangle of every patch (triIndex into flatVerts), patches without one are skipped
+    void SetGeometry(const std::vector<RADPATCH>& patches, const std::vector<OBJVertex>& flatVerts);
+    // Pixels along one edge of the top face, rounded up to even
+    void SetResolution(UINT res);
+    UINT GetResolution() const { return m_res; }
+    size_t GetItemCount() const { return m_faceUp.size(); }
+
+    // ff[i] = form factor from a differential area at 'eye' facing 'normal' to patch i,
+    // 0 for 'skip' and for patches facing away (those still occlude). ff has GetItemCount() entries.
+    // Not reentrant, the buffers are members.
+    void Compute(const D3DXVECTOR3& eye, const D3DXVECTOR3& normal, int skip, float* ff);
+
+private:
+    struct Job
+    {
+        int   iz, ix, iy;   // Local axis (0 = u, 1 = v, 2 = normal) for depth, x and y
+        float sz;           // Depth along +axis or -axis
+        float y0;           // Rows cover y in [y0, y0 + 1], x is always [-1, 1]
+        std::vector<float> deltaFF; // Per pixel, fixed for a resolution
+        std::vector<float> depth;   // 1/z, 0 = nothing
+        std::vector<int>   ids;
+    };
+
+    void Rasterize(Job& job, int skip);
+
+    UINT m_res = 0;
+    Job  m_jobs[JOB_COUNT];
+    std::vector<D3DXVECTOR3> m_verts;   // 3 per item, world space
+    std::vector<BYTE>        m_hasTri;
+    std::vector<D3DXVECTOR3> m_faceUp;  // Triangle normal per item
+    std::vector<float>       m_local;   // 9 per item, vertices in the shooter's frame
+    std::vector<BYTE>        m_facing;  // Item faces the eye
+};
@@ -0,0 +1,332 @@
+#include "stdafx.h"
+#include "RadiosityHierarchy.h"
+
+// Patch pairs sampled to estimate a link that has a cluster on either end
+static const int CLUSTER_SAMPLES = 4;
+
+static inline float FluxSum(const D3DXVECTOR3& v) { return v.x + v.y + v.z; }
+
+void CRadiosityHierarchy::Build(const std::vector<RADPATCH>& patches, const std::vector<OBJVertex>& flatVerts)
+{
+    m_nodes.clear();
+    m_links.clear();
+    m_pending.clear();
+    m_order.resize(patches.size());
+    m_sourceFlux = 0.0f;
+    m_newLinks = 0;
+    m_bStarted = false;
+    m_stats = RadHierarchyStats();
+    if (patches.empty()) return;
+
+    std::vector<float> patchRadius(patches.size());
+    for (size_t i = 0; i < patches.size(); i++)
+    {
+        const RADPATCH& patch = patches[i];
+        m_order[i] = (int)i;
+        m_sourceFlux += FluxSum(patch.unshot);
+
+        float r = sqrtf(patch.area);
+        if (patch.triIndex >= 0 && (size_t)patch.triIndex * 3 + 2 < flatVerts.size())
+        {
+            r = 0.0f;
+            for (int c = 0; c < 3; c++)
+            {
+                const OBJVertex& v = flatVerts[(size_t)patch.triIndex * 3 + c];
+                D3DXVECTOR3 d = D3DXVECTOR3(v.x, v.y, v.z) - patch.center;
+                r = std::max(r, D3DXVec3Length(&d));
+            }
+        }
+        patchRadius[i] = r;
+    }
+
+    m_nodes.reserve(patches.size() * 2 - 1);
+    BuildNode(0, (UINT)patches.size(), patches, patchRadius, -1);
+    m_stats.clusters = (int)(m_nodes.size() - patches.size());
+}
+
+// Median split on the longest axis of the patch centers, children follow their parent
+int CRadiosityHierarchy::BuildNode(UINT first, UINT count, const std::vector<RADPATCH>& patches,
+    const std::vector<float>& patchRadius, int parent)
+{
+    int index = (int)m_nodes.size();
+    m_nodes.push_back(Node());
+    // D3DXVECTOR3 doesn't initialize itself
+    const D3DXVECTOR3 zero(0, 0, 0);
+    m_nodes[index].normal = m_nodes[index].source = m_nodes[index].base = m_nodes[index].rho = zero;
+    m_nodes[index].fluxOut = m_nodes[index].gathered = m_nodes[index].fluxIn = zero;
+    m_nodes[index].parent = parent;
+    m_nodes[index].first = first;
+    m_nodes[index].count = count;
+
+    if (count == 1)
+    {
+        const RADPATCH& patch = patches[m_order[first]];
+        Node& leaf = m_nodes[index];
+        leaf.patch = m_order[first];
+        leaf.center = patch.center;
+        leaf.radius = patchRadius[leaf.patch];
+        leaf.area = patch.area;
+        leaf.normal = patch.normal;
+        leaf.source = patch.unshot;
+        leaf.base = patch.accumulated;
+        leaf.rho = D3DXVECTOR3(patch.reflectivity.r, patch.reflectivity.g, patch.reflectivity.b);
+        return index;
+    }
+
+    D3DXVECTOR3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (UINT i = first; i < first + count; i++)
+    {
+        D3DXVec3Minimize(&lo, &lo, &patches[m_order[i]].center);
+        D3DXVec3Maximize(&hi, &hi, &patches[m_order[i]].center);
+    }
+    D3DXVECTOR3 ext = hi - lo;
+    int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+
+    UINT half = count / 2;
+    std::nth_element(m_order.begin() + first, m_order.begin() + first + half, m_order.begin() + first + count,
+        [&](int a, int b) { return ((const float*)&patches[a].center)[axis] < ((const float*)&patches[b].center)[axis]; });
+
+    int c0 = BuildNode(first, half, patches, patchRadius, index);
+    int c1 = BuildNode(first + half, count - half, patches, patchRadius, index);
+
+    // Smallest sphere around both child spheres
+    const Node& a = m_nodes[c0];
+    const Node& b = m_nodes[c1];
+    D3DXVECTOR3 d = b.center - a.center;
+    float dist = D3DXVec3Length(&d);
+    Node& node = m_nodes[index];
+    node.child[0] = c0;
+    node.child[1] = c1;
+    node.area = a.area + b.area;
+    if (dist + b.radius <= a.radius)      { node.center = a.center; node.radius = a.radius; }
+    else if (dist + a.radius <= b.radius) { node.center = b.center; node.radius = b.radius; }
+    else
+    {
+        node.radius = (dist + a.radius + b.radius) * 0.5f;
+        node.center = a.center + d * ((node.radius - a.radius) / dist);
+    }
+    return index;
+}
+
+// Nothing can pass between the nodes when one is a patch and the other lies entirely behind it
+bool CRadiosityHierarchy::Culled(int s, int r) const
+{
+    const Node& src = m_nodes[s];
+    const Node& dst = m_nodes[r];
+    if (src.patch >= 0)
+    {
+        D3DXVECTOR3 d = dst.center - src.center;
+        if (D3DXVec3Dot(&src.normal, &d) < -dst.radius) return true;
+    }
+    if (dst.patch >= 0)
+    {
+        D3DXVECTOR3 d = src.center - dst.center;
+        if (D3DXVec3Dot(&dst.normal, &d) < -src.radius) return true;
+    }
+    return false;
+}
+
+// Most flux a link s -> r could carry right now: unoccluded, both cosines at 1,
+// the two bounding spheres at their closest.
+float CRadiosityHierarchy::FluxBound(int s, int r) const
+{
+    const Node& src = m_nodes[s];
+    const Node& dst = m_nodes[r];
+    D3DXVECTOR3 d = dst.center - src.center;
+    float gap = D3DXVec3Length(&d) - src.radius - dst.radius;
+    float ff = (gap > 0.0f) ? dst.area / (D3DX_PI * gap * gap + dst.area) : 1.0f;
+    return FluxSum(src.fluxOut) * ff;
+}
+
+void CRadiosityHierarchy::Refine(int s, int r, float maxFlux)
+{
+    if (Culled(s, r)) return;
+
+    const Node& src = m_nodes[s];
+    const Node& dst = m_nodes[r];
+    if (s == r)
+    {
+        // A flat patch doesn't light itself, a cluster's parts light each other
+        if (src.patch >= 0) return;
+        int a = src.child[0], b = src.child[1];
+        Refine(a, a, maxFlux);
+        Refine(a, b, maxFlux);
+        Refine(b, a, maxFlux);
+        Refine(b, b, maxFlux);
+        return;
+    }
+
+    bool srcLeaf = src.patch >= 0;
+    bool dstLeaf = dst.patch >= 0;
+    if ((srcLeaf && dstLeaf) || FluxBound(s, r) <= maxFlux)
+    {
+        Link link = { s, r, 0.0f };
+        m_pending.push_back(link);
+        return;
+    }
+
+    // Split the bigger end
+    bool splitSrc = !srcLeaf && (dstLeaf || src.radius >= dst.radius);
+    if (splitSrc)
+    {
+        int c0 = src.child[0], c1 = src.child[1];
+        Refine(c0, r, maxFlux);
+        Refine(c1, r, maxFlux);
+    }
+    else
+    {
+        int c0 = dst.child[0], c1 = dst.child[1];
+        Refine(s, c0, maxFlux);
+        Refine(s, c1, maxFlux);
+    }
+}
+
+// Fraction of s's outgoing flux that arrives at r.
+// Patch to patch is the exact form factor the progressive shooter uses. With a cluster on
+// either end, a few patch pairs spread over both ranges are sampled for the cosines and
+// visibility, and the whole receiver area is put at the sampled patch.
+float CRadiosityHierarchy::EvaluateLink(int s, int r, const std::vector<RADPATCH>& patches,
+    const FormFactorFn& formFactor, const VisibleFn& visible, int& formFactors, int& rays) const
+{
+    const Node& src = m_nodes[s];
+    const Node& dst = m_nodes[r];
+    if (src.patch >= 0 && dst.patch >= 0)
+    {
+        formFactors++;
+        return formFactor(patches[src.patch], patches[dst.patch]);
+    }
+
+    float sum = 0.0f;
+    for (int k = 0; k < CLUSTER_SAMPLES; k++)
+    {
+        const RADPATCH& a = patches[m_order[src.first + (UINT)(((uint64_t)src.count * (2 * k + 1)) / (2 * CLUSTER_SAMPLES))]];
+        const RADPATCH& b = patches[m_order[dst.first + (UINT)(((uint64_t)dst.count * (2 * k + 1)) / (2 * CLUSTER_SAMPLES))]];
+        formFactors++;
+
+        D3DXVECTOR3 vec = b.center - a.center;
+        float distSq = D3DXVec3LengthSq(&vec);
+        if (distSq < 1e-12f) continue;
+        D3DXVECTOR3 dir = vec / sqrtf(distSq);
+        float cosSrc = D3DXVec3Dot(&a.normal, &dir);
+        float cosDest = -D3DXVec3Dot(&b.normal, &dir);
+        if (cosSrc <= 0.0f || cosDest <= 0.0f) continue;
+
+        // Same offsets as CalculateFormFactor
+        rays++;
+        if (!visible(a.center + a.normal * 0.05f, b.center - dir * 0.001f)) continue;
+        sum += (cosSrc * cosDest * dst.area) / (D3DX_PI * distSq + dst.area);
+    }
+    return sum / (float)CLUSTER_SAMPLES;
+}
+
+// Outgoing flux bottom-up: leaves reflect what reached them, clusters add up their children
+void CRadiosityHierarchy::PullFlux()
+{
+    for (int i = (int)m_nodes.size() - 1; i >= 0; i--)
+    {
+        Node& node = m_nodes[i];
+        if (node.patch >= 0)
+        {
+            node.fluxOut.x = node.source.x + node.rho.x * node.fluxIn.x;
+            node.fluxOut.y = node.source.y + node.rho.y * node.fluxIn.y;
+            node.fluxOut.z = node.source.z + node.rho.z * node.fluxIn.z;
+        }
+        else
+            node.fluxOut = m_nodes[node.child[0]].fluxOut + m_nodes[node.child[1]].fluxOut;
+    }
+}
+
+float CRadiosityHierarchy::Iterate(const std::vector<RADPATCH>& patches, float errorBound,
+    const FormFactorFn& formFactor, const VisibleFn& visible)
+{
+    m_newLinks = 0;
+    if (m_nodes.empty()) return 0.0f;
+
+    PullFlux();
+
+    // 1. Refine against the current flux. Links only ever get finer.
+    const float maxFlux = errorBound * m_sourceFlux;
+    m_pending.clear();
+    if (!m_bStarted)
+    {
+        Refine(0, 0, maxFlux);
+        m_bStarted = true;
+    }
+    else
+    {
+        size_t linkCount = m_links.size();
+        for (size_t i = 0; i < linkCount; i++)
+        {
+            Link link = m_links[i];
+            if (m_nodes[link.src].patch >= 0 && m_nodes[link.dst].patch >= 0) continue;
+            if (FluxBound(link.src, link.dst) <= maxFlux) continue;
+
+            m_links[i].transfer = -1.0f;
+            m_stats.refinedLinks++;
+            Refine(link.src, link.dst, maxFlux);
+        }
+        m_links.erase(std::remove_if(m_links.begin(), m_links.end(),
+            [](const Link& l) { return l.transfer < 0.0f; }), m_links.end());
+    }
+
+    // 2. Evaluate the new links, that's where the rays go
+    int formFactors = 0, rays = 0;
+    const int pendingCount = (int)m_pending.size();
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:formFactors, rays)
+    for (int i = 0; i < pendingCount; i++)
+    {
+        Link& link = m_pending[i];
+        link.transfer = EvaluateLink(link.src, link.dst, patches, formFactor, visible, formFactors, rays);
+    }
+    m_stats.formFactors += formFactors;
+    m_stats.rays += rays;
+    // A cluster estimate can come out 0 (its sample rays all blocked) while parts of it still see
+    // each other, keep those so a later FluxBound pass can split them. Only leaf pairs are final.
+    for (const Link& link : m_pending)
+        if (link.transfer > 0.0f || m_nodes[link.src].patch < 0 || m_nodes[link.dst].patch < 0)
+            m_links.push_back(link);
+    m_newLinks = pendingCount;
+    m_stats.links = (int)m_links.size();
+    m_pending.clear();
+
+    // 3. Gather (Jacobi: everything reads the flux from the pull above)
+    for (auto& node : m_nodes) node.gathered = D3DXVECTOR3(0, 0, 0);
+    for (const Link& link : m_links)
+        m_nodes[link.dst].gathered += m_nodes[link.src].fluxOut * link.transfer;
+
+    // 4. Push: a cluster's flux goes to its children by area, parents come first in the array
+    float change = 0.0f;
+    for (auto& node : m_nodes)
+    {
+        D3DXVECTOR3 in = node.gathered;
+        if (node.parent >= 0)
+        {
+            const Node& parent = m_nodes[node.parent];
+            if (parent.area > 0.0f) in += parent.fluxIn * (node.area / parent.area);
+        }
+        if (node.patch >= 0)
+        {
+            D3DXVECTOR3 d = in - node.fluxIn;
+            change += fabsf(d.x * node.rho.x) + fabsf(d.y * node.rho.y) + fabsf(d.z * node.rho.z);
+        }
+        node.fluxIn = in;
+    }
+    return change;
+}
+
+void CRadiosityHierarchy::Apply(std::vector<RADPATCH>& patches) const
+{
+    for (const auto& node : m_nodes)
+    {
+        if (node.patch < 0) continue;
+        RADPATCH& patch = patches[node.patch];
+        patch.accumulated = node.base;
+        if (node.area > 1e-6f)
+        {
+            patch.accumulated.x += node.rho.x * node.fluxIn.x / node.area;
+            patch.accumulated.y += node.rho.y * node.fluxIn.y / node.area;
+            patch.accumulated.z += node.rho.z * node.fluxIn.z / node.area;
+        }
+        patch.unshot = D3DXVECTOR3(0, 0, 0);
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "stdafx.h"
+#include <functional>
+#include "CBSPlevel.h"
+
+struct RadHierarchyStats
+{
+    int clusters = 0;
+    int links = 0;              // Live links after the last refinement
+    int formFactors = 0;        // Link transfers evaluated (patch-patch form factors + cluster estimates)
+    int rays = 0;               // Visibility rays cast for cluster links (patch links go through FormFactorFn)
+    int refinedLinks = 0;       // Links replaced by finer ones
+};
+
+// Hierarchical radiosity over the level's patches (one patch per flat triangle).
+// Patches are grouped into a binary bounding sphere hierarchy. Links between two nodes are
+// made at the coarsest level where the flux they can carry stays under the error bound
+// (BF refinement), so light exchanged between far or dark regions goes cluster to cluster
+// and only the bright, close interactions get patch-to-patch form factors.
+// A link with a cluster on either end is estimated from a few sampled patch pairs.
+//
+// The patches' starting unshot flux (emission + sky) is the source term. Each Iterate()
+// refines against the current flux, then does one Jacobi gather and a push/pull pass.
+class CRadiosityHierarchy
+{
+public:
+    // Patch to patch form factor including visibility (CBSPlevel::CalculateFormFactor)
+    typedef std::function<float(const RADPATCH& src, const RADPATCH& dest)> FormFactorFn;
+    // True if nothing blocks the segment
+    typedef std::function<bool(const D3DXVECTOR3& from, const D3DXVECTOR3& to)> VisibleFn;
+
+    // 'flatVerts' gives the patch corners (3 per triIndex) for the leaf bounding spheres
+    void Build(const std::vector<RADPATCH>& patches, const std::vector<OBJVertex>& flatVerts);
+    // 'errorBound' is relative to the total source flux.
+    // Returns the total change of outgoing flux (r+g+b), 0 once converged
+    float Iterate(const std::vector<RADPATCH>& patches, float errorBound,
+        const FormFactorFn& formFactor, const VisibleFn& visible);
+    // Writes the solution to accumulated (radiosity) and clears unshot
+    void Apply(std::vector<RADPATCH>& patches) const;
+
+    float GetSourceFlux() const { return m_sourceFlux; }
+    int   GetNewLinks() const { return m_newLinks; }
+    const RadHierarchyStats& GetStats() const { return m_stats; }
+
+private:
+    struct Node
+    {
+        D3DXVECTOR3 center;
+        float radius = 0.0f;
+        float area = 0.0f;
+        int   child[2] = { -1, -1 };
+        int   parent = -1;
+        UINT  first = 0, count = 0; // Range in m_order
+
+        // Leaves only, copied from the patch so Apply() can be called between iterations
+        int   patch = -1;
+        D3DXVECTOR3 normal;
+        D3DXVECTOR3 source;         // Unshot flux at Build(): emission + sky
+        D3DXVECTOR3 base;           // Accumulated radiosity at Build()
+        D3DXVECTOR3 rho;            // Reflectivity
+
+        D3DXVECTOR3 fluxOut;        // Source + reflected, summed up the tree (pull)
+        D3DXVECTOR3 gathered;       // Flux arriving through this node's own links
+        D3DXVECTOR3 fluxIn;         // gathered plus the ancestors' share by area (push), leaves use it
+    };
+    struct Link
+    {
+        int   src;
+        int   dst;
+        float transfer;             // Fraction of src's outgoing flux that reaches dst, < 0 = removed
+    };
+
+    int   BuildNode(UINT first, UINT count, const std::vector<RADPATCH>& patches,
+        const std::vector<float>& patchRadius, int parent);
+    void  Refine(int s, int r, float maxFlux);
+    bool  Culled(int s, int r) const;
+    float FluxBound(int s, int r) const;
+    float EvaluateLink(int s, int r, const std::vector<RADPATCH>& patches,
+        const FormFactorFn& formFactor, const VisibleFn& visible, int& formFactors, int& rays) const;
+    void  PullFlux();
+
+    std::vector<Node> m_nodes;      // Pre-order, node 0 is the root
+    std::vector<int>  m_order;      // Patch indices, every node owns a contiguous range
+    std::vector<Link> m_links;
+    std::vector<Link> m_pending;    // Made by Refine(), evaluated in parallel afterwards
+    float m_sourceFlux = 0.0f;
+    int   m_newLinks = 0;
+    bool  m_bStarted = false;
+    RadHierarchyStats m_stats;
+};
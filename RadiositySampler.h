@@ -0,0 +1,76 @@
+#pragma once
+#include "stdafx.h"
+
+// Low-discrepancy directions for the sky gather. The first two Sobol dimensions, each Owen
+// scrambled (hash-based nested uniform scramble, Laine-Karras) with seeds derived from the
+// patch, mapped to cosine-weighted directions around the patch normal.
+// Every prefix of 2^m samples stays a (0,m,2)-net, so batches of a power of two can be added
+// until the estimate is good enough and each batch fills in the gaps of the previous ones.
+// Patches get unrelated scrambles, so neighbours don't share a pattern, and the same patch
+// gets the same directions on every run whatever thread picks it up.
+class CRadSkySampler
+{
+public:
+    CRadSkySampler(const D3DXVECTOR3& normal, uint32_t seed)
+        : m_seedU(Hash(seed ^ 0x9e3779b9u)), m_seedV(Hash(seed ^ 0x7f4a7c15u))
+    {
+        D3DXVec3Normalize(&m_n, &normal);
+        D3DXVECTOR3 helper = (fabsf(m_n.x) < 0.9f) ? D3DXVECTOR3(1, 0, 0) : D3DXVECTOR3(0, 1, 0);
+        D3DXVec3Cross(&m_u, &helper, &m_n);
+        D3DXVec3Normalize(&m_u, &m_u);
+        D3DXVec3Cross(&m_v, &m_n, &m_u);
+    }
+
+    // Sample i, pdf cos(theta) / pi
+    D3DXVECTOR3 Direction(uint32_t i) const
+    {
+        float u = ToFloat(Scramble(ReverseBits(i), m_seedU));
+        float v = ToFloat(Scramble(Sobol1(i), m_seedV));
+        float r = sqrtf(u);
+        float phi = 2.0f * D3DX_PI * v;
+        float z = sqrtf(std::max(0.0f, 1.0f - u));
+        return m_u * (r * cosf(phi)) + m_v * (r * sinf(phi)) + m_n * z;
+    }
+
+    static uint32_t Hash(uint32_t x)
+    {
+        x ^= x >> 16; x *= 0x7feb352du;
+        x ^= x >> 15; x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+private:
+    static uint32_t ReverseBits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+    // Second Sobol dimension (primitive polynomial x + 1), the first is ReverseBits
+    static uint32_t Sobol1(uint32_t i)
+    {
+        uint32_t r = 0;
+        for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+            if (i & 1) r ^= v;
+        return r;
+    }
+    // Nested uniform scramble: a bit only ever depends on the bits above it
+    static uint32_t Scramble(uint32_t x, uint32_t seed)
+    {
+        x = ReverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return ReverseBits(x);
+    }
+    static float ToFloat(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); }
+
+    D3DXVECTOR3 m_n, m_u, m_v;
+    uint32_t m_seedU, m_seedV;
+};
@@ -0,0 +1,131 @@
+#pragma once
+#include "stdafx.h"
+
+// Indexed binary max-heap over the patches' unshot energy (r+g+b), used by the progressive
+// solver to pick shooters without scanning every patch per shot.
+// Items are patch indices 0..n-1, m_pos maps an item to its heap slot so a receiver's key
+// can be moved in place. Heap entries carry a copy of the key so sifting stays in one array. The total of all keys is kept alongside for the progress/stats code.
+//
+// When a shot reaches a large share of the patches, sifting each of them costs more than the
+// scan it replaces. SetKeyDeferred() only stores the key and leaves the heap unordered, Top()
+// then scans like the old code did until Rebuild() heapifies again.
+class CRadShooterQueue
+{
+public:
+    void Build(const std::vector<float>& keys)
+    {
+        m_keys = keys;
+        m_heap.resize(keys.size());
+        m_pos.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) m_heap[i].item = (int)i;
+        Rebuild();
+    }
+    void Clear()
+    {
+        m_keys.clear();
+        m_heap.clear();
+        m_pos.clear();
+        m_total = 0.0;
+        m_bOrdered = true;
+    }
+
+    // Changes one key and restores the heap, O(log n). Just stores it while unordered.
+    void Update(int item, float key)
+    {
+        if (!m_bOrdered)
+        {
+            SetKeyDeferred(item, key);
+            return;
+        }
+        int slot = m_pos[item];
+        float old = m_keys[item];
+        m_keys[item] = key;
+        m_heap[slot].key = key;
+        m_total += (double)key - old;
+        if (key > old) SiftUp(slot);
+        else if (key < old) SiftDown(slot);
+    }
+    // Changes a key and leaves the heap unordered until Rebuild()
+    void SetKeyDeferred(int item, float key)
+    {
+        m_total += (double)key - m_keys[item];
+        m_keys[item] = key;
+        m_bOrdered = false;
+    }
+    // Floyd's bottom-up heapify, O(n)
+    void Rebuild()
+    {
+        m_total = 0.0;
+        for (size_t i = 0; i < m_heap.size(); i++)
+        {
+            m_heap[i].key = m_keys[m_heap[i].item];
+            m_pos[m_heap[i].item] = (int)i;
+            m_total += m_heap[i].key;
+        }
+        for (int i = (int)m_heap.size() / 2 - 1; i >= 0; i--) SiftDown(i);
+        m_bOrdered = true;
+    }
+
+    bool   IsOrdered() const { return m_bOrdered; }
+    bool   Empty() const { return m_heap.empty(); }
+    size_t Size() const { return m_heap.size(); }
+    int    Top() const;
+    float  TopKey() const { int top = Top(); return (top < 0) ? 0.0f : m_keys[top]; }
+    float  GetKey(int item) const { return m_keys[item]; }
+    double GetTotal() const { return m_total; }
+
+private:
+    struct Entry
+    {
+        float key;
+        int   item;
+    };
+
+    void SiftUp(int slot)
+    {
+        Entry e = m_heap[slot];
+        while (slot > 0)
+        {
+            int parent = (slot - 1) / 2;
+            if (m_heap[parent].key >= e.key) break;
+            m_heap[slot] = m_heap[parent];
+            m_pos[m_heap[slot].item] = slot;
+            slot = parent;
+        }
+        m_heap[slot] = e;
+        m_pos[e.item] = slot;
+    }
+    void SiftDown(int slot)
+    {
+        const int count = (int)m_heap.size();
+        Entry e = m_heap[slot];
+        for (;;)
+        {
+            int child = slot * 2 + 1;
+            if (child >= count) break;
+            if (child + 1 < count && m_heap[child + 1].key > m_heap[child].key) child++;
+            if (m_heap[child].key <= e.key) break;
+            m_heap[slot] = m_heap[child];
+            m_pos[m_heap[slot].item] = slot;
+            slot = child;
+        }
+        m_heap[slot] = e;
+        m_pos[e.item] = slot;
+    }
+
+    std::vector<float> m_keys;  // By patch index, always current
+    std::vector<Entry> m_heap;  // Max at [0] while ordered, keys are stale while unordered
+    std::vector<int>   m_pos;   // Heap slot of each patch
+    double m_total = 0.0;
+    bool   m_bOrdered = true;
+};
+
+inline int CRadShooterQueue::Top() const
+{
+    if (m_heap.empty()) return -1;
+    if (m_bOrdered) return m_heap[0].item;
+    int best = 0;
+    for (int i = 1; i < (int)m_keys.size(); i++)
+        if (m_keys[i] > m_keys[best]) best = i;
+    return best;
+}
@@ -0,0 +1,287 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "ShadowBVH.h"
+
+static const int   SAH_BINS = 16;
+static const UINT  LEAF_SIZE = 4;           // Triangles per leaf at most
+static const float BOX_PAD = 0.0001f;       // Flat walls still get a box with some thickness
+static const float RAY_EPSILON = 0.00001f;  // Same as IntersectTriangleShadowEdges
+static const int   STACK_DEPTH = 64;
+
+static inline float HalfArea(const D3DXVECTOR3& lo, const D3DXVECTOR3& hi)
+{
+    D3DXVECTOR3 d = hi - lo;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+void CShadowBVH::Clear()
+{
+    m_nodes.clear();
+    m_tris.clear();
+    m_order.clear();
+}
+
+void CShadowBVH::Build(const std::vector<BSPShadowTri>& tris)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    Clear();
+    if (tris.empty()) return;
+
+    std::vector<Bounds> triBounds(tris.size());
+    std::vector<D3DXVECTOR3> centroids(tris.size());
+    m_order.resize(tris.size());
+    for (size_t i = 0; i < tris.size(); i++)
+    {
+        const BSPShadowTri& tri = tris[i];
+        D3DXVECTOR3 v1 = tri.v0 + tri.edge1, v2 = tri.v0 + tri.edge2;
+        Bounds& b = triBounds[i];
+        D3DXVec3Minimize(&b.lo, &tri.v0, &v1);
+        D3DXVec3Minimize(&b.lo, &b.lo, &v2);
+        D3DXVec3Maximize(&b.hi, &tri.v0, &v1);
+        D3DXVec3Maximize(&b.hi, &b.hi, &v2);
+        b.lo -= D3DXVECTOR3(BOX_PAD, BOX_PAD, BOX_PAD);
+        b.hi += D3DXVECTOR3(BOX_PAD, BOX_PAD, BOX_PAD);
+        centroids[i] = (b.lo + b.hi) * 0.5f;
+        m_order[i] = (UINT)i;
+    }
+
+    std::vector<BuildNode> binary;
+    binary.reserve(tris.size() * 2 / LEAF_SIZE + 1);
+    int root = BuildBinary(binary, 0, (UINT)tris.size(), triBounds, centroids);
+
+    m_tris.resize(tris.size());
+    for (size_t i = 0; i < tris.size(); i++) m_tris[i] = tris[m_order[i]];
+    m_nodes.reserve(binary.size() / 2 + 1);
+    Collapse(binary, root);
+
+    m_order.clear();
+    m_order.shrink_to_fit();
+    m_buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Binned SAH over the triangle centroids, all three axes. Falls back to a median split
+// when every centroid lands in one bin (stacked or identical triangles).
+int CShadowBVH::BuildBinary(std::vector<BuildNode>& out, UINT first, UINT count,
+    const std::vector<Bounds>& triBounds, const std::vector<D3DXVECTOR3>& centroids)
+{
+    int index = (int)out.size();
+    out.push_back(BuildNode());
+
+    Bounds bounds = triBounds[m_order[first]];
+    D3DXVECTOR3 cLo = centroids[m_order[first]], cHi = cLo;
+    for (UINT i = first + 1; i < first + count; i++)
+    {
+        const Bounds& b = triBounds[m_order[i]];
+        D3DXVec3Minimize(&bounds.lo, &bounds.lo, &b.lo);
+        D3DXVec3Maximize(&bounds.hi, &bounds.hi, &b.hi);
+        D3DXVec3Minimize(&cLo, &cLo, &centroids[m_order[i]]);
+        D3DXVec3Maximize(&cHi, &cHi, &centroids[m_order[i]]);
+    }
+    out[index].bounds = bounds;
+    out[index].first = first;
+    out[index].count = count;
+    if (count <= LEAF_SIZE) return index;
+
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo = ((const float*)&cLo)[axis], hi = ((const float*)&cHi)[axis];
+        if (hi - lo <= 1e-6f) continue;
+        float scale = SAH_BINS / (hi - lo);
+
+        Bounds bins[SAH_BINS];
+        UINT binCount[SAH_BINS] = {};
+        for (int b = 0; b < SAH_BINS; b++)
+        {
+            bins[b].lo = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+            bins[b].hi = D3DXVECTOR3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        }
+        for (UINT i = first; i < first + count; i++)
+        {
+            int b = std::min(SAH_BINS - 1, (int)((((const float*)&centroids[m_order[i]])[axis] - lo) * scale));
+            binCount[b]++;
+            D3DXVec3Minimize(&bins[b].lo, &bins[b].lo, &triBounds[m_order[i]].lo);
+            D3DXVec3Maximize(&bins[b].hi, &bins[b].hi, &triBounds[m_order[i]].hi);
+        }
+
+        // Sweep from the right for the right side areas, then from the left
+        float rightArea[SAH_BINS];
+        UINT rightCount[SAH_BINS];
+        Bounds acc = bins[SAH_BINS - 1];
+        UINT n = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--)
+        {
+            D3DXVec3Minimize(&acc.lo, &acc.lo, &bins[b].lo);
+            D3DXVec3Maximize(&acc.hi, &acc.hi, &bins[b].hi);
+            n += binCount[b];
+            rightArea[b] = n ? HalfArea(acc.lo, acc.hi) : 0.0f;
+            rightCount[b] = n;
+        }
+        acc = bins[0];
+        n = 0;
+        for (int b = 0; b < SAH_BINS - 1; b++)
+        {
+            D3DXVec3Minimize(&acc.lo, &acc.lo, &bins[b].lo);
+            D3DXVec3Maximize(&acc.hi, &acc.hi, &bins[b].hi);
+            n += binCount[b];
+            if (n == 0 || rightCount[b + 1] == 0) continue;
+            float cost = HalfArea(acc.lo, acc.hi) * n + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b + 1;
+            }
+        }
+    }
+
+    UINT mid;
+    if (bestAxis >= 0)
+    {
+        float lo = ((const float*)&cLo)[bestAxis];
+        float scale = SAH_BINS / (((const float*)&cHi)[bestAxis] - lo);
+        auto it = std::partition(m_order.begin() + first, m_order.begin() + first + count, [&](UINT t)
+            {
+                int b = std::min(SAH_BINS - 1, (int)((((const float*)&centroids[t])[bestAxis] - lo) * scale));
+                return b < bestSplit;
+            });
+        mid = (UINT)(it - m_order.begin());
+    }
+    else
+    {
+        mid = first + count / 2;
+        D3DXVECTOR3 ext = cHi - cLo;
+        int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+        std::nth_element(m_order.begin() + first, m_order.begin() + mid, m_order.begin() + first + count,
+            [&](UINT a, UINT b) { return ((const float*)&centroids[a])[axis] < ((const float*)&centroids[b])[axis]; });
+    }
+
+    int left = BuildBinary(out, first, mid - first, triBounds, centroids);
+    int right = BuildBinary(out, mid, first + count - mid, triBounds, centroids);
+    out[index].left = left;
+    out[index].right = right;
+    return index;
+}
+
+// Pulls up to four binary descendants into one node, always opening the largest inner child
+int CShadowBVH::Collapse(const std::vector<BuildNode>& binary, int index)
+{
+    int nodeIndex = (int)m_nodes.size();
+    m_nodes.push_back(Node());
+
+    int kids[4];
+    int kidCount = 0;
+    const BuildNode& b = binary[index];
+    if (b.left < 0)
+        kids[kidCount++] = index; // Whole tree is one leaf
+    else
+    {
+        kids[kidCount++] = b.left;
+        kids[kidCount++] = b.right;
+    }
+    while (kidCount < 4)
+    {
+        int open = -1;
+        float openArea = -1.0f;
+        for (int k = 0; k < kidCount; k++)
+        {
+            const BuildNode& kid = binary[kids[k]];
+            if (kid.left < 0) continue;
+            float area = HalfArea(kid.bounds.lo, kid.bounds.hi);
+            if (area > openArea)
+            {
+                openArea = area;
+                open = k;
+            }
+        }
+        if (open < 0) break;
+        int opened = kids[open];
+        kids[open] = binary[opened].left;
+        kids[kidCount++] = binary[opened].right;
+    }
+
+    for (int lane = 0; lane < 4; lane++)
+    {
+        int child = -1, count = 0;
+        Bounds box;
+        box.lo = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+        box.hi = D3DXVECTOR3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        if (lane < kidCount)
+        {
+            const BuildNode& kid = binary[kids[lane]];
+            box = kid.bounds;
+            if (kid.left < 0)
+            {
+                child = ~(int)kid.first;
+                count = (int)kid.count;
+            }
+            else
+                child = Collapse(binary, kids[lane]); // m_nodes may move, write the lane after
+        }
+        Node& node = m_nodes[nodeIndex];
+        node.minX[lane] = box.lo.x; node.minY[lane] = box.lo.y; node.minZ[lane] = box.lo.z;
+        node.maxX[lane] = box.hi.x; node.maxY[lane] = box.hi.y; node.maxZ[lane] = box.hi.z;
+        node.child[lane] = child;
+        node.count[lane] = count;
+    }
+    return nodeIndex;
+}
+
+bool CShadowBVH::RayCastAny(const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length) const
+{
+    if (m_nodes.empty()) return false;
+    return CastFrom(0, start, dir, length);
+}
+
+bool CShadowBVH::CastFrom(int root, const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length) const
+{
+    // Tiny instead of zero components keep the slab products finite
+    auto inverse = [](float d) { return 1.0f / ((fabsf(d) > 1e-20f) ? d : (d < 0.0f ? -1e-20f : 1e-20f)); };
+    const __m128 ox = _mm_set1_ps(start.x), oy = _mm_set1_ps(start.y), oz = _mm_set1_ps(start.z);
+    const __m128 ix = _mm_set1_ps(inverse(dir.x)), iy = _mm_set1_ps(inverse(dir.y)), iz = _mm_set1_ps(inverse(dir.z));
+    const __m128 tStart = _mm_setzero_ps();
+    const __m128 tEnd = _mm_set1_ps(length + RAY_EPSILON);
+
+    int stack[STACK_DEPTH];
+    int sp = 0;
+    int nodeIndex = root;
+    for (;;)
+    {
+        const Node& node = m_nodes[nodeIndex];
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), ox), ix);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), ox), ix);
+        __m128 tNear = _mm_max_ps(tStart, _mm_min_ps(t1, t2));
+        __m128 tFar = _mm_min_ps(tEnd, _mm_max_ps(t1, t2));
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), oy), iy);
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), oy), iy);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), oz), iz);
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), oz), iz);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        int hitMask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (!((hitMask >> lane) & 1)) continue;
+            int child = node.child[lane];
+            if (child >= 0)
+            {
+                if (sp < STACK_DEPTH) stack[sp++] = child;
+                else if (CastFrom(child, start, dir, length)) return true;
+                continue;
+            }
+            const BSPShadowTri* tri = &m_tris[~child];
+            for (int t = 0; t < node.count[lane]; t++, tri++)
+            {
+                if (IntersectTriangleShadowEdges(start, dir, length + RAY_EPSILON, tri->v0, tri->edge1, tri->edge2))
+                    return true;
+            }
+        }
+
+        if (sp == 0) return false;
+        nodeIndex = stack[--sp];
+    }
+}
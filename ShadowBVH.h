@@ -0,0 +1,55 @@
+#pragma once
+#include "stdafx.h"
+#include "CBSPlevel.h"
+
+// 4-wide bounding volume hierarchy over the level's shadow triangles, an alternative to the
+// BSP for any-hit rays. The BSP keeps triangles on interior nodes and a ray crossing a
+// plane has to go down both sides; here every triangle sits in exactly one leaf and a
+// ray only enters the boxes it actually hits, four boxes tested per step.
+// Built with binned SAH into a binary tree, then collapsed to 4 children per node.
+class CShadowBVH
+{
+public:
+    void Build(const std::vector<BSPShadowTri>& tris);
+    void Clear();
+
+    // True if a triangle is hit at 0 < t < length. 'dir' must be normalized.
+    bool RayCastAny(const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length) const;
+
+    bool   IsBuilt() const { return !m_nodes.empty(); }
+    size_t GetNodeCount() const { return m_nodes.size(); }
+    size_t GetMemoryBytes() const { return m_nodes.size() * sizeof(Node) + m_tris.size() * sizeof(m_tris[0]); }
+    double GetBuildMs() const { return m_buildMs; }
+
+private:
+    // Four child boxes in SoA form so one SSE test covers the whole node.
+    // child >= 0 is an inner node, < 0 is a leaf of 'count' triangles from ~child, empty lanes have count 0.
+    struct Node
+    {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+        int   child[4];
+        int   count[4];
+    };
+    struct Bounds
+    {
+        D3DXVECTOR3 lo, hi;
+    };
+    // Binary build node, only lives during Build()
+    struct BuildNode
+    {
+        Bounds bounds;
+        int    left = -1, right = -1;
+        UINT   first = 0, count = 0;
+    };
+
+    int  BuildBinary(std::vector<BuildNode>& out, UINT first, UINT count,
+        const std::vector<Bounds>& triBounds, const std::vector<D3DXVECTOR3>& centroids);
+    int  Collapse(const std::vector<BuildNode>& binary, int index);
+    bool CastFrom(int root, const D3DXVECTOR3& start, const D3DXVECTOR3& dir, float length) const;
+
+    std::vector<Node>         m_nodes;  // [0] is the root
+    std::vector<BSPShadowTri> m_tris;   // Reordered so every leaf is a contiguous range
+    std::vector<UINT>         m_order;  // Build scratch: triangle indices
+    double m_buildMs = 0.0;
+};